@@ -0,0 +1,390 @@
+/*******************************************************************************
+ * nbquery.h - Public interface of libnbquery, the NetBIOS Node Status Query
+ * library that the nbquery tool is built on.
+ *
+ * The library is nbtquery.c compiled with NBSTAT_LIBRARY defined, which leaves
+ * out the command line tool:
+ *
+ * gcc -c -o nbquery.o nbtquery.c -DNBSTAT_LIBRARY -Wall && ar rcs libnbquery.a nbquery.o
+ * gcc -shared -fPIC -fvisibility=hidden -o libnbquery.so nbtquery.c -DNBSTAT_LIBRARY -pthread
+ * gcc -shared -o nbquery.dll nbtquery.c -DNBSTAT_LIBRARY -DNBSTAT_BUILD_DLL -lws2_32
+ *
+ * Applications using nbquery.dll define NBSTAT_DLL before including this file.
+ * All calls on one context must come from one thread at a time.
+ *******************************************************************************/
+
+#ifndef NBQUERY_H
+#define NBQUERY_H
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <netinet/in.h>
+#endif
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32) && defined(NBSTAT_BUILD_DLL)
+#define NBSTAT_API __declspec(dllexport)
+#elif defined(_WIN32) && defined(NBSTAT_DLL)
+#define NBSTAT_API __declspec(dllimport)
+#elif defined(__GNUC__)
+#define NBSTAT_API __attribute__((visibility("default")))
+#else
+#define NBSTAT_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Error codes: */
+#define NBSTAT_EOK      0x000
+#define NBSTAT_ENOMEM   0x101
+#define NBSTAT_EINVAL   0x102
+#define NBSTAT_EWSAFAIL 0x103
+#define NBSTAT_ESOCKET  0x104
+#define NBSTAT_EPROTO   0x105 /* Generic protocol error */
+#define NBSTAT_ETRFLAG  0x106 /* Truncation flag in response. */
+#define NBSTAT_ETIMEOUT 0x107
+#define NBSTAT_EAGAIN   0x108 /* Socket buffer full, try again later. */
+#define NBSTAT_ENAME    0x109 /* Negative name query response */
+#define NBSTAT_EDEBUG   0x200
+
+/* Node Entry - 18 bytes (RFC 1002, section 4.2.18) */
+struct nbstat_node_name {
+   uint8_t nbf_name[15]; /* NetBIOS format name */
+   uint8_t suffix;
+   uint16_t g:        1; /* Group name flag */
+   uint16_t ont:      2; /* Owner Node Type */
+   uint16_t drg:      1; /* Deregistration flag */
+   uint16_t cnf:      1; /* Conflict flag */
+   uint16_t act:      1; /* Active name flag */
+   uint16_t prm:      1; /* Permanent name flag */
+   uint16_t reserved: 9; /* Reserved, must be zero */
+};
+
+/* A response fits in 576 bytes: 57 bytes of header, RR and name count, the
+ * 46-byte statistics field and 18 bytes per name leave room for 26 names. */
+#define NBSTAT_MAX_NAMES ((576 - 57 - 46) / 18)
+
+/* A first-level encoded name on the wire: length byte 0x20, two letters per
+ * byte of the 16-byte name, and the empty label that ends it. */
+#define NBSTAT_QNAME_SIZE 34
+
+/* Buffer object */
+typedef struct buffer {
+   void *data;
+   size_t size;
+   size_t length;
+   /* size_t offset; */
+} buffer_t;
+
+/* nbtstat_t object */
+typedef struct nbstat {
+   struct sockaddr_in sin;
+   uint8_t hwaddr[6];
+   uint32_t ttl;   /* Seconds, from the response RR */
+   int     count;
+   struct nbstat_node_name node[NBSTAT_MAX_NAMES]; /* First count entries are valid. */
+} nbstat_t;
+
+/* nbstat_view_t object. A validated response, read in place from the receive
+ * buffer; only valid for as long as that buffer is. */
+typedef struct nbstat_view {
+   const uint8_t *data;
+   size_t length;
+   int count;
+} nbstat_view_t;
+
+/* Address range in host byte order, both ends inclusive. */
+struct nbstat_range {
+   uint32_t first;
+   uint32_t last;
+};
+
+/* Query statistics. Each context counts its own, so only the thread running
+ * it writes them; others may read them while it runs, hence the relaxed
+ * single-writer updates. RTTs go into a log-linear (HDR) histogram of
+ * microseconds: exact below 2 * NBSTAT_HIST_SUB, then NBSTAT_HIST_SUB
+ * buckets per power of two, about 6% apart, up to 2^32 us. */
+#define NBSTAT_HIST_SUB   16
+#define NBSTAT_HIST_SIZE  (NBSTAT_HIST_SUB * 29)
+#define NBSTAT_OUTCOMES   11 /* NBSTAT_EOK, 0x101 to 0x109, anything else */
+
+struct nbstat_stats {
+   uint64_t start;     /* nbstat_clock() when counting began */
+   uint64_t sent;      /* Datagrams handed to the kernel */
+   uint64_t resent;    /* Of which retransmissions */
+   uint64_t received;  /* Datagrams read */
+   uint64_t matched;   /* Replies to an outstanding request */
+   uint64_t duplicate; /* Replies to a request that has finished, or was reused */
+   uint64_t unmatched; /* Replies to nothing we asked */
+   uint64_t drops;     /* Datagrams the receive buffer overflowed on */
+   uint64_t total;     /* Targets of the sweeps, where known in advance */
+   uint64_t targets;   /* Targets sent a first request */
+   uint64_t completed; /* Of which finished, with any result */
+   uint64_t outcome[NBSTAT_OUTCOMES];
+   uint64_t rtt[NBSTAT_HIST_SIZE];
+};
+
+/* One owner of a name, from the RDATA of a positive answer */
+struct nbstat_nb {
+   uint16_t flags;    /* NB_FLAGS: G bit 0x8000, ONT bits 0x6000 */
+   uint32_t addr;     /* Host order */
+};
+
+/* Opaque objects */
+typedef struct nbstat_ctx nbstat_ctx_t;
+typedef struct nbstat_targets nbstat_targets_t;
+typedef struct nbstat_cache nbstat_cache_t;
+typedef struct nbstat_index nbstat_index_t;
+
+typedef void (*nbstat_stats_fn)(void *arg, const struct nbstat_stats *stats);
+
+/* Sweep callback, invoked exactly once per target with the final result. The
+ * view is NULL unless the result is NBSTAT_EOK, and only valid during the call. */
+typedef void (*nbstat_sweep_fn)(void *user, int result, const struct sockaddr_in *sin, const nbstat_view_t *view);
+
+/* Target source: stores the next target (host order) and returns 1, or
+ * returns 0 once it is exhausted. A long-running source returns
+ * NBSTAT_TARGET_IDLE when nothing is due yet; it is asked again at least
+ * every NBSTAT_IDLE_MS. */
+typedef int (*nbstat_target_fn)(void *arg, uint32_t *addr);
+
+#define NBSTAT_TARGET_IDLE (-1)
+#define NBSTAT_IDLE_MS     50
+
+/* Broadcast callback, invoked once per responder; nbstat is only valid
+ * during the call. */
+typedef void (*nbstat_broadcast_fn)(void *user, const nbstat_t *nbstat);
+
+/* Return nonzero to leave out a target; called from the sweep threads. */
+typedef int (*nbstat_skip_fn)(void *arg, uint32_t addr);
+
+/* Name query callback, invoked once per name of a server query; with
+ * broadcast once per answer, then with NBSTAT_ETIMEOUT if there was none.
+ * `name' is the 16-byte first-level name: 15 padded bytes and the suffix. */
+typedef void (*nbstat_name_fn)(void *user, int result, const uint8_t *name, const struct sockaddr_in *from,
+                               const struct nbstat_nb *nb, int count);
+
+/* Follow-up stage of a pipeline. It acts on every name of a sweep answer
+ * that has the suffix (-1 for any) and any of the flag bits (0 for any) of
+ * the flags word as sent, e.g. 0x0800 for CNF. */
+#define NBSTAT_STAGE_NAMES  1 /* Name query for the name, once per name */
+#define NBSTAT_STAGE_STATUS 2 /* Node status query of the host again, once per host */
+
+struct nbstat_stage {
+   int type;
+   int suffix;
+   uint16_t flags;
+};
+
+/* Pipeline node status callback: nbstat_sweep_fn with the stage, 0 for the
+ * sweep, else 1 + the index of the stage that asked again. */
+typedef void (*nbstat_stage_fn)(void *user, int stage, int result, const struct sockaddr_in *sin,
+                                const nbstat_view_t *view);
+
+/* Streaming writer formats */
+#define NBSTAT_FMT_TABLE     0 /* nbtstat -A style, as nbstat_dump_nbtstat() */
+#define NBSTAT_FMT_NDJSON    1 /* One JSON object per line and responder */
+#define NBSTAT_FMT_CSV       2 /* One row per name, with a header */
+#define NBSTAT_FMT_NMBLOOKUP 3 /* nmblookup -A style */
+#define NBSTAT_FMT_BINARY    4 /* Archive blocks */
+
+typedef struct nbstat_writer {
+   FILE *fp;
+   int format;
+   char *buf;
+   size_t size;
+   size_t len;
+   uint64_t flushed;     /* Time of the last flush */
+   unsigned long count;  /* Responders written */
+   int error;
+   char *names;          /* Name table of the pending archive block */
+   size_t nlen;
+   uint32_t nrec;
+   uint32_t nname;
+   uint64_t stamp;       /* Archive record and event time, 0 for the current time */
+} nbstat_writer_t;
+
+/* Memory-mapped archive */
+typedef struct nbstat_archive {
+   const uint8_t *data;
+   size_t length;
+   uint64_t created;
+#ifdef _WIN32
+   HANDLE file;
+   HANDLE map;
+#endif
+} nbstat_archive_t;
+
+/* Position in an archive; rec points at the current record. */
+typedef struct nbstat_arch_iter {
+   size_t block;         /* Offset of the current block, 0 before the first */
+   uint32_t nrec;
+   uint32_t nname;
+   uint32_t i;           /* Next record of the block */
+   const uint8_t *rec;
+   const uint8_t *names; /* Name table of the block */
+} nbstat_arch_iter_t;
+
+/* Capture reader */
+#define NBSTAT_PCAP_SNAP  (256 * 1024) /* Longer records are skipped */
+#define NBSTAT_PCAP_IFMAX 256          /* pcapng interfaces per section */
+
+typedef struct nbstat_pcap {
+   FILE *fp;
+   uint8_t *buf;      /* NBSTAT_PCAP_SNAP + 32 bytes */
+   int ng;            /* pcapng */
+   int have;          /* Bytes of the next block already in buf */
+   int be;            /* The current section is big-endian */
+   int nsec;          /* Classic pcap with nanosecond stamps */
+   uint32_t linktype; /* Classic pcap */
+   int nif;
+   uint16_t iflink[NBSTAT_PCAP_IFMAX];
+   uint64_t ifunits[NBSTAT_PCAP_IFMAX]; /* Time stamp units per second */
+   uint64_t skipped;  /* Records skipped for their size or interface */
+} nbstat_pcap_t;
+
+/* A packet, valid until the next call to nbstat_pcap_next() */
+typedef struct nbstat_packet {
+   const uint8_t *data;
+   size_t length;     /* Captured */
+   uint32_t linktype;
+   uint64_t time;     /* ms since 1970 */
+} nbstat_packet_t;
+
+/* Contexts */
+NBSTAT_API int nbstat_ctx_create(nbstat_ctx_t **ctx);
+NBSTAT_API void nbstat_ctx_destroy(nbstat_ctx_t *ctx);
+NBSTAT_API void nbstat_ctx_hash_ids(nbstat_ctx_t *ctx, uint32_t key);
+NBSTAT_API void nbstat_ctx_set_rate(nbstat_ctx_t *ctx, uint32_t pps);
+NBSTAT_API void nbstat_ctx_set_retries(nbstat_ctx_t *ctx, int retries);
+NBSTAT_API int nbstat_ctx_bind(nbstat_ctx_t *ctx, uint32_t addr, int prefix);
+NBSTAT_API void nbstat_ctx_set_report(nbstat_ctx_t *ctx, int interval, nbstat_stats_fn fn, void *arg);
+NBSTAT_API const struct nbstat_stats *nbstat_ctx_stats(const nbstat_ctx_t *ctx);
+
+/* Asynchronous queries. The blocking calls below return NBSTAT_EAGAIN on a
+ * context while any of these are pending. */
+NBSTAT_API int nbstat_submit(nbstat_ctx_t *ctx, uint32_t addr, uint16_t port, int timeout,
+                             nbstat_sweep_fn fn, void *user);
+NBSTAT_API int nbstat_poll(nbstat_ctx_t *ctx, int timeout);
+NBSTAT_API int nbstat_pending(const nbstat_ctx_t *ctx);
+
+/* Single queries */
+NBSTAT_API int nbstat_query(nbstat_t **nbstat, const char *target, uint16_t port, int timeout);
+NBSTAT_API int nbstat_query_ctx(nbstat_ctx_t *ctx, nbstat_t **nbstat, const char *target, uint16_t port, int timeout);
+NBSTAT_API int nbstat_query_addr(nbstat_ctx_t *ctx, nbstat_t **nbstat, uint32_t addr, uint16_t port, int timeout);
+NBSTAT_API void nbstat_free(nbstat_t *nbstat);
+NBSTAT_API int nbstat_broadcast(nbstat_ctx_t *ctx, const char *target, uint16_t port, int timeout,
+                                nbstat_broadcast_fn fn, void *user);
+NBSTAT_API int nbstat_names(nbstat_ctx_t *ctx, const char *server, int bcast, const uint8_t *names, size_t count,
+                            uint16_t port, int timeout, int window, nbstat_name_fn fn, void *user);
+
+/* Sweeps */
+NBSTAT_API int nbstat_sweep(nbstat_ctx_t *ctx, const struct nbstat_range *range, int nrange, uint16_t port,
+                            int timeout, int window, nbstat_sweep_fn fn, void *user);
+NBSTAT_API int nbstat_sweep_list(nbstat_ctx_t *ctx, const uint32_t *addr, size_t count, uint16_t port,
+                                 int timeout, int window, nbstat_sweep_fn fn, void *user);
+NBSTAT_API int nbstat_sweep_targets(nbstat_ctx_t *ctx, nbstat_targets_t *targets, uint16_t port,
+                                    int timeout, int window, nbstat_sweep_fn fn, void *user);
+NBSTAT_API int nbstat_sweep_mt(nbstat_ctx_t *ctx, nbstat_targets_t *targets, uint16_t port,
+                               int timeout, int window, int nthreads, nbstat_sweep_fn fn, void *user);
+NBSTAT_API int nbstat_monitor(nbstat_ctx_t *ctx, nbstat_targets_t *targets, uint16_t port, int timeout,
+                              int window, int interval, nbstat_writer_t *w, volatile int *stop);
+NBSTAT_API int nbstat_pipeline(nbstat_ctx_t *ctx, nbstat_targets_t *targets, const struct nbstat_stage *stage,
+                               int nstage, const char *server, int bcast, uint16_t port, int timeout, int window,
+                               nbstat_stage_fn status, nbstat_name_fn name, void *user);
+
+/* Targets */
+NBSTAT_API int nbstat_parse_ipv4(const char *str, size_t len, uint32_t *addr);
+NBSTAT_API int nbstat_parse_range(const char *str, struct nbstat_range *range);
+NBSTAT_API int nbstat_targets_create(nbstat_targets_t **targets);
+NBSTAT_API void nbstat_targets_destroy(nbstat_targets_t *targets);
+NBSTAT_API int nbstat_targets_add(nbstat_targets_t *targets, const char *spec);
+NBSTAT_API int nbstat_targets_exclude(nbstat_targets_t *targets, const char *spec);
+NBSTAT_API int nbstat_targets_file(nbstat_targets_t *targets, FILE *fp);
+NBSTAT_API int nbstat_targets_shuffle(nbstat_targets_t *targets, uint32_t seed);
+NBSTAT_API void nbstat_targets_skip(nbstat_targets_t *targets, nbstat_skip_fn fn, void *arg);
+NBSTAT_API unsigned long nbstat_targets_bad(const nbstat_targets_t *targets);
+NBSTAT_API int nbstat_targets_next(void *arg, uint32_t *addr);
+
+/* Responses */
+NBSTAT_API int nbstat_view_init(nbstat_view_t *view, const buffer_t *buffer);
+NBSTAT_API int nbstat_view_count(const nbstat_view_t *view);
+NBSTAT_API uint32_t nbstat_view_ttl(const nbstat_view_t *view);
+NBSTAT_API const uint8_t *nbstat_view_hwaddr(const nbstat_view_t *view);
+NBSTAT_API const uint8_t *nbstat_view_name(const nbstat_view_t *view, int i, uint8_t *suffix, uint16_t *flags);
+NBSTAT_API int nbstat_view_find(const nbstat_view_t *view, uint8_t suffix, int group);
+NBSTAT_API void nbstat_view_decode(const nbstat_view_t *view, nbstat_t *nbstat);
+NBSTAT_API void nbstat_encode_names(uint8_t *out, const uint8_t *names, size_t count, uint8_t pad);
+NBSTAT_API size_t nbstat_decode_names(uint8_t *names, const uint8_t *in, size_t count);
+NBSTAT_API const char *nbstat_error(int x);
+NBSTAT_API const char *netbios_service_name(uint8_t g, uint8_t suffix);
+NBSTAT_API void nbstat_dump_nbtstat(const nbstat_t *nbstat);
+NBSTAT_API void nbstat_dump_nmblookup(const nbstat_t *nbstat);
+
+/* Statistics */
+NBSTAT_API uint64_t nbstat_clock(void);
+NBSTAT_API void nbstat_stats_add(struct nbstat_stats *sum, const struct nbstat_stats *st);
+NBSTAT_API uint64_t nbstat_stats_rtt(const struct nbstat_stats *st, uint32_t q);
+NBSTAT_API void nbstat_stats_print(FILE *fp, const struct nbstat_stats *st, uint64_t now);
+
+/* Writers */
+NBSTAT_API int nbstat_writer_init(nbstat_writer_t *w, FILE *fp, int format, size_t size);
+NBSTAT_API int nbstat_writer_flush(nbstat_writer_t *w);
+NBSTAT_API int nbstat_writer_close(nbstat_writer_t *w);
+NBSTAT_API int nbstat_writer_put(nbstat_writer_t *w, const nbstat_t *nbstat);
+NBSTAT_API int nbstat_writer_event(nbstat_writer_t *w, const char *event, const nbstat_t *nbstat,
+                                   const struct nbstat_node_name *node);
+NBSTAT_API int nbstat_writer_name(nbstat_writer_t *w, int result, const uint8_t *name, const struct sockaddr_in *from,
+                                  const struct nbstat_nb *nb, int count);
+
+/* Archives */
+NBSTAT_API int nbstat_archive_open(nbstat_archive_t *a, const char *path);
+NBSTAT_API void nbstat_archive_close(nbstat_archive_t *a);
+NBSTAT_API void nbstat_archive_first(nbstat_arch_iter_t *it);
+NBSTAT_API int nbstat_archive_next(const nbstat_archive_t *a, nbstat_arch_iter_t *it);
+NBSTAT_API uint32_t nbstat_arec_addr(const nbstat_arch_iter_t *it);
+NBSTAT_API const uint8_t *nbstat_arec_hwaddr(const nbstat_arch_iter_t *it);
+NBSTAT_API int nbstat_arec_count(const nbstat_arch_iter_t *it);
+NBSTAT_API uint64_t nbstat_arec_time(const nbstat_arch_iter_t *it);
+NBSTAT_API const uint8_t *nbstat_arec_name(const nbstat_arch_iter_t *it, int i, uint8_t *suffix, uint16_t *flags);
+NBSTAT_API void nbstat_arec_decode(const nbstat_arch_iter_t *it, nbstat_t *nbstat);
+NBSTAT_API int nbstat_archive_diff(const nbstat_archive_t *old, const nbstat_archive_t *cur, nbstat_writer_t *w);
+
+/* Captures */
+NBSTAT_API int nbstat_pcap_open(nbstat_pcap_t *p, const char *path);
+NBSTAT_API void nbstat_pcap_close(nbstat_pcap_t *p);
+NBSTAT_API int nbstat_pcap_next(nbstat_pcap_t *p, nbstat_packet_t *pkt);
+NBSTAT_API int nbstat_pcap_view(const nbstat_packet_t *pkt, uint16_t port, nbstat_view_t *view, struct sockaddr_in *from);
+
+/* Response cache */
+NBSTAT_API int nbstat_cache_create(nbstat_cache_t **cache, uint32_t ttl);
+NBSTAT_API void nbstat_cache_destroy(nbstat_cache_t *cache);
+NBSTAT_API int nbstat_cache_load(nbstat_cache_t *cache, const char *path);
+NBSTAT_API int nbstat_cache_save(nbstat_cache_t *cache, const char *path);
+NBSTAT_API const nbstat_t *nbstat_cache_get(nbstat_cache_t *cache, uint32_t addr);
+NBSTAT_API int nbstat_cache_put(nbstat_cache_t *cache, const nbstat_t *nbstat);
+NBSTAT_API int nbstat_cache_commit(nbstat_cache_t *cache);
+NBSTAT_API int nbstat_cache_skip(void *arg, uint32_t addr);
+NBSTAT_API void nbstat_cache_served(const nbstat_cache_t *cache, nbstat_broadcast_fn fn, void *user);
+
+/* Result index */
+NBSTAT_API int nbstat_index_create(nbstat_index_t **index);
+NBSTAT_API void nbstat_index_destroy(nbstat_index_t *index);
+NBSTAT_API int nbstat_index_add(nbstat_index_t *index, const nbstat_t *nbstat);
+NBSTAT_API const nbstat_t *nbstat_index_mac(const nbstat_index_t *index, const uint8_t *hwaddr,
+                                            uint32_t *addr, size_t *naddr);
+NBSTAT_API const nbstat_t *nbstat_index_name(const nbstat_index_t *index, const uint8_t *nbf_name, uint8_t suffix,
+                                             uint32_t *cursor);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* NBQUERY_H */
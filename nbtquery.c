@@ -1,898 +1,9817 @@
-
-
-/*******************************************************************************
- * nbquery.c - Implementation of the RFC 1001/1002 Node Status Request.
- * This tool implements the NetBIOS API Adapter Status Query function.
- * Also known as Node Status Query and many other names, this NBT message is 
- * used to retrieve the NetBIOS name table for both the local computer and 
- * remote computers, and various statistics from LAN cards or virtual adapters.    
- * Modern systems ignore the data in the statistics record except for the first
- * six bytes (unit_id field), which are used to store the Ethernet MAC address.
- 
- * gcc -o nbquery.exe nbquery.c -Wall -lw2_32
- *******************************************************************************/
-
-#ifndef WIN32_LEAN_AND_MEAN
-#define WIN32_LEAN_AND_MEAN
-#endif
-
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <stdint.h>
-
-/* #pragma comment(lib, "Ws2_32.lib") */
-
-typedef SOCKET socket_t;
-
-#define NBT_DEFAULT_PORT 137    /* netbios-ns */
-#define TIMEOUT_DEFAULT 5000
-
-/* Packet header - 12 bytes */
-struct nbstat_packet_header {
-   uint16_t name_trn_id;
-/* --- Flags field --- */
-   /* 5-bit OPCODE field: */
-   uint16_t r:       1; 
-   uint16_t opcode:  4;
-   /* 7-bit NM_FLAGS field: */
-   uint16_t aa:      1;
-   uint16_t tc:      1;
-   uint16_t rd:      1;
-   uint16_t ra:      1;
-   uint16_t unused1: 1;
-   uint16_t unused2: 1;
-   uint16_t b:       1;
-   /* 4-bit RCODE field: */
-   uint16_t rcode:    4;
-/* --- End of Flags field --- */
-   uint16_t qdcount;
-   uint16_t ancount;
-   uint16_t nscount;
-   uint16_t arcount;
-};
-
-/* Operation specifier */
-#define OPCODE_QUERY        0x00
-#define OPCODE_REGISTRATION 0x05
-#define OPCODE_RELEASE      0x06
-#define OPCODE_WACK         0x07
-#define OPCODE_REFRESH      0x08
-
-/* Question Section - 36 bytes */
-struct nbstat_question_section {
-   uint8_t   q_name[34];
-   uint16_t  q_type;
-   uint16_t  q_class;
-};
-
-#define QTYPE_NB     0x0020 /* Name Query */
-#define QTYPE_NBSTAT 0x0021 /* Node status request */
-#define QCLASS_IN    0x0001 /* Internet class */
-
-/* Resource Record - 44 bytes */ 
-struct nbstat_resource_record {
-   uint8_t  rr_name[34];
-   uint16_t rr_type;
-   uint16_t rr_class;
-   uint32_t ttl;
-   uint16_t rdlength;
-};
-
-#define RR_TYPE_A      0x0001 /* IP address RR */
-#define RR_TYPE_NS     0x0002 /* Name Server RR */
-#define RR_TYPE_NULL   0x000A /* NULL RR */
-#define RR_TYPE_NB     0x0020 /* General Name Service RR */
-#define RR_TYPE_NBSTAT 0x0021 /* Node Status RR */
-#define RR_CLASS_IN    0x0001 /* Internet class */
-
-/* Node Entry - 18 bytes (RFC 1002, section 4.2.18) */
-struct nbstat_node_name {
-   uint8_t nbf_name[15]; /* NetBIOS format name */
-   uint8_t suffix;       
-   uint16_t g:        1; /* Group name flag */
-   uint16_t ont:      2; /* Owner Node Type */
-   uint16_t drg:      1; /* Deregistration flag */
-   uint16_t cnf:      1; /* Conflict flag */
-   uint16_t act:      1; /* Active name flag */  
-   uint16_t prm:      1; /* Permanent name flag */
-   uint16_t reserved: 9; /* Reserved, must be zero */
-   struct nbstat_node_name *next;
-};
-
-/* Statistics field of the Node Status Response - 46 bytes */
-struct nbstat_statistics {
-   uint8_t  unit_id[6]; /* This is usually the hardware address (MAC). */
-   uint8_t  jumpers;
-   uint8_t  test_result;
-   uint16_t version_number;
-   uint16_t period_of_statistics;
-   uint16_t number_of_crcs;
-   uint16_t number_alignment_errors;
-   uint16_t number_of_collisions;
-   uint16_t number_send_aborts;
-   uint32_t number_good_sends;
-   uint32_t number_good_receives;
-   uint16_t number_retransmits;
-   uint16_t number_no_resource_conditions;
-   uint16_t number_free_command_blocks;
-   uint16_t total_number_command_blocks;
-   uint16_t max_total_number_command_blocks;
-   uint16_t number_pending_sessions;
-   uint16_t max_number_pending_sessions;
-   uint16_t max_total_sessions_possible;
-   uint16_t session_data_packet_size;
-};
-
-/* Node Status Request */
-struct nbstat_query {
-    struct nbstat_packet_header hdr;
-    struct nbstat_question_section question;
-};
-
-/* Node Status Response */
-struct nbstat_response {
-   struct nbstat_packet_header hdr;
-   struct nbstat_resource_record rr;
-   uint8_t num_names;
-   struct nbstat_node_name *node;
-   struct nbstat_statistics stat;  
-};
-
-/* Buffer object */
-typedef struct buffer {
-   void *data;
-   size_t size;
-   size_t length;
-   /* size_t offset; */
-} buffer_t;
-
-/* nbtstat_t object */
-typedef struct nbstat {
-   struct sockaddr_in sin; 
-   uint8_t hwaddr[6]; 
-   int     count;  
-   struct nbstat_node_name *node; /* Zero or more entries. */
-} nbstat_t;
-
-/* Error codes: */
-#define NBSTAT_EOK      0x000
-#define NBSTAT_ENOMEM   0x101
-#define NBSTAT_EINVAL   0x102 
-#define NBSTAT_EWSAFAIL 0x103
-#define NBSTAT_ESOCKET  0x104
-#define NBSTAT_EPROTO   0x105 /* Generic protocol error */
-#define NBSTAT_ETRFLAG  0x106 /* Truncation flag in response. */
-#define NBSTAT_ETIMEOUT 0x107
-#define NBSTAT_EDEBUG   0x200
-
-
-uint8_t dec8be(const void *p)
-{
-   uint8_t const *ptr = (uint8_t const *)p;
-
-   return ptr[0];
-}
-
-uint16_t dec16be(const void *p)
-{
-   uint8_t const *ptr = (uint8_t const *)p;
-
-   return ((ptr[0] << 8) | ptr[1]);
-}
-
-uint32_t dec32be(const void *p)
-{
-   uint8_t const *ptr = (uint8_t const *)p;
-
-   return (((uint32_t)ptr[0] << 24) | (ptr[1] << 16) | (ptr[2] << 8) | ptr[3]);
-}
-
-void enc8be(void *p, uint8_t x)
-{
-   uint8_t *ptr = (uint8_t *)p;
-
-   ptr[0] = x;
-}
-
-void enc16be(void *p, uint16_t x)
-{
-   uint8_t *ptr = (uint8_t *)p;
-
-   ptr[0] = (x >> 8) & 0xff;
-   ptr[1] = x & 0xff;  
-}
-
-void enc32be(void *p, uint32_t x)
-{
-   uint8_t *ptr = (uint8_t *)p;
-
-   ptr[0] = (x >> 24) & 0xff;
-   ptr[1] = (x >> 16) & 0xff;
-   ptr[2] = (x >>  8) & 0xff;
-   ptr[3] = x & 0xff;
-}
-
-/* buffer_init */
-static void buffer_init(buffer_t *buffer, void *data, size_t size)
-{
-   buffer->data = data;
-   buffer->size = size;
-   buffer->length = 0;   
-
-   memset(buffer->data, 0x00, buffer->size);
-}
-
-/* winsock_init */
-static int winsock_init(void)
-{
-   WORD wVersionRequested;
-   WSADATA wsaData;
-   int result;
-
-   wVersionRequested = MAKEWORD(2, 2);
-   result = WSAStartup(wVersionRequested, &wsaData);
-   if (result != 0)
-       return result;
-
-    if (LOBYTE(wsaData.wVersion) != 2 || HIBYTE(wsaData.wVersion) != 2) {
-       WSACleanup();
-       return WSAVERNOTSUPPORTED;
-   }
-
-   return result;
-}
-
-/* socket_create - */
-static int nbstat_socket(SOCKET *sfd, const char *target, uint16_t port, struct sockaddr_in *sin)
-{
-   struct addrinfo *result = NULL;
-   struct addrinfo *ptr = NULL;
-   struct addrinfo hints;
-   char buffer[5+1];
-   int rcode;
-   int err = 0;
-
-   /* Redundant, set flags, addrlen and canonname to NULL */
-   memset(&hints, 0x00, sizeof(hints));
-   
-   hints.ai_family = AF_INET;
-   hints.ai_socktype = SOCK_DGRAM;
-   hints.ai_protocol = IPPROTO_UDP;
-   hints.ai_flags = 4; /* AI_NUMERICHOST */
-
-
-   _snprintf(buffer, sizeof(buffer), "%u", port);
-   buffer[5] = '\0';
-
-   rcode = getaddrinfo(target, buffer, &hints, &result);
-   if (rcode != 0) {
-       err = WSAGetLastError(); 
-       WSACleanup();
-       return err; 
-   }
-
-   *sfd = INVALID_SOCKET;
-
-   for (ptr = result; ptr != NULL; ptr = ptr->ai_next) {
-
-       *sfd = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
-       if (*sfd == INVALID_SOCKET) {
-           err = WSAGetLastError(); 
-           WSACleanup();
-           return err; 
-       }
-       rcode = connect(*sfd, ptr->ai_addr, (int)ptr->ai_addrlen); 
-       if (rcode == SOCKET_ERROR) {
-           closesocket(*sfd);
-           *sfd = INVALID_SOCKET;
-           continue;    
-       }
-       break;  
-   }
-  
-   if (*sfd == INVALID_SOCKET) {
-       err = WSAGetLastError();
-       WSACleanup();
-   } else 
-       memcpy(sin, ptr->ai_addr, ptr->ai_addrlen);     
-  
-   freeaddrinfo(result);
-
-   return err;
-}
-
-static int nbstat_send(socket_t sfd, buffer_t *buffer, const struct sockaddr_in *sin)
-{
-   char *ptr = buffer->data;
-   size_t len = buffer->length;  
-   
-   return sendto(sfd, ptr, len, 0, (struct sockaddr *)sin, sizeof(*sin));
-}
-
-static int socket_timeout(socket_t sfd, fd_set *rdfdset, int delay)
-{
-   struct timeval timeout;
-
-   FD_ZERO(rdfdset);
-   FD_SET(sfd, rdfdset);
-   timeout.tv_sec = delay / 1000;
-   timeout.tv_usec = (delay % 1000) * 1000;
-
-   return select(sfd+1, rdfdset, NULL, NULL, &timeout);
-}
-
-/* nbstat_recv */
-static int nbstat_recv(socket_t sfd, buffer_t *buffer, struct sockaddr_in *sin)
-{
-   char *ptr = buffer->data;
-   int sinlen = sizeof(*sin);
-   int nr;
-
-   nr = recvfrom(sfd, ptr, buffer->size, 0, (struct sockaddr *)sin, &sinlen); 
-   if (nr == SOCKET_ERROR)
-       return nr;
-
-   buffer->length = nr;
-
-   return nr;   
-}
-
-/* Encode the request */
-static int nbstat_encode_request(buffer_t *buffer, const struct nbstat_query *query)
-{
-   uint8_t *ptr = NULL;
-   uint16_t flags;
-
-   if (buffer == NULL || query == NULL)
-       return NBSTAT_EINVAL;
-
-   ptr = buffer->data;
-
-   enc16be(ptr, query->hdr.name_trn_id);
-   ptr += sizeof(query->hdr.name_trn_id);   
-
-   /* Encode flags. */
-   flags = 0x0000;
-   /* Opcode field: */
-   flags |= (query->hdr.r << 15) & 0x8000;
-   flags |= (query->hdr.opcode << 11) & 0x7800;
-   /* NM Flags: */
-   flags |= (query->hdr.aa << 10) & 0x0400;
-   flags |= (query->hdr.tc <<  9) & 0x0200;
-   flags |= (query->hdr.rd <<  8) & 0x0100;
-   flags |= (query->hdr.ra <<  7) & 0x0080;
-   flags |= (query->hdr.unused1 << 6) & 0x0040;
-   flags |= (query->hdr.unused2 << 5) & 0x0020;
-   flags |= (query->hdr.b << 4) & 0x0010;
-   /* Result code of request: */
-   flags |= query->hdr.rcode & 0x000f;
-
-   enc16be(ptr, flags);
-   ptr += sizeof(flags);
-
-   enc16be(ptr, query->hdr.qdcount);
-   ptr += sizeof(query->hdr.qdcount);
-   enc16be(ptr, query->hdr.ancount);
-   ptr += sizeof(query->hdr.ancount);
-   enc16be(ptr, query->hdr.nscount);
-   ptr += sizeof(query->hdr.nscount);
-   enc16be(ptr, query->hdr.arcount);
-   ptr += sizeof(query->hdr.arcount);
-
-   memcpy(ptr, query->question.q_name, sizeof(query->question.q_name));
-   ptr += sizeof(query->question.q_name);
-
-   enc16be(ptr, query->question.q_type);
-   ptr += sizeof(query->question.q_type);
-   enc16be(ptr, query->question.q_class);
-   ptr += sizeof(query->question.q_class);
-
-   buffer->length = ptr - (uint8_t *)buffer->data;
-
-   ptr = NULL;
-   
-   return NBSTAT_EOK; 
-}
-
-static void node_name_free(struct nbstat_node_name *node)
-{
-   struct nbstat_node_name *current = NULL, *tmp = NULL;
-
-   if (node != NULL) {
-       current = node;
-       while (current != NULL) {
-           tmp = current;
-           current = current->next;
-           free(tmp);   
-       }
-   }
-
-}
-
-/* Decode the response and validate */
-static int nbstat_decode_response(buffer_t *buffer, struct nbstat_response *rep)
-{
-   struct nbstat_node_name *current = NULL, *tmp = NULL;
-   uint8_t *ptr = NULL;
-   uint16_t flags;
-   size_t offset;
-   int i; 
-
-   /* Check whether the packet length does not exceed the maximum IP datagram size. */
-   if (buffer->length > 576)
-       return NBSTAT_EPROTO;
-
-   ptr = buffer->data;
-   rep->hdr.name_trn_id = dec16be(ptr);
-   ptr += sizeof(rep->hdr.name_trn_id);
-
-   flags = dec16be(ptr);
-   ptr += sizeof(flags);
-
-   /* Decode flags. Opcode field: */
-   rep->hdr.r = (flags >> 15) & 0x1;
-   rep->hdr.opcode = (flags >> 11) & 0xf;
-   /* NM Flags: */
-   rep->hdr.aa = flags;
-   rep->hdr.tc = flags;
-   rep->hdr.rd = flags;
-   rep->hdr.ra = flags;
-   rep->hdr.unused1 = flags;
-   rep->hdr.unused2 = flags;
-   rep->hdr.b = flags;
-   rep->hdr.rcode = flags;
-
-   rep->hdr.qdcount = dec16be(ptr);
-   ptr += sizeof(rep->hdr.qdcount);
-   rep->hdr.ancount = dec16be(ptr);
-   ptr += sizeof(rep->hdr.ancount);
-   rep->hdr.nscount = dec16be(ptr);
-   ptr += sizeof(rep->hdr.nscount);
-   rep->hdr.arcount = dec16be(ptr);
-   ptr += sizeof(rep->hdr.arcount);
-
-   /* Decode resource record. */
-   ptr += sizeof(rep->rr.rr_name);
-   rep->rr.rr_type = dec16be(ptr);
-   ptr += sizeof(rep->rr.rr_type);
-
-   if (rep->rr.rr_type != RR_TYPE_NBSTAT)
-       return NBSTAT_EPROTO;    
-
-   rep->rr.rr_class = dec16be(ptr);
-   ptr += sizeof(rep->rr.rr_class);
-   
-   rep->rr.ttl = dec32be(ptr);
-   ptr += sizeof(rep->rr.ttl);
-   
-   rep->rr.rdlength = dec16be(ptr);
-   ptr += sizeof(rep->rr.rdlength);
-
-   rep->num_names = dec8be(ptr);
-   ptr += sizeof(rep->num_names);
-
-   /* Make sure the remaining length is sensible. */
-   offset = ptr - (uint8_t *)buffer->data;
-   offset += 18 * rep->num_names + 46;
-   
-   if (offset != buffer->length)
-       return NBSTAT_EPROTO;
-
-   rep->node = NULL;
-
-   /* Build the linked list. */
-   for (i = 0; i < rep->num_names; i++) {
-
-       current = malloc(sizeof(struct nbstat_node_name));
-       if (current == NULL) {
-           node_name_free(rep->node);
-           return NBSTAT_ENOMEM; 
-       }       
-
-       current->next = NULL;
-
-       if (rep->node == NULL)
-           rep->node = current;
-       else
-           tmp->next = current;
-
-       tmp = current;
-
-       memcpy(current->nbf_name, ptr, sizeof(current->nbf_name));
-       ptr += sizeof(current->nbf_name);
-
-       current->suffix = dec8be(ptr);
-       ptr += sizeof(current->suffix);
-       
-       flags = dec16be(ptr);
-       /* Group Name Flag. If set, name is a GROUP. */
-       current->g = (flags >> 15) & 0x1; 
-       /* Owner Node Type (b00 = B; b01 = P; b10 = M; b11 = Reserved). */
-       current->ont = (flags >> 13) & 0x3;
-       /* Deregister Flag. If set, name is in the process of being deleted. */
-       current->drg = (flags >> 12) & 0x1;
-       /* Conflict Flag. If set, name on this node is in conflict. */
-       current->cnf = (flags >> 11) & 0x1;
-       /* Active Name Flag. All entries have this flag set. */
-       current->act = (flags >> 10) & 0x1; /* $fixme */
-       /* Permanent Name Flag. If set, entry is for permanent node name. */
-       current->prm = (flags >> 9) & 0x1;
-       /* Reserved, must be zero (0). */
-       current->reserved = flags & 0x1ff; 
-
-       ptr += sizeof(flags);           
-          
-   }
-
-   for (i = 0; i < sizeof(rep->stat.unit_id); i++) {
-       rep->stat.unit_id[i] = dec8be(ptr);
-       ptr += sizeof(rep->stat.unit_id[i]); 
-   }
-
-   /* No modern implementation ever fills these fields. We decode them anyway. */
-   rep->stat.jumpers = dec8be(ptr);
-   ptr += sizeof(rep->stat.jumpers);
-   rep->stat.test_result = dec8be(ptr);
-   ptr += sizeof(rep->stat.test_result);
-   rep->stat.version_number = dec16be(ptr);
-   ptr += sizeof(rep->stat.version_number);
-   rep->stat.period_of_statistics = dec16be(ptr);
-   ptr += sizeof(rep->stat.period_of_statistics);
-   rep->stat.number_of_crcs = dec16be(ptr);
-   ptr += sizeof(rep->stat.number_of_crcs);
-   rep->stat.number_alignment_errors = dec16be(ptr);
-   ptr += sizeof(rep->stat.number_alignment_errors);
-   rep->stat.number_of_collisions = dec16be(ptr);
-   ptr += sizeof(rep->stat.number_of_collisions);
-   rep->stat.number_send_aborts = dec16be(ptr);
-   ptr += sizeof(rep->stat.number_send_aborts);
-   rep->stat.number_good_sends = dec32be(ptr);
-   ptr += sizeof(rep->stat.number_good_sends);
-   rep->stat.number_good_receives = dec32be(ptr);
-   ptr += sizeof(rep->stat.number_good_receives);
-   rep->stat.number_retransmits = dec16be(ptr);
-   ptr += sizeof(rep->stat.number_retransmits);
-   rep->stat.number_no_resource_conditions = dec16be(ptr);
-   ptr += sizeof(rep->stat.number_no_resource_conditions);
-   rep->stat.number_free_command_blocks = dec16be(ptr);
-   ptr += sizeof(rep->stat.number_free_command_blocks);
-   rep->stat.total_number_command_blocks = dec16be(ptr);
-   ptr += sizeof(rep->stat.total_number_command_blocks);
-   rep->stat.max_total_number_command_blocks = dec16be(ptr);
-   ptr += sizeof(rep->stat.max_total_number_command_blocks);
-   rep->stat.number_pending_sessions = dec16be(ptr);
-   ptr += sizeof(rep->stat.number_pending_sessions);
-   rep->stat.max_number_pending_sessions = dec16be(ptr);
-   ptr += sizeof(rep->stat.max_number_pending_sessions);
-   rep->stat.max_total_sessions_possible = dec16be(ptr);
-   ptr += sizeof(rep->stat.max_total_sessions_possible);
-   rep->stat.session_data_packet_size = dec16be(ptr);
-   ptr += sizeof(rep->stat.session_data_packet_size);
-
-   offset = ptr - (uint8_t *)buffer->data;
-
-   return offset != buffer->length ? NBSTAT_EDEBUG : NBSTAT_EOK; 
-} 
-
-/* netbios_encode_name */
-static size_t netbios_encode_name(char *name, const char *src, uint8_t pad)
-{
-   char *ptr = name;
-   int length = 16;
-   int i;
-
-   *ptr++ = 0x20;
-   for (i = 0; i < length; i++) {
-       *ptr++ = 0x41 + ((*src >> 4) & 0x0f);
-       *ptr++ = 0x41 + (*src & 0x0f);
-       src++;
-   }
- 
-   *ptr = 0x00;
-   return (size_t)(ptr - name);
-
-}
-
-void nbstat_free(nbstat_t *nbstat) 
-{
-   if (nbstat != NULL) {
-       if (nbstat->node != NULL)
-           node_name_free(nbstat->node);   
-       free(nbstat);
-   }
-}
-
-static int nbstat_close(socket_t sfd)
-{
-   int result;
-
-   result = closesocket(sfd);
-   WSACleanup();
-  
-   return result;
-}
-
-/* nbstat_query */
-int nbstat_query(nbstat_t **nbstat, const char *target, uint16_t port, int timeout)
-{
-   SOCKET sfd = INVALID_SOCKET;
-   struct sockaddr_in sin;
-   struct nbstat_query query; /* Node status request */  
-   struct nbstat_response rep; /* Node status response */
-   struct nbstat_node_name *node;
-   buffer_t buffer;
-   char data[1024];
-   char nbtname[16]; 
-   fd_set rdfdset;
-   int result;
-   int i;
-   int nready;
-   
-   result = winsock_init();
-   if (result != 0)
-       return NBSTAT_EWSAFAIL;
-
-   result = nbstat_socket(&sfd, target, port, &sin);
-   if (result != 0)
-       return NBSTAT_ESOCKET; 
-
-   query.hdr.name_trn_id = GetCurrentProcessId();
-
-   query.hdr.r = 0;
-   query.hdr.opcode = OPCODE_QUERY;
-   query.hdr.aa = 0;
-   query.hdr.tc = 0;
-   query.hdr.rd = 0;
-   query.hdr.ra = 0;
-   query.hdr.unused1 = 0;
-   query.hdr.unused2 = 0;
-   query.hdr.b = 0;
-   query.hdr.rcode = 0;
-   
-   query.hdr.qdcount = 1;
-   query.hdr.ancount = 0;
-   query.hdr.nscount = 0;
-   query.hdr.arcount = 0;
-
-
-   /* Encode the first-level NetBIOS name. */
-   memset(nbtname, '\0', sizeof(nbtname));
-   nbtname[0] = '*';
-   netbios_encode_name((char *)query.question.q_name, nbtname, 0x20);
-
-   query.question.q_type  = QTYPE_NBSTAT;
-   query.question.q_class = QCLASS_IN;
-
-   buffer_init(&buffer, data, sizeof(data));
-   nbstat_encode_request(&buffer, &query);
-
-   result = nbstat_send(sfd, &buffer, &sin);
-   if (result == SOCKET_ERROR || result != buffer.length) {
-       nbstat_close(sfd);
-       return NBSTAT_EDEBUG;
-   }
-    
-   buffer_init(&buffer, data, sizeof(data));
-   
-   if (timeout > 10000 || timeout <= 0)
-       timeout = 3000;
-     
-   nready = socket_timeout(sfd, &rdfdset, timeout);
-   if (nready == SOCKET_ERROR) {
-       nbstat_close(sfd);    
-       return NBSTAT_EDEBUG;
-   } else if (nready == 0) {
-       nbstat_close(sfd);
-       return NBSTAT_ETIMEOUT;
-   } else if (nready > 0) {
-       if (FD_ISSET(sfd, &rdfdset)) { /* redundant*/
-           result = nbstat_recv(sfd, &buffer, &sin);
-           nbstat_close(sfd); 
-           if (result == SOCKET_ERROR)
-               return NBSTAT_EDEBUG; 
-       }  
-   } 
- 
-   /* Decode the response. */
-   result = nbstat_decode_response(&buffer, &rep);
-   if (result != NBSTAT_EOK)
-       return result;
-
-   *nbstat = (nbstat_t *)malloc(sizeof(nbstat_t));
-   if (*nbstat == NULL) 
-       return NBSTAT_ENOMEM;
-     
-   memset(*nbstat, 0x00, sizeof(nbstat_t));  
-   (*nbstat)->sin = sin; 
-   (*nbstat)->node = rep.node;
-   node = (*nbstat)->node;
-
-   while (node != NULL) {
-       (*nbstat)->count++;       
-       node = node->next; 
-   }
-         
-   for (i = 0; i < sizeof((*nbstat)->hwaddr); i++)
-       (*nbstat)->hwaddr[i] = rep.stat.unit_id[i];     
-
-   return NBSTAT_EOK;
-} 
-
-struct error_list {
-   int result;
-   const char *str;
-} error_list[] = {
-  { NBSTAT_EOK,      "operation completed successfully" },
-  { NBSTAT_ENOMEM,   "memory allocation failure" },
-  { NBSTAT_EINVAL,   "an invalid argument was passed to a library function" },
-  { NBSTAT_EWSAFAIL, "could not initialize the sockets layer" },
-  { NBSTAT_ESOCKET,  "the system could not allocate a socket descriptor" },
-  { NBSTAT_ETRFLAG,  "truncation flag was set in response" },
-  { NBSTAT_ETIMEOUT, "request expired" }, 
-  { NBSTAT_EDEBUG,   "debugging error" },
-  { 0xffffffff,       NULL }
-};
-
-/* nbstat_error */
-const char *nbstat_error(int x)
-{
-   /* static char buffer[128]; */
-   const char *error = NULL;
-   int i;
-   
-   for (i = 0; error_list[i].str != NULL; i++) {
-      if (error_list[i].result == x) {
-          error = error_list[i].str;   
-          break; 
-      }
-   }
-   if (error == NULL)
-       error = "Unknown error";
-
-   return error;
-}
-
-
-const char *netbios_service_name(uint8_t g, uint8_t suffix)
-{
-   const char *name = NULL;
-
-   switch(suffix) {
-       case 0x00: name = !g ? "Workstation Service" : "Browser Client"; break;
-       case 0x01: name =  g ? "Master Browser" : NULL; break;
-       case 0x1B: name = !g ? "Domain Master Browser" : NULL; break; 
-       case 0x1D: name = !g ? "Master Browser" : NULL; break;
-       case 0x1E: name =  g ? "Browser Service Elections" : NULL; break;
-       case 0x20: name = !g ? "Default Name" : NULL; break;
-       case 0x6A: break;
-       case 0x6B: break;
-       default:
-           break;
-   }
-   if (name == NULL)
-       name = "Unknown"; 
-   
-   return name;
-}
-
-/* nbstat_dump_nbtstat */
-void nbstat_dump_nbtstat(const nbstat_t *nbstat)
-{
-   struct nbstat_node_name *current = NULL;
-   const char *name;
-   char ch;
-   int i;
-
-   putchar('\n');
-   printf("    NetBIOS Remote Machine Table\n\n");
-   printf("       Name             Type   Status     Description  \n");
-   printf("    ----------------------------------------------\n");
-
-   /* Traverse the linked list and print all the relevant info. */
-   current = nbstat->node;
-
-   while (current != NULL) {
-       printf("    ");
-       for (i = 0; i < 15; i++) {
-           ch = current->nbf_name[i];     
-           if (ch >= 0x20 && ch <= 0x79)
-               putchar(ch);
-           else
-               putchar('.');
-       }
-       printf("<%02X> ", current->suffix);
-       printf("%s ", !current->g ? "UNIQUE" : "GROUP "); /* Space in GROUP is for text alignment. */
-       name = netbios_service_name(current->g, current->suffix);
-       printf("Registered %s\n", name);
-
-       current = current->next;
-   }
-
-   printf("\n    MAC Address = ");
-   for (i = 0; i < sizeof(nbstat->hwaddr); i++) {
-       if (i > 0) putchar('-');
-       printf("%02X", nbstat->hwaddr[i]);    
-   } 
-   printf("\n");
-
-}
-
-/* To do: implement this function! */
-void nbstat_dump_nmblookup(const nbstat_t *nbstat)
-{
-   printf("nmblookup-like output\n"); 
-}
-
-static int strtoi(char *str)
-{
-   return atoi(str);
-}
-
-int main(int argc, char *argv[])
-{
-   nbstat_t *nbstat = NULL;
-   int port = 0;
-   int timeout = 0;
-   char *target = NULL;
-   char *progname;
-   int result;
-
-   if (argc != 2 && argc != 4 && argc != 6) {
-       fprintf(stderr, "-%s: incorrect number of arguments\n", argv[0]);
-       fprintf(stderr, "\nUsage:   %s [-p port] [-t timeout] target\n", argv[0]);
-       fprintf(stderr, "Example: %s -p 137 -t 3000 192.168.1.200\n", argv[0]); 
-       return EXIT_FAILURE; 
-   }
-
-   progname = argv[0];
-   argc--;
-   argv++;
-
-   while (argc > 1) {
-       if (strcmp(*argv, "-p") == 0) {
-           if (--argc < 1 || port != 0) {
-               fprintf(stderr, "-%s: incorrect number of arguments for option -p\n", progname);
-               return EXIT_FAILURE;
-           }  
-           port = strtoi(*(++argv));    
-       } else if (strcmp(*argv, "-t") == 0) {
-           if (--argc < 1 || timeout != 0) {
-               fprintf(stderr, "-%s: incorrect number of arguments for option -t\n", progname);
-               return EXIT_FAILURE; 
-           }
-           timeout = strtoi(*(++argv)); 
-       } else {
-           fprintf(stderr, "-%s: -unknown option %s \n", progname, *argv);
-           return EXIT_FAILURE;
-       }
-
-       argc--; 
-       argv++;  
-   }
-
-   target = *argv;
-   
-   if (port == 0) 
-       port = 137; /* NBSTAT_DEFAULT_PORT; */
-   if (timeout == 0) 
-       timeout = 3000;
-
-   result = nbstat_query(&nbstat, target, port, timeout);
-   if (result != NBSTAT_EOK /*&& result != NBSTAT_ETIMEOUT*/ ) {
-       printf("-%s: error! %s (0x%04X) \n", progname, nbstat_error(result), result);
-       return EXIT_FAILURE;
-   }
-
-   nbstat_dump_nbtstat(nbstat);
-   
-   /* We are done, destroy the nbstat object! */
-   nbstat_free(nbstat);
-
-   return EXIT_SUCCESS;
-}
-
-
-/* EOF */
+
+
+/*******************************************************************************
+ * nbquery.c - Implementation of the RFC 1001/1002 Node Status Request.
+ * This tool implements the NetBIOS API Adapter Status Query function.
+ * Also known as Node Status Query and many other names, this NBT message is 
+ * used to retrieve the NetBIOS name table for both the local computer and 
+ * remote computers, and various statistics from LAN cards or virtual adapters.    
+ * Modern systems ignore the data in the statistics record except for the first
+ * six bytes (unit_id field), which are used to store the Ethernet MAC address.
+ 
+ * gcc -o nbquery.exe nbquery.c -Wall -lw2_32
+ * gcc -o nbquery nbquery.c -Wall -pthread              (Linux/POSIX)
+ * gcc -c nbquery.c -Wall -DNBSTAT_LIBRARY               (libnbquery, see nbquery.h)
+ * -DNBSTAT_RIO: Registered I/O on Windows 8 and later, instead of overlapped
+ * receives; opt-in, it has had less testing.
+ *******************************************************************************/
+
+#ifdef _WIN32
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0602 /* Registered I/O */
+#endif
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <mswsock.h>
+#include <windows.h>
+#include <io.h>    /* _setmode */
+#include <fcntl.h>
+
+/* #pragma comment(lib, "Ws2_32.lib") */
+
+typedef SOCKET socket_t;
+
+#else /* POSIX */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* sendmmsg, recvmmsg */
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#include <poll.h>
+#include <ifaddrs.h>
+
+typedef int socket_t;
+
+/* The few Winsock names used below, mapped onto BSD sockets. */
+#define INVALID_SOCKET      (-1)
+#define SOCKET_ERROR        (-1)
+#define closesocket(s)      close(s)
+#define WSAGetLastError()   (errno)
+#define WSACleanup()        ((void)0)
+#define WSAEWOULDBLOCK      EWOULDBLOCK
+#define WSAENOBUFS          ENOBUFS
+#define _snprintf           snprintf
+#define GetCurrentProcessId getpid
+
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+
+/* SIMD name kernels; other compilers and targets use the scalar ones. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define NBSTAT_SIMD_X86
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON)
+#define NBSTAT_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+#include "nbquery.h"
+
+#define NBT_DEFAULT_PORT 137    /* netbios-ns */
+#define TIMEOUT_DEFAULT 5000
+
+/* Packet header - 12 bytes */
+struct nbstat_packet_header {
+   uint16_t name_trn_id;
+/* --- Flags field --- */
+   /* 5-bit OPCODE field: */
+   uint16_t r:       1; 
+   uint16_t opcode:  4;
+   /* 7-bit NM_FLAGS field: */
+   uint16_t aa:      1;
+   uint16_t tc:      1;
+   uint16_t rd:      1;
+   uint16_t ra:      1;
+   uint16_t unused1: 1;
+   uint16_t unused2: 1;
+   uint16_t b:       1;
+   /* 4-bit RCODE field: */
+   uint16_t rcode:    4;
+/* --- End of Flags field --- */
+   uint16_t qdcount;
+   uint16_t ancount;
+   uint16_t nscount;
+   uint16_t arcount;
+};
+
+/* Operation specifier */
+#define OPCODE_QUERY        0x00
+#define OPCODE_REGISTRATION 0x05
+#define OPCODE_RELEASE      0x06
+#define OPCODE_WACK         0x07
+#define OPCODE_REFRESH      0x08
+
+/* Question Section - 36 bytes */
+struct nbstat_question_section {
+   uint8_t   q_name[34];
+   uint16_t  q_type;
+   uint16_t  q_class;
+};
+
+#define QTYPE_NB     0x0020 /* Name Query */
+#define QTYPE_NBSTAT 0x0021 /* Node status request */
+#define QCLASS_IN    0x0001 /* Internet class */
+
+/* Resource Record - 44 bytes */ 
+struct nbstat_resource_record {
+   uint8_t  rr_name[34];
+   uint16_t rr_type;
+   uint16_t rr_class;
+   uint32_t ttl;
+   uint16_t rdlength;
+};
+
+#define RR_TYPE_A      0x0001 /* IP address RR */
+#define RR_TYPE_NS     0x0002 /* Name Server RR */
+#define RR_TYPE_NULL   0x000A /* NULL RR */
+#define RR_TYPE_NB     0x0020 /* General Name Service RR */
+#define RR_TYPE_NBSTAT 0x0021 /* Node Status RR */
+#define RR_CLASS_IN    0x0001 /* Internet class */
+
+/* Fixed offsets into a node status response. */
+#define NBSTAT_OFF_FLAGS     2
+#define NBSTAT_FLAG_B        0x0010 /* Broadcast bit of the flags word */
+#define NBSTAT_OFF_RR_TYPE   46
+#define NBSTAT_OFF_TTL       50
+#define NBSTAT_OFF_NUM_NAMES 56
+#define NBSTAT_OFF_NAMES     57
+#define NBSTAT_NAME_SIZE     18
+#define NBSTAT_STAT_SIZE     46
+
+/* Statistics field of the Node Status Response - 46 bytes */
+struct nbstat_statistics {
+   uint8_t  unit_id[6]; /* This is usually the hardware address (MAC). */
+   uint8_t  jumpers;
+   uint8_t  test_result;
+   uint16_t version_number;
+   uint16_t period_of_statistics;
+   uint16_t number_of_crcs;
+   uint16_t number_alignment_errors;
+   uint16_t number_of_collisions;
+   uint16_t number_send_aborts;
+   uint32_t number_good_sends;
+   uint32_t number_good_receives;
+   uint16_t number_retransmits;
+   uint16_t number_no_resource_conditions;
+   uint16_t number_free_command_blocks;
+   uint16_t total_number_command_blocks;
+   uint16_t max_total_number_command_blocks;
+   uint16_t number_pending_sessions;
+   uint16_t max_number_pending_sessions;
+   uint16_t max_total_sessions_possible;
+   uint16_t session_data_packet_size;
+};
+
+/* Node Status Request */
+struct nbstat_query {
+    struct nbstat_packet_header hdr;
+    struct nbstat_question_section question;
+};
+
+/* Node Status Response */
+struct nbstat_response {
+   struct nbstat_packet_header hdr;
+   struct nbstat_resource_record rr;
+   uint8_t num_names;
+   struct nbstat_node_name *node; /* Caller storage for NBSTAT_MAX_NAMES entries */
+   struct nbstat_statistics stat;  
+};
+
+/* Hierarchical timer wheel: 4 levels of 64 slots at 1 ms resolution cover
+ * 2^24 ms (about 4.6 hours), with O(1) insertion and removal. */
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN   ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+/* Timer, embedded in the object it times out. */
+struct nbstat_timer {
+   struct nbstat_timer *next; /* NULL when not armed */
+   struct nbstat_timer *prev;
+   uint64_t expires;
+};
+
+struct nbstat_wheel {
+   uint64_t now;  /* Last processed tick */
+   size_t count;  /* Armed timers */
+   struct nbstat_timer slot[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+typedef void (*nbstat_timer_fn)(void *user, struct nbstat_timer *timer);
+
+/* Relaxed single-writer access to the nbstat_stats counters */
+#ifdef _WIN32
+#define stat_get(p)     ((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(p), 0, 0))
+#define stat_add(p, n)  ((void)InterlockedExchangeAdd64((volatile LONG64 *)(p), (LONG64)(n)))
+#else
+#define stat_get(p)     __atomic_load_n(p, __ATOMIC_RELAXED)
+#define stat_add(p, n)  __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#endif
+
+/* Event engine. Overlapped WSARecvFrom on an I/O completion port, or Registered
+ * I/O with NBSTAT_RIO, on Windows; epoll readiness elsewhere. Datagrams move in
+ * batches where the platform allows it (RIO, recvmmsg/sendmmsg) and one at a
+ * time otherwise.
+ * Either way every received datagram is handed to a callback. */
+#define NBSTAT_RXDEPTH 64 /* Receives kept posted, and datagrams per wakeup */
+#define NBSTAT_TXDEPTH 64 /* Datagrams staged for one batched send */
+
+/* The receive buffer is sized for a reply to every request in flight; the
+ * kernel charges a small datagram about 1 KB of buffer space, twice that to
+ * be safe. */
+#define NBSTAT_RCVBUF_SLOT (2 * 1024)
+#define NBSTAT_RCVBUF_MIN  (256 * 1024)
+#define NBSTAT_RCVBUF_MAX  (64 * 1024 * 1024)
+
+/* Peer address. RIO wants the SOCKADDR_INET form inside a registered buffer. */
+typedef union nbstat_addr {
+   struct sockaddr_in sin;
+#ifdef _WIN32
+   SOCKADDR_INET inet;
+#endif
+} nbstat_addr_t;
+
+/* Receive slot */
+struct nbstat_rxmsg {
+#ifdef _WIN32
+   OVERLAPPED ov; /* Must be first */
+   WSABUF wsabuf;
+   INT fromlen;
+   DWORD flags;
+   int pending;
+#endif
+   nbstat_addr_t from;
+   char data[1024];
+};
+
+/* Staged outgoing datagram */
+struct nbstat_txmsg {
+   nbstat_addr_t to;
+   uint32_t length;
+   int tag; /* Handed back if the send fails */
+   char data[64];
+};
+
+#if defined(_WIN32) && defined(NBSTAT_RIO)
+/* Registered I/O state */
+struct nbstat_rio {
+   RIO_EXTENSION_FUNCTION_TABLE fn;
+   RIO_CQ cq;
+   RIO_RQ rq;
+   RIO_BUFFERID rxid;
+   RIO_BUFFERID txid;
+   OVERLAPPED ov; /* Completion queue notification */
+   int armed;
+};
+#endif
+
+struct nbstat_engine {
+   socket_t sfd;
+   struct nbstat_rxmsg *rx;    /* NBSTAT_RXDEPTH slots */
+   struct nbstat_txmsg *tx;    /* NBSTAT_TXDEPTH slots */
+   int txfree[NBSTAT_TXDEPTH]; /* Unused tx slots */
+   int ntxfree;
+   int txq[NBSTAT_TXDEPTH];    /* Staged tx slots, in send order */
+   int ntxq;
+   struct nbstat_stats *stats; /* Counts datagrams in and out */
+   int rxmore;                 /* Last batch was full: more is queued, read before waiting */
+   int rcvbuf;                 /* SO_RCVBUF asked for, 0 = system default */
+   uint32_t dropped;           /* Receive buffer overflows the caller has not seen yet */
+#ifdef _WIN32
+   HANDLE iocp;
+#ifdef NBSTAT_RIO
+   struct nbstat_rio *rio;     /* NULL when RIO is unavailable */
+#endif
+   int pending;                /* Overlapped receives posted */
+#else
+   int epfd;
+#ifdef __linux__
+   int nommsg;                 /* No sendmmsg/recvmmsg, e.g. filtered by seccomp */
+   uint32_t ovfl;              /* Last SO_RXQ_OVFL count, the socket's drops so far */
+   struct mmsghdr rxhdr[NBSTAT_RXDEPTH];
+   struct iovec rxiov[NBSTAT_RXDEPTH];
+   union {
+       struct cmsghdr hdr;
+       char buf[CMSG_SPACE(sizeof(uint32_t))];
+   } rxctl[NBSTAT_RXDEPTH];
+   struct mmsghdr txhdr[NBSTAT_TXDEPTH];
+   struct iovec txiov[NBSTAT_TXDEPTH];
+#endif
+#endif
+};
+
+typedef void (*nbstat_rx_fn)(void *user, buffer_t *buffer, const struct sockaddr_in *from);
+typedef void (*nbstat_txerr_fn)(void *user, int tag, const struct sockaddr_in *to, int err);
+
+/* Send pacing. A token bucket caps the request rate; the rate is cut by a
+ * quarter when an interval shows loss or a full send buffer, and grows back
+ * by 1/16 per clean interval. */
+#define NBSTAT_PACE_EPOCH 100 /* ms per measuring interval */
+#define NBSTAT_PACE_MIN   10  /* Never slow down below this many pps */
+
+struct nbstat_pace {
+   uint32_t limit;   /* Configured ceiling in pps, 0 = none */
+   uint32_t rate;    /* Current rate in pps, 0 = unpaced */
+   int64_t tokens;   /* In 1/1000 of a request */
+   uint64_t last;    /* Last refill */
+   uint64_t epoch;   /* Start of the current interval */
+   uint32_t sent;    /* Requests sent in the interval */
+   uint32_t replies; /* Replies received in the interval */
+   uint32_t lost;    /* Of those, replies that needed a retransmission */
+   int blocked;      /* The send buffer filled up in the interval */
+};
+
+/* Query context. Owns the Winsock state, the socket and the event engine, so
+ * a caller that queries many hosts pays for the setup only once. */
+#define NBSTAT_REQUEST_SIZE 50  /* Header, encoded wildcard name, type, class */
+
+/* Retransmission timeouts follow RFC 6298, kept per /24 so that a slow WAN
+ * subnet does not inflate the timeout of the local one. */
+#define NBSTAT_RTT_SLOTS       256 /* Direct mapped by subnet */
+#define NBSTAT_RTO_INIT        250 /* ms, before the first sample */
+#define NBSTAT_RTO_MIN         10
+#define NBSTAT_RTO_MAX         60000
+#define NBSTAT_RETRIES_DEFAULT 2
+
+/* Source address to send from, with the subnet it reaches directly */
+#define NBSTAT_SOURCES_MAX 16
+
+struct nbstat_source {
+   uint32_t addr;  /* Host order */
+   uint32_t mask;  /* 0 when no subnet is known */
+};
+
+/* Round-trip time estimator, in ms scaled as in the BSD TCP code. */
+struct nbstat_rtt {
+   uint32_t net;   /* Subnet (host order >> 8) the slot belongs to */
+   int srtt;       /* Smoothed RTT << 3 */
+   int rttvar;     /* RTT variation << 2 */
+   int samples;    /* 0 = empty */
+   int backoff;    /* RTO doubled by timeouts, until the next sample */
+};
+
+struct nbstat_ctx {
+   socket_t sfd;                /* Unconnected, non-blocking UDP socket */
+   uint16_t trn_id;             /* Last sequence number used by nbstat_query_ctx() */
+   uint32_t trn_key;            /* Non-zero: mix a keyed hash of the target into IDs */
+   uint8_t request[NBSTAT_REQUEST_SIZE]; /* Encoded request; only the ID varies */
+   int retries;                 /* Retransmissions per target */
+   int broadcast;               /* SO_BROADCAST has been set */
+   struct nbstat_rtt rtt_all;   /* Over all subnets, for subnets not seen yet */
+   struct nbstat_rtt rtt[NBSTAT_RTT_SLOTS];
+   struct nbstat_engine engine;
+   struct nbstat_wheel wheel;   /* Request timeouts */
+   struct nbstat_pace pace;     /* Sweep send rate */
+   struct nbstat_stats stats;
+   nbstat_stats_fn report;      /* Called every report_every ms of a sweep */
+   void *report_arg;
+   int report_every;
+   uint64_t report_due;
+   struct nbstat_sweep *async;  /* nbstat_submit() slots, NULL until first used */
+   int pending;                 /* Of which outstanding; the blocking calls wait for none */
+   struct nbstat_source src[NBSTAT_SOURCES_MAX]; /* The socket is bound to the first */
+   int nsrc;
+};
+
+
+static uint8_t dec8be(const void *p)
+{
+   uint8_t const *ptr = (uint8_t const *)p;
+
+   return ptr[0];
+}
+
+static uint16_t dec16be(const void *p)
+{
+   uint8_t const *ptr = (uint8_t const *)p;
+
+   return ((ptr[0] << 8) | ptr[1]);
+}
+
+static uint32_t dec32be(const void *p)
+{
+   uint8_t const *ptr = (uint8_t const *)p;
+
+   return (((uint32_t)ptr[0] << 24) | (ptr[1] << 16) | (ptr[2] << 8) | ptr[3]);
+}
+
+static uint64_t dec64be(const void *p)
+{
+   uint8_t const *ptr = (uint8_t const *)p;
+
+   return ((uint64_t)dec32be(ptr) << 32) | dec32be(ptr + 4);
+}
+
+static void enc8be(void *p, uint8_t x)
+{
+   uint8_t *ptr = (uint8_t *)p;
+
+   ptr[0] = x;
+}
+
+static void enc16be(void *p, uint16_t x)
+{
+   uint8_t *ptr = (uint8_t *)p;
+
+   ptr[0] = (x >> 8) & 0xff;
+   ptr[1] = x & 0xff;  
+}
+
+static void enc32be(void *p, uint32_t x)
+{
+   uint8_t *ptr = (uint8_t *)p;
+
+   ptr[0] = (x >> 24) & 0xff;
+   ptr[1] = (x >> 16) & 0xff;
+   ptr[2] = (x >>  8) & 0xff;
+   ptr[3] = x & 0xff;
+}
+
+static void enc64be(void *p, uint64_t x)
+{
+   uint8_t *ptr = (uint8_t *)p;
+
+   enc32be(ptr, (uint32_t)(x >> 32));
+   enc32be(ptr + 4, (uint32_t)x);
+}
+
+/* buffer_init */
+static void buffer_init(buffer_t *buffer, void *data, size_t size)
+{
+   buffer->data = data;
+   buffer->size = size;
+   buffer->length = 0;   
+
+   memset(buffer->data, 0x00, buffer->size);
+}
+
+/* winsock_init */
+static int winsock_init(void)
+{
+#ifdef _WIN32
+   WORD wVersionRequested;
+   WSADATA wsaData;
+   int result;
+
+   wVersionRequested = MAKEWORD(2, 2);
+   result = WSAStartup(wVersionRequested, &wsaData);
+   if (result != 0)
+       return result;
+
+    if (LOBYTE(wsaData.wVersion) != 2 || HIBYTE(wsaData.wVersion) != 2) {
+       WSACleanup();
+       return WSAVERNOTSUPPORTED;
+   }
+
+   return result;
+#else
+   return 0;
+#endif
+}
+
+/* nbstat_parse_ipv4 - parse exactly `len' characters of a decimal dotted
+ * quad into a host order address, without the resolver. */
+int nbstat_parse_ipv4(const char *str, size_t len, uint32_t *addr)
+{
+   const char *end = str + len;
+   uint32_t a = 0, part;
+   int digits, i;
+
+   for (i = 0; i < 4; i++) {
+       if (i > 0 && (str == end || *str++ != '.'))
+           return NBSTAT_EINVAL;
+       for (part = 0, digits = 0; str < end && *str >= '0' && *str <= '9' && digits < 3; digits++)
+           part = part * 10 + (uint32_t)(*str++ - '0');
+       if (digits == 0 || part > 255)
+           return NBSTAT_EINVAL;
+       a = a << 8 | part;
+   }
+   if (str != end)
+       return NBSTAT_EINVAL;
+
+   *addr = a;
+
+   return NBSTAT_EOK;
+}
+
+/* nbstat_resolve - convert a numeric target address into a sockaddr_in. */
+static int nbstat_resolve(const char *target, uint16_t port, struct sockaddr_in *sin)
+{
+   struct addrinfo *result = NULL;
+   struct addrinfo hints;
+   char buffer[5+1];
+   uint32_t addr;
+   int rcode;
+
+   /* Plain dotted quads, i.e. nearly everything, skip getaddrinfo(). */
+   if (nbstat_parse_ipv4(target, strlen(target), &addr) == NBSTAT_EOK) {
+       memset(sin, 0x00, sizeof(*sin));
+       sin->sin_family = AF_INET;
+       sin->sin_port = htons(port);
+       sin->sin_addr.s_addr = htonl(addr);
+       return 0;
+   }
+
+   /* Redundant, set flags, addrlen and canonname to NULL */
+   memset(&hints, 0x00, sizeof(hints));
+   
+   hints.ai_family = AF_INET;
+   hints.ai_socktype = SOCK_DGRAM;
+   hints.ai_protocol = IPPROTO_UDP;
+   hints.ai_flags = 4; /* AI_NUMERICHOST */
+
+
+   _snprintf(buffer, sizeof(buffer), "%u", port);
+   buffer[5] = '\0';
+
+   rcode = getaddrinfo(target, buffer, &hints, &result);
+   if (rcode != 0)
+       return rcode; 
+
+   if (result == NULL || result->ai_addrlen > sizeof(*sin)) {
+       freeaddrinfo(result);
+       return NBSTAT_EINVAL; 
+   }
+
+   memcpy(sin, result->ai_addr, result->ai_addrlen);     
+   freeaddrinfo(result);
+
+   return 0;
+}
+
+#ifndef _WIN32
+/* nbstat_recv */
+static int nbstat_recv(socket_t sfd, buffer_t *buffer, struct sockaddr_in *sin)
+{
+   char *ptr = buffer->data;
+   socklen_t sinlen = sizeof(*sin);
+   int nr;
+
+   nr = recvfrom(sfd, ptr, buffer->size, 0, (struct sockaddr *)sin, &sinlen); 
+   if (nr == SOCKET_ERROR)
+       return nr;
+
+   buffer->length = nr;
+
+   return nr;   
+}
+#endif
+
+/* nbstat_clock - monotonic time in milliseconds */
+uint64_t nbstat_clock(void)
+{
+#ifdef _WIN32
+   return GetTickCount64();
+#else
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+/* nbstat_walltime - milliseconds since 1970, for time stamps that outlive the process */
+static uint64_t nbstat_walltime(void)
+{
+#ifdef _WIN32
+   FILETIME ft;
+   uint64_t t;
+
+   GetSystemTimeAsFileTime(&ft);
+   t = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+   return t / 10000 - 11644473600000ULL;
+#else
+   struct timespec ts;
+
+   clock_gettime(CLOCK_REALTIME, &ts);
+   return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+/* nbstat_clock_us - monotonic time in microseconds, for RTT samples */
+static uint64_t nbstat_clock_us(void)
+{
+#ifdef _WIN32
+   LARGE_INTEGER freq, t;
+
+   QueryPerformanceFrequency(&freq);
+   QueryPerformanceCounter(&t);
+   return (uint64_t)(t.QuadPart / freq.QuadPart * 1000000 + t.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+#else
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/* hist_bucket - the histogram bucket a value falls into. */
+static int hist_bucket(uint64_t v)
+{
+   int shift = 0;
+
+   if (v >> 32)
+       v = 0xffffffffU;
+   while ((v >> shift) >= 2 * NBSTAT_HIST_SUB)
+       shift++;
+
+   return shift * NBSTAT_HIST_SUB + (int)(v >> shift);
+}
+
+/* hist_value - the highest value of a bucket. */
+static uint64_t hist_value(int i)
+{
+   int shift = i < 2 * NBSTAT_HIST_SUB ? 0 : i / NBSTAT_HIST_SUB - 1;
+
+   return (((uint64_t)(i - shift * NBSTAT_HIST_SUB) + 1) << shift) - 1;
+}
+
+/* stats_result - count the outcome of one request, and pass it on. */
+static int stats_result(struct nbstat_stats *st, int result)
+{
+   int i = NBSTAT_OUTCOMES - 1;
+
+   if (result == NBSTAT_EOK)
+       i = 0;
+   else if (result >= NBSTAT_ENOMEM && result <= NBSTAT_ENAME)
+       i = result - NBSTAT_ENOMEM + 1;
+   stat_add(&st->outcome[i], 1);
+
+   return result;
+}
+
+/* stats_rtt - record the round trip of a reply to a request sent at `sent' us. */
+static void stats_rtt(struct nbstat_stats *st, uint64_t sent)
+{
+   uint64_t now = nbstat_clock_us();
+
+   stat_add(&st->rtt[hist_bucket(now > sent ? now - sent : 0)], 1);
+}
+
+/* nbstat_stats_add - add the counters of a context, possibly still running,
+ * to a summary. */
+void nbstat_stats_add(struct nbstat_stats *sum, const struct nbstat_stats *st)
+{
+   int i;
+
+   if (sum->start == 0 || (st->start != 0 && st->start < sum->start))
+       sum->start = st->start;
+   sum->sent += stat_get(&st->sent);
+   sum->resent += stat_get(&st->resent);
+   sum->received += stat_get(&st->received);
+   sum->matched += stat_get(&st->matched);
+   sum->duplicate += stat_get(&st->duplicate);
+   sum->unmatched += stat_get(&st->unmatched);
+   sum->drops += stat_get(&st->drops);
+   sum->total += stat_get(&st->total);
+   sum->targets += stat_get(&st->targets);
+   sum->completed += stat_get(&st->completed);
+   for (i = 0; i < NBSTAT_OUTCOMES; i++)
+       sum->outcome[i] += stat_get(&st->outcome[i]);
+   for (i = 0; i < NBSTAT_HIST_SIZE; i++)
+       sum->rtt[i] += stat_get(&st->rtt[i]);
+}
+
+/* nbstat_stats_rtt - the RTT in us that `q' per 100000 of the samples do not
+ * exceed; 100000 gives the maximum. 0 without samples. */
+uint64_t nbstat_stats_rtt(const struct nbstat_stats *st, uint32_t q)
+{
+   uint64_t total = 0, want, seen = 0;
+   int i;
+
+   for (i = 0; i < NBSTAT_HIST_SIZE; i++)
+       total += st->rtt[i];
+   if (total == 0)
+       return 0;
+
+   want = (total * q + 99999) / 100000;
+   if (want == 0)
+       want = 1;
+   for (i = 0; i < NBSTAT_HIST_SIZE; i++) {
+       seen += st->rtt[i];
+       if (seen >= want)
+           break;
+   }
+
+   return hist_value(i < NBSTAT_HIST_SIZE ? i : NBSTAT_HIST_SIZE - 1);
+}
+
+/* nbstat_stats_print - write a summary of a snapshot taken at `now'. */
+void nbstat_stats_print(FILE *fp, const struct nbstat_stats *st, uint64_t now)
+{
+   static const char *const outcome[NBSTAT_OUTCOMES] = {
+       "ok", "nomem", "inval", "wsafail", "socket", "proto", "trflag", "timeout", "again", "name", "other"
+   };
+   uint64_t elapsed = now > st->start ? now - st->start : 0;
+   uint64_t samples = 0;
+   int i;
+
+   fprintf(fp, "stats: %llu.%us, %llu sent (%llu resent, %llu/s), %llu received: "
+           "%llu matched, %llu duplicate, %llu unmatched, %llu dropped\n",
+           (unsigned long long)(elapsed / 1000), (unsigned)(elapsed % 1000 / 100),
+           (unsigned long long)st->sent, (unsigned long long)st->resent,
+           (unsigned long long)(elapsed > 0 ? st->sent * 1000 / elapsed : 0),
+           (unsigned long long)st->received, (unsigned long long)st->matched,
+           (unsigned long long)st->duplicate, (unsigned long long)st->unmatched,
+           (unsigned long long)st->drops);
+
+   fprintf(fp, "stats: results");
+   for (i = 0; i < NBSTAT_OUTCOMES; i++) {
+       if (st->outcome[i] != 0)
+           fprintf(fp, " %s %llu", outcome[i], (unsigned long long)st->outcome[i]);
+   }
+   fprintf(fp, "\n");
+
+   for (i = 0; i < NBSTAT_HIST_SIZE; i++)
+       samples += st->rtt[i];
+   if (samples > 0)
+       fprintf(fp, "stats: rtt us p50 %llu p90 %llu p99 %llu p99.9 %llu max %llu (%llu samples)\n",
+               (unsigned long long)nbstat_stats_rtt(st, 50000), (unsigned long long)nbstat_stats_rtt(st, 90000),
+               (unsigned long long)nbstat_stats_rtt(st, 99000), (unsigned long long)nbstat_stats_rtt(st, 99900),
+               (unsigned long long)nbstat_stats_rtt(st, 100000), (unsigned long long)samples);
+}
+
+/* wheel_init */
+static void wheel_init(struct nbstat_wheel *wheel, uint64_t now)
+{
+   int i, j;
+
+   wheel->now = now;
+   wheel->count = 0;
+   for (i = 0; i < WHEEL_LEVELS; i++) {
+       for (j = 0; j < WHEEL_SIZE; j++)
+           wheel->slot[i][j].next = wheel->slot[i][j].prev = &wheel->slot[i][j];
+   }
+}
+
+/* wheel_link - put a timer into its slot, relative to the current tick. */
+static void wheel_link(struct nbstat_wheel *wheel, struct nbstat_timer *timer)
+{
+   struct nbstat_timer *head;
+   uint64_t delta;
+   int level;
+
+   if (timer->expires <= wheel->now)
+       timer->expires = wheel->now + 1;
+   if (timer->expires - wheel->now >= WHEEL_SPAN)
+       timer->expires = wheel->now + WHEEL_SPAN - 1;
+
+   delta = timer->expires - wheel->now;
+   for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+       if (delta < (uint64_t)1 << (WHEEL_BITS * (level + 1)))
+           break;
+   }
+
+   head = &wheel->slot[level][(timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+   timer->next = head;
+   timer->prev = head->prev;
+   head->prev->next = timer;
+   head->prev = timer;
+}
+
+/* wheel_unlink */
+static void wheel_unlink(struct nbstat_timer *timer)
+{
+   timer->prev->next = timer->next;
+   timer->next->prev = timer->prev;
+   timer->next = timer->prev = NULL;
+}
+
+/* wheel_add - arm a timer to fire at the absolute time `expires'. */
+static void wheel_add(struct nbstat_wheel *wheel, struct nbstat_timer *timer, uint64_t expires)
+{
+   timer->expires = expires;
+   wheel_link(wheel, timer);
+   wheel->count++;
+}
+
+/* wheel_del - disarm a timer; harmless if it is not armed. */
+static void wheel_del(struct nbstat_wheel *wheel, struct nbstat_timer *timer)
+{
+   if (timer->next != NULL) {
+       wheel_unlink(timer);
+       wheel->count--;
+   }
+}
+
+/* wheel_cascade - move the current slot of a higher level down the wheel. */
+static void wheel_cascade(struct nbstat_wheel *wheel, int level)
+{
+   struct nbstat_timer *head, *timer;
+   struct nbstat_timer list;
+
+   head = &wheel->slot[level][(wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK];
+   if (head->next == head)
+       return;
+
+   /* Detach the slot first, timers may land in it again. */
+   list.next = head->next;
+   list.prev = head->prev;
+   list.next->prev = &list;
+   list.prev->next = &list;
+   head->next = head->prev = head;
+
+   while (list.next != &list) {
+       timer = list.next;
+       wheel_unlink(timer);
+       wheel_link(wheel, timer);
+   }
+}
+
+/* wheel_advance - run every timer that expires up to `now'. */
+static void wheel_advance(struct nbstat_wheel *wheel, uint64_t now, nbstat_timer_fn fn, void *user)
+{
+   struct nbstat_timer *head, *timer;
+   int level;
+
+   while (wheel->now < now) {
+       if (wheel->count == 0) {
+           wheel->now = now;
+           break;
+       }
+
+       wheel->now++;
+       if ((wheel->now & WHEEL_MASK) == 0) {
+           for (level = 1; level < WHEEL_LEVELS; level++) {
+               wheel_cascade(wheel, level);
+               if ((wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK)
+                   break;
+           }
+       }
+
+       head = &wheel->slot[0][wheel->now & WHEEL_MASK];
+       while (head->next != head) {
+           timer = head->next;
+           wheel_unlink(timer);
+           wheel->count--;
+           fn(user, timer);
+       }
+   }
+}
+
+/* wheel_next - milliseconds until the wheel needs attention, -1 if idle. */
+static int wheel_next(const struct nbstat_wheel *wheel, uint64_t now)
+{
+   const struct nbstat_timer *head;
+   uint64_t tick;
+
+   if (wheel->count == 0)
+       return -1;
+
+   /* The next armed level 0 slot, or the next cascade, whichever is first. */
+   for (tick = wheel->now + 1; ; tick++) {
+       head = &wheel->slot[0][tick & WHEEL_MASK];
+       if ((tick & WHEEL_MASK) == 0 || head->next != head)
+           break;
+   }
+
+   return tick > now ? (int)(tick - now) : 0;
+}
+
+/* engine_alloc - the staging buffers shared by every backend. */
+static int engine_alloc(struct nbstat_engine *eng, socket_t sfd)
+{
+   int i;
+
+   memset(eng, 0x00, sizeof(*eng));
+   eng->sfd = sfd;
+
+   eng->rx = calloc(NBSTAT_RXDEPTH, sizeof(struct nbstat_rxmsg));
+   eng->tx = calloc(NBSTAT_TXDEPTH, sizeof(struct nbstat_txmsg));
+   if (eng->rx == NULL || eng->tx == NULL) {
+       free(eng->rx);
+       free(eng->tx);
+       return NBSTAT_ENOMEM;
+   }
+
+   for (i = 0; i < NBSTAT_TXDEPTH; i++)
+       eng->txfree[i] = NBSTAT_TXDEPTH - 1 - i;
+   eng->ntxfree = NBSTAT_TXDEPTH;
+
+   return NBSTAT_EOK;
+}
+
+/* nbstat_engine_stage - reserve a staged datagram of `length' bytes, to be
+ * filled in by the caller before the next flush. NULL when staging is full. */
+static uint8_t *nbstat_engine_stage(struct nbstat_engine *eng, size_t length, const struct sockaddr_in *to, int tag)
+{
+   struct nbstat_txmsg *msg;
+   int i;
+
+   if (length > sizeof(msg->data) || eng->ntxfree == 0)
+       return NULL;
+
+   i = eng->txfree[--eng->ntxfree];
+   msg = &eng->tx[i];
+
+   memset(&msg->to, 0x00, sizeof(msg->to));
+   msg->to.sin = *to;
+   msg->length = (uint32_t)length;
+   msg->tag = tag;
+
+   eng->txq[eng->ntxq++] = i;
+
+   return (uint8_t *)msg->data;
+}
+
+/* engine_txpop - take the first n datagrams off the staging queue. */
+static void engine_txpop(struct nbstat_engine *eng, int n, int recycle)
+{
+   int i;
+
+   if (recycle) {
+       for (i = 0; i < n; i++)
+           eng->txfree[eng->ntxfree++] = eng->txq[i];
+   }
+
+   eng->ntxq -= n;
+   memmove(eng->txq, eng->txq + n, eng->ntxq * sizeof(eng->txq[0]));
+}
+
+/* nbstat_engine_discard - drop whatever is still staged. */
+static void nbstat_engine_discard(struct nbstat_engine *eng)
+{
+   engine_txpop(eng, eng->ntxq, 1);
+}
+
+#ifdef _WIN32
+
+#ifdef NBSTAT_RIO
+#define RIO_TXTAG 0x80000000UL /* RequestContext flag of send completions */
+
+/* rio_buf - describe a piece of a registered buffer. */
+static void rio_buf(RIO_BUF *buf, RIO_BUFFERID id, const void *base, const void *ptr, size_t length)
+{
+   buf->BufferId = id;
+   buf->Offset = (ULONG)((const char *)ptr - (const char *)base);
+   buf->Length = (ULONG)length;
+}
+
+/* rio_post - post receive slot i. */
+static int rio_post(struct nbstat_engine *eng, int i)
+{
+   struct nbstat_rio *rio = eng->rio;
+   RIO_BUF data, addr;
+
+   rio_buf(&data, rio->rxid, eng->rx, eng->rx[i].data, sizeof(eng->rx[i].data));
+   rio_buf(&addr, rio->rxid, eng->rx, &eng->rx[i].from, sizeof(eng->rx[i].from));
+
+   if (!rio->fn.RIOReceiveEx(rio->rq, &data, 1, NULL, &addr, NULL, NULL, 0, (PVOID)(ULONG_PTR)i))
+       return SOCKET_ERROR;
+
+   return 0;
+}
+
+/* rio_free */
+static void rio_free(struct nbstat_rio *rio)
+{
+   if (rio->rxid != RIO_INVALID_BUFFERID)
+       rio->fn.RIODeregisterBuffer(rio->rxid);
+   if (rio->txid != RIO_INVALID_BUFFERID)
+       rio->fn.RIODeregisterBuffer(rio->txid);
+   if (rio->cq != RIO_INVALID_CQ)
+       rio->fn.RIOCloseCompletionQueue(rio->cq);
+   free(rio);
+}
+
+/* rio_init - switch the engine to Registered I/O (Windows 8 and later). */
+static int rio_init(struct nbstat_engine *eng)
+{
+   GUID id = WSAID_MULTIPLE_RIO;
+   RIO_NOTIFICATION_COMPLETION nc;
+   struct nbstat_rio *rio;
+   DWORD nbytes;
+   int i;
+
+   rio = calloc(1, sizeof(struct nbstat_rio));
+   if (rio == NULL)
+       return NBSTAT_ENOMEM;
+
+   rio->cq = RIO_INVALID_CQ;
+   rio->rxid = rio->txid = RIO_INVALID_BUFFERID;
+   rio->fn.cbSize = sizeof(rio->fn);
+
+   if (WSAIoctl(eng->sfd, SIO_GET_MULTIPLE_EXTENSION_FUNCTION_POINTER, &id, sizeof(id),
+                &rio->fn, sizeof(rio->fn), &nbytes, NULL, NULL) != 0) {
+       free(rio);
+       return NBSTAT_ESOCKET;
+   }
+
+   memset(&nc, 0x00, sizeof(nc));
+   nc.Type = RIO_IOCP_COMPLETION;
+   nc.Iocp.IocpHandle = eng->iocp;
+   nc.Iocp.CompletionKey = (PVOID)eng;
+   nc.Iocp.Overlapped = &rio->ov;
+
+   rio->cq = rio->fn.RIOCreateCompletionQueue(NBSTAT_RXDEPTH + NBSTAT_TXDEPTH, &nc);
+   if (rio->cq != RIO_INVALID_CQ)
+       rio->rq = rio->fn.RIOCreateRequestQueue(eng->sfd, NBSTAT_RXDEPTH, 1, NBSTAT_TXDEPTH, 1,
+                                               rio->cq, rio->cq, NULL);
+   if (rio->cq == RIO_INVALID_CQ || rio->rq == RIO_INVALID_RQ) {
+       rio_free(rio);
+       return NBSTAT_ESOCKET;
+   }
+
+   rio->rxid = rio->fn.RIORegisterBuffer((PCHAR)eng->rx, NBSTAT_RXDEPTH * sizeof(struct nbstat_rxmsg));
+   rio->txid = rio->fn.RIORegisterBuffer((PCHAR)eng->tx, NBSTAT_TXDEPTH * sizeof(struct nbstat_txmsg));
+   if (rio->rxid == RIO_INVALID_BUFFERID || rio->txid == RIO_INVALID_BUFFERID) {
+       rio_free(rio);
+       return NBSTAT_ESOCKET;
+   }
+
+   eng->rio = rio;
+   for (i = 0; i < NBSTAT_RXDEPTH; i++)
+       rio_post(eng, i);
+
+   return NBSTAT_EOK;
+}
+
+/* rio_submit - post the staged datagrams as deferred sends and commit once. */
+static int rio_submit(struct nbstat_engine *eng)
+{
+   struct nbstat_rio *rio = eng->rio;
+   struct nbstat_txmsg *msg;
+   RIO_BUF data, addr;
+   int n;
+
+   for (n = 0; n < eng->ntxq; n++) {
+       msg = &eng->tx[eng->txq[n]];
+       rio_buf(&data, rio->txid, eng->tx, msg->data, msg->length);
+       rio_buf(&addr, rio->txid, eng->tx, &msg->to, sizeof(msg->to));
+       if (!rio->fn.RIOSendEx(rio->rq, &data, 1, NULL, &addr, NULL, NULL, RIO_MSG_DEFER,
+                              (PVOID)(ULONG_PTR)(eng->txq[n] | RIO_TXTAG)))
+           break;
+   }
+
+   if (n == 0)
+       return SOCKET_ERROR;
+
+   rio->fn.RIOSendEx(rio->rq, NULL, 0, NULL, NULL, NULL, NULL, RIO_MSG_COMMIT_ONLY, NULL);
+
+   return n;
+}
+
+/* rio_poll - dequeue completions, waiting on the port when there are none. */
+static int rio_poll(struct nbstat_engine *eng, int timeout, nbstat_rx_fn fn, void *user)
+{
+   RIORESULT result[NBSTAT_RXDEPTH + NBSTAT_TXDEPTH];
+   struct nbstat_rio *rio = eng->rio;
+   OVERLAPPED *ov = NULL;
+   ULONG_PTR key;
+   buffer_t buffer;
+   DWORD nbytes;
+   ULONG n, i;
+   int slot;
+
+   n = rio->fn.RIODequeueCompletion(rio->cq, result, NBSTAT_RXDEPTH + NBSTAT_TXDEPTH);
+   if (n == 0) {
+       if (!rio->armed) {
+           if (rio->fn.RIONotify(rio->cq) != ERROR_SUCCESS)
+               return SOCKET_ERROR;
+           rio->armed = 1;
+       }
+       if (!GetQueuedCompletionStatus(eng->iocp, &nbytes, &key, &ov, timeout < 0 ? INFINITE : (DWORD)timeout))
+           return ov == NULL && GetLastError() == WAIT_TIMEOUT ? 0 : SOCKET_ERROR;
+       rio->armed = 0;
+       n = rio->fn.RIODequeueCompletion(rio->cq, result, NBSTAT_RXDEPTH + NBSTAT_TXDEPTH);
+   }
+   if (n == RIO_CORRUPT_CQ)
+       return SOCKET_ERROR;
+
+   for (i = 0; i < n; i++) {
+       slot = (int)(result[i].RequestContext & ~(ULONGLONG)RIO_TXTAG);
+       if (result[i].RequestContext & RIO_TXTAG) {
+           eng->txfree[eng->ntxfree++] = slot;
+           continue;
+       }
+
+       if (result[i].Status == 0) {
+           buffer.data = eng->rx[slot].data;
+           buffer.size = sizeof(eng->rx[slot].data);
+           buffer.length = result[i].BytesTransferred;
+           stat_add(&eng->stats->received, 1);
+           fn(user, &buffer, &eng->rx[slot].from.sin);
+       }
+       rio_post(eng, slot);
+   }
+
+   return (int)n;
+}
+#endif /* NBSTAT_RIO */
+
+/* engine_post - post one overlapped receive. */
+static int engine_post(struct nbstat_engine *eng, struct nbstat_rxmsg *op)
+{
+   DWORD nbytes;
+
+   memset(&op->ov, 0x00, sizeof(op->ov));
+   op->wsabuf.buf = op->data;
+   op->wsabuf.len = sizeof(op->data);
+   op->fromlen = sizeof(op->from.sin);
+   op->flags = 0;
+
+   if (WSARecvFrom(eng->sfd, &op->wsabuf, 1, &nbytes, &op->flags, (struct sockaddr *)&op->from.sin,
+                   &op->fromlen, &op->ov, NULL) == SOCKET_ERROR && WSAGetLastError() != WSA_IO_PENDING)
+       return SOCKET_ERROR;
+
+   /* Even on immediate success the completion is queued to the port. */
+   op->pending = 1;
+   eng->pending++;
+
+   return 0;
+}
+
+/* nbstat_engine_init */
+static int nbstat_engine_init(struct nbstat_engine *eng, socket_t sfd)
+{
+   int i;
+
+   if (engine_alloc(eng, sfd) != NBSTAT_EOK)
+       return NBSTAT_ENOMEM;
+
+   eng->iocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+   if (eng->iocp == NULL) {
+       free(eng->rx);
+       free(eng->tx);
+       return NBSTAT_ESOCKET;
+   }
+
+#ifdef NBSTAT_RIO
+   if (rio_init(eng) == NBSTAT_EOK)
+       return NBSTAT_EOK;
+#endif
+
+   /* Overlapped receives on the port. */
+   if (CreateIoCompletionPort((HANDLE)sfd, eng->iocp, 0, 0) == NULL) {
+       CloseHandle(eng->iocp);
+       free(eng->rx);
+       free(eng->tx);
+       return NBSTAT_ESOCKET;
+   }
+
+   /* Failures are retried on the next poll. */
+   for (i = 0; i < NBSTAT_RXDEPTH; i++)
+       engine_post(eng, &eng->rx[i]);
+
+   return NBSTAT_EOK;
+}
+
+/* nbstat_engine_poll - wait up to `timeout' ms (-1 = forever) and dispatch. */
+static int nbstat_engine_poll(struct nbstat_engine *eng, int timeout, nbstat_rx_fn fn, void *user)
+{
+   OVERLAPPED_ENTRY entry[NBSTAT_RXDEPTH];
+   struct nbstat_rxmsg *op;
+   buffer_t buffer;
+   DWORD nbytes, flags;
+   ULONG n, i;
+#ifdef NBSTAT_RIO
+   int r;
+
+   if (eng->rio != NULL) {
+       r = rio_poll(eng, timeout, fn, user);
+       eng->rxmore = r >= NBSTAT_RXDEPTH;
+       return r;
+   }
+#endif
+
+   for (i = 0; i < NBSTAT_RXDEPTH; i++) {
+       if (!eng->rx[i].pending)
+           engine_post(eng, &eng->rx[i]);
+   }
+
+   if (!GetQueuedCompletionStatusEx(eng->iocp, entry, NBSTAT_RXDEPTH, &n,
+                                    timeout < 0 ? INFINITE : (DWORD)timeout, FALSE))
+       return GetLastError() == WAIT_TIMEOUT ? 0 : SOCKET_ERROR;
+
+   for (i = 0; i < n; i++) {
+       op = (struct nbstat_rxmsg *)entry[i].lpOverlapped;
+       op->pending = 0;
+       eng->pending--;
+
+       /* Oversized datagrams and the like complete with an error. */
+       if (WSAGetOverlappedResult(eng->sfd, &op->ov, &nbytes, FALSE, &flags)) {
+           buffer.data = op->data;
+           buffer.size = sizeof(op->data);
+           buffer.length = nbytes;
+           stat_add(&eng->stats->received, 1);
+           fn(user, &buffer, &op->from.sin);
+       }
+
+       engine_post(eng, op);
+   }
+   eng->rxmore = n == NBSTAT_RXDEPTH;
+
+   return (int)n;
+}
+
+/* nbstat_engine_close - release the engine once the socket is closed. */
+static void nbstat_engine_close(struct nbstat_engine *eng)
+{
+   OVERLAPPED_ENTRY entry[NBSTAT_RXDEPTH];
+   ULONG n, i;
+
+#ifdef NBSTAT_RIO
+   if (eng->rio != NULL)
+       rio_free(eng->rio);
+#endif
+
+   /* Closing the socket aborted the posted receives; collect them. */
+   while (eng->pending > 0) {
+       if (!GetQueuedCompletionStatusEx(eng->iocp, entry, NBSTAT_RXDEPTH, &n, 1000, FALSE))
+           break;
+       for (i = 0; i < n; i++) {
+           ((struct nbstat_rxmsg *)entry[i].lpOverlapped)->pending = 0;
+           eng->pending--;
+       }
+   }
+
+   CloseHandle(eng->iocp);
+
+   /* Never free buffers the kernel may still write to. */
+   if (eng->pending == 0)
+       free(eng->rx);
+   free(eng->tx);
+}
+
+#else /* POSIX */
+
+/* nbstat_engine_init */
+static int nbstat_engine_init(struct nbstat_engine *eng, socket_t sfd)
+{
+#ifdef __linux__
+   struct epoll_event ev;
+   int on = 1;
+   int i;
+#endif
+
+   if (engine_alloc(eng, sfd) != NBSTAT_EOK)
+       return NBSTAT_ENOMEM;
+
+#ifdef __linux__
+   for (i = 0; i < NBSTAT_RXDEPTH; i++) {
+       eng->rxiov[i].iov_base = eng->rx[i].data;
+       eng->rxiov[i].iov_len = sizeof(eng->rx[i].data);
+       eng->rxhdr[i].msg_hdr.msg_iov = &eng->rxiov[i];
+       eng->rxhdr[i].msg_hdr.msg_iovlen = 1;
+       eng->rxhdr[i].msg_hdr.msg_name = &eng->rx[i].from.sin;
+       eng->rxhdr[i].msg_hdr.msg_control = eng->rxctl[i].buf;
+   }
+
+   /* Have every datagram carry the socket's running count of drops. */
+   setsockopt(sfd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+   for (i = 0; i < NBSTAT_TXDEPTH; i++) {
+       eng->txhdr[i].msg_hdr.msg_iov = &eng->txiov[i];
+       eng->txhdr[i].msg_hdr.msg_iovlen = 1;
+       eng->txhdr[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+   }
+
+   eng->epfd = epoll_create1(0);
+   if (eng->epfd < 0) {
+       free(eng->rx);
+       free(eng->tx);
+       return NBSTAT_ESOCKET;
+   }
+
+   memset(&ev, 0x00, sizeof(ev));
+   ev.events = EPOLLIN;
+   ev.data.fd = sfd;
+   if (epoll_ctl(eng->epfd, EPOLL_CTL_ADD, sfd, &ev) < 0) {
+       close(eng->epfd);
+       free(eng->rx);
+       free(eng->tx);
+       return NBSTAT_ESOCKET;
+   }
+#endif
+
+   return NBSTAT_EOK;
+}
+
+#ifdef __linux__
+/* engine_ovfl - count the drops a received datagram reports since the last. */
+static void engine_ovfl(struct nbstat_engine *eng, struct msghdr *msg)
+{
+   struct cmsghdr *cmsg;
+   uint32_t count;
+
+   for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+       if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SO_RXQ_OVFL)
+           continue;
+       memcpy(&count, CMSG_DATA(cmsg), sizeof(count));
+       /* Counted when queued, so a batch can carry an older count after a newer one. */
+       if ((int32_t)(count - eng->ovfl) > 0) {
+           stat_add(&eng->stats->drops, count - eng->ovfl);
+           eng->dropped += count - eng->ovfl;
+           eng->ovfl = count;
+       }
+   }
+}
+#endif
+
+/* engine_recv - read one batch of queued datagrams. */
+static int engine_recv(struct nbstat_engine *eng, nbstat_rx_fn fn, void *user)
+{
+   struct sockaddr_in from;
+   buffer_t buffer;
+   int n;
+#ifdef __linux__
+   int i;
+
+   if (!eng->nommsg) {
+       for (i = 0; i < NBSTAT_RXDEPTH; i++) {
+           eng->rxhdr[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+           eng->rxhdr[i].msg_hdr.msg_controllen = sizeof(eng->rxctl[i].buf);
+       }
+
+       n = recvmmsg(eng->sfd, eng->rxhdr, NBSTAT_RXDEPTH, 0, NULL);
+       if (n >= 0) {
+           for (i = 0; i < n; i++) {
+               if (eng->rxhdr[i].msg_hdr.msg_controllen > 0)
+                   engine_ovfl(eng, &eng->rxhdr[i].msg_hdr);
+               if (eng->rxhdr[i].msg_hdr.msg_flags & MSG_TRUNC)
+                   continue;
+               buffer.data = eng->rx[i].data;
+               buffer.size = sizeof(eng->rx[i].data);
+               buffer.length = eng->rxhdr[i].msg_len;
+               stat_add(&eng->stats->received, 1);
+               fn(user, &buffer, &eng->rx[i].from.sin);
+           }
+           return n;
+       }
+       if (errno != ENOSYS)
+           return 0;
+       eng->nommsg = 1;
+   }
+#endif
+
+   buffer.data = eng->rx[0].data;
+   buffer.size = sizeof(eng->rx[0].data);
+
+   for (n = 0; n < NBSTAT_RXDEPTH; n++) {
+       if (nbstat_recv(eng->sfd, &buffer, &from) == SOCKET_ERROR) {
+           if (errno == EWOULDBLOCK || errno == EAGAIN)
+               break;
+           continue;
+       }
+       stat_add(&eng->stats->received, 1);
+       fn(user, &buffer, &from);
+   }
+
+   return n;
+}
+
+/* nbstat_engine_poll - wait up to `timeout' ms (-1 = forever) and dispatch. */
+static int nbstat_engine_poll(struct nbstat_engine *eng, int timeout, nbstat_rx_fn fn, void *user)
+{
+#ifdef __linux__
+   struct epoll_event ev;
+#else
+   struct pollfd pfd;
+#endif
+   int n;
+
+   /* Level-triggered, so only wait once the socket has been drained. */
+   if (!eng->rxmore) {
+#ifdef __linux__
+       n = epoll_wait(eng->epfd, &ev, 1, timeout);
+#else
+       pfd.fd = eng->sfd;
+       pfd.events = POLLIN;
+       n = poll(&pfd, 1, timeout);
+#endif
+       if (n <= 0)
+           return n < 0 && errno != EINTR ? SOCKET_ERROR : 0;
+   }
+
+   n = engine_recv(eng, fn, user);
+   eng->rxmore = n == NBSTAT_RXDEPTH;
+
+   return n;
+}
+
+/* nbstat_engine_close */
+static void nbstat_engine_close(struct nbstat_engine *eng)
+{
+#ifdef __linux__
+   close(eng->epfd);
+#endif
+   free(eng->rx);
+   free(eng->tx);
+}
+
+#endif /* _WIN32 */
+
+/* engine_submit - hand staged datagrams to the kernel; returns how many. */
+static int engine_submit(struct nbstat_engine *eng)
+{
+   struct nbstat_txmsg *msg;
+#ifdef __linux__
+   int i, n;
+
+   if (!eng->nommsg) {
+       for (i = 0; i < eng->ntxq; i++) {
+           msg = &eng->tx[eng->txq[i]];
+           eng->txiov[i].iov_base = msg->data;
+           eng->txiov[i].iov_len = msg->length;
+           eng->txhdr[i].msg_hdr.msg_name = &msg->to.sin;
+       }
+       n = sendmmsg(eng->sfd, eng->txhdr, eng->ntxq, 0);
+       if (n >= 0 || errno != ENOSYS)
+           return n;
+       eng->nommsg = 1;
+   }
+#endif
+#if defined(_WIN32) && defined(NBSTAT_RIO)
+   if (eng->rio != NULL)
+       return rio_submit(eng);
+#endif
+
+   msg = &eng->tx[eng->txq[0]];
+   if (sendto(eng->sfd, msg->data, (int)msg->length, 0, (struct sockaddr *)&msg->to.sin,
+              sizeof(msg->to.sin)) == SOCKET_ERROR)
+       return SOCKET_ERROR;
+
+   return 1;
+}
+
+/* nbstat_engine_flush - send everything staged, in as few calls as possible.
+ * Returns NBSTAT_EAGAIN, with the rest still staged, when the kernel is full.
+ * A datagram that fails outright is reported to `fn' and dropped. */
+static int nbstat_engine_flush(struct nbstat_engine *eng, nbstat_txerr_fn fn, void *user)
+{
+   struct nbstat_txmsg *msg;
+   int recycle = 1;
+   int n, err;
+
+#if defined(_WIN32) && defined(NBSTAT_RIO)
+   /* RIO slots are recycled when their send completes. */
+   recycle = eng->rio == NULL;
+#endif
+
+   while (eng->ntxq > 0) {
+       n = engine_submit(eng);
+       if (n > 0) {
+           stat_add(&eng->stats->sent, n);
+           engine_txpop(eng, n, recycle);
+           continue;
+       }
+
+       err = WSAGetLastError();
+       if (err == WSAEWOULDBLOCK || err == WSAENOBUFS)
+           return NBSTAT_EAGAIN;
+
+       msg = &eng->tx[eng->txq[0]];
+       if (fn != NULL)
+           fn(user, msg->tag, &msg->to.sin, err);
+       engine_txpop(eng, 1, 1);
+   }
+
+   return NBSTAT_EOK;
+}
+
+/* engine_move - move an engine set up elsewhere into `dst', whose own has
+ * been closed; the batch headers point into the engine itself. */
+static void engine_move(struct nbstat_engine *dst, const struct nbstat_engine *src)
+{
+#ifdef __linux__
+   int i;
+#endif
+
+   memcpy(dst, src, sizeof(*dst));
+#ifdef __linux__
+   for (i = 0; i < NBSTAT_RXDEPTH; i++) {
+       dst->rxhdr[i].msg_hdr.msg_iov = &dst->rxiov[i];
+       dst->rxhdr[i].msg_hdr.msg_control = dst->rxctl[i].buf;
+   }
+   for (i = 0; i < NBSTAT_TXDEPTH; i++)
+       dst->txhdr[i].msg_hdr.msg_iov = &dst->txiov[i];
+#endif
+}
+
+/* nbstat_engine_rcvbuf - grow the receive buffer to hold a reply for each of
+ * `window' requests in flight. Linux caps SO_RCVBUF at net.core.rmem_max, the
+ * privileged SO_RCVBUFFORCE goes past that. */
+static void nbstat_engine_rcvbuf(struct nbstat_engine *eng, int window)
+{
+   int size;
+
+   size = window > NBSTAT_RCVBUF_MAX / NBSTAT_RCVBUF_SLOT ? NBSTAT_RCVBUF_MAX : window * NBSTAT_RCVBUF_SLOT;
+   if (size < NBSTAT_RCVBUF_MIN)
+       size = NBSTAT_RCVBUF_MIN;
+   if (size <= eng->rcvbuf)
+       return;
+
+#ifdef SO_RCVBUFFORCE
+   if (setsockopt(eng->sfd, SOL_SOCKET, SO_RCVBUFFORCE, (const char *)&size, sizeof(size)) == 0) {
+       eng->rcvbuf = size;
+       return;
+   }
+#endif
+   setsockopt(eng->sfd, SOL_SOCKET, SO_RCVBUF, (const char *)&size, sizeof(size));
+   eng->rcvbuf = size;
+}
+
+/* Encode the request */
+static int nbstat_encode_request(buffer_t *buffer, const struct nbstat_query *query)
+{
+   uint8_t *ptr = NULL;
+   uint16_t flags;
+
+   if (buffer == NULL || query == NULL)
+       return NBSTAT_EINVAL;
+
+   ptr = buffer->data;
+
+   enc16be(ptr, query->hdr.name_trn_id);
+   ptr += sizeof(query->hdr.name_trn_id);   
+
+   /* Encode flags. */
+   flags = 0x0000;
+   /* Opcode field: */
+   flags |= (query->hdr.r << 15) & 0x8000;
+   flags |= (query->hdr.opcode << 11) & 0x7800;
+   /* NM Flags: */
+   flags |= (query->hdr.aa << 10) & 0x0400;
+   flags |= (query->hdr.tc <<  9) & 0x0200;
+   flags |= (query->hdr.rd <<  8) & 0x0100;
+   flags |= (query->hdr.ra <<  7) & 0x0080;
+   flags |= (query->hdr.unused1 << 6) & 0x0040;
+   flags |= (query->hdr.unused2 << 5) & 0x0020;
+   flags |= (query->hdr.b << 4) & 0x0010;
+   /* Result code of request: */
+   flags |= query->hdr.rcode & 0x000f;
+
+   enc16be(ptr, flags);
+   ptr += sizeof(flags);
+
+   enc16be(ptr, query->hdr.qdcount);
+   ptr += sizeof(query->hdr.qdcount);
+   enc16be(ptr, query->hdr.ancount);
+   ptr += sizeof(query->hdr.ancount);
+   enc16be(ptr, query->hdr.nscount);
+   ptr += sizeof(query->hdr.nscount);
+   enc16be(ptr, query->hdr.arcount);
+   ptr += sizeof(query->hdr.arcount);
+
+   memcpy(ptr, query->question.q_name, sizeof(query->question.q_name));
+   ptr += sizeof(query->question.q_name);
+
+   enc16be(ptr, query->question.q_type);
+   ptr += sizeof(query->question.q_type);
+   enc16be(ptr, query->question.q_class);
+   ptr += sizeof(query->question.q_class);
+
+   buffer->length = ptr - (uint8_t *)buffer->data;
+
+   ptr = NULL;
+   
+   return NBSTAT_EOK; 
+}
+
+/* node_name_decode - decode one 18-byte node entry. */
+static void node_name_decode(struct nbstat_node_name *current, const uint8_t *ptr)
+{
+   uint16_t flags;
+
+   memcpy(current->nbf_name, ptr, sizeof(current->nbf_name));
+   ptr += sizeof(current->nbf_name);
+
+   current->suffix = dec8be(ptr);
+   ptr += sizeof(current->suffix);
+       
+   flags = dec16be(ptr);
+   /* Group Name Flag. If set, name is a GROUP. */
+   current->g = (flags >> 15) & 0x1; 
+   /* Owner Node Type (b00 = B; b01 = P; b10 = M; b11 = Reserved). */
+   current->ont = (flags >> 13) & 0x3;
+   /* Deregister Flag. If set, name is in the process of being deleted. */
+   current->drg = (flags >> 12) & 0x1;
+   /* Conflict Flag. If set, name on this node is in conflict. */
+   current->cnf = (flags >> 11) & 0x1;
+   /* Active Name Flag. All entries have this flag set. */
+   current->act = (flags >> 10) & 0x1; /* $fixme */
+   /* Permanent Name Flag. If set, entry is for permanent node name. */
+   current->prm = (flags >> 9) & 0x1;
+   /* Reserved, must be zero (0). */
+   current->reserved = flags & 0x1ff; 
+}
+
+/* Shape of a node status response, checked before anything is decoded: a
+ * length with room for the fixed parts and up to NBSTAT_MAX_NAMES names, a
+ * positive answer to a query (R set, opcode 0) and the NBSTAT RR type. Other
+ * traffic on the port is turned away after the one compare and two loads. */
+#define NBSTAT_MIN_LENGTH (NBSTAT_OFF_NAMES + NBSTAT_STAT_SIZE)
+#define NBSTAT_FLAG_R     0x8000
+#define NBSTAT_FLAG_TC    0x0200
+#define NBSTAT_OPCODE_R   0xf800 /* R and opcode */
+
+/* response_reject - the error for a datagram that is not one: TC set on an
+ * answer that did not fit says why (RFC 1002 4.2.1.1). */
+static int response_reject(const uint8_t *data, size_t length)
+{
+   if (length >= NBSTAT_OFF_FLAGS + 2 &&
+       (dec16be(data + NBSTAT_OFF_FLAGS) & (NBSTAT_FLAG_R | NBSTAT_FLAG_TC)) == (NBSTAT_FLAG_R | NBSTAT_FLAG_TC))
+       return NBSTAT_ETRFLAG;
+
+   return NBSTAT_EPROTO;
+}
+
+/* response_shape - NBSTAT_EOK when `data' has the shape of a node status
+ * response, with exactly the names the count says. */
+static int response_shape(const uint8_t *data, size_t length)
+{
+   if (length - NBSTAT_MIN_LENGTH > (size_t)NBSTAT_NAME_SIZE * NBSTAT_MAX_NAMES ||
+       (dec16be(data + NBSTAT_OFF_FLAGS) & NBSTAT_OPCODE_R) != NBSTAT_FLAG_R ||
+       dec16be(data + NBSTAT_OFF_RR_TYPE) != RR_TYPE_NBSTAT ||
+       NBSTAT_MIN_LENGTH + NBSTAT_NAME_SIZE * (size_t)data[NBSTAT_OFF_NUM_NAMES] != length)
+       return response_reject(data, length);
+
+   return NBSTAT_EOK;
+}
+
+/* header_decode - the flags word into its fields. */
+static void header_decode(struct nbstat_packet_header *hdr, uint16_t flags)
+{
+   /* Opcode field: */
+   hdr->r = (flags >> 15) & 0x1;
+   hdr->opcode = (flags >> 11) & 0xf;
+   /* NM Flags: */
+   hdr->aa = (flags >> 10) & 0x1;
+   hdr->tc = (flags >> 9) & 0x1;
+   hdr->rd = (flags >> 8) & 0x1;
+   hdr->ra = (flags >> 7) & 0x1;
+   hdr->unused1 = (flags >> 6) & 0x1;
+   hdr->unused2 = (flags >> 5) & 0x1;
+   hdr->b = (flags >> 4) & 0x1;
+   /* Result code: */
+   hdr->rcode = flags & 0xf;
+}
+
+/* Counters of the statistics field, after unit_id, jumpers and test_result:
+ * runs of big-endian words at the same offsets as in struct
+ * nbstat_statistics, which the typedef below holds it to. */
+static const struct stat_run {
+   uint8_t offset;
+   uint8_t count;
+   uint8_t width;
+} stat_runs[] = {
+   { offsetof(struct nbstat_statistics, version_number), 6, 2 },
+   { offsetof(struct nbstat_statistics, number_good_sends), 2, 4 },
+   { offsetof(struct nbstat_statistics, number_retransmits), 9, 2 }
+};
+
+typedef char stat_layout_check[offsetof(struct nbstat_statistics, session_data_packet_size) ==
+                               NBSTAT_STAT_SIZE - 2 ? 1 : -1];
+
+/* stat_decode - the 46-byte statistics field. */
+static void stat_decode(struct nbstat_statistics *stat, const uint8_t *ptr)
+{
+   uint8_t *base = (uint8_t *)stat;
+   const struct stat_run *run;
+   size_t r;
+   int i;
+
+   memcpy(stat->unit_id, ptr, sizeof(stat->unit_id));
+   stat->jumpers = ptr[6];
+   stat->test_result = ptr[7];
+
+   for (r = 0; r < sizeof(stat_runs) / sizeof(stat_runs[0]); r++) {
+       run = &stat_runs[r];
+       if (run->width == 2) {
+           for (i = 0; i < run->count; i++)
+               ((uint16_t *)(base + run->offset))[i] = dec16be(ptr + run->offset + 2 * i);
+       } else {
+           for (i = 0; i < run->count; i++)
+               ((uint32_t *)(base + run->offset))[i] = dec32be(ptr + run->offset + 4 * i);
+       }
+   }
+}
+
+/* Decode the response and validate. The names go to the table at rep->node.
+ * Everything sits at a fixed offset once the shape is known, so the header
+ * and RR are read a word at a time. */
+static int nbstat_decode_response(buffer_t *buffer, struct nbstat_response *rep)
+{
+   const uint8_t *ptr = (const uint8_t *)buffer->data;
+   uint32_t word;
+   int result;
+   int i;
+
+   result = response_shape(ptr, buffer->length);
+   if (result != NBSTAT_EOK)
+       return result;
+
+   word = dec32be(ptr);
+   rep->hdr.name_trn_id = (uint16_t)(word >> 16);
+   header_decode(&rep->hdr, (uint16_t)word);
+   word = dec32be(ptr + 4);
+   rep->hdr.qdcount = (uint16_t)(word >> 16);
+   rep->hdr.ancount = (uint16_t)word;
+   word = dec32be(ptr + 8);
+   rep->hdr.nscount = (uint16_t)(word >> 16);
+   rep->hdr.arcount = (uint16_t)word;
+
+   /* Resource record. */
+   memcpy(rep->rr.rr_name, ptr + 12, sizeof(rep->rr.rr_name));
+   word = dec32be(ptr + NBSTAT_OFF_RR_TYPE);
+   rep->rr.rr_type = (uint16_t)(word >> 16);
+   rep->rr.rr_class = (uint16_t)word;
+   rep->rr.ttl = dec32be(ptr + NBSTAT_OFF_TTL);
+   rep->rr.rdlength = dec16be(ptr + NBSTAT_OFF_TTL + 4);
+
+   /* The name table, in place, then the statistics. */
+   rep->num_names = ptr[NBSTAT_OFF_NUM_NAMES];
+   ptr += NBSTAT_OFF_NAMES;
+   for (i = 0; i < rep->num_names; i++, ptr += NBSTAT_NAME_SIZE)
+       node_name_decode(&rep->node[i], ptr);
+   stat_decode(&rep->stat, ptr);
+
+   return NBSTAT_EOK;
+}
+
+/* nbstat_view_init - validate a response once, without decoding it. */
+int nbstat_view_init(nbstat_view_t *view, const buffer_t *buffer)
+{
+   const uint8_t *ptr = (const uint8_t *)buffer->data;
+   int result;
+
+   result = response_shape(ptr, buffer->length);
+   if (result != NBSTAT_EOK)
+       return result;
+
+   view->data = ptr;
+   view->length = buffer->length;
+   view->count = ptr[NBSTAT_OFF_NUM_NAMES];
+
+   return NBSTAT_EOK;
+}
+
+/* nbstat_view_count - number of entries in the name table */
+int nbstat_view_count(const nbstat_view_t *view)
+{
+   return view->count;
+}
+
+/* nbstat_view_ttl */
+uint32_t nbstat_view_ttl(const nbstat_view_t *view)
+{
+   return dec32be(view->data + NBSTAT_OFF_TTL);
+}
+
+/* nbstat_view_hwaddr - the 6-byte unit_id, usually the MAC address */
+const uint8_t *nbstat_view_hwaddr(const nbstat_view_t *view)
+{
+   return view->data + NBSTAT_OFF_NAMES + NBSTAT_NAME_SIZE * view->count;
+}
+
+/* nbstat_view_name - the 15-byte name of entry i; suffix and flags are optional. */
+const uint8_t *nbstat_view_name(const nbstat_view_t *view, int i, uint8_t *suffix, uint16_t *flags)
+{
+   const uint8_t *ptr;
+
+   if (i < 0 || i >= view->count)
+       return NULL;
+
+   ptr = view->data + NBSTAT_OFF_NAMES + NBSTAT_NAME_SIZE * i;
+   if (suffix != NULL)
+       *suffix = ptr[15];
+   if (flags != NULL)
+       *flags = dec16be(ptr + 16);
+
+   return ptr;
+}
+
+/* nbstat_view_find - index of the first unique (group = 0) or group name with
+ * the given suffix, e.g. <20> for the server name, or -1. */
+int nbstat_view_find(const nbstat_view_t *view, uint8_t suffix, int group)
+{
+   const uint8_t *ptr = view->data + NBSTAT_OFF_NAMES;
+   int i;
+
+   for (i = 0; i < view->count; i++, ptr += NBSTAT_NAME_SIZE) {
+       if (ptr[15] == suffix && !(ptr[16] & 0x80) == !group)
+           return i;
+   }
+
+   return -1;
+}
+
+/* nbstat_view_decode - full decode of the name table and MAC (sin is left alone). */
+void nbstat_view_decode(const nbstat_view_t *view, nbstat_t *nbstat)
+{
+   const uint8_t *ptr = view->data + NBSTAT_OFF_NAMES;
+   int i;
+
+   for (i = 0; i < view->count; i++, ptr += NBSTAT_NAME_SIZE)
+       node_name_decode(&nbstat->node[i], ptr);
+
+   nbstat->count = view->count;
+   nbstat->ttl = nbstat_view_ttl(view);
+   memcpy(nbstat->hwaddr, ptr, sizeof(nbstat->hwaddr));
+}
+
+/*
+ * First-level name codec (RFC 1001 14.1): each byte of the 16-byte name goes
+ * out as two letters, 'A' plus its high nibble then 'A' plus its low one,
+ * after a length byte of 0x20 and before the empty label that ends the
+ * name. Bytes after a NUL in the first 15 are padded with `pad', except that
+ * the wildcard "*" stays padded with NULs; the suffix in byte 15 is sent as
+ * is. The batch kernels below do many names per call, with SSE2 or AVX2 (as
+ * the CPU has it) on x86 and NEON on AArch64, and plain C anywhere else.
+ */
+#if defined(NBSTAT_SIMD_X86) || defined(NBSTAT_SIMD_NEON)
+static const uint8_t name_lanes[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+#endif
+
+/* name_fill - the padding of a name whose first NUL is byte `first'. */
+static uint8_t name_fill(const uint8_t *src, int first, uint8_t pad)
+{
+   return first == 1 && src[0] == '*' ? 0x00 : pad;
+}
+
+/* The plain C kernels, for targets without SIMD and as the reference the
+ * bench checks the others against. */
+#if !(defined(NBSTAT_SIMD_X86) || defined(NBSTAT_SIMD_NEON)) || defined(NBSTAT_BENCH)
+/* name_encode_scalar */
+static void name_encode_scalar(uint8_t *out, const uint8_t *src, size_t count, uint8_t pad)
+{
+   uint8_t c[16], letters[32];
+   size_t n;
+   int i, first;
+
+   for (n = 0; n < count; n++, src += 16, out += NBSTAT_QNAME_SIZE) {
+       memcpy(c, src, sizeof(c));
+       for (first = 0; first < 15 && c[first] != 0x00; first++)
+           ;
+       if (first < 15)
+           memset(c + first, name_fill(src, first, pad), 15 - first);
+
+       /* Spelt out in a local array, which compilers vectorize. */
+       for (i = 0; i < 16; i++) {
+           letters[2 * i] = (uint8_t)('A' + (c[i] >> 4));
+           letters[2 * i + 1] = (uint8_t)('A' + (c[i] & 0x0f));
+       }
+       out[0] = 0x20;
+       memcpy(out + 1, letters, sizeof(letters));
+       out[NBSTAT_QNAME_SIZE - 1] = 0x00;
+   }
+}
+
+/* name_decode_scalar - returns the number of well-formed names before the first that is not. */
+static size_t name_decode_scalar(uint8_t *names, const uint8_t *in, size_t count)
+{
+   uint8_t hi, lo;
+   size_t n;
+   int i;
+
+   for (n = 0; n < count; n++, in += NBSTAT_QNAME_SIZE, names += 16) {
+       if (in[0] != 0x20 || in[NBSTAT_QNAME_SIZE - 1] != 0x00)
+           return n;
+       for (i = 0; i < 16; i++) {
+           hi = (uint8_t)(in[1 + 2 * i] - 'A');
+           lo = (uint8_t)(in[2 + 2 * i] - 'A');
+           if ((hi | lo) > 0x0f)
+               return n;
+           names[i] = (uint8_t)(hi << 4 | lo);
+       }
+   }
+
+   return n;
+}
+#endif
+
+#ifdef NBSTAT_SIMD_X86
+/* name_pad_sse2 - pad a name that has a NUL in its first 15 bytes (mask m). */
+static __m128i name_pad_sse2(__m128i v, unsigned m, const uint8_t *src, uint8_t pad)
+{
+   int first = __builtin_ctz(m);
+   __m128i lanes = _mm_loadu_si128((const __m128i *)name_lanes);
+   __m128i mask;
+
+   mask = _mm_and_si128(_mm_cmpgt_epi8(lanes, _mm_set1_epi8((char)(first - 1))),
+                        _mm_cmplt_epi8(lanes, _mm_set1_epi8(15)));
+
+   return _mm_or_si128(_mm_and_si128(mask, _mm_set1_epi8((char)name_fill(src, first, pad))),
+                       _mm_andnot_si128(mask, v));
+}
+
+/* name_encode_sse2 */
+static void name_encode_sse2(uint8_t *out, const uint8_t *src, size_t count, uint8_t pad)
+{
+   const __m128i nibble = _mm_set1_epi8(0x0f);
+   const __m128i a = _mm_set1_epi8('A');
+   __m128i v, hi, lo;
+   unsigned m;
+   size_t n;
+
+   for (n = 0; n < count; n++, src += 16, out += NBSTAT_QNAME_SIZE) {
+       v = _mm_loadu_si128((const __m128i *)src);
+       m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) & 0x7fff;
+       if (m != 0)
+           v = name_pad_sse2(v, m, src, pad);
+
+       hi = _mm_add_epi8(_mm_and_si128(_mm_srli_epi16(v, 4), nibble), a);
+       lo = _mm_add_epi8(_mm_and_si128(v, nibble), a);
+       out[0] = 0x20;
+       _mm_storeu_si128((__m128i *)(out + 1), _mm_unpacklo_epi8(hi, lo));
+       _mm_storeu_si128((__m128i *)(out + 17), _mm_unpackhi_epi8(hi, lo));
+       out[NBSTAT_QNAME_SIZE - 1] = 0x00;
+   }
+}
+
+/* name_decode_sse2 - the letters of a 16-bit lane, less 'A', make the byte
+ * (even << 4 | odd) in its low half. */
+static size_t name_decode_sse2(uint8_t *names, const uint8_t *in, size_t count)
+{
+   const __m128i a = _mm_set1_epi8('A');
+   const __m128i high = _mm_set1_epi8((char)0xf0);
+   const __m128i low = _mm_set1_epi16(0x00ff);
+   __m128i x0, x1;
+   size_t n;
+
+   for (n = 0; n < count; n++, in += NBSTAT_QNAME_SIZE, names += 16) {
+       if (in[0] != 0x20 || in[NBSTAT_QNAME_SIZE - 1] != 0x00)
+           break;
+       x0 = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(in + 1)), a);
+       x1 = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(in + 17)), a);
+       if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(_mm_or_si128(x0, x1), high), _mm_setzero_si128())) != 0xffff)
+           break;
+
+       x0 = _mm_and_si128(_mm_or_si128(_mm_slli_epi16(x0, 4), _mm_srli_epi16(x0, 8)), low);
+       x1 = _mm_and_si128(_mm_or_si128(_mm_slli_epi16(x1, 4), _mm_srli_epi16(x1, 8)), low);
+       _mm_storeu_si128((__m128i *)names, _mm_packus_epi16(x0, x1));
+   }
+
+   return n;
+}
+
+/* name_encode_avx2 - two names per step. */
+__attribute__((target("avx2")))
+static void name_encode_avx2(uint8_t *out, const uint8_t *src, size_t count, uint8_t pad)
+{
+   const __m256i nibble = _mm256_set1_epi8(0x0f);
+   const __m256i a = _mm256_set1_epi8('A');
+   __m256i v, hi, lo, first, second;
+   __m128i x0, x1;
+   unsigned m;
+
+   for (; count >= 2; count -= 2, src += 32, out += 2 * NBSTAT_QNAME_SIZE) {
+       v = _mm256_loadu_si256((const __m256i *)src);
+       m = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+       if ((m & 0x7fff7fff) != 0) {
+           x0 = _mm256_castsi256_si128(v);
+           x1 = _mm256_extracti128_si256(v, 1);
+           if ((m & 0x7fff) != 0)
+               x0 = name_pad_sse2(x0, m & 0x7fff, src, pad);
+           if ((m & 0x7fff0000) != 0)
+               x1 = name_pad_sse2(x1, (m >> 16) & 0x7fff, src + 16, pad);
+           v = _mm256_inserti128_si256(_mm256_castsi128_si256(x0), x1, 1);
+       }
+
+       /* Unpacking stays within the 128-bit lanes: first and second halves
+        * of both names, which the permutes put back in order. */
+       hi = _mm256_add_epi8(_mm256_and_si256(_mm256_srli_epi16(v, 4), nibble), a);
+       lo = _mm256_add_epi8(_mm256_and_si256(v, nibble), a);
+       first = _mm256_unpacklo_epi8(hi, lo);
+       second = _mm256_unpackhi_epi8(hi, lo);
+       out[0] = 0x20;
+       _mm256_storeu_si256((__m256i *)(out + 1), _mm256_permute2x128_si256(first, second, 0x20));
+       out[NBSTAT_QNAME_SIZE - 1] = 0x00;
+       out[NBSTAT_QNAME_SIZE] = 0x20;
+       _mm256_storeu_si256((__m256i *)(out + NBSTAT_QNAME_SIZE + 1), _mm256_permute2x128_si256(first, second, 0x31));
+       out[2 * NBSTAT_QNAME_SIZE - 1] = 0x00;
+   }
+
+   name_encode_sse2(out, src, count, pad);
+}
+
+/* name_decode_avx2 - two names per step; a pair with a bad name, and an odd
+ * one at the end, go to the SSE2 kernel. */
+__attribute__((target("avx2")))
+static size_t name_decode_avx2(uint8_t *names, const uint8_t *in, size_t count)
+{
+   const __m256i a = _mm256_set1_epi8('A');
+   const __m256i high = _mm256_set1_epi8((char)0xf0);
+   const __m256i low = _mm256_set1_epi16(0x00ff);
+   __m256i y0, y1;
+   size_t n;
+
+   for (n = 0; n + 2 <= count; n += 2, in += 2 * NBSTAT_QNAME_SIZE, names += 32) {
+       if (in[0] != 0x20 || in[NBSTAT_QNAME_SIZE - 1] != 0x00 ||
+           in[NBSTAT_QNAME_SIZE] != 0x20 || in[2 * NBSTAT_QNAME_SIZE - 1] != 0x00)
+           break;
+       y0 = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i *)(in + 1)), a);
+       y1 = _mm256_sub_epi8(_mm256_loadu_si256((const __m256i *)(in + NBSTAT_QNAME_SIZE + 1)), a);
+       if (!_mm256_testz_si256(_mm256_or_si256(y0, y1), high))
+           break;
+
+       y0 = _mm256_and_si256(_mm256_or_si256(_mm256_slli_epi16(y0, 4), _mm256_srli_epi16(y0, 8)), low);
+       y1 = _mm256_and_si256(_mm256_or_si256(_mm256_slli_epi16(y1, 4), _mm256_srli_epi16(y1, 8)), low);
+       /* Packed by lane: 8 bytes of each name, then the other 8 of each. */
+       _mm256_storeu_si256((__m256i *)names, _mm256_permute4x64_epi64(_mm256_packus_epi16(y0, y1), 0xd8));
+   }
+
+   return n + name_decode_sse2(names, in, count - n);
+}
+#endif
+
+#ifdef NBSTAT_SIMD_NEON
+/* name_encode_neon - vst2q interleaves the two letters of each byte. */
+static void name_encode_neon(uint8_t *out, const uint8_t *src, size_t count, uint8_t pad)
+{
+   const uint8x16_t nibble = vdupq_n_u8(0x0f);
+   const uint8x16_t a = vdupq_n_u8('A');
+   uint8x16x2_t letters;
+   uint8x16_t v, lanes, mask;
+   int first;
+   size_t n;
+
+   lanes = vld1q_u8(name_lanes);
+   for (n = 0; n < count; n++, src += 16, out += NBSTAT_QNAME_SIZE) {
+       v = vld1q_u8(src);
+       if (vmaxvq_u8(vsetq_lane_u8(0, vceqq_u8(v, vdupq_n_u8(0)), 15)) != 0) {
+           for (first = 0; src[first] != 0x00; first++)
+               ;
+           mask = vandq_u8(vcgeq_u8(lanes, vdupq_n_u8((uint8_t)first)), vcltq_u8(lanes, vdupq_n_u8(15)));
+           v = vbslq_u8(mask, vdupq_n_u8(name_fill(src, first, pad)), v);
+       }
+
+       letters.val[0] = vaddq_u8(vshrq_n_u8(v, 4), a);
+       letters.val[1] = vaddq_u8(vandq_u8(v, nibble), a);
+       out[0] = 0x20;
+       vst2q_u8(out + 1, letters);
+       out[NBSTAT_QNAME_SIZE - 1] = 0x00;
+   }
+}
+
+/* name_decode_neon - vld2q splits the letters back into high and low nibbles. */
+static size_t name_decode_neon(uint8_t *names, const uint8_t *in, size_t count)
+{
+   const uint8x16_t a = vdupq_n_u8('A');
+   uint8x16x2_t letters;
+   uint8x16_t hi, lo;
+   size_t n;
+
+   for (n = 0; n < count; n++, in += NBSTAT_QNAME_SIZE, names += 16) {
+       if (in[0] != 0x20 || in[NBSTAT_QNAME_SIZE - 1] != 0x00)
+           break;
+       letters = vld2q_u8(in + 1);
+       hi = vsubq_u8(letters.val[0], a);
+       lo = vsubq_u8(letters.val[1], a);
+       if (vmaxvq_u8(vorrq_u8(hi, lo)) > 0x0f)
+           break;
+       vst1q_u8(names, vorrq_u8(vshlq_n_u8(hi, 4), lo));
+   }
+
+   return n;
+}
+#endif
+
+/* nbstat_encode_names - `count' 16-byte names to NBSTAT_QNAME_SIZE bytes each. */
+void nbstat_encode_names(uint8_t *out, const uint8_t *names, size_t count, uint8_t pad)
+{
+#if defined(NBSTAT_SIMD_X86)
+   if (__builtin_cpu_supports("avx2"))
+       name_encode_avx2(out, names, count, pad);
+   else
+       name_encode_sse2(out, names, count, pad);
+#elif defined(NBSTAT_SIMD_NEON)
+   name_encode_neon(out, names, count, pad);
+#else
+   name_encode_scalar(out, names, count, pad);
+#endif
+}
+
+/* nbstat_decode_names - the reverse, padding and all; returns how many names
+ * were well formed, stopping at the first that was not. */
+size_t nbstat_decode_names(uint8_t *names, const uint8_t *in, size_t count)
+{
+#if defined(NBSTAT_SIMD_X86)
+   if (__builtin_cpu_supports("avx2"))
+       return name_decode_avx2(names, in, count);
+   return name_decode_sse2(names, in, count);
+#elif defined(NBSTAT_SIMD_NEON)
+   return name_decode_neon(names, in, count);
+#else
+   return name_decode_scalar(names, in, count);
+#endif
+}
+
+/* netbios_encode_name - one name, for the requests; returns the offset of
+ * the terminating label. */
+static size_t netbios_encode_name(char *name, const char *src, uint8_t pad)
+{
+#if defined(NBSTAT_SIMD_X86)
+   name_encode_sse2((uint8_t *)name, (const uint8_t *)src, 1, pad);
+#elif defined(NBSTAT_SIMD_NEON)
+   name_encode_neon((uint8_t *)name, (const uint8_t *)src, 1, pad);
+#else
+   name_encode_scalar((uint8_t *)name, (const uint8_t *)src, 1, pad);
+#endif
+
+   return NBSTAT_QNAME_SIZE - 1;
+}
+
+void nbstat_free(nbstat_t *nbstat) 
+{
+   free(nbstat);
+}
+
+static int nbstat_close(socket_t sfd)
+{
+   int result;
+
+   result = closesocket(sfd);
+   WSACleanup();
+  
+   return result;
+}
+
+#if defined(_WIN32) && !defined(SIO_UDP_CONNRESET)
+#define SIO_UDP_CONNRESET _WSAIOW(IOC_VENDOR, 12)
+#endif
+#if defined(_WIN32) && !defined(WSA_FLAG_REGISTERED_IO)
+#define WSA_FLAG_REGISTERED_IO 0x100
+#endif
+
+/* nbstat_ctx_socket - open the shared, non-blocking socket, bound to a local
+ * address (host order) unless that is INADDR_ANY. */
+static int nbstat_ctx_socket(socket_t *sfd, uint32_t addr)
+{
+   struct sockaddr_in sin;
+   int err;
+#ifdef _WIN32
+   u_long nonblock = 1;
+   BOOL connreset = FALSE;
+   DWORD nbytes = 0;
+#endif
+
+#ifdef _WIN32
+   /* Ask for Registered I/O support; older systems reject the flag. */
+   *sfd = WSASocket(AF_INET, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, WSA_FLAG_OVERLAPPED | WSA_FLAG_REGISTERED_IO);
+   if (*sfd == INVALID_SOCKET)
+       *sfd = WSASocket(AF_INET, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, WSA_FLAG_OVERLAPPED);
+#else
+   *sfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+#endif
+   if (*sfd == INVALID_SOCKET)
+       return WSAGetLastError();
+
+#ifdef _WIN32
+   if (ioctlsocket(*sfd, FIONBIO, &nonblock) == SOCKET_ERROR) {
+#else
+   if (fcntl(*sfd, F_SETFL, fcntl(*sfd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+#endif
+       closesocket(*sfd);
+       *sfd = INVALID_SOCKET;
+       return WSAGetLastError();
+   }
+
+   if (addr != INADDR_ANY) {
+       memset(&sin, 0x00, sizeof(sin));
+       sin.sin_family = AF_INET;
+       sin.sin_addr.s_addr = htonl(addr);
+       if (bind(*sfd, (struct sockaddr *)&sin, sizeof(sin)) == SOCKET_ERROR) {
+           err = WSAGetLastError();
+           closesocket(*sfd);
+           *sfd = INVALID_SOCKET;
+           return err;
+       }
+   }
+
+#ifdef _WIN32
+   /* Don't let ICMP port unreachable from one target fail recvfrom() for all. */
+   WSAIoctl(*sfd, SIO_UDP_CONNRESET, &connreset, sizeof(connreset), NULL, 0, &nbytes, NULL, NULL);
+#endif
+
+   return 0;
+}
+
+/* nbstat_query_init - fill in a node status request for the wildcard name. */
+static void nbstat_query_init(struct nbstat_query *query, uint16_t trn_id)
+{
+   char nbtname[16]; 
+
+   query->hdr.name_trn_id = trn_id;
+
+   query->hdr.r = 0;
+   query->hdr.opcode = OPCODE_QUERY;
+   query->hdr.aa = 0;
+   query->hdr.tc = 0;
+   query->hdr.rd = 0;
+   query->hdr.ra = 0;
+   query->hdr.unused1 = 0;
+   query->hdr.unused2 = 0;
+   query->hdr.b = 0;
+   query->hdr.rcode = 0;
+   
+   query->hdr.qdcount = 1;
+   query->hdr.ancount = 0;
+   query->hdr.nscount = 0;
+   query->hdr.arcount = 0;
+
+   /* Encode the first-level NetBIOS name. */
+   memset(nbtname, '\0', sizeof(nbtname));
+   nbtname[0] = '*';
+   netbios_encode_name((char *)query->question.q_name, nbtname, 0x20);
+
+   query->question.q_type  = QTYPE_NBSTAT;
+   query->question.q_class = QCLASS_IN;
+}
+
+/* nbstat_request_init - encode the request template once per context. */
+static void nbstat_request_init(nbstat_ctx_t *ctx)
+{
+   struct nbstat_query query;
+   buffer_t buffer;
+
+   nbstat_query_init(&query, 0);
+   buffer_init(&buffer, ctx->request, sizeof(ctx->request));
+   nbstat_encode_request(&buffer, &query);
+}
+
+/* nbstat_trn_hash - 16-bit keyed hash of a target address (network order),
+ * or 0 when hashed IDs are off. */
+static uint16_t nbstat_trn_hash(const nbstat_ctx_t *ctx, uint32_t addr)
+{
+   uint32_t h;
+
+   if (ctx->trn_key == 0)
+       return 0;
+
+   /* murmur3 finalizer */
+   h = addr ^ ctx->trn_key;
+   h ^= h >> 16;
+   h *= 0x85ebca6bU;
+   h ^= h >> 13;
+   h *= 0xc2b2ae35U;
+   h ^= h >> 16;
+
+   return (uint16_t)(h >> 16);
+}
+
+/* nbstat_request_stage - stage the template for `to' with the given ID. */
+static int nbstat_request_stage(nbstat_ctx_t *ctx, const struct sockaddr_in *to, uint16_t trn_id, int tag)
+{
+   uint8_t *data;
+
+   data = nbstat_engine_stage(&ctx->engine, sizeof(ctx->request), to, tag);
+   if (data == NULL)
+       return NBSTAT_EAGAIN;
+
+   memcpy(data, ctx->request, sizeof(ctx->request));
+   enc16be(data, trn_id);
+
+   return NBSTAT_EOK;
+}
+
+/* nbstat_ctx_hash_ids - mix a keyed hash of each target into its transaction
+ * ID, so that off-path replies cannot guess it. A zero key turns this off. */
+void nbstat_ctx_hash_ids(nbstat_ctx_t *ctx, uint32_t key)
+{
+   if (ctx != NULL)
+       ctx->trn_key = key;
+}
+
+/* pace_burst - bucket depth in requests, about 20 ms worth. */
+static int64_t pace_burst(const struct nbstat_pace *pace)
+{
+   uint32_t burst = pace->rate / 50;
+
+   if (burst < 1)
+       burst = 1;
+   if (burst > NBSTAT_TXDEPTH)
+       burst = NBSTAT_TXDEPTH;
+
+   return (int64_t)burst * 1000;
+}
+
+/* pace_reset - start pacing afresh at the configured rate. */
+static void pace_reset(struct nbstat_pace *pace, uint64_t now)
+{
+   pace->rate = pace->limit;
+   pace->tokens = pace_burst(pace);
+   pace->last = pace->epoch = now;
+   pace->sent = pace->replies = pace->lost = 0;
+   pace->blocked = 0;
+}
+
+/* pace_ready - refill the bucket; true if a request may go out now. */
+static int pace_ready(struct nbstat_pace *pace, uint64_t now)
+{
+   if (pace->rate == 0)
+       return 1;
+
+   if (now > pace->last) {
+       pace->tokens += (int64_t)(now - pace->last) * pace->rate;
+       if (pace->tokens > pace_burst(pace))
+           pace->tokens = pace_burst(pace);
+       pace->last = now;
+   }
+
+   return pace->tokens >= 1000;
+}
+
+/* pace_spend - account for one request sent; may leave the bucket in debt. */
+static void pace_spend(struct nbstat_pace *pace)
+{
+   pace->sent++;
+   if (pace->rate != 0)
+       pace->tokens -= 1000;
+}
+
+/* pace_delay - ms until the next token, 0 when unpaced. */
+static int pace_delay(const struct nbstat_pace *pace)
+{
+   if (pace->rate == 0 || pace->tokens >= 1000)
+       return 0;
+
+   return (int)((1000 - pace->tokens + pace->rate - 1) / pace->rate);
+}
+
+/* pace_adjust - end of interval: back off on congestion, else creep up. */
+static void pace_adjust(struct nbstat_pace *pace, uint64_t now)
+{
+   uint64_t elapsed = now - pace->epoch;
+   uint32_t rate;
+
+   if (elapsed < NBSTAT_PACE_EPOCH)
+       return;
+
+   if (pace->blocked || (pace->replies >= 8 && pace->lost * 10 > pace->replies)) {
+       /* Unpaced so far: start from what was actually sent. */
+       rate = pace->rate != 0 ? pace->rate : (uint32_t)(pace->sent * 1000 / elapsed);
+       rate -= rate / 4;
+       pace->rate = rate < NBSTAT_PACE_MIN ? NBSTAT_PACE_MIN : rate;
+       if (pace->tokens > pace_burst(pace))
+           pace->tokens = pace_burst(pace);
+   } else if (pace->rate != 0 && pace->replies > 0) {
+       pace->rate += pace->rate / 16 > 0 ? pace->rate / 16 : 1;
+       if (pace->limit != 0 && pace->rate > pace->limit)
+           pace->rate = pace->limit;
+   }
+
+   pace->epoch = now;
+   pace->sent = pace->replies = pace->lost = 0;
+   pace->blocked = 0;
+}
+
+/* pace_drops - replies the receive buffer overflowed on count as lost, so
+ * the rate comes down until we keep up with reading them. */
+static void pace_drops(struct nbstat_pace *pace, struct nbstat_engine *eng)
+{
+   pace->replies += eng->dropped;
+   pace->lost += eng->dropped;
+   eng->dropped = 0;
+}
+
+/* nbstat_ctx_set_rate - cap sweeps at `pps' requests per second, 0 = no cap.
+ * The rate is lowered automatically when the network shows signs of overload. */
+void nbstat_ctx_set_rate(nbstat_ctx_t *ctx, uint32_t pps)
+{
+   if (ctx != NULL)
+       ctx->pace.limit = pps;
+}
+
+/* nbstat_ctx_set_retries - how often a request is resent before giving up. */
+void nbstat_ctx_set_retries(nbstat_ctx_t *ctx, int retries)
+{
+   if (ctx != NULL)
+       ctx->retries = retries < 0 ? 0 : retries;
+}
+
+/* rtt_update - fold one sample into an estimator. */
+static void rtt_update(struct nbstat_rtt *rtt, int sample)
+{
+   int delta;
+
+   rtt->backoff = 0;
+   if (rtt->samples++ == 0) {
+       rtt->srtt = sample << 3;
+       rtt->rttvar = sample << 1;
+       return;
+   }
+
+   /* srtt += (R - srtt) / 8, rttvar += (|R - srtt| - rttvar) / 4 */
+   delta = sample - (rtt->srtt >> 3);
+   rtt->srtt += delta;
+   if (delta < 0)
+       delta = -delta;
+   rtt->rttvar += delta - (rtt->rttvar >> 2);
+}
+
+/* rtt_slot - the estimator of subnet `net', taken over from any other. */
+static struct nbstat_rtt *rtt_slot(nbstat_ctx_t *ctx, uint32_t net)
+{
+   struct nbstat_rtt *rtt = &ctx->rtt[net % NBSTAT_RTT_SLOTS];
+
+   if ((rtt->samples == 0 && rtt->backoff == 0) || rtt->net != net) {
+       memset(rtt, 0x00, sizeof(*rtt));
+       rtt->net = net;
+   }
+
+   return rtt;
+}
+
+/* rtt_sample - record the RTT of a reply from `addr' (network order). */
+static void rtt_sample(nbstat_ctx_t *ctx, uint32_t addr, int sample)
+{
+   rtt_update(rtt_slot(ctx, ntohl(addr) >> 8), sample);
+   rtt_update(&ctx->rtt_all, sample);
+}
+
+/* rtt_timeout - an attempt to `addr' went unanswered for its whole `rto':
+ * back off to twice that for the subnet and for those not seen yet, and
+ * keep it until a sample comes in (RFC 6298 5.5, 5.7). Karn's rule keeps
+ * replies to resent requests from being timed, so without this a path that
+ * got slower than its RTO could never be learned. */
+static void rtt_timeout(nbstat_ctx_t *ctx, uint32_t addr, int rto)
+{
+   struct nbstat_rtt *rtt = rtt_slot(ctx, ntohl(addr) >> 8);
+   int backoff = rto < NBSTAT_RTO_MAX / 2 ? rto << 1 : NBSTAT_RTO_MAX;
+
+   if (rtt->backoff < backoff)
+       rtt->backoff = backoff;
+   if (ctx->rtt_all.backoff < backoff)
+       ctx->rtt_all.backoff = backoff;
+}
+
+/* rtt_rto - retransmission timeout for `addr' (network order), in ms. */
+static int rtt_rto(const nbstat_ctx_t *ctx, uint32_t addr)
+{
+   uint32_t net = ntohl(addr) >> 8;
+   const struct nbstat_rtt *rtt = &ctx->rtt[net % NBSTAT_RTT_SLOTS];
+   int rto;
+
+   if ((rtt->samples == 0 && rtt->backoff == 0) || rtt->net != net)
+       rtt = &ctx->rtt_all;
+   if (rtt->samples == 0) {
+       rto = NBSTAT_RTO_INIT;
+   } else {
+       rto = (rtt->srtt >> 3) + rtt->rttvar;
+       if (rto < NBSTAT_RTO_MIN)
+           rto = NBSTAT_RTO_MIN;
+   }
+
+   return rto > rtt->backoff ? rto : rtt->backoff;
+}
+
+/* rtt_arm - when an attempt sent to `addr' at `now' times out: one RTO on,
+ * or at the deadline for the last attempt. *rto is set to the RTO, or to 0
+ * when the deadline cuts it short and the timeout says nothing of the path. */
+static uint64_t rtt_arm(const nbstat_ctx_t *ctx, uint32_t addr, uint64_t now, uint64_t deadline, int last, int *rto)
+{
+   uint64_t expires;
+
+   *rto = rtt_rto(ctx, addr);
+   expires = now + *rto;
+   if (expires > deadline)
+       *rto = 0;
+
+   return last || expires > deadline ? deadline : expires;
+}
+
+/* nbstat_ctx_create */
+int nbstat_ctx_create(nbstat_ctx_t **ctx)
+{
+   nbstat_ctx_t *c;
+
+   if (ctx == NULL)
+       return NBSTAT_EINVAL;
+
+   c = (nbstat_ctx_t *)malloc(sizeof(nbstat_ctx_t));
+   if (c == NULL)
+       return NBSTAT_ENOMEM;
+
+   memset(c, 0x00, sizeof(nbstat_ctx_t));
+   c->trn_id = (uint16_t)GetCurrentProcessId();
+   c->retries = NBSTAT_RETRIES_DEFAULT;
+   nbstat_request_init(c);
+   wheel_init(&c->wheel, nbstat_clock());
+
+   if (winsock_init() != 0) {
+       free(c);
+       return NBSTAT_EWSAFAIL;
+   }
+
+   if (nbstat_ctx_socket(&c->sfd, INADDR_ANY) != 0) {
+       WSACleanup();
+       free(c);
+       return NBSTAT_ESOCKET;
+   }
+
+   if (nbstat_engine_init(&c->engine, c->sfd) != NBSTAT_EOK) {
+       nbstat_close(c->sfd);
+       free(c);
+       return NBSTAT_ESOCKET;
+   }
+   c->engine.stats = &c->stats;
+   c->stats.start = nbstat_clock();
+
+   *ctx = c;
+
+   return NBSTAT_EOK;
+}
+
+/* nbstat_ctx_bind - add a source address (host order) to send from, with the
+ * prefix length of the subnet it reaches directly, 0 for none. The context
+ * socket moves to the first source; nbstat_sweep_mt() gives every source
+ * workers and a socket of its own, and sends each target from the source on
+ * its subnet, spreading the others over all of them. */
+int nbstat_ctx_bind(nbstat_ctx_t *ctx, uint32_t addr, int prefix)
+{
+   struct nbstat_engine engine;
+   socket_t sfd;
+
+   if (ctx == NULL || prefix < 0 || prefix > 32 || ctx->nsrc >= NBSTAT_SOURCES_MAX || ctx->pending > 0)
+       return NBSTAT_EINVAL;
+
+   if (ctx->nsrc == 0) {
+       if (nbstat_ctx_socket(&sfd, addr) != 0)
+           return NBSTAT_ESOCKET;
+
+       /* Only once the new engine is up does it replace the old one. */
+       if (nbstat_engine_init(&engine, sfd) != NBSTAT_EOK) {
+           closesocket(sfd);
+           return NBSTAT_ESOCKET;
+       }
+       closesocket(ctx->sfd);
+       nbstat_engine_close(&ctx->engine);
+       engine_move(&ctx->engine, &engine);
+       ctx->engine.stats = &ctx->stats;
+       ctx->sfd = sfd;
+       ctx->broadcast = 0;
+   }
+
+   ctx->src[ctx->nsrc].addr = addr;
+   ctx->src[ctx->nsrc].mask = prefix > 0 ? 0xFFFFFFFFU << (32 - prefix) : 0;
+   ctx->nsrc++;
+
+   return NBSTAT_EOK;
+}
+
+/* nbstat_ctx_set_report - have sweeps call `fn' with the statistics every
+ * `interval' ms; 0 turns it off. During a sweep the calls come from a reporter
+ * thread of their own, outside the send and receive loops; for submitted
+ * queries, from nbstat_poll(). */
+void nbstat_ctx_set_report(nbstat_ctx_t *ctx, int interval, nbstat_stats_fn fn, void *arg)
+{
+   if (ctx == NULL)
+       return;
+   ctx->report = interval > 0 ? fn : NULL;
+   ctx->report_arg = arg;
+   ctx->report_every = interval;
+   ctx->report_due = nbstat_clock() + interval;
+}
+
+/* nbstat_from_response - complete an nbstat_t whose name table rep was decoded into. */
+static void nbstat_from_response(nbstat_t *nbstat, const struct nbstat_response *rep, const struct sockaddr_in *sin)
+{
+   int i;
+
+   nbstat->sin = *sin; 
+   nbstat->ttl = rep->rr.ttl;
+   nbstat->count = rep->num_names;
+         
+   for (i = 0; i < sizeof(nbstat->hwaddr); i++)
+       nbstat->hwaddr[i] = rep->stat.unit_id[i];     
+}
+
+/* Outstanding nbstat_query_ctx() request */
+struct nbstat_wait {
+   struct sockaddr_in sin;
+   struct sockaddr_in from;
+   struct nbstat_response rep;
+   nbstat_t nbstat;
+   struct nbstat_stats *stats;
+   uint16_t trn_id;
+   int result;
+   int done;
+};
+
+/* query_reply - accept the first datagram that answers our request. */
+static void query_reply(void *user, buffer_t *buffer, const struct sockaddr_in *from)
+{
+   struct nbstat_wait *wait = (struct nbstat_wait *)user;
+
+   if (buffer->length < sizeof(wait->trn_id) ||
+       dec16be(buffer->data) != wait->trn_id ||
+       from->sin_addr.s_addr != wait->sin.sin_addr.s_addr ||
+       from->sin_port != wait->sin.sin_port) {
+       stat_add(&wait->stats->unmatched, 1);
+       return;
+   }
+   if (wait->done) {
+       stat_add(&wait->stats->duplicate, 1);
+       return;
+   }
+
+   stat_add(&wait->stats->matched, 1);
+   wait->rep.node = wait->nbstat.node;
+   wait->result = nbstat_decode_response(buffer, &wait->rep);
+   wait->from = *from;
+   wait->done = 1;
+}
+
+/* query_txerr - the request could not be sent. */
+static void query_txerr(void *user, int tag, const struct sockaddr_in *to, int err)
+{
+   struct nbstat_wait *wait = (struct nbstat_wait *)user;
+
+   wait->result = NBSTAT_ESOCKET;
+   wait->done = 1;
+}
+
+/* nbstat_query_addr - query one target given in host byte order, reusing
+ * the context socket. */
+int nbstat_query_addr(nbstat_ctx_t *ctx, nbstat_t **nbstat, uint32_t addr, uint16_t port, int timeout)
+{
+   struct nbstat_wait wait;
+   uint64_t deadline, resend, sent, now, sent_us;
+   int tries = 0;
+   int delay, rto;
+
+   if (ctx == NULL || nbstat == NULL)
+       return NBSTAT_EINVAL;
+   if (ctx->pending > 0)
+       return NBSTAT_EAGAIN;
+
+   memset(&wait, 0x00, sizeof(wait));
+   wait.sin.sin_family = AF_INET;
+   wait.sin.sin_port = htons(port);
+   wait.sin.sin_addr.s_addr = htonl(addr);
+   wait.stats = &ctx->stats;
+
+   wait.trn_id = (uint16_t)(++ctx->trn_id + nbstat_trn_hash(ctx, wait.sin.sin_addr.s_addr));
+   if (nbstat_request_stage(ctx, &wait.sin, wait.trn_id, 0) != NBSTAT_EOK)
+       return stats_result(&ctx->stats, NBSTAT_EDEBUG);
+    
+   if (timeout > 10000 || timeout <= 0)
+       timeout = 3000;
+   sent = nbstat_clock();
+   sent_us = nbstat_clock_us();
+   deadline = sent + timeout;
+   resend = rtt_arm(ctx, wait.sin.sin_addr.s_addr, sent, deadline, ctx->retries == 0, &rto);
+
+   /* Wait for the reply, resending on each RTO and dropping anything else
+    * that arrives meanwhile. The last attempt listens until the deadline. */
+   while (!wait.done) {
+       now = nbstat_clock();
+       if (now >= resend) {
+           if (rto > 0)
+               rtt_timeout(ctx, wait.sin.sin_addr.s_addr, rto);
+           if (now >= deadline) {
+               nbstat_engine_discard(&ctx->engine);
+               return stats_result(&ctx->stats, NBSTAT_ETIMEOUT);
+           }
+           if (nbstat_request_stage(ctx, &wait.sin, wait.trn_id, 0) == NBSTAT_EOK) {
+               stat_add(&ctx->stats.resent, 1);
+               tries++;
+           }
+           resend = rtt_arm(ctx, wait.sin.sin_addr.s_addr, now, deadline, tries >= ctx->retries, &rto);
+       }
+       delay = (int)(resend - now);
+
+       /* Keep retrying while the send buffer is full. */
+       if (nbstat_engine_flush(&ctx->engine, query_txerr, &wait) == NBSTAT_EAGAIN && delay > 1)
+           delay = 1;
+       if (wait.done)
+           break;
+
+       if (nbstat_engine_poll(&ctx->engine, delay, query_reply, &wait) == SOCKET_ERROR)
+           return stats_result(&ctx->stats, NBSTAT_EDEBUG);
+   }
+ 
+   if (stats_result(&ctx->stats, wait.result) != NBSTAT_EOK)
+       return wait.result;
+
+   /* Karn: a reply to a resent request says nothing about the RTT. */
+   if (tries == 0) {
+       rtt_sample(ctx, wait.sin.sin_addr.s_addr, (int)(nbstat_clock() - sent));
+       stats_rtt(&ctx->stats, sent_us);
+   }
+
+   *nbstat = (nbstat_t *)malloc(sizeof(nbstat_t));
+   if (*nbstat == NULL)
+       return NBSTAT_ENOMEM;
+     
+   nbstat_from_response(&wait.nbstat, &wait.rep, &wait.from);
+   memcpy(*nbstat, &wait.nbstat, sizeof(nbstat_t));
+
+   return NBSTAT_EOK;
+} 
+
+/* nbstat_query_ctx - query one target, reusing the context socket. */
+int nbstat_query_ctx(nbstat_ctx_t *ctx, nbstat_t **nbstat, const char *target, uint16_t port, int timeout)
+{
+   struct sockaddr_in sin;
+
+   if (ctx == NULL || nbstat == NULL || target == NULL)
+       return NBSTAT_EINVAL;
+
+   if (nbstat_resolve(target, port, &sin) != 0)
+       return NBSTAT_EINVAL; 
+
+   return nbstat_query_addr(ctx, nbstat, ntohl(sin.sin_addr.s_addr), port, timeout);
+}
+
+/* nbstat_query - one-shot query, sets up and tears down its own context. */
+int nbstat_query(nbstat_t **nbstat, const char *target, uint16_t port, int timeout)
+{
+   nbstat_ctx_t *ctx = NULL;
+   int result;
+   
+   result = nbstat_ctx_create(&ctx);
+   if (result != NBSTAT_EOK)
+       return result;
+
+   result = nbstat_query_ctx(ctx, nbstat, target, port, timeout);
+   nbstat_ctx_destroy(ctx);
+
+   return result;
+} 
+
+/*
+ * Broadcast mode. One request with the B bit set goes to a directed broadcast
+ * address and every node on the segment answers from its own unicast address,
+ * so replies are matched on the transaction ID and port alone.
+ */
+
+/* Broadcast round state */
+struct nbstat_bcast {
+   struct sockaddr_in sin;
+   uint16_t trn_id;
+   uint32_t *seen;  /* Open addressing set of responder addresses, 0 = empty */
+   size_t nseen;
+   size_t size;     /* Power of two */
+   int result;
+   struct nbstat_stats *stats;
+   nbstat_broadcast_fn fn;
+   void *user;
+};
+
+/* bcast_insert - add a responder address; 0 if it was there already, -1 if
+ * out of memory. */
+static int bcast_insert(struct nbstat_bcast *bc, uint32_t addr)
+{
+   uint32_t *seen;
+   size_t size, i, j;
+
+   if (2 * (bc->nseen + 1) > bc->size) {
+       size = bc->size != 0 ? 2 * bc->size : 256;
+       seen = calloc(size, sizeof(uint32_t));
+       if (seen == NULL)
+           return -1;
+       for (i = 0; i < bc->size; i++) {
+           if (bc->seen[i] == 0)
+               continue;
+           for (j = bc->seen[i] * 2654435761U & (size - 1); seen[j] != 0; j = (j + 1) & (size - 1))
+               ;
+           seen[j] = bc->seen[i];
+       }
+       free(bc->seen);
+       bc->seen = seen;
+       bc->size = size;
+   }
+
+   for (i = addr * 2654435761U & (bc->size - 1); bc->seen[i] != 0; i = (i + 1) & (bc->size - 1)) {
+       if (bc->seen[i] == addr)
+           return 0;
+   }
+   bc->seen[i] = addr;
+   bc->nseen++;
+
+   return 1;
+}
+
+/* bcast_reply - decode the reply of one responder. */
+static void bcast_reply(void *user, buffer_t *buffer, const struct sockaddr_in *from)
+{
+   struct nbstat_bcast *bc = (struct nbstat_bcast *)user;
+   nbstat_view_t view;
+   nbstat_t nbstat;
+   int added;
+   int result;
+
+   if (buffer->length < sizeof(bc->trn_id) ||
+       dec16be(buffer->data) != bc->trn_id ||
+       from->sin_port != bc->sin.sin_port ||
+       from->sin_addr.s_addr == 0) {
+       stat_add(&bc->stats->unmatched, 1);
+       return;
+   }
+
+   result = nbstat_view_init(&view, buffer);
+   if (result != NBSTAT_EOK) {
+       stats_result(bc->stats, result);
+       return;
+   }
+
+   /* A node on several paths, or a duplicated datagram, answers twice. */
+   added = bcast_insert(bc, from->sin_addr.s_addr);
+   if (added < 0)
+       bc->result = NBSTAT_ENOMEM;
+   if (added <= 0) {
+       stat_add(&bc->stats->duplicate, 1);
+       return;
+   }
+   stat_add(&bc->stats->matched, 1);
+   stats_result(bc->stats, NBSTAT_EOK);
+
+   nbstat.sin = *from;
+   nbstat_view_decode(&view, &nbstat);
+   bc->fn(bc->user, &nbstat);
+}
+
+/* bcast_txerr - the request could not be sent. */
+static void bcast_txerr(void *user, int tag, const struct sockaddr_in *to, int err)
+{
+   ((struct nbstat_bcast *)user)->result = NBSTAT_ESOCKET;
+}
+
+/* nbstat_broadcast - query a directed broadcast address and report every
+ * node that answers before the timeout. */
+int nbstat_broadcast(nbstat_ctx_t *ctx, const char *target, uint16_t port, int timeout,
+                     nbstat_broadcast_fn fn, void *user)
+{
+   struct nbstat_bcast bc;
+   uint64_t deadline, now;
+   int on = 1;
+   uint8_t *data;
+
+   if (ctx == NULL || target == NULL || fn == NULL)
+       return NBSTAT_EINVAL;
+   if (ctx->pending > 0)
+       return NBSTAT_EAGAIN;
+
+   memset(&bc, 0x00, sizeof(bc));
+   if (nbstat_resolve(target, port, &bc.sin) != 0)
+       return NBSTAT_EINVAL;
+   bc.stats = &ctx->stats;
+   bc.fn = fn;
+   bc.user = user;
+
+   if (!ctx->broadcast) {
+       if (setsockopt(ctx->sfd, SOL_SOCKET, SO_BROADCAST, (const char *)&on, sizeof(on)) == SOCKET_ERROR)
+           return NBSTAT_ESOCKET;
+       ctx->broadcast = 1;
+   }
+   nbstat_engine_rcvbuf(&ctx->engine, 256); /* A /24 answers all at once */
+
+   bc.trn_id = ++ctx->trn_id;
+   data = nbstat_engine_stage(&ctx->engine, sizeof(ctx->request), &bc.sin, 0);
+   if (data == NULL)
+       return NBSTAT_EDEBUG;
+   memcpy(data, ctx->request, sizeof(ctx->request));
+   enc16be(data, bc.trn_id);
+   enc16be(data + NBSTAT_OFF_FLAGS, dec16be(data + NBSTAT_OFF_FLAGS) | NBSTAT_FLAG_B);
+
+   if (timeout > 10000 || timeout <= 0)
+       timeout = 3000;
+   deadline = nbstat_clock() + timeout;
+
+   /* There is no last reply to wait for, so collect until the deadline. */
+   while (bc.result == NBSTAT_EOK && (now = nbstat_clock()) < deadline) {
+       nbstat_engine_flush(&ctx->engine, bcast_txerr, &bc);
+       if (bc.result != NBSTAT_EOK)
+           break;
+       if (nbstat_engine_poll(&ctx->engine, ctx->engine.ntxq > 0 ? 1 : (int)(deadline - now),
+                              bcast_reply, &bc) == SOCKET_ERROR)
+           bc.result = NBSTAT_EDEBUG;
+   }
+
+   nbstat_engine_discard(&ctx->engine);
+   free(bc.seen);
+
+   return bc.result;
+}
+
+/*
+ * Sweep mode. One unconnected socket is shared by every target and up to
+ * `window' requests are kept in flight on the context's event engine. Each
+ * request owns a slot in the probe table. The table is split into pages of at
+ * most 64K slots; the page is picked from the low bits of the target address
+ * and the index within the page is sent as the transaction ID. A reply is thus
+ * matched back to its target with one table lookup plus a check of the source
+ * address, whatever the window size. Timeouts run on the context timer wheel.
+ */
+
+#define NBSTAT_WINDOW_DEFAULT 256
+#define NBSTAT_WINDOW_MAX     (1 << 20)
+#define NBSTAT_PAGE_MAX       65536 /* Bounded by the 16-bit transaction ID. */
+
+/* In-flight request slot */
+struct nbstat_probe {
+   struct nbstat_timer timer; /* Must be first */
+   struct sockaddr_in sin;
+   uint64_t sent;             /* First transmission */
+   uint64_t sent_us;          /* The same in us, for the RTT histogram */
+   uint64_t deadline;         /* Give up by then, however many tries are left */
+   int tries;                 /* Retransmissions so far */
+   int rto;                   /* Of the current attempt, 0 if the deadline cuts it short */
+   int next;                  /* Free list link */
+   int busy;
+   int queued;                /* Timer links are on the resend queue instead */
+};
+
+/* Callback of an nbstat_submit() request */
+struct nbstat_async {
+   nbstat_sweep_fn fn;
+   void *user;
+};
+
+/* Sweep state */
+struct nbstat_sweep {
+   nbstat_ctx_t *ctx;
+   uint16_t port;
+   int timeout;
+   struct nbstat_probe *probe;
+   int window;
+   int npage;    /* Power of two */
+   int pagesize; /* Slots per page, at most NBSTAT_PAGE_MAX */
+   int *free;    /* Free slot list of each page, linked through next */
+   int inflight;
+   struct nbstat_timer resend; /* Due retransmissions waiting for staging space */
+   nbstat_sweep_fn fn;
+   void *user;
+   struct nbstat_async *async; /* Per slot callbacks instead of fn, NULL in a sweep */
+};
+
+/* sweep_page - the page that serves a target address (host byte order). */
+static int sweep_page(const struct nbstat_sweep *sw, uint32_t addr)
+{
+   return (int)(addr & (uint32_t)(sw->npage - 1));
+}
+
+/* sweep_acquire - take a free slot from the target's page. */
+static int sweep_acquire(struct nbstat_sweep *sw, uint32_t addr)
+{
+   int page = sweep_page(sw, addr);
+   int slot;
+
+   slot = sw->free[page];
+   if (slot < 0)
+       return -1;
+
+   sw->free[page] = sw->probe[slot].next;
+   sw->probe[slot].busy = 1;
+   sw->inflight++;
+
+   return slot;
+}
+
+/* sweep_release - return a slot to its page. */
+static void sweep_release(struct nbstat_sweep *sw, int slot)
+{
+   struct nbstat_probe *probe = &sw->probe[slot];
+   int page = slot / sw->pagesize;
+
+   if (probe->queued)
+       wheel_unlink(&probe->timer);
+   else
+       wheel_del(&sw->ctx->wheel, &probe->timer);
+   probe->queued = 0;
+   probe->busy = 0;
+   probe->next = sw->free[page];
+   sw->free[page] = slot;
+   sw->inflight--;
+}
+
+/* sweep_finish - report the outcome of a slot and release it. */
+static void sweep_finish(struct nbstat_sweep *sw, int slot, int result, const nbstat_view_t *view)
+{
+   struct sockaddr_in sin = sw->probe[slot].sin;
+
+   sweep_release(sw, slot);
+   stat_add(&sw->ctx->stats.completed, 1);
+   result = stats_result(&sw->ctx->stats, result);
+   if (sw->async != NULL) {
+       sw->ctx->pending--;
+       sw->async[slot].fn(sw->async[slot].user, result, &sin, view);
+   } else
+       sw->fn(sw->user, result, &sin, view);
+}
+
+/* sweep_txerr - a staged request could not be sent. */
+static void sweep_txerr(void *user, int tag, const struct sockaddr_in *to, int err)
+{
+   struct nbstat_sweep *sw = (struct nbstat_sweep *)user;
+   struct nbstat_probe *probe;
+
+   /* Requests of other exchanges sharing the loop have tags beyond. */
+   if (tag < 0 || tag >= sw->window)
+       return;
+
+   /* The slot may have timed out and been reused meanwhile. */
+   probe = &sw->probe[tag];
+   if (probe->busy && probe->sin.sin_addr.s_addr == to->sin_addr.s_addr)
+       sweep_finish(sw, tag, NBSTAT_ESOCKET, NULL);
+}
+
+/* sweep_stage - stage the request of a slot for the next flush. */
+static int sweep_stage(struct nbstat_sweep *sw, int slot)
+{
+   struct nbstat_probe *probe = &sw->probe[slot];
+   int trn;
+
+   /* The in-page index, offset by the target hash when hashed IDs are on. */
+   trn = (slot % sw->pagesize + nbstat_trn_hash(sw->ctx, probe->sin.sin_addr.s_addr)) % sw->pagesize;
+
+   return nbstat_request_stage(sw->ctx, &probe->sin, (uint16_t)trn, slot);
+}
+
+/* sweep_arm - run the timer of a slot until its current attempt times out. */
+static void sweep_arm(struct nbstat_sweep *sw, struct nbstat_probe *probe, uint64_t now)
+{
+   wheel_add(&sw->ctx->wheel, &probe->timer,
+             rtt_arm(sw->ctx, probe->sin.sin_addr.s_addr, now, probe->deadline,
+                     probe->tries >= sw->ctx->retries, &probe->rto));
+}
+
+/* sweep_send - stage the request for one target and return its slot, or
+ * NBSTAT_EAGAIN without staging space; a slot must be free. */
+static int sweep_send(struct nbstat_sweep *sw, uint32_t addr, uint16_t port, int timeout, uint64_t now)
+{
+   struct nbstat_probe *probe;
+   int slot;
+
+   slot = sweep_acquire(sw, addr);
+   probe = &sw->probe[slot];
+
+   memset(&probe->sin, 0x00, sizeof(probe->sin));
+   probe->sin.sin_family = AF_INET;
+   probe->sin.sin_port = htons(port);
+   probe->sin.sin_addr.s_addr = htonl(addr);
+
+   /* Sent on the next flush; the timer counts from now. */
+   if (sweep_stage(sw, slot) != NBSTAT_EOK) {
+       sweep_release(sw, slot);
+       return NBSTAT_EAGAIN;
+   }
+
+   pace_spend(&sw->ctx->pace);
+   stat_add(&sw->ctx->stats.targets, 1);
+   probe->sent = now;
+   probe->sent_us = nbstat_clock_us();
+   probe->deadline = now + timeout;
+   probe->tries = 0;
+   sweep_arm(sw, probe, now);
+
+   return slot;
+}
+
+/* sweep_reply - match a datagram to its slot and decode it. */
+static void sweep_reply(void *user, buffer_t *buffer, const struct sockaddr_in *from)
+{
+   struct nbstat_sweep *sw = (struct nbstat_sweep *)user;
+   struct nbstat_probe *probe;
+   nbstat_view_t view;
+   int slot;
+   int result;
+
+   if (buffer->length < sizeof(struct nbstat_packet_header)) {
+       stat_add(&sw->ctx->stats.unmatched, 1);
+       return;
+   }
+
+   slot = dec16be(buffer->data);
+   if (slot >= sw->pagesize) {
+       stat_add(&sw->ctx->stats.unmatched, 1);
+       return;
+   }
+   slot = (slot + sw->pagesize - nbstat_trn_hash(sw->ctx, from->sin_addr.s_addr) % sw->pagesize) % sw->pagesize;
+   slot += sweep_page(sw, ntohl(from->sin_addr.s_addr)) * sw->pagesize;
+   if (slot >= sw->window) {
+       stat_add(&sw->ctx->stats.unmatched, 1);
+       return;
+   }
+
+   /* A late reply finds its slot idle, or serving another target. */
+   probe = &sw->probe[slot];
+   if (!probe->busy ||
+       probe->sin.sin_addr.s_addr != from->sin_addr.s_addr ||
+       probe->sin.sin_port != from->sin_port) {
+       stat_add(&sw->ctx->stats.duplicate, 1);
+       return;
+   }
+   stat_add(&sw->ctx->stats.matched, 1);
+
+   /* Karn: only replies to the first transmission are timed. */
+   if (probe->tries == 0) {
+       rtt_sample(sw->ctx, from->sin_addr.s_addr, (int)(nbstat_clock() - probe->sent));
+       stats_rtt(&sw->ctx->stats, probe->sent_us);
+   } else
+       sw->ctx->pace.lost++;
+   sw->ctx->pace.replies++;
+
+   /* Validate only; consumers read what they need from the view. */
+   result = nbstat_view_init(&view, buffer);
+   sweep_finish(sw, slot, result, result == NBSTAT_EOK ? &view : NULL);
+}
+
+/* sweep_expire - timer wheel callback: resend, or give up on the target. */
+static void sweep_expire(void *user, struct nbstat_timer *timer)
+{
+   struct nbstat_sweep *sw = (struct nbstat_sweep *)user;
+   struct nbstat_probe *probe = (struct nbstat_probe *)timer;
+   uint64_t now = sw->ctx->wheel.now;
+   int slot = (int)(probe - sw->probe);
+
+   if (probe->rto > 0)
+       rtt_timeout(sw->ctx, probe->sin.sin_addr.s_addr, probe->rto);
+   probe->rto = 0;
+   if (probe->tries >= sw->ctx->retries || now >= probe->deadline) {
+       sweep_finish(sw, slot, NBSTAT_ETIMEOUT, NULL);
+       return;
+   }
+
+   /* Retransmissions go out regardless of the pacing and leave the bucket in
+    * debt, so new targets wait instead. Without staging space, queue it for
+    * the send loop. */
+   if (sweep_stage(sw, slot) != NBSTAT_EOK) {
+       timer->next = &sw->resend;
+       timer->prev = sw->resend.prev;
+       sw->resend.prev->next = timer;
+       sw->resend.prev = timer;
+       probe->queued = 1;
+       return;
+   }
+
+   pace_spend(&sw->ctx->pace);
+   stat_add(&sw->ctx->stats.resent, 1);
+   probe->tries++;
+   sweep_arm(sw, probe, now);
+}
+
+/* sweep_resend - stage queued retransmissions, flushing as staging fills. */
+static int sweep_resend(struct nbstat_sweep *sw, uint64_t now)
+{
+   struct nbstat_probe *probe;
+
+   while (sw->resend.next != &sw->resend) {
+       probe = (struct nbstat_probe *)sw->resend.next;
+       if (sweep_stage(sw, (int)(probe - sw->probe)) != NBSTAT_EOK) {
+           if (nbstat_engine_flush(&sw->ctx->engine, sweep_txerr, sw) == NBSTAT_EAGAIN)
+               return NBSTAT_EAGAIN;
+           continue;
+       }
+
+       wheel_unlink(&probe->timer);
+       probe->queued = 0;
+       pace_spend(&sw->ctx->pace);
+       stat_add(&sw->ctx->stats.resent, 1);
+       probe->tries++;
+       sweep_arm(sw, probe, now);
+   }
+
+   return NBSTAT_EOK;
+}
+
+/* Ordered access to the words threads hand over to each other */
+#ifdef _WIN32
+#define atomic_load64(p)         ((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(p), 0, 0))
+#define atomic_store64(p, v)     ((void)InterlockedExchange64((volatile LONG64 *)(p), (LONG64)(v)))
+#define atomic_cas64(p, o, n)    ((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(p), (LONG64)(n), (LONG64)(o)) == (o))
+#define atomic_load32(p)         ((uint32_t)InterlockedCompareExchange((volatile LONG *)(p), 0, 0))
+#define atomic_store32(p, v)     ((void)InterlockedExchange((volatile LONG *)(p), (LONG)(v)))
+#else
+#define atomic_load64(p)         __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define atomic_store64(p, v)     __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define atomic_cas64(p, o, n)    __atomic_compare_exchange_n(p, &(o), n, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define atomic_load32(p)         __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define atomic_store32(p, v)     __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#endif
+
+/* mt_sleep */
+static void mt_sleep(int ms)
+{
+#ifdef _WIN32
+   Sleep(ms);
+#else
+   struct timespec ts;
+
+   ts.tv_sec = ms / 1000;
+   ts.tv_nsec = (ms % 1000) * 1000000L;
+   nanosleep(&ts, NULL);
+#endif
+}
+
+/*
+ * Progress reports. While a sweep with a report callback runs, a thread of
+ * its own wakes every interval, sums the counters of the sweeping threads
+ * and hands them to the callback. Every counter has a single writer and is
+ * updated with relaxed atomics, so the send and receive loops take no lock
+ * and do not look at the clock for it.
+ */
+#define NBSTAT_REPORT_STEP 50 /* ms, how soon the reporter notices the end */
+
+struct nbstat_reporter {
+   nbstat_ctx_t *ctx;
+   const struct nbstat_stats *const *st; /* Counters of each sweeping thread */
+   int nst;
+   uint32_t stop;
+   int running;
+#ifdef _WIN32
+   HANDLE thread;
+#else
+   pthread_t thread;
+#endif
+};
+
+/* reporter_loop - thread body. */
+static void reporter_loop(struct nbstat_reporter *r)
+{
+   nbstat_ctx_t *ctx = r->ctx;
+   struct nbstat_stats sum;
+   uint64_t now, due;
+   int i;
+
+   due = nbstat_clock() + ctx->report_every;
+   while (!atomic_load32(&r->stop)) {
+       now = nbstat_clock();
+       if (now < due) {
+           mt_sleep(due - now < NBSTAT_REPORT_STEP ? (int)(due - now) : NBSTAT_REPORT_STEP);
+           continue;
+       }
+
+       memset(&sum, 0x00, sizeof(sum));
+       for (i = 0; i < r->nst; i++)
+           nbstat_stats_add(&sum, r->st[i]);
+       ctx->report(ctx->report_arg, &sum);
+
+       /* A slow callback skips reports rather than bunching them up. */
+       due += ctx->report_every;
+       if (due <= nbstat_clock())
+           due = nbstat_clock() + ctx->report_every;
+   }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI reporter_thread(LPVOID arg)
+{
+   reporter_loop((struct nbstat_reporter *)arg);
+   return 0;
+}
+#else
+static void *reporter_thread(void *arg)
+{
+   reporter_loop((struct nbstat_reporter *)arg);
+   return NULL;
+}
+#endif
+
+/* reporter_start - report on the `nst' counters at st while a sweep runs,
+ * if the context has a report callback. Without a thread there are no
+ * reports, and the sweep goes on. */
+static void reporter_start(struct nbstat_reporter *r, nbstat_ctx_t *ctx, const struct nbstat_stats *const *st, int nst)
+{
+   memset(r, 0x00, sizeof(*r));
+   r->ctx = ctx;
+   r->st = st;
+   r->nst = nst;
+   if (ctx->report == NULL)
+       return;
+
+#ifdef _WIN32
+   r->thread = CreateThread(NULL, 0, reporter_thread, r, 0, NULL);
+   r->running = r->thread != NULL;
+#else
+   r->running = pthread_create(&r->thread, NULL, reporter_thread, r) == 0;
+#endif
+}
+
+/* reporter_stop */
+static void reporter_stop(struct nbstat_reporter *r)
+{
+   if (!r->running)
+       return;
+
+   atomic_store32(&r->stop, 1);
+#ifdef _WIN32
+   WaitForSingleObject(r->thread, INFINITE);
+   CloseHandle(r->thread);
+#else
+   pthread_join(r->thread, NULL);
+#endif
+   r->running = 0;
+}
+
+/* report_tick - hand the statistics to the report callback when it is due,
+ * for the submitted queries, which have no sweep to report from; returns the
+ * ms until the next report, -1 without one. */
+static int report_tick(nbstat_ctx_t *ctx, const struct nbstat_stats *st, uint64_t now)
+{
+   if (ctx->report == NULL)
+       return -1;
+
+   if (now >= ctx->report_due) {
+       ctx->report_due = now + ctx->report_every;
+       ctx->report(ctx->report_arg, st);
+   }
+
+   return (int)(ctx->report_due - now);
+}
+
+/* sweep_init - allocate the slots of a window, all free. */
+static int sweep_init(struct nbstat_sweep *sw, nbstat_ctx_t *ctx, int window)
+{
+   int page;
+   int i;
+
+   memset(sw, 0x00, sizeof(*sw));
+   sw->resend.next = sw->resend.prev = &sw->resend;
+   sw->ctx = ctx;
+
+   for (sw->npage = 1; window > sw->npage * NBSTAT_PAGE_MAX; sw->npage <<= 1)
+       ;
+   sw->pagesize = (window + sw->npage - 1) / sw->npage;
+   sw->window = sw->npage * sw->pagesize;
+
+   sw->probe = calloc(sw->window, sizeof(struct nbstat_probe));
+   sw->free = calloc(sw->npage, sizeof(int));
+   if (sw->probe == NULL || sw->free == NULL) {
+       free(sw->probe);
+       free(sw->free);
+       return NBSTAT_ENOMEM;
+   }
+   for (page = 0; page < sw->npage; page++) {
+       sw->free[page] = page * sw->pagesize;
+       for (i = page * sw->pagesize; i < (page + 1) * sw->pagesize; i++)
+           sw->probe[i].next = i + 1 < (page + 1) * sw->pagesize ? i + 1 : -1;
+   }
+
+   return NBSTAT_EOK;
+}
+
+/* sweep_abort - report whatever is still in flight as failed. */
+static void sweep_abort(struct nbstat_sweep *sw, int result)
+{
+   int i;
+
+   nbstat_engine_discard(&sw->ctx->engine);
+   for (i = 0; sw->inflight > 0 && i < sw->window; i++) {
+       if (sw->probe[i].busy)
+           sweep_finish(sw, i, result, NULL);
+   }
+}
+
+/* sweep_run - query every target the source produces. */
+static int sweep_run(nbstat_ctx_t *ctx, nbstat_target_fn source, void *arg, uint16_t port,
+                     int timeout, int window, nbstat_sweep_fn fn, void *user)
+{
+   const struct nbstat_stats *st = &ctx->stats;
+   struct nbstat_reporter reporter;
+   struct nbstat_sweep sw;
+   uint32_t next = 0;
+   uint64_t now;
+   int have = 0; /* next holds a target not sent yet */
+   int more = 1; /* The source may have more, or is idle */
+   int wrblock = 0;
+   int delay;
+   int budget;
+   int result = NBSTAT_EOK;
+
+   if (ctx->pending > 0)
+       return NBSTAT_EAGAIN;
+   if (timeout > 10000 || timeout <= 0)
+       timeout = 3000;
+   if (window <= 0)
+       window = NBSTAT_WINDOW_DEFAULT;
+   if (window > NBSTAT_WINDOW_MAX)
+       window = NBSTAT_WINDOW_MAX;
+
+   if (sweep_init(&sw, ctx, window) != NBSTAT_EOK)
+       return NBSTAT_ENOMEM;
+   sw.port = port;
+   sw.timeout = timeout;
+   sw.fn = fn;
+   sw.user = user;
+   nbstat_engine_rcvbuf(&ctx->engine, sw.window);
+
+   wheel_advance(&ctx->wheel, nbstat_clock(), sweep_expire, &sw);
+   pace_reset(&ctx->pace, nbstat_clock());
+   reporter_start(&reporter, ctx, &st, 1);
+
+   for (;;) {
+       /* Fill the window, up to the first target whose page is full or the
+        * pacing allows, and submit the staged requests in batches. */
+       now = nbstat_clock();
+       pace_drops(&ctx->pace, &ctx->engine);
+       pace_adjust(&ctx->pace, now);
+       if (sweep_resend(&sw, now) == NBSTAT_EAGAIN)
+           wrblock = 1;
+       if (more == NBSTAT_TARGET_IDLE)
+           more = 1;
+       /* While replies are backed up they are read first: one batch of new
+        * requests per batch read, so sending cannot outrun receiving. */
+       budget = ctx->engine.rxmore ? NBSTAT_TXDEPTH : sw.window;
+       while (!wrblock && budget > 0 && (have || (more == 1 && (have = (more = source(arg, &next)) == 1))) &&
+              sw.free[sweep_page(&sw, next)] >= 0 && pace_ready(&ctx->pace, now)) {
+           if (sweep_send(&sw, next, sw.port, sw.timeout, now) == NBSTAT_EAGAIN) {
+               if (nbstat_engine_flush(&ctx->engine, sweep_txerr, &sw) == NBSTAT_EAGAIN)
+                   wrblock = 1;
+               continue;
+           }
+           have = 0;
+           budget--;
+       }
+       if (nbstat_engine_flush(&ctx->engine, sweep_txerr, &sw) == NBSTAT_EAGAIN)
+           wrblock = 1;
+       if (wrblock)
+           ctx->pace.blocked = 1;
+
+       if (sw.inflight == 0 && !have && !more)
+           break;
+
+       /* Back off briefly while the send buffer is full, and wake up for the
+        * next token while targets are waiting on the pacing. */
+       delay = wheel_next(&ctx->wheel, nbstat_clock());
+       if (wrblock && (delay < 0 || delay > 1))
+           delay = 1;
+       if (have && pace_delay(&ctx->pace) > 0 && (delay < 0 || delay > pace_delay(&ctx->pace)))
+           delay = pace_delay(&ctx->pace);
+       if (more == NBSTAT_TARGET_IDLE && (delay < 0 || delay > NBSTAT_IDLE_MS))
+           delay = NBSTAT_IDLE_MS;
+       if (budget == 0)
+           delay = 0;
+       wrblock = 0;
+
+       if (nbstat_engine_poll(&ctx->engine, delay, sweep_reply, &sw) == SOCKET_ERROR) {
+           result = NBSTAT_EDEBUG;
+           break;
+       }
+
+       wheel_advance(&ctx->wheel, nbstat_clock(), sweep_expire, &sw);
+   }
+
+   /* Anything still in flight after an error is reported as failed. */
+   sweep_abort(&sw, result);
+   reporter_stop(&reporter);
+
+   free(sw.probe);
+   free(sw.free);
+
+   return result;
+}
+
+/* Walks a list of ranges in order. */
+struct nbstat_range_iter {
+   const struct nbstat_range *range;
+   int nrange;
+   int i;
+   uint64_t next;
+};
+
+/* range_next - target source over a list of ranges. */
+static int range_next(void *arg, uint32_t *addr)
+{
+   struct nbstat_range_iter *it = (struct nbstat_range_iter *)arg;
+
+   while (it->i < it->nrange && it->next > it->range[it->i].last) {
+       if (++it->i < it->nrange)
+           it->next = it->range[it->i].first;
+   }
+   if (it->i >= it->nrange)
+       return 0;
+
+   *addr = (uint32_t)it->next++;
+
+   return 1;
+}
+
+/* nbstat_sweep - query every address in the given ranges. */
+int nbstat_sweep(nbstat_ctx_t *ctx, const struct nbstat_range *range, int nrange, uint16_t port,
+                 int timeout, int window, nbstat_sweep_fn fn, void *user)
+{
+   struct nbstat_range_iter it;
+   int i;
+
+   if (ctx == NULL || range == NULL || nrange <= 0 || fn == NULL)
+       return NBSTAT_EINVAL;
+
+   memset(&it, 0x00, sizeof(it));
+   it.range = range;
+   it.nrange = nrange;
+   it.next = range[0].first;
+   for (i = 0; i < nrange; i++) {
+       if (range[i].last >= range[i].first)
+           stat_add(&ctx->stats.total, (uint64_t)range[i].last - range[i].first + 1);
+   }
+
+   return sweep_run(ctx, range_next, &it, port, timeout, window, fn, user);
+}
+
+/* Walks an array of addresses. */
+struct nbstat_list_iter {
+   const uint32_t *addr;
+   size_t count;
+   size_t i;
+};
+
+/* list_next - target source over an array of addresses. */
+static int list_next(void *arg, uint32_t *addr)
+{
+   struct nbstat_list_iter *it = (struct nbstat_list_iter *)arg;
+
+   if (it->i >= it->count)
+       return 0;
+
+   *addr = it->addr[it->i++];
+
+   return 1;
+}
+
+/* nbstat_sweep_list - query every address (host byte order) of an array. */
+int nbstat_sweep_list(nbstat_ctx_t *ctx, const uint32_t *addr, size_t count, uint16_t port,
+                      int timeout, int window, nbstat_sweep_fn fn, void *user)
+{
+   struct nbstat_list_iter it;
+
+   if (ctx == NULL || (addr == NULL && count > 0) || fn == NULL)
+       return NBSTAT_EINVAL;
+
+   it.addr = addr;
+   it.count = count;
+   it.i = 0;
+   stat_add(&ctx->stats.total, count);
+
+   return sweep_run(ctx, list_next, &it, port, timeout, window, fn, user);
+}
+
+/*
+ * Asynchronous queries, for an application with an event loop of its own.
+ * nbstat_submit() stages a request and returns at once; nbstat_poll() sends,
+ * waits for replies and timeouts for a bounded time, and runs the callbacks.
+ * The requests share one set of NBSTAT_ASYNC_WINDOW slots per context, with
+ * the retransmission and pacing of a sweep.
+ */
+#define NBSTAT_ASYNC_WINDOW 4096
+
+/* nbstat_submit - queue a query of one target (host byte order). `fn' is
+ * called exactly once with the result, from nbstat_poll(), or from a later
+ * nbstat_submit() if the request fails to go out. NBSTAT_EAGAIN means all
+ * slots are in use, or the pacing or the send buffer holds the request back;
+ * poll, then submit again. */
+int nbstat_submit(nbstat_ctx_t *ctx, uint32_t addr, uint16_t port, int timeout, nbstat_sweep_fn fn, void *user)
+{
+   struct nbstat_sweep *sw;
+   uint64_t now;
+   int slot;
+
+   if (ctx == NULL || fn == NULL)
+       return NBSTAT_EINVAL;
+   if (timeout > 10000 || timeout <= 0)
+       timeout = 3000;
+
+   now = nbstat_clock();
+   if (ctx->async == NULL) {
+       sw = malloc(sizeof(*sw));
+       if (sw == NULL)
+           return NBSTAT_ENOMEM;
+       if (sweep_init(sw, ctx, NBSTAT_ASYNC_WINDOW) != NBSTAT_EOK ||
+           (sw->async = calloc(sw->window, sizeof(struct nbstat_async))) == NULL) {
+           free(sw->probe);
+           free(sw->free);
+           free(sw);
+           return NBSTAT_ENOMEM;
+       }
+       ctx->async = sw;
+       nbstat_engine_rcvbuf(&ctx->engine, NBSTAT_ASYNC_WINDOW);
+   }
+   sw = ctx->async;
+
+   /* The wheel and the pacing have been idle since the last batch. */
+   if (ctx->pending == 0) {
+       wheel_advance(&ctx->wheel, now, sweep_expire, sw);
+       pace_reset(&ctx->pace, now);
+   }
+   pace_drops(&ctx->pace, &ctx->engine);
+   pace_adjust(&ctx->pace, now);
+   if (sw->free[sweep_page(sw, addr)] < 0 || !pace_ready(&ctx->pace, now))
+       return NBSTAT_EAGAIN;
+
+   slot = sweep_send(sw, addr, port, timeout, now);
+   if (slot == NBSTAT_EAGAIN) {
+       if (nbstat_engine_flush(&ctx->engine, sweep_txerr, sw) == NBSTAT_EAGAIN) {
+           ctx->pace.blocked = 1;
+           return NBSTAT_EAGAIN;
+       }
+       if (sw->free[sweep_page(sw, addr)] < 0 ||
+           (slot = sweep_send(sw, addr, port, timeout, now)) == NBSTAT_EAGAIN)
+           return NBSTAT_EAGAIN;
+   }
+   sw->async[slot].fn = fn;
+   sw->async[slot].user = user;
+   ctx->pending++;
+
+   return NBSTAT_EOK;
+}
+
+/* nbstat_pending - the number of submitted queries without a result yet. */
+int nbstat_pending(const nbstat_ctx_t *ctx)
+{
+   return ctx != NULL ? ctx->pending : 0;
+}
+
+/* nbstat_poll - send what has been submitted and wait up to `timeout' ms (-1
+ * for as long as it takes, 0 not at all) for replies, running the callbacks
+ * of the queries that complete. Returns at once when nothing is pending. */
+int nbstat_poll(nbstat_ctx_t *ctx, int timeout)
+{
+   struct nbstat_sweep *sw;
+   uint64_t now;
+   int wrblock = 0;
+   int delay;
+
+   if (ctx == NULL)
+       return NBSTAT_EINVAL;
+   if (ctx->pending == 0)
+       return NBSTAT_EOK;
+   sw = ctx->async;
+
+   now = nbstat_clock();
+   pace_drops(&ctx->pace, &ctx->engine);
+   pace_adjust(&ctx->pace, now);
+   report_tick(ctx, &ctx->stats, now);
+   if (sweep_resend(sw, now) == NBSTAT_EAGAIN)
+       wrblock = 1;
+   if (nbstat_engine_flush(&ctx->engine, sweep_txerr, sw) == NBSTAT_EAGAIN)
+       wrblock = 1;
+   if (wrblock)
+       ctx->pace.blocked = 1;
+   if (ctx->pending == 0)
+       return NBSTAT_EOK;
+
+   delay = wheel_next(&ctx->wheel, nbstat_clock());
+   if (wrblock && (delay < 0 || delay > 1))
+       delay = 1;
+   if (timeout >= 0 && (delay < 0 || delay > timeout))
+       delay = timeout;
+
+   if (nbstat_engine_poll(&ctx->engine, delay, sweep_reply, sw) == SOCKET_ERROR) {
+       sweep_abort(sw, NBSTAT_EDEBUG);
+       return NBSTAT_EDEBUG;
+   }
+   wheel_advance(&ctx->wheel, nbstat_clock(), sweep_expire, sw);
+
+   /* Retransmissions the timers staged go out now rather than next time. */
+   if (nbstat_engine_flush(&ctx->engine, sweep_txerr, sw) == NBSTAT_EAGAIN)
+       ctx->pace.blocked = 1;
+
+   return NBSTAT_EOK;
+}
+
+/* nbstat_ctx_stats - the statistics the context has counted so far. */
+const struct nbstat_stats *nbstat_ctx_stats(const nbstat_ctx_t *ctx)
+{
+   return &ctx->stats;
+}
+
+/* nbstat_ctx_destroy - queries still pending are reported as timed out. */
+void nbstat_ctx_destroy(nbstat_ctx_t *ctx)
+{
+   if (ctx != NULL) {
+       if (ctx->async != NULL) {
+           sweep_abort(ctx->async, NBSTAT_ETIMEOUT);
+           free(ctx->async->probe);
+           free(ctx->async->free);
+           free(ctx->async->async);
+           free(ctx->async);
+       }
+       /* Close the socket first; that cancels whatever the engine has posted. */
+       closesocket(ctx->sfd);
+       nbstat_engine_close(&ctx->engine);
+       WSACleanup();
+       free(ctx);
+   }
+}
+
+/* parse_spec - parse "a.b.c.d", "a.b.c.d/n" or "a.b.c.d-e.f.g.h"; with `hosts'
+ * set, a block loses its network and broadcast addresses. */
+static int parse_spec(const char *str, struct nbstat_range *range, int hosts)
+{
+   const char *sep;
+   uint32_t addr, mask;
+   int prefix = 32;
+
+   sep = strpbrk(str, "/-");
+   if (nbstat_parse_ipv4(str, sep != NULL ? (size_t)(sep - str) : strlen(str), &addr) != NBSTAT_EOK)
+       return NBSTAT_EINVAL;
+
+   if (sep != NULL && *sep == '-') {
+       range->first = addr;
+       if (nbstat_parse_ipv4(sep + 1, strlen(sep + 1), &range->last) != NBSTAT_EOK || range->last < addr)
+           return NBSTAT_EINVAL;
+       return NBSTAT_EOK;
+   }
+
+   if (sep != NULL) {
+       if (sep[1] < '0' || sep[1] > '9')
+           return NBSTAT_EINVAL;
+       prefix = atoi(sep + 1);
+       if (prefix < 0 || prefix > 32)
+           return NBSTAT_EINVAL;
+   }
+
+   mask = prefix == 0 ? 0 : 0xffffffffU << (32 - prefix);
+   range->first = addr & mask;
+   range->last = addr | ~mask;
+
+   /* Skip the network and broadcast addresses of real subnets. */
+   if (hosts && prefix < 31) {
+       range->first++;
+       range->last--;
+   }
+
+   return NBSTAT_EOK;
+}
+
+/* nbstat_parse_range - parse "a.b.c.d", "a.b.c.d/n" or "a.b.c.d-e.f.g.h". */
+int nbstat_parse_range(const char *str, struct nbstat_range *range)
+{
+   return parse_spec(str, range, 1);
+}
+
+/*
+ * Target generator. Targets come from ranges given up front, then from a file
+ * read one line at a time, minus an exclusion list. Nothing is expanded in
+ * memory. The ranges are numbered 0..total-1; in random order, index n maps
+ * to x = start * g^n mod p, with p the first prime above the total and g a
+ * primitive root, which visits every x in 1..p-1 once (masscan does the
+ * same). Values of x above the total are skipped. A cursor can seek to any n,
+ * so workers can split the sequence between them. The file is always read in
+ * order, after the ranges.
+ */
+
+/* Position in the target sequence */
+struct nbstat_cursor {
+   uint64_t n;       /* Next index */
+   uint64_t x;       /* start * g^n mod p, random order only */
+   int range;        /* Range holding the next target, sequential order */
+};
+
+struct nbstat_targets {
+   struct nbstat_range *range;
+   uint32_t *base;   /* Number of the first target of each range */
+   int nrange;
+   int maxrange;
+   uint64_t total;
+   struct nbstat_range *exclude; /* Sorted and merged once frozen */
+   int nexclude;
+   int maxexclude;
+   FILE *fp;         /* Line source, read after the ranges; may be NULL */
+   struct nbstat_range line; /* Targets left from the current line */
+   int haveline;
+   unsigned long bad; /* Lines that did not parse */
+   int shuffle;
+   uint32_t seed;
+   uint64_t prime;
+   uint64_t gen;
+   uint64_t start;
+   uint64_t span;    /* Number of indices: total, or prime - 1 */
+   int frozen;
+   struct nbstat_cursor cur; /* For nbstat_targets_next() */
+   nbstat_skip_fn skip;
+   void *skiparg;
+};
+
+/* nbstat_targets_create */
+int nbstat_targets_create(nbstat_targets_t **targets)
+{
+   if (targets == NULL)
+       return NBSTAT_EINVAL;
+
+   *targets = calloc(1, sizeof(nbstat_targets_t));
+   if (*targets == NULL)
+       return NBSTAT_ENOMEM;
+
+   return NBSTAT_EOK;
+}
+
+/* nbstat_targets_destroy - release the generator; the file is not closed. */
+void nbstat_targets_destroy(nbstat_targets_t *targets)
+{
+   if (targets != NULL) {
+       free(targets->range);
+       free(targets->base);
+       free(targets->exclude);
+       free(targets);
+   }
+}
+
+/* range_push - append to a growable range list. */
+static int range_push(struct nbstat_range **list, int *n, int *max, const struct nbstat_range *range)
+{
+   struct nbstat_range *p;
+
+   if (*n == *max) {
+       p = realloc(*list, (*max != 0 ? 2 * *max : 16) * sizeof(struct nbstat_range));
+       if (p == NULL)
+           return NBSTAT_ENOMEM;
+       *list = p;
+       *max = *max != 0 ? 2 * *max : 16;
+   }
+   (*list)[(*n)++] = *range;
+
+   return NBSTAT_EOK;
+}
+
+/* nbstat_targets_add - add an address, CIDR block or a-b range. */
+int nbstat_targets_add(nbstat_targets_t *targets, const char *spec)
+{
+   struct nbstat_range range;
+
+   if (targets == NULL || spec == NULL || targets->frozen)
+       return NBSTAT_EINVAL;
+   if (nbstat_parse_range(spec, &range) != NBSTAT_EOK)
+       return NBSTAT_EINVAL;
+
+   return range_push(&targets->range, &targets->nrange, &targets->maxrange, &range);
+}
+
+/* nbstat_targets_exclude - never produce the addresses of `spec'. */
+int nbstat_targets_exclude(nbstat_targets_t *targets, const char *spec)
+{
+   struct nbstat_range range;
+
+   if (targets == NULL || spec == NULL || targets->frozen)
+       return NBSTAT_EINVAL;
+   if (parse_spec(spec, &range, 0) != NBSTAT_EOK)
+       return NBSTAT_EINVAL;
+
+   return range_push(&targets->exclude, &targets->nexclude, &targets->maxexclude, &range);
+}
+
+/* nbstat_targets_file - read further targets from `fp', one spec per line,
+ * after the ranges. Blank lines and # comments are skipped. */
+int nbstat_targets_file(nbstat_targets_t *targets, FILE *fp)
+{
+   if (targets == NULL || fp == NULL || targets->frozen || targets->fp != NULL)
+       return NBSTAT_EINVAL;
+
+   targets->fp = fp;
+
+   return NBSTAT_EOK;
+}
+
+/* nbstat_targets_shuffle - produce the ranges in a random order. */
+int nbstat_targets_shuffle(nbstat_targets_t *targets, uint32_t seed)
+{
+   if (targets == NULL || targets->frozen)
+       return NBSTAT_EINVAL;
+
+   targets->shuffle = 1;
+   targets->seed = seed;
+
+   return NBSTAT_EOK;
+}
+
+/* nbstat_targets_skip - consult fn for every target before it is probed. */
+void nbstat_targets_skip(nbstat_targets_t *targets, nbstat_skip_fn fn, void *arg)
+{
+   targets->skip = fn;
+   targets->skiparg = arg;
+}
+
+/* nbstat_targets_bad - lines of the target file that were skipped. */
+unsigned long nbstat_targets_bad(const nbstat_targets_t *targets)
+{
+   return targets != NULL ? targets->bad : 0;
+}
+
+/* line_spec - read one spec from a file per line; 0 at the end of the file. */
+static int line_spec(nbstat_targets_t *t, struct nbstat_range *range)
+{
+   char line[256];
+   char *p, *q;
+
+   while (fgets(line, sizeof(line), t->fp) != NULL) {
+       /* Drop the rest of an overlong line. */
+       if (strchr(line, '\n') == NULL && !feof(t->fp)) {
+           while (fgets(line, sizeof(line), t->fp) != NULL && strchr(line, '\n') == NULL)
+               ;
+           t->bad++;
+           continue;
+       }
+
+       for (p = line; *p == ' ' || *p == '\t'; p++)
+           ;
+       for (q = p; *q != '\0' && *q != '#' && *q != ' ' && *q != '\t' && *q != '\r' && *q != '\n'; q++)
+           ;
+       if (q == p)
+           continue;
+       *q = '\0';
+
+       if (nbstat_parse_range(p, range) == NBSTAT_EOK)
+           return 1;
+       t->bad++;
+   }
+
+   return 0;
+}
+
+/* range_cmp - qsort order of ranges */
+static int range_cmp(const void *a, const void *b)
+{
+   const struct nbstat_range *x = (const struct nbstat_range *)a;
+   const struct nbstat_range *y = (const struct nbstat_range *)b;
+
+   return x->first < y->first ? -1 : x->first > y->first;
+}
+
+/* targets_excluded - binary search in the merged exclusion list. */
+static int targets_excluded(const nbstat_targets_t *t, uint32_t addr)
+{
+   int a = 0, b = t->nexclude - 1, m;
+
+   while (a <= b) {
+       m = (a + b) / 2;
+       if (addr < t->exclude[m].first)
+           b = m - 1;
+       else if (addr > t->exclude[m].last)
+           a = m + 1;
+       else
+           return 1;
+   }
+
+   return 0;
+}
+
+/* targets_keep - not excluded, and not left out by the skip callback */
+static int targets_keep(const nbstat_targets_t *t, uint32_t addr)
+{
+   if (t->nexclude > 0 && targets_excluded(t, addr))
+       return 0;
+
+   return t->skip == NULL || !t->skip(t->skiparg, addr);
+}
+
+/* mulmod - a * b mod m, for a, b < m < 2^32. */
+static uint64_t mulmod(uint64_t a, uint64_t b, uint64_t m)
+{
+   return a * b % m;
+}
+
+/* powmod - b^e mod m */
+static uint64_t powmod(uint64_t b, uint64_t e, uint64_t m)
+{
+   uint64_t r = 1;
+
+   for (b %= m; e > 0; e >>= 1) {
+       if (e & 1)
+           r = mulmod(r, b, m);
+       b = mulmod(b, b, m);
+   }
+
+   return r;
+}
+
+/* is_prime - trial division, fine below 2^32. */
+static int is_prime(uint64_t n)
+{
+   uint64_t d;
+
+   if (n < 2 || n % 2 == 0)
+       return n == 2;
+   for (d = 3; d * d <= n; d += 2) {
+       if (n % d == 0)
+           return 0;
+   }
+
+   return 1;
+}
+
+/* is_generator - whether g generates the multiplicative group mod prime p. */
+static int is_generator(uint64_t g, uint64_t p)
+{
+   uint64_t n = p - 1, q;
+
+   for (q = 2; q * q <= n; q++) {
+       if (n % q != 0)
+           continue;
+       if (powmod(g, (p - 1) / q, p) == 1)
+           return 0;
+       while (n % q == 0)
+           n /= q;
+   }
+
+   return n == 1 || powmod(g, (p - 1) / n, p) != 1;
+}
+
+/* xorshift32 */
+static uint32_t xorshift32(uint32_t *state)
+{
+   uint32_t x = *state;
+
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+
+   return *state = x;
+}
+
+/* cursor_seek - position a cursor at index n. */
+static void cursor_seek(const nbstat_targets_t *t, struct nbstat_cursor *c, uint64_t n)
+{
+   int a, b, m;
+
+   c->n = n;
+   if (t->shuffle) {
+       c->x = mulmod(t->start, powmod(t->gen, n, t->prime), t->prime);
+       return;
+   }
+
+   /* The last range whose first target number is <= n. */
+   for (a = 0, b = t->nrange - 1; a < b; ) {
+       m = (a + b + 1) / 2;
+       if (t->base[m] <= n)
+           a = m;
+       else
+           b = m - 1;
+   }
+   c->range = a;
+}
+
+/* range_lookup - the address of target number i. */
+static uint32_t range_lookup(const nbstat_targets_t *t, uint64_t i)
+{
+   int a = 0, b = t->nrange - 1, m;
+
+   while (a < b) {
+       m = (a + b + 1) / 2;
+       if (t->base[m] <= i)
+           a = m;
+       else
+           b = m - 1;
+   }
+
+   return t->range[a].first + (uint32_t)(i - t->base[a]);
+}
+
+/* cursor_step - the address of the next target before index `end', kept or not. */
+static int cursor_step(const nbstat_targets_t *t, struct nbstat_cursor *c, uint64_t end, uint32_t *addr)
+{
+   uint64_t i;
+
+   while (c->n < end) {
+       c->n++;
+       if (t->shuffle) {
+           i = c->x - 1;
+           c->x = mulmod(c->x, t->gen, t->prime);
+           if (i >= t->total)
+               continue;
+           *addr = range_lookup(t, i);
+       } else {
+           i = c->n - 1;
+           while (c->range + 1 < t->nrange && t->base[c->range + 1] <= i)
+               c->range++;
+           *addr = t->range[c->range].first + (uint32_t)(i - t->base[c->range]);
+       }
+       return 1;
+   }
+
+   return 0;
+}
+
+/* cursor_next - the next target before index `end', skipping exclusions. */
+static int cursor_next(const nbstat_targets_t *t, struct nbstat_cursor *c, uint64_t end, uint32_t *addr)
+{
+   while (cursor_step(t, c, end, addr)) {
+       if (targets_keep(t, *addr))
+           return 1;
+   }
+
+   return 0;
+}
+
+/* targets_freeze - number the ranges and set up the order; no more changes. */
+static int targets_freeze(nbstat_targets_t *t)
+{
+   uint32_t state;
+   int i, j;
+
+   if (t->frozen)
+       return NBSTAT_EOK;
+
+   t->base = calloc(t->nrange + 1, sizeof(uint32_t));
+   if (t->base == NULL)
+       return NBSTAT_ENOMEM;
+   for (i = 0; i < t->nrange; i++) {
+       t->base[i] = (uint32_t)t->total;
+       t->total += (uint64_t)t->range[i].last - t->range[i].first + 1;
+       /* Target numbers are 32 bits wide. */
+       if (t->total > 0xffffffffU)
+           return NBSTAT_EINVAL;
+   }
+   /* So is the group, and 2^32 - 5 is the largest prime below 2^32. */
+   if (t->shuffle && t->total >= 0xfffffffbU)
+       return NBSTAT_EINVAL;
+
+   if (t->nexclude > 0) {
+       qsort(t->exclude, t->nexclude, sizeof(struct nbstat_range), range_cmp);
+       for (i = 0, j = 1; j < t->nexclude; j++) {
+           if (t->exclude[j].first <= t->exclude[i].last + (uint64_t)1) {
+               if (t->exclude[j].last > t->exclude[i].last)
+                   t->exclude[i].last = t->exclude[j].last;
+           } else {
+               t->exclude[++i] = t->exclude[j];
+           }
+       }
+       t->nexclude = i + 1;
+   }
+
+   t->span = t->total;
+   if (t->shuffle && t->total > 1) {
+       for (t->prime = t->total > 4 ? t->total + 1 : 5; !is_prime(t->prime); t->prime++)
+           ;
+       /* Spread nearby seeds apart (murmur3 finalizer). */
+       state = t->seed ^ 0x9e3779b9U;
+       state = (state ^ state >> 16) * 0x85ebca6bU;
+       state = (state ^ state >> 13) * 0xc2b2ae35U;
+       state ^= state >> 16;
+       if (state == 0)
+           state = 0x9e3779b9U;
+       do {
+           t->gen = 2 + xorshift32(&state) % (t->prime - 3);
+       } while (!is_generator(t->gen, t->prime));
+       t->start = 1 + xorshift32(&state) % (t->prime - 1);
+       t->span = t->prime - 1;
+   } else {
+       t->shuffle = 0;
+   }
+
+   cursor_seek(t, &t->cur, 0);
+   t->frozen = 1;
+
+   return NBSTAT_EOK;
+}
+
+/* targets_planned - how many targets the ranges hold, less the excluded
+ * ones, for the progress reports; 0 (not known) with a line file. Those the
+ * skip callback leaves out only turn up as the sweep meets them. */
+static uint64_t targets_planned(const nbstat_targets_t *t)
+{
+   uint64_t n = t->total;
+   uint32_t lo, hi;
+   int i, a, b, m;
+
+   if (t->fp != NULL)
+       return 0;
+
+   for (i = 0; i < t->nrange; i++) {
+       /* The first exclusion that does not end before the range. */
+       for (a = 0, b = t->nexclude; a < b; ) {
+           m = (a + b) / 2;
+           if (t->exclude[m].last < t->range[i].first)
+               a = m + 1;
+           else
+               b = m;
+       }
+       for (; a < t->nexclude && t->exclude[a].first <= t->range[i].last; a++) {
+           lo = t->exclude[a].first > t->range[i].first ? t->exclude[a].first : t->range[i].first;
+           hi = t->exclude[a].last < t->range[i].last ? t->exclude[a].last : t->range[i].last;
+           n -= (uint64_t)hi - lo + 1;
+       }
+   }
+
+   return n;
+}
+
+/* nbstat_targets_next - target source: the ranges, then the file lines. */
+int nbstat_targets_next(void *arg, uint32_t *addr)
+{
+   nbstat_targets_t *t = (nbstat_targets_t *)arg;
+
+   if (t->nrange > 0 && cursor_next(t, &t->cur, t->span, addr))
+       return 1;
+
+   while (t->fp != NULL) {
+       if (!t->haveline && !(t->haveline = line_spec(t, &t->line)))
+           return 0;
+
+       *addr = t->line.first;
+       if (t->line.first++ == t->line.last)
+           t->haveline = 0;
+       if (targets_keep(t, *addr))
+           return 1;
+   }
+
+   return 0;
+}
+
+/* nbstat_sweep_targets - nbstat_sweep() over a target generator. */
+int nbstat_sweep_targets(nbstat_ctx_t *ctx, nbstat_targets_t *targets, uint16_t port,
+                         int timeout, int window, nbstat_sweep_fn fn, void *user)
+{
+   int result;
+
+   if (ctx == NULL || targets == NULL || fn == NULL)
+       return NBSTAT_EINVAL;
+
+   result = targets_freeze(targets);
+   if (result != NBSTAT_EOK)
+       return result;
+   stat_add(&ctx->stats.total, targets_planned(targets));
+
+   return sweep_run(ctx, nbstat_targets_next, targets, port, timeout, window, fn, user);
+}
+
+/*
+ * Multi-threaded sweep. Each worker runs sweep_run() on a context of its own,
+ * so sockets, engines, timer wheels and RTT estimators are never shared. The
+ * index space of the target generator is split evenly into one span per
+ * worker. A worker claims chunks from the front of its own span with
+ * a compare-and-swap; once that runs dry it steals the upper half of the
+ * largest span left. Results go through one single-producer ring per worker
+ * to the calling thread, which runs the callback. No locks are taken.
+ *
+ * With several source addresses the workers form one group per source, each
+ * splitting the whole index space between its own workers and keeping the
+ * targets routed to its source; stealing stays within the group.
+ */
+
+#define NBSTAT_THREADS_MAX 64
+#define NBSTAT_CHUNK       64   /* Targets claimed at a time */
+#define NBSTAT_RING_SIZE   1024 /* Results buffered per worker, power of two */
+
+/* Span of target numbers [lo, hi), packed as lo << 32 | hi for one CAS. */
+#define SPAN(lo, hi)  ((uint64_t)(lo) << 32 | (uint32_t)(hi))
+#define SPAN_LO(s)    ((uint32_t)((s) >> 32))
+#define SPAN_HI(s)    ((uint32_t)(s))
+
+/* Result handed from a worker to the calling thread */
+struct nbstat_result {
+   int result;
+   struct sockaddr_in sin;
+   size_t length;    /* Datagram bytes, 0 unless result is NBSTAT_EOK */
+   uint8_t data[576];
+};
+
+/* Single-producer, single-consumer result ring */
+struct nbstat_ring {
+   uint32_t head;    /* Written by the worker */
+   char pad1[60];
+   uint32_t tail;    /* Written by the consumer */
+   char pad2[60];
+   struct nbstat_result slot[NBSTAT_RING_SIZE];
+};
+
+struct nbstat_mt;
+
+/* Worker state */
+struct nbstat_worker {
+   uint64_t span;    /* Unclaimed targets; others steal from it */
+   char pad[56];
+   struct nbstat_mt *mt;
+   int id;
+   int group;        /* Source the worker sends from */
+   nbstat_ctx_t *ctx;
+   struct nbstat_cursor cur; /* Claimed chunk [cur.n, end) */
+   uint64_t end;
+   struct nbstat_ring *ring;
+   int result;
+   uint32_t done;    /* Set when the worker has returned */
+#ifdef _WIN32
+   HANDLE thread;
+#else
+   pthread_t thread;
+#endif
+};
+
+/* Multi-threaded sweep state */
+struct nbstat_mt {
+   const nbstat_targets_t *targets;
+   uint16_t port;
+   int timeout;
+   int window;       /* Per worker */
+   struct nbstat_worker *worker;
+   int nworker;
+   const struct nbstat_source *src;
+   int nsrc;
+};
+
+/* mt_steal - move the upper half of the largest other span into our own. */
+static int mt_steal(struct nbstat_worker *w)
+{
+   struct nbstat_mt *mt = w->mt;
+   struct nbstat_worker *victim;
+   uint64_t span;
+   uint32_t lo, hi, mid, best;
+   int i, v;
+
+   for (;;) {
+       best = 0;
+       v = -1;
+       for (i = 0; i < mt->nworker; i++) {
+           span = atomic_load64(&mt->worker[i].span);
+           if (i != w->id && mt->worker[i].group == w->group &&
+               SPAN_HI(span) - SPAN_LO(span) > best && SPAN_LO(span) < SPAN_HI(span)) {
+               best = SPAN_HI(span) - SPAN_LO(span);
+               v = i;
+           }
+       }
+       if (v < 0)
+           return 0;
+
+       victim = &mt->worker[v];
+       span = atomic_load64(&victim->span);
+       lo = SPAN_LO(span);
+       hi = SPAN_HI(span);
+       if (lo >= hi)
+           continue;
+
+       /* Leave a lone chunk to its owner, take it all if that is all there is. */
+       mid = hi - lo > NBSTAT_CHUNK ? lo + (hi - lo) / 2 : lo;
+       if (atomic_cas64(&victim->span, span, SPAN(lo, mid))) {
+           atomic_store64(&w->span, SPAN(mid, hi));
+           return 1;
+       }
+   }
+}
+
+/* mt_claim - claim the next chunk of targets, stealing when out of work. */
+static int mt_claim(struct nbstat_worker *w)
+{
+   uint64_t span;
+   uint32_t lo, hi, n;
+
+   for (;;) {
+       span = atomic_load64(&w->span);
+       lo = SPAN_LO(span);
+       hi = SPAN_HI(span);
+       if (lo >= hi) {
+           if (!mt_steal(w))
+               return 0;
+           continue;
+       }
+
+       n = hi - lo < NBSTAT_CHUNK ? hi - lo : NBSTAT_CHUNK;
+       if (atomic_cas64(&w->span, span, SPAN(lo + n, hi)))
+           break;
+   }
+
+   cursor_seek(w->mt->targets, &w->cur, lo);
+   w->end = (uint64_t)lo + n;
+
+   return 1;
+}
+
+/* mt_route - the source a target goes out from: the one on its subnet, else
+ * one picked by a hash of the address. */
+static int mt_route(const struct nbstat_mt *mt, uint32_t addr)
+{
+   int i;
+
+   for (i = 0; i < mt->nsrc; i++) {
+       if (mt->src[i].mask != 0 && ((addr ^ mt->src[i].addr) & mt->src[i].mask) == 0)
+           return i;
+   }
+
+   return (int)(((uint64_t)(uint32_t)(addr * 2654435761U) * mt->nsrc) >> 32);
+}
+
+/* mt_next - target source of a worker. */
+static int mt_next(void *arg, uint32_t *addr)
+{
+   struct nbstat_worker *w = (struct nbstat_worker *)arg;
+
+   /* Every source group walks the whole span: route before the skip
+    * callback, so that only the group sending to an address asks it. */
+   for (;;) {
+       while (!cursor_step(w->mt->targets, &w->cur, w->end, addr)) {
+           if (!mt_claim(w))
+               return 0;
+       }
+       if ((w->mt->nsrc == 1 || mt_route(w->mt, *addr) == w->group) && targets_keep(w->mt->targets, *addr))
+           return 1;
+   }
+}
+
+/* mt_report - sweep callback of a worker: queue the result for the caller. */
+static void mt_report(void *user, int result, const struct sockaddr_in *sin, const nbstat_view_t *view)
+{
+   struct nbstat_worker *w = (struct nbstat_worker *)user;
+   struct nbstat_ring *ring = w->ring;
+   struct nbstat_result *r;
+   uint32_t head = ring->head;
+
+   /* Full: the consumer only prints, so it will catch up shortly. */
+   while (head - atomic_load32(&ring->tail) >= NBSTAT_RING_SIZE)
+       mt_sleep(0);
+
+   r = &ring->slot[head & (NBSTAT_RING_SIZE - 1)];
+   r->result = result;
+   r->sin = *sin;
+   r->length = view != NULL ? view->length : 0;
+   if (r->length > 0)
+       memcpy(r->data, view->data, r->length);
+
+   atomic_store32(&ring->head, head + 1);
+}
+
+/* mt_worker - thread body. */
+static void mt_worker(struct nbstat_worker *w)
+{
+   struct nbstat_mt *mt = w->mt;
+
+   w->result = sweep_run(w->ctx, mt_next, w, mt->port, mt->timeout, mt->window, mt_report, w);
+   atomic_store32(&w->done, 1);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI mt_thread(LPVOID arg)
+{
+   mt_worker((struct nbstat_worker *)arg);
+   return 0;
+}
+#else
+static void *mt_thread(void *arg)
+{
+   mt_worker((struct nbstat_worker *)arg);
+   return NULL;
+}
+#endif
+
+/* mt_drain - run the callback on everything the workers have queued. */
+static int mt_drain(struct nbstat_mt *mt, nbstat_sweep_fn fn, void *user)
+{
+   struct nbstat_ring *ring;
+   struct nbstat_result *r;
+   nbstat_view_t view;
+   buffer_t buffer;
+   uint32_t head, tail;
+   int n = 0;
+   int i;
+
+   for (i = 0; i < mt->nworker; i++) {
+       ring = mt->worker[i].ring;
+       head = atomic_load32(&ring->head);
+       for (tail = ring->tail; tail != head; tail++, n++) {
+           r = &ring->slot[tail & (NBSTAT_RING_SIZE - 1)];
+           if (r->result == NBSTAT_EOK) {
+               buffer.data = r->data;
+               buffer.size = sizeof(r->data);
+               buffer.length = r->length;
+               nbstat_view_init(&view, &buffer);
+               fn(user, r->result, &r->sin, &view);
+           } else {
+               fn(user, r->result, &r->sin, NULL);
+           }
+       }
+       atomic_store32(&ring->tail, tail);
+   }
+
+   return n;
+}
+
+/* mt_free */
+static void mt_free(struct nbstat_mt *mt)
+{
+   int i;
+
+   for (i = 0; i < mt->nworker; i++) {
+       nbstat_ctx_destroy(mt->worker[i].ctx);
+       free(mt->worker[i].ring);
+   }
+   free(mt->worker);
+}
+
+/* nbstat_sweep_mt - nbstat_sweep_targets() on `nthreads' workers, at least
+ * one per source address. Settings are taken from ctx, whose rate cap is
+ * shared out between the workers; `window' is the total. The callback runs
+ * on the calling thread. A target file cannot be split lock-free, so with one
+ * the sweep runs on ctx alone, from its first source. */
+int nbstat_sweep_mt(nbstat_ctx_t *ctx, nbstat_targets_t *targets, uint16_t port,
+                    int timeout, int window, int nthreads, nbstat_sweep_fn fn, void *user)
+{
+   const struct nbstat_stats *st[NBSTAT_THREADS_MAX + 1];
+   struct nbstat_reporter reporter;
+   struct nbstat_worker *w;
+   struct nbstat_mt mt;
+   uint64_t total;
+   int result = NBSTAT_EOK;
+   int started = 0;
+   int nsrc, per, j;
+   int done;
+   int i;
+
+   if (ctx == NULL || targets == NULL || fn == NULL)
+       return NBSTAT_EINVAL;
+   nsrc = ctx->nsrc > 1 ? ctx->nsrc : 1;
+   if ((nthreads <= 1 && nsrc == 1) || targets->fp != NULL)
+       return nbstat_sweep_targets(ctx, targets, port, timeout, window, fn, user);
+   if (ctx->pending > 0)
+       return NBSTAT_EAGAIN;
+   if (nthreads < nsrc)
+       nthreads = nsrc;
+   if (nthreads > NBSTAT_THREADS_MAX)
+       nthreads = NBSTAT_THREADS_MAX;
+   per = nthreads / nsrc;
+   nthreads = per * nsrc;
+   if (window <= 0)
+       window = NBSTAT_WINDOW_DEFAULT;
+
+   result = targets_freeze(targets);
+   if (result != NBSTAT_EOK)
+       return result;
+   total = targets->span;
+   stat_add(&ctx->stats.total, targets_planned(targets));
+
+   memset(&mt, 0x00, sizeof(mt));
+   mt.targets = targets;
+   mt.port = port;
+   mt.timeout = timeout;
+   mt.window = (window + nthreads - 1) / nthreads;
+   mt.src = ctx->src;
+   mt.nsrc = nsrc;
+
+   mt.worker = calloc(nthreads, sizeof(struct nbstat_worker));
+   if (mt.worker == NULL)
+       return NBSTAT_ENOMEM;
+   mt.nworker = nthreads;
+
+   for (i = 0; i < nthreads; i++) {
+       w = &mt.worker[i];
+       w->mt = &mt;
+       w->id = i;
+       w->group = i % nsrc;
+       j = i / nsrc;
+       w->span = SPAN(total * j / per, total * (j + 1) / per);
+
+       w->ring = calloc(1, sizeof(struct nbstat_ring));
+       if (w->ring == NULL) {
+           mt_free(&mt);
+           return NBSTAT_ENOMEM;
+       }
+       result = nbstat_ctx_create(&w->ctx);
+       if (result != NBSTAT_EOK) {
+           mt_free(&mt);
+           return result;
+       }
+       if (ctx->nsrc > 0)
+           result = nbstat_ctx_bind(w->ctx, ctx->src[w->group].addr, 0);
+       if (result != NBSTAT_EOK) {
+           mt_free(&mt);
+           return result;
+       }
+       w->ctx->retries = ctx->retries;
+       w->ctx->trn_key = ctx->trn_key;
+       if (ctx->pace.limit != 0)
+           w->ctx->pace.limit = ctx->pace.limit / nthreads > 0 ? ctx->pace.limit / nthreads : 1;
+   }
+
+   for (i = 0; i < nthreads; i++) {
+       w = &mt.worker[i];
+#ifdef _WIN32
+       w->thread = CreateThread(NULL, 0, mt_thread, w, 0, NULL);
+       if (w->thread == NULL)
+#else
+       if (pthread_create(&w->thread, NULL, mt_thread, w) != 0)
+#endif
+           break;
+       started++;
+   }
+
+   /* Workers that failed to start leave their span to be stolen within their group. */
+   if (started == 0) {
+       mt_free(&mt);
+       return NBSTAT_EDEBUG;
+   }
+   for (i = started; i < nthreads; i++)
+       mt.worker[i].done = 1;
+
+   /* Reports over all workers, reading their counters as they run. */
+   st[0] = &ctx->stats;
+   for (i = 0; i < started; i++)
+       st[i + 1] = &mt.worker[i].ctx->stats;
+   reporter_start(&reporter, ctx, st, started + 1);
+
+   do {
+       for (done = 1, i = 0; i < started; i++)
+           done &= atomic_load32(&mt.worker[i].done);
+       if (mt_drain(&mt, fn, user) == 0 && !done)
+           mt_sleep(1);
+   } while (!done);
+   mt_drain(&mt, fn, user);
+   reporter_stop(&reporter);
+
+   result = NBSTAT_EOK;
+   for (i = 0; i < started; i++) {
+#ifdef _WIN32
+       WaitForSingleObject(mt.worker[i].thread, INFINITE);
+       CloseHandle(mt.worker[i].thread);
+#else
+       pthread_join(mt.worker[i].thread, NULL);
+#endif
+       if (mt.worker[i].result != NBSTAT_EOK)
+           result = mt.worker[i].result;
+       nbstat_stats_add(&ctx->stats, &mt.worker[i].ctx->stats);
+   }
+   /* Sources whose workers all failed to start had their targets left out. */
+   if (started < nsrc && result == NBSTAT_EOK)
+       result = NBSTAT_EDEBUG;
+
+   mt_free(&mt);
+
+   return result;
+}
+
+/*
+ * Name query mode. NetBIOS names are resolved to addresses with NAME QUERY
+ * requests (QTYPE_NB), sent to an NBNS (WINS) server or to a broadcast
+ * address, up to `window' at a time on the context's engine; the slot index
+ * is the transaction ID. A server answers each name once and retransmissions
+ * back off on its RTT estimate. With broadcast every owner of the name may
+ * answer, so each query runs to its timeout, repeated every
+ * NBSTAT_BCAST_RETRY ms as RFC 1002 has it.
+ */
+
+#define NBSTAT_BCAST_RETRY 250
+#define NBSTAT_NB_MAX      ((576 - 12 - 44) / 6) /* Owners in one answer */
+#define NBSTAT_WACK_MAX    60   /* s, longest wait a WACK may ask for */
+
+/* In-flight name query */
+struct nbstat_nq {
+   struct nbstat_timer timer; /* Must be first */
+   uint8_t name[16];
+   uint64_t sent;
+   uint64_t sent_us;
+   uint64_t deadline;
+   int tries;
+   int rto;                   /* Of the current attempt, 0 if the deadline cuts it short */
+   int answers;
+   int busy;
+   int next;                  /* Free list link */
+};
+
+struct nbstat_names {
+   nbstat_ctx_t *ctx;
+   struct nbstat_wheel *wheel; /* The context's, unless another loop shares it */
+   struct sockaddr_in to;
+   int bcast;
+   int timeout;
+   struct nbstat_nq *nq;
+   int window;
+   int base;                   /* Transaction ID and send tag of slot 0 */
+   int free;
+   int inflight;
+   const uint8_t *names;       /* Waiting to be asked, 16 bytes each */
+   size_t count;
+   size_t next;
+   nbstat_name_fn fn;
+   void *user;
+};
+
+/* nbname_query_init - a name query for the first-level name `name'. */
+static void nbname_query_init(struct nbstat_query *query, const uint8_t *name, int bcast)
+{
+   nbstat_query_init(query, 0);
+
+   /* Ask a server to recurse, as a name query always does (RFC 1002 4.2.12). */
+   query->hdr.rd = 1;
+   query->hdr.b = bcast ? 1 : 0;
+   netbios_encode_name((char *)query->question.q_name, (const char *)name, 0x20);
+   query->question.q_type = QTYPE_NB;
+}
+
+/* names_stage - stage the request of slot i. */
+static int names_stage(struct nbstat_names *nm, int i)
+{
+   struct nbstat_query query;
+   buffer_t buffer;
+   uint8_t *data;
+
+   data = nbstat_engine_stage(&nm->ctx->engine, NBSTAT_REQUEST_SIZE, &nm->to, nm->base + i);
+   if (data == NULL)
+       return NBSTAT_EAGAIN;
+
+   nbname_query_init(&query, nm->nq[i].name, nm->bcast);
+   query.hdr.name_trn_id = (uint16_t)(nm->base + i);
+   buffer_init(&buffer, data, NBSTAT_REQUEST_SIZE);
+   nbstat_encode_request(&buffer, &query);
+
+   return NBSTAT_EOK;
+}
+
+/* names_arm - next retransmission, or the end of the query */
+static void names_arm(struct nbstat_names *nm, struct nbstat_nq *q, uint64_t now)
+{
+   uint64_t expires;
+
+   q->rto = 0;
+   if (nm->bcast)
+       expires = now + NBSTAT_BCAST_RETRY;
+   else
+       expires = rtt_arm(nm->ctx, nm->to.sin_addr.s_addr, now, q->deadline, q->tries >= nm->ctx->retries, &q->rto);
+   wheel_add(nm->wheel, &q->timer, expires < q->deadline ? expires : q->deadline);
+}
+
+/* names_finish - free the slot of a query that is over. */
+static void names_finish(struct nbstat_names *nm, int i)
+{
+   struct nbstat_nq *q = &nm->nq[i];
+
+   wheel_del(nm->wheel, &q->timer);
+   q->busy = 0;
+   q->next = nm->free;
+   nm->free = i;
+   nm->inflight--;
+}
+
+/* names_txerr - a request could not be sent. */
+static void names_txerr(void *user, int tag, const struct sockaddr_in *to, int err)
+{
+   struct nbstat_names *nm = (struct nbstat_names *)user;
+
+   tag -= nm->base;
+   if (tag >= 0 && tag < nm->window && nm->nq[tag].busy) {
+       nm->fn(nm->user, stats_result(&nm->ctx->stats, NBSTAT_ESOCKET), nm->nq[tag].name, &nm->to, NULL, 0);
+       names_finish(nm, tag);
+   }
+}
+
+/* names_expire - retransmit, or give up. */
+static void names_expire(void *user, struct nbstat_timer *timer)
+{
+   struct nbstat_names *nm = (struct nbstat_names *)user;
+   struct nbstat_nq *q = (struct nbstat_nq *)timer;
+   uint64_t now = nm->wheel->now;
+   int i = (int)(q - nm->nq);
+
+   if (q->rto > 0)
+       rtt_timeout(nm->ctx, nm->to.sin_addr.s_addr, q->rto);
+   q->rto = 0;
+   if (now >= q->deadline || (!nm->bcast && q->tries >= nm->ctx->retries)) {
+       if (q->answers == 0)
+           nm->fn(nm->user, stats_result(&nm->ctx->stats, NBSTAT_ETIMEOUT), q->name, &nm->to, NULL, 0);
+       names_finish(nm, i);
+       return;
+   }
+
+   /* A broadcast query that has been repeated enough listens until the end. */
+   if (q->tries >= nm->ctx->retries) {
+       wheel_add(nm->wheel, &q->timer, q->deadline);
+       return;
+   }
+
+   /* Without staging space, try again on the next tick. */
+   if (names_stage(nm, i) != NBSTAT_EOK) {
+       wheel_add(nm->wheel, &q->timer, now + 1);
+       return;
+   }
+   stat_add(&nm->ctx->stats.resent, 1);
+   q->tries++;
+   names_arm(nm, q, now);
+}
+
+/* names_reply - match an answer to its query by transaction ID and name. */
+static void names_reply(void *user, buffer_t *buffer, const struct sockaddr_in *from)
+{
+   struct nbstat_names *nm = (struct nbstat_names *)user;
+   struct nbstat_nb nb[NBSTAT_NB_MAX];
+   const uint8_t *data = buffer->data;
+   struct nbstat_nq *q;
+   char encoded[34];
+   uint16_t flags;
+   uint32_t ttl;
+   uint64_t now;
+   int i, n, count;
+
+   if (buffer->length < 12 + sizeof(encoded) || dec16be(data) < nm->base || dec16be(data) >= nm->base + nm->window ||
+       (!nm->bcast && (from->sin_addr.s_addr != nm->to.sin_addr.s_addr || from->sin_port != nm->to.sin_port))) {
+       stat_add(&nm->ctx->stats.unmatched, 1);
+       return;
+   }
+
+   /* A response, for the name that was asked. */
+   i = dec16be(data) - nm->base;
+   q = &nm->nq[i];
+   flags = dec16be(data + NBSTAT_OFF_FLAGS);
+   if (q->busy)
+       netbios_encode_name(encoded, (const char *)q->name, 0x20);
+   if (!q->busy || !(flags & 0x8000) || memcmp(data + 12, encoded, sizeof(encoded)) != 0) {
+       stat_add(&nm->ctx->stats.duplicate, 1);
+       return;
+   }
+   stat_add(&nm->ctx->stats.matched, 1);
+
+   /* The server needs time, e.g. to ask another server: stop repeating
+    * the request and wait as long as it says (RFC 1002 5.1.3.4). */
+   now = nbstat_clock();
+   if (((flags >> 11) & 0xf) == OPCODE_WACK) {
+       if (nm->bcast || buffer->length < 56)
+           return;
+       ttl = dec32be(data + 50);
+       q->deadline = now + 1000 * (uint64_t)(ttl < NBSTAT_WACK_MAX ? ttl : NBSTAT_WACK_MAX);
+       q->tries = nm->ctx->retries;
+       wheel_del(nm->wheel, &q->timer);
+       wheel_add(nm->wheel, &q->timer, q->deadline);
+       return;
+   }
+   if (((flags >> 11) & 0xf) != OPCODE_QUERY)
+       return;
+
+   if (!nm->bcast && q->tries == 0) {
+       rtt_sample(nm->ctx, from->sin_addr.s_addr, (int)(now - q->sent));
+       stats_rtt(&nm->ctx->stats, q->sent_us);
+   }
+   nm->ctx->pace.replies++;
+
+   /* Negative answer: the name is not registered. */
+   if ((flags & 0x000f) != 0) {
+       if (!nm->bcast) {
+           nm->fn(nm->user, stats_result(&nm->ctx->stats, NBSTAT_ENAME), q->name, from, NULL, 0);
+           names_finish(nm, i);
+       }
+       return;
+   }
+
+   if (buffer->length < 56 || dec16be(data + NBSTAT_OFF_RR_TYPE) != RR_TYPE_NB)
+       return;
+   n = dec16be(data + 54);
+   if (buffer->length < 56 + (size_t)n)
+       return;
+   count = n / 6 < NBSTAT_NB_MAX ? n / 6 : NBSTAT_NB_MAX;
+   for (n = 0; n < count; n++) {
+       nb[n].flags = dec16be(data + 56 + 6 * n);
+       nb[n].addr = dec32be(data + 58 + 6 * n);
+   }
+
+   q->answers++;
+   nm->fn(nm->user, stats_result(&nm->ctx->stats, NBSTAT_EOK), q->name, from, nb, count);
+   if (!nm->bcast)
+       names_finish(nm, i);
+}
+
+/* names_init - set up `window' query slots for `server', or a broadcast
+ * address if bcast is set, on the context's wheel. */
+static int names_init(struct nbstat_names *nm, nbstat_ctx_t *ctx, const char *server, int bcast,
+                      uint16_t port, int timeout, int window)
+{
+   int on = 1;
+   int i;
+
+   memset(nm, 0x00, sizeof(*nm));
+   if (nbstat_resolve(server, port, &nm->to) != 0)
+       return NBSTAT_EINVAL;
+   if (bcast && !ctx->broadcast) {
+       if (setsockopt(ctx->sfd, SOL_SOCKET, SO_BROADCAST, (const char *)&on, sizeof(on)) == SOCKET_ERROR)
+           return NBSTAT_ESOCKET;
+       ctx->broadcast = 1;
+   }
+
+   if (timeout > 10000 || timeout <= 0)
+       timeout = 3000;
+   if (window <= 0)
+       window = NBSTAT_WINDOW_DEFAULT;
+   if (window > NBSTAT_PAGE_MAX)
+       window = NBSTAT_PAGE_MAX;
+
+   nm->ctx = ctx;
+   nm->wheel = &ctx->wheel;
+   nm->bcast = bcast;
+   nm->timeout = timeout;
+   nm->window = window;
+   nm->nq = calloc(window, sizeof(struct nbstat_nq));
+   if (nm->nq == NULL)
+       return NBSTAT_ENOMEM;
+   for (i = 0; i < window; i++)
+       nm->nq[i].next = i + 1 < window ? i + 1 : -1;
+
+   return NBSTAT_EOK;
+}
+
+/* names_fill - send waiting names while slots and the pacing allow; flushes
+ * report to txerr. Returns NBSTAT_EAGAIN when the send buffer is full. */
+static int names_fill(struct nbstat_names *nm, uint64_t now, nbstat_txerr_fn txerr, void *user)
+{
+   struct nbstat_nq *q;
+   int i;
+
+   while (nm->next < nm->count && nm->free >= 0 && pace_ready(&nm->ctx->pace, now)) {
+       i = nm->free;
+       q = &nm->nq[i];
+       memcpy(q->name, nm->names + 16 * nm->next, sizeof(q->name));
+       if (names_stage(nm, i) != NBSTAT_EOK) {
+           if (nbstat_engine_flush(&nm->ctx->engine, txerr, user) == NBSTAT_EAGAIN)
+               return NBSTAT_EAGAIN;
+           continue;
+       }
+       nm->free = q->next;
+       q->busy = 1;
+       q->tries = 0;
+       q->answers = 0;
+       q->sent = now;
+       q->sent_us = nbstat_clock_us();
+       q->deadline = now + nm->timeout;
+       names_arm(nm, q, now);
+       pace_spend(&nm->ctx->pace);
+       nm->inflight++;
+       nm->next++;
+   }
+
+   return NBSTAT_EOK;
+}
+
+/* names_abort - report whatever is still in flight, and free the slots. */
+static void names_abort(struct nbstat_names *nm, int result)
+{
+   int i;
+
+   for (i = 0; nm->inflight > 0 && i < nm->window; i++) {
+       if (nm->nq[i].busy) {
+           nm->fn(nm->user, result, nm->nq[i].name, &nm->to, NULL, 0);
+           names_finish(nm, i);
+       }
+   }
+   free(nm->nq);
+}
+
+/* nbstat_names - resolve `count' first-level names of 16 bytes each, stored
+ * back to back, by asking `server', or a broadcast address if bcast is set. */
+int nbstat_names(nbstat_ctx_t *ctx, const char *server, int bcast, const uint8_t *names, size_t count,
+                 uint16_t port, int timeout, int window, nbstat_name_fn fn, void *user)
+{
+   struct nbstat_names nm;
+   uint64_t now;
+   int wrblock;
+   int delay;
+   int result;
+
+   if (ctx == NULL || server == NULL || (names == NULL && count > 0) || fn == NULL)
+       return NBSTAT_EINVAL;
+   if (ctx->pending > 0)
+       return NBSTAT_EAGAIN;
+
+   result = names_init(&nm, ctx, server, bcast, port, timeout, window);
+   if (result != NBSTAT_EOK)
+       return result;
+   nm.names = names;
+   nm.count = count;
+   nm.fn = fn;
+   nm.user = user;
+   nbstat_engine_rcvbuf(&ctx->engine, nm.window);
+
+   wheel_advance(&ctx->wheel, nbstat_clock(), names_expire, &nm);
+   pace_reset(&ctx->pace, nbstat_clock());
+
+   for (;;) {
+       now = nbstat_clock();
+       pace_drops(&ctx->pace, &ctx->engine);
+       pace_adjust(&ctx->pace, now);
+       wrblock = names_fill(&nm, now, names_txerr, &nm) == NBSTAT_EAGAIN;
+       if (nbstat_engine_flush(&ctx->engine, names_txerr, &nm) == NBSTAT_EAGAIN)
+           wrblock = 1;
+
+       if (nm.inflight == 0 && nm.next >= nm.count)
+           break;
+
+       delay = wheel_next(&ctx->wheel, nbstat_clock());
+       if (wrblock && (delay < 0 || delay > 1))
+           delay = 1;
+       if (nm.next < nm.count && nm.free >= 0 && pace_delay(&ctx->pace) > 0 &&
+           (delay < 0 || delay > pace_delay(&ctx->pace)))
+           delay = pace_delay(&ctx->pace);
+
+       if (nbstat_engine_poll(&ctx->engine, delay, names_reply, &nm) == SOCKET_ERROR) {
+           result = NBSTAT_EDEBUG;
+           break;
+       }
+
+       wheel_advance(&ctx->wheel, nbstat_clock(), names_expire, &nm);
+   }
+
+   nbstat_engine_discard(&ctx->engine);
+   names_abort(&nm, result);
+
+   return result;
+}
+
+/*
+ * Pipelines. The answers of a node status sweep feed follow-up stages on the
+ * same context: a name query for each new name with a given suffix, e.g. the
+ * <1B> and <1C> names that lead to the domain master browsers and the domain
+ * controllers, and a second node status query of each host with a name flag
+ * such as CNF. Everything runs in one loop on one socket and one pacing, so
+ * a follow-up goes out as soon as the answer that calls for it is in, and the
+ * pipeline takes about as long as the sweep alone. Name queries take the
+ * transaction IDs from NBSTAT_PIPE_BASE up and a timer wheel of their own.
+ */
+
+#define NBSTAT_PIPE_BASE 0x8000
+
+/* Host queued for another node status query */
+struct nbstat_phost {
+   uint32_t addr;
+   int stage;
+   int done;
+};
+
+struct nbstat_pipe {
+   struct nbstat_sweep sw;
+   struct nbstat_names nm;
+   struct nbstat_wheel wheel;        /* Name query timeouts */
+   const struct nbstat_stage *stage;
+   int nstage;
+   uint8_t *names;                   /* Names found, asked in order */
+   size_t nnames, maxnames;
+   uint32_t *nameset;                /* Open addressing over names, index + 1 */
+   size_t namesize;
+   struct nbstat_phost *host;        /* Hosts queued, sent in order */
+   size_t nhost, maxhost, sent;
+   uint32_t *hostset;                /* Over host, index + 1 */
+   size_t hostsize;
+   nbstat_stage_fn status;
+   void *user;
+   int result;                       /* NBSTAT_ENOMEM once a follow-up was lost */
+};
+
+/* pipe_namehash - FNV-1a over the 16 bytes of a first-level name */
+static uint32_t pipe_namehash(const uint8_t *name)
+{
+   uint32_t h = 2166136261U;
+   int i;
+
+   for (i = 0; i < 16; i++)
+       h = (h ^ name[i]) * 16777619U;
+
+   return h;
+}
+
+/* pipe_nameslot - the slot of a name in the name set, or the free one it goes to. */
+static uint32_t *pipe_nameslot(struct nbstat_pipe *p, const uint8_t *name)
+{
+   size_t i = pipe_namehash(name) & (p->namesize - 1);
+
+   while (p->nameset[i] != 0 && memcmp(p->names + 16 * (p->nameset[i] - 1), name, 16) != 0)
+       i = (i + 1) & (p->namesize - 1);
+
+   return &p->nameset[i];
+}
+
+/* pipe_hostslot - the same for an address in the host set */
+static uint32_t *pipe_hostslot(struct nbstat_pipe *p, uint32_t addr)
+{
+   size_t i = (addr * 2654435761U) & (p->hostsize - 1);
+
+   while (p->hostset[i] != 0 && p->host[p->hostset[i] - 1].addr != addr)
+       i = (i + 1) & (p->hostsize - 1);
+
+   return &p->hostset[i];
+}
+
+/* pipe_addname - queue a name query unless the name was seen before. */
+static int pipe_addname(struct nbstat_pipe *p, const uint8_t *name)
+{
+   uint32_t *set;
+   uint8_t *grown;
+   size_t i;
+
+   if (p->nameset != NULL && *pipe_nameslot(p, name) != 0)
+       return NBSTAT_EOK;
+
+   /* The set stays at most half full, and is rebuilt when it grows. */
+   if (2 * (p->nnames + 1) > p->namesize) {
+       set = calloc(p->namesize != 0 ? 2 * p->namesize : 64, sizeof(uint32_t));
+       if (set == NULL)
+           return NBSTAT_ENOMEM;
+       free(p->nameset);
+       p->nameset = set;
+       p->namesize = p->namesize != 0 ? 2 * p->namesize : 64;
+       for (i = 0; i < p->nnames; i++)
+           *pipe_nameslot(p, p->names + 16 * i) = (uint32_t)i + 1;
+   }
+   if (p->nnames == p->maxnames) {
+       grown = realloc(p->names, (p->maxnames != 0 ? 2 * p->maxnames : 64) * 16);
+       if (grown == NULL)
+           return NBSTAT_ENOMEM;
+       p->names = grown;
+       p->maxnames = p->maxnames != 0 ? 2 * p->maxnames : 64;
+   }
+
+   set = pipe_nameslot(p, name);
+   memcpy(p->names + 16 * p->nnames, name, 16);
+   *set = (uint32_t)++p->nnames;
+   p->nm.names = p->names;
+   p->nm.count = p->nnames;
+
+   return NBSTAT_EOK;
+}
+
+/* pipe_addhost - queue a host for stage `stage', unless it is queued already. */
+static int pipe_addhost(struct nbstat_pipe *p, uint32_t addr, int stage)
+{
+   struct nbstat_phost *grown;
+   uint32_t *set;
+   size_t i;
+
+   if (p->hostset != NULL && *pipe_hostslot(p, addr) != 0)
+       return NBSTAT_EOK;
+
+   if (2 * (p->nhost + 1) > p->hostsize) {
+       set = calloc(p->hostsize != 0 ? 2 * p->hostsize : 64, sizeof(uint32_t));
+       if (set == NULL)
+           return NBSTAT_ENOMEM;
+       free(p->hostset);
+       p->hostset = set;
+       p->hostsize = p->hostsize != 0 ? 2 * p->hostsize : 64;
+       for (i = 0; i < p->nhost; i++)
+           *pipe_hostslot(p, p->host[i].addr) = (uint32_t)i + 1;
+   }
+   if (p->nhost == p->maxhost) {
+       grown = realloc(p->host, (p->maxhost != 0 ? 2 * p->maxhost : 64) * sizeof(*grown));
+       if (grown == NULL)
+           return NBSTAT_ENOMEM;
+       p->host = grown;
+       p->maxhost = p->maxhost != 0 ? 2 * p->maxhost : 64;
+   }
+
+   set = pipe_hostslot(p, addr);
+   p->host[p->nhost].addr = addr;
+   p->host[p->nhost].stage = stage;
+   p->host[p->nhost].done = 0;
+   *set = (uint32_t)++p->nhost;
+
+   return NBSTAT_EOK;
+}
+
+/* pipe_status - nbstat_sweep_fn: report an answer and queue what it calls for. */
+static void pipe_status(void *user, int result, const struct sockaddr_in *sin, const nbstat_view_t *view)
+{
+   struct nbstat_pipe *p = (struct nbstat_pipe *)user;
+   const struct nbstat_stage *st;
+   struct nbstat_phost *h = NULL;
+   uint32_t addr = ntohl(sin->sin_addr.s_addr);
+   const uint8_t *name;
+   uint16_t flags;
+   uint8_t suffix;
+   uint32_t *set;
+   int i, s;
+
+   /* The second query of a host ends there. */
+   if (p->hostset != NULL && *(set = pipe_hostslot(p, addr)) != 0)
+       h = &p->host[*set - 1];
+   if (h != NULL && *set - 1 < p->sent && !h->done) {
+       h->done = 1;
+       p->status(p->user, h->stage, result, sin, view);
+       return;
+   }
+
+   p->status(p->user, 0, result, sin, view);
+   if (result != NBSTAT_EOK)
+       return;
+
+   for (i = 0; i < view->count; i++) {
+       name = nbstat_view_name(view, i, &suffix, &flags);
+       for (s = 0; s < p->nstage; s++) {
+           st = &p->stage[s];
+           if ((st->suffix >= 0 && suffix != st->suffix) || (st->flags != 0 && (flags & st->flags) == 0))
+               continue;
+           if (st->type == NBSTAT_STAGE_NAMES) {
+               if (pipe_addname(p, name) != NBSTAT_EOK)
+                   p->result = NBSTAT_ENOMEM;
+           } else if (pipe_addhost(p, addr, s + 1) != NBSTAT_EOK) {
+               p->result = NBSTAT_ENOMEM;
+           }
+       }
+   }
+}
+
+/* pipe_reply - name query answers by their transaction IDs; the rest is the sweep's. */
+static void pipe_reply(void *user, buffer_t *buffer, const struct sockaddr_in *from)
+{
+   struct nbstat_pipe *p = (struct nbstat_pipe *)user;
+
+   if (buffer->length >= 2 && dec16be(buffer->data) >= NBSTAT_PIPE_BASE)
+       names_reply(&p->nm, buffer, from);
+   else
+       sweep_reply(&p->sw, buffer, from);
+}
+
+/* pipe_txerr - the same for send errors, by tag */
+static void pipe_txerr(void *user, int tag, const struct sockaddr_in *to, int err)
+{
+   struct nbstat_pipe *p = (struct nbstat_pipe *)user;
+
+   if (tag >= NBSTAT_PIPE_BASE)
+       names_txerr(&p->nm, tag, to, err);
+   else
+       sweep_txerr(&p->sw, tag, to, err);
+}
+
+/* pipe_next - the next host to query: a queued follow-up, or a target. */
+static int pipe_next(struct nbstat_pipe *p, nbstat_targets_t *targets, int *more, uint32_t *addr)
+{
+   if (p->sent < p->nhost) {
+       *addr = p->host[p->sent++].addr;
+       return 1;
+   }
+   if (!*more)
+       return 0;
+   *more = nbstat_targets_next(targets, addr);
+
+   return *more;
+}
+
+/* nbstat_pipeline - sweep the targets and run the follow-up stages on the
+ * answers. `status' gets every node status result with its stage, 0 for the
+ * sweep; `name' the name queries, which go to `server', or a broadcast
+ * address if bcast is set, and are only needed with NBSTAT_STAGE_NAMES.
+ * Everything goes out on the context's own socket, from the first source
+ * nbstat_ctx_bind() gave it; the others are not used. */
+int nbstat_pipeline(nbstat_ctx_t *ctx, nbstat_targets_t *targets, const struct nbstat_stage *stage, int nstage,
+                    const char *server, int bcast, uint16_t port, int timeout, int window,
+                    nbstat_stage_fn status, nbstat_name_fn name, void *user)
+{
+   const struct nbstat_stats *st;
+   struct nbstat_reporter reporter;
+   struct nbstat_pipe p;
+   uint32_t next = 0;
+   uint64_t now;
+   int have = 0; /* next holds a host not sent yet */
+   int more = 1; /* The targets may have more */
+   int names = 0;
+   int wrblock = 0;
+   int delay;
+   int budget;
+   int result;
+   int i;
+
+   if (ctx == NULL || targets == NULL || status == NULL || nstage < 0 || (stage == NULL && nstage > 0))
+       return NBSTAT_EINVAL;
+   for (i = 0; i < nstage; i++) {
+       if (stage[i].type != NBSTAT_STAGE_NAMES && stage[i].type != NBSTAT_STAGE_STATUS)
+           return NBSTAT_EINVAL;
+       if (stage[i].type == NBSTAT_STAGE_NAMES)
+           names = 1;
+   }
+   if (names && (server == NULL || name == NULL))
+       return NBSTAT_EINVAL;
+   if (ctx->pending > 0)
+       return NBSTAT_EAGAIN;
+
+   result = targets_freeze(targets);
+   if (result != NBSTAT_EOK)
+       return result;
+
+   if (timeout > 10000 || timeout <= 0)
+       timeout = 3000;
+   if (window <= 0)
+       window = NBSTAT_WINDOW_DEFAULT;
+   if (window > NBSTAT_PIPE_BASE)
+       window = NBSTAT_PIPE_BASE;
+
+   memset(&p, 0x00, sizeof(p));
+   if (names) {
+       result = names_init(&p.nm, ctx, server, bcast, port, timeout, NBSTAT_WINDOW_DEFAULT);
+       if (result != NBSTAT_EOK)
+           return result;
+   }
+   if (sweep_init(&p.sw, ctx, window) != NBSTAT_EOK) {
+       free(p.nm.nq);
+       return NBSTAT_ENOMEM;
+   }
+   p.sw.port = port;
+   p.sw.timeout = timeout;
+   p.sw.fn = pipe_status;
+   p.sw.user = &p;
+   p.nm.ctx = ctx;
+   p.nm.wheel = &p.wheel;
+   p.nm.base = NBSTAT_PIPE_BASE;
+   p.nm.fn = name;
+   p.nm.user = user;
+   p.stage = stage;
+   p.nstage = nstage;
+   p.status = status;
+   p.user = user;
+   wheel_init(&p.wheel, nbstat_clock());
+   nbstat_engine_rcvbuf(&ctx->engine, p.sw.window + p.nm.window);
+
+   wheel_advance(&ctx->wheel, nbstat_clock(), sweep_expire, &p.sw);
+   pace_reset(&ctx->pace, nbstat_clock());
+   stat_add(&ctx->stats.total, targets_planned(targets));
+   st = &ctx->stats;
+   reporter_start(&reporter, ctx, &st, 1);
+
+   for (;;) {
+       /* Retransmissions, then the follow-ups whose answers are in, then
+        * new targets, as in sweep_run(). */
+       now = nbstat_clock();
+       pace_drops(&ctx->pace, &ctx->engine);
+       pace_adjust(&ctx->pace, now);
+       if (sweep_resend(&p.sw, now) == NBSTAT_EAGAIN)
+           wrblock = 1;
+       if (!wrblock && names_fill(&p.nm, now, pipe_txerr, &p) == NBSTAT_EAGAIN)
+           wrblock = 1;
+       budget = ctx->engine.rxmore ? NBSTAT_TXDEPTH : p.sw.window;
+       while (!wrblock && budget > 0 && (have || (have = pipe_next(&p, targets, &more, &next))) &&
+              p.sw.free[sweep_page(&p.sw, next)] >= 0 && pace_ready(&ctx->pace, now)) {
+           if (sweep_send(&p.sw, next, p.sw.port, p.sw.timeout, now) == NBSTAT_EAGAIN) {
+               if (nbstat_engine_flush(&ctx->engine, pipe_txerr, &p) == NBSTAT_EAGAIN)
+                   wrblock = 1;
+               continue;
+           }
+           have = 0;
+           budget--;
+       }
+       if (nbstat_engine_flush(&ctx->engine, pipe_txerr, &p) == NBSTAT_EAGAIN)
+           wrblock = 1;
+       if (wrblock)
+           ctx->pace.blocked = 1;
+
+       /* Done when nothing is in flight that could call for more. */
+       if (p.sw.inflight == 0 && !have && !more && p.sent >= p.nhost &&
+           p.nm.inflight == 0 && p.nm.next >= p.nm.count)
+           break;
+
+       delay = wheel_next(&ctx->wheel, nbstat_clock());
+       i = wheel_next(&p.wheel, nbstat_clock());
+       if (i >= 0 && (delay < 0 || delay > i))
+           delay = i;
+       if (wrblock && (delay < 0 || delay > 1))
+           delay = 1;
+       if ((have || (p.nm.next < p.nm.count && p.nm.free >= 0)) && pace_delay(&ctx->pace) > 0 &&
+           (delay < 0 || delay > pace_delay(&ctx->pace)))
+           delay = pace_delay(&ctx->pace);
+       if (budget == 0)
+           delay = 0;
+       wrblock = 0;
+
+       if (nbstat_engine_poll(&ctx->engine, delay, pipe_reply, &p) == SOCKET_ERROR) {
+           result = NBSTAT_EDEBUG;
+           break;
+       }
+
+       wheel_advance(&ctx->wheel, nbstat_clock(), sweep_expire, &p.sw);
+       wheel_advance(&p.wheel, nbstat_clock(), names_expire, &p.nm);
+   }
+
+   sweep_abort(&p.sw, result);
+   names_abort(&p.nm, result);
+   reporter_stop(&reporter);
+   free(p.sw.probe);
+   free(p.sw.free);
+   free(p.names);
+   free(p.nameset);
+   free(p.host);
+   free(p.hostset);
+
+   return result != NBSTAT_EOK ? result : p.result;
+}
+
+struct error_list {
+   int result;
+   const char *str;
+};
+
+static const struct error_list error_list[] = {
+  { NBSTAT_EOK,      "operation completed successfully" },
+  { NBSTAT_ENOMEM,   "memory allocation failure" },
+  { NBSTAT_EINVAL,   "an invalid argument was passed to a library function" },
+  { NBSTAT_EWSAFAIL, "could not initialize the sockets layer" },
+  { NBSTAT_ESOCKET,  "the system could not allocate a socket descriptor" },
+  { NBSTAT_EPROTO,   "malformed packet or file" },
+  { NBSTAT_ETRFLAG,  "truncation flag was set in response" },
+  { NBSTAT_ETIMEOUT, "request expired" }, 
+  { NBSTAT_EAGAIN,   "resource temporarily unavailable" },
+  { NBSTAT_ENAME,    "the name is not registered" },
+  { NBSTAT_EDEBUG,   "debugging error" },
+  { 0xffffffff,       NULL }
+};
+
+/* nbstat_error */
+const char *nbstat_error(int x)
+{
+   /* static char buffer[128]; */
+   const char *error = NULL;
+   int i;
+   
+   for (i = 0; error_list[i].str != NULL; i++) {
+      if (error_list[i].result == x) {
+          error = error_list[i].str;   
+          break; 
+      }
+   }
+   if (error == NULL)
+       error = "Unknown error";
+
+   return error;
+}
+
+
+const char *netbios_service_name(uint8_t g, uint8_t suffix)
+{
+   const char *name = NULL;
+
+   switch(suffix) {
+       case 0x00: name = !g ? "Workstation Service" : "Browser Client"; break;
+       case 0x01: name =  g ? "Master Browser" : NULL; break;
+       case 0x1B: name = !g ? "Domain Master Browser" : NULL; break; 
+       case 0x1D: name = !g ? "Master Browser" : NULL; break;
+       case 0x1E: name =  g ? "Browser Service Elections" : NULL; break;
+       case 0x20: name = !g ? "Default Name" : NULL; break;
+       case 0x6A: break;
+       case 0x6B: break;
+       default:
+           break;
+   }
+   if (name == NULL)
+       name = "Unknown"; 
+   
+   return name;
+}
+
+/* nbstat_dump_nbtstat */
+void nbstat_dump_nbtstat(const nbstat_t *nbstat)
+{
+   const struct nbstat_node_name *current = NULL;
+   const char *name;
+   char ch;
+   int i, j;
+
+   putchar('\n');
+   printf("    NetBIOS Remote Machine Table\n\n");
+   printf("       Name             Type   Status     Description  \n");
+   printf("    ----------------------------------------------\n");
+
+   /* Walk the name table and print all the relevant info. */
+   for (j = 0; j < nbstat->count; j++) {
+       current = &nbstat->node[j];
+       printf("    ");
+       for (i = 0; i < 15; i++) {
+           ch = current->nbf_name[i];     
+           if (ch >= 0x20 && ch <= 0x79)
+               putchar(ch);
+           else
+               putchar('.');
+       }
+       printf("<%02X> ", current->suffix);
+       printf("%s ", !current->g ? "UNIQUE" : "GROUP "); /* Space in GROUP is for text alignment. */
+       name = netbios_service_name(current->g, current->suffix);
+       printf("Registered %s\n", name);
+   }
+
+   printf("\n    MAC Address = ");
+   for (i = 0; i < sizeof(nbstat->hwaddr); i++) {
+       if (i > 0) putchar('-');
+       printf("%02X", nbstat->hwaddr[i]);    
+   } 
+   printf("\n");
+
+}
+
+/*
+ * Streaming writers. Each responder is formatted into a large buffer as soon
+ * as it is reported, and the buffer goes out in one write when it runs low or
+ * every NBSTAT_FLUSH_MS, so results reach a pipe while the sweep is running.
+ */
+
+#define NBSTAT_OUT_SIZE   (256 * 1024)
+#define NBSTAT_RECORD_MAX 8192 /* Room that one responder can take */
+#define NBSTAT_FLUSH_MS   100
+
+/*
+ * Binary result archive. All integers are big-endian, like the wire format,
+ * and every item has a fixed size, so a reader maps the file and walks it
+ * with the accessors below instead of parsing. The file is a header followed
+ * by any number of blocks; each writer flush appends one block, so new scans
+ * can be appended to an existing archive. The records of a block are sorted
+ * by address, then time, so that blocks are runs a reader can merge.
+ *
+ *   header  0 magic "NBQA", 4 version, 6 header size, 8 record size,
+ *          10 name size, 12 reserved, 16 creation time (ms since 1970)
+ *   block   0 magic "NBQB", 4 records, 8 names, 12 reserved, then the
+ *           records, then the names they point into
+ *   record  0 address (host order value), 4 MAC, 10 name count, 11 reserved,
+ *          12 time (ms since 1970), 20 index of the first name in the block
+ *   name    0 nbf_name, 15 suffix, 16 flags word as sent, 18 reserved
+ */
+
+#define NBSTAT_ARCH_VERSION 1
+#define NBSTAT_ARCH_HDR     32
+#define NBSTAT_ARCH_BLOCK   16
+#define NBSTAT_ARCH_REC     24
+#define NBSTAT_ARCH_NAME    20
+#define NBSTAT_ARCH_RECMAX  4096 /* Records per block */
+
+static const uint8_t arch_magic[4] = { 'N', 'B', 'Q', 'A' };
+static const uint8_t block_magic[4] = { 'N', 'B', 'Q', 'B' };
+
+/* arec_cmp - qsort archive records by address, then time; both big-endian. */
+static int arec_cmp(const void *a, const void *b)
+{
+   int c = memcmp(a, b, 4);
+
+   return c != 0 ? c : memcmp((const uint8_t *)a + 12, (const uint8_t *)b + 12, 8);
+}
+
+/* arch_header - write the file header unless the file already has content,
+ * so that `>>' appends blocks to an existing archive. */
+static void arch_header(nbstat_writer_t *w)
+{
+   uint8_t hdr[NBSTAT_ARCH_HDR];
+   long pos;
+
+   /* Appending to an archive: it has its header. Pipes fail the seek. */
+   if (fseek(w->fp, 0, SEEK_END) == 0 && (pos = ftell(w->fp)) > 0)
+       return;
+
+   memset(hdr, 0x00, sizeof(hdr));
+   memcpy(hdr, arch_magic, sizeof(arch_magic));
+   enc16be(hdr + 4, NBSTAT_ARCH_VERSION);
+   enc16be(hdr + 6, NBSTAT_ARCH_HDR);
+   enc16be(hdr + 8, NBSTAT_ARCH_REC);
+   enc16be(hdr + 10, NBSTAT_ARCH_NAME);
+   enc64be(hdr + 16, nbstat_walltime());
+
+   if (fwrite(hdr, 1, sizeof(hdr), w->fp) != sizeof(hdr))
+       w->error = 1;
+}
+
+/* arch_flush - write the pending records and names as one block. */
+static void arch_flush(nbstat_writer_t *w)
+{
+   uint8_t hdr[NBSTAT_ARCH_BLOCK];
+
+   if (w->nrec == 0)
+       return;
+
+   /* Records point into the name table by index, so they move freely. */
+   qsort(w->buf, w->nrec, NBSTAT_ARCH_REC, arec_cmp);
+
+   memset(hdr, 0x00, sizeof(hdr));
+   memcpy(hdr, block_magic, sizeof(block_magic));
+   enc32be(hdr + 4, w->nrec);
+   enc32be(hdr + 8, w->nname);
+
+   if (fwrite(hdr, 1, sizeof(hdr), w->fp) != sizeof(hdr) ||
+       fwrite(w->buf, 1, w->len, w->fp) != w->len ||
+       fwrite(w->names, 1, w->nlen, w->fp) != w->nlen)
+       w->error = 1;
+
+   w->len = w->nlen = 0;
+   w->nrec = w->nname = 0;
+}
+
+
+/* nbstat_writer_init - `size' 0 picks NBSTAT_OUT_SIZE. */
+int nbstat_writer_init(nbstat_writer_t *w, FILE *fp, int format, size_t size)
+{
+   if (w == NULL || fp == NULL || format < NBSTAT_FMT_TABLE || format > NBSTAT_FMT_BINARY)
+       return NBSTAT_EINVAL;
+
+   memset(w, 0x00, sizeof(*w));
+   w->size = size >= NBSTAT_RECORD_MAX ? size : NBSTAT_OUT_SIZE;
+   w->buf = malloc(w->size);
+   if (w->buf == NULL)
+       return NBSTAT_ENOMEM;
+
+   /* Names of a block are kept apart and written after its records. */
+   if (format == NBSTAT_FMT_BINARY) {
+       w->names = malloc(w->size);
+       if (w->names == NULL) {
+           free(w->buf);
+           w->buf = NULL;
+           return NBSTAT_ENOMEM;
+       }
+   }
+
+   w->fp = fp;
+   w->format = format;
+   w->flushed = nbstat_clock();
+   if (format == NBSTAT_FMT_BINARY)
+       arch_header(w);
+
+   return NBSTAT_EOK;
+}
+
+/* nbstat_writer_flush - write out whatever is buffered. */
+int nbstat_writer_flush(nbstat_writer_t *w)
+{
+   if (w->format == NBSTAT_FMT_BINARY) {
+       arch_flush(w);
+   } else if (w->len > 0) {
+       if (fwrite(w->buf, 1, w->len, w->fp) != w->len)
+           w->error = 1;
+       w->len = 0;
+   }
+   if (fflush(w->fp) != 0)
+       w->error = 1;
+   w->flushed = nbstat_clock();
+
+   return w->error ? NBSTAT_EDEBUG : NBSTAT_EOK;
+}
+
+/* nbstat_writer_close - flush and release the buffer; the file stays open. */
+int nbstat_writer_close(nbstat_writer_t *w)
+{
+   int result = nbstat_writer_flush(w);
+
+   free(w->buf);
+   free(w->names);
+   w->buf = NULL;
+   w->names = NULL;
+
+   return result;
+}
+
+/* w_puts, w_putc, w_hex, w_dec - append to the buffer; a record never
+ * outgrows the NBSTAT_RECORD_MAX reserved for it. */
+static void w_puts(nbstat_writer_t *w, const char *s)
+{
+   size_t n = strlen(s);
+
+   memcpy(w->buf + w->len, s, n);
+   w->len += n;
+}
+
+static void w_putc(nbstat_writer_t *w, char ch)
+{
+   w->buf[w->len++] = ch;
+}
+
+static void w_hex(nbstat_writer_t *w, uint8_t v)
+{
+   static const char hex[] = "0123456789ABCDEF";
+
+   w->buf[w->len++] = hex[v >> 4];
+   w->buf[w->len++] = hex[v & 0x0f];
+}
+
+static void w_dec(nbstat_writer_t *w, unsigned v)
+{
+   char tmp[10];
+   int n = 0;
+
+   do {
+       tmp[n++] = (char)('0' + v % 10);
+       v /= 10;
+   } while (v > 0);
+   while (n > 0)
+       w->buf[w->len++] = tmp[--n];
+}
+
+/* w_mac - MAC address as 00-11-22-33-44-55 */
+static void w_mac(nbstat_writer_t *w, const uint8_t *hwaddr)
+{
+   int i;
+
+   for (i = 0; i < 6; i++) {
+       if (i > 0)
+           w_putc(w, '-');
+       w_hex(w, hwaddr[i]);
+   }
+}
+
+/* name_length - name length without the space padding */
+static int name_length(const struct nbstat_node_name *node)
+{
+   int n = sizeof(node->nbf_name);
+
+   while (n > 0 && node->nbf_name[n - 1] == ' ')
+       n--;
+
+   return n;
+}
+
+/* name_flags - the flags word as sent, for the machine readable formats */
+static unsigned name_flags(const struct nbstat_node_name *node)
+{
+   return (node->g << 15) | (node->ont << 13) | (node->drg << 12) | (node->cnf << 11) |
+          (node->act << 10) | (node->prm << 9);
+}
+
+/* w_jname - a name as a JSON string body */
+static void w_jname(nbstat_writer_t *w, const struct nbstat_node_name *node)
+{
+   uint8_t ch;
+   int i, n;
+
+   for (i = 0, n = name_length(node); i < n; i++) {
+       ch = node->nbf_name[i];
+       if (ch == '"' || ch == '\\') {
+           w_putc(w, '\\');
+           w_putc(w, (char)ch);
+       } else if (ch < 0x20 || ch >= 0x7f) {
+           w_puts(w, "\\u00");
+           w_hex(w, ch);
+       } else {
+           w_putc(w, (char)ch);
+       }
+   }
+}
+
+/* w_cname - a name as a quoted CSV field, doubling quotes; control
+ * characters are hidden. */
+static void w_cname(nbstat_writer_t *w, const struct nbstat_node_name *node)
+{
+   uint8_t ch;
+   int i, n;
+
+   w_putc(w, '"');
+   for (i = 0, n = name_length(node); i < n; i++) {
+       ch = node->nbf_name[i];
+       if (ch == '"')
+           w_putc(w, '"');
+       w_putc(w, ch >= 0x20 && ch < 0x7f ? (char)ch : '.');
+   }
+   w_putc(w, '"');
+}
+
+/* w_nbname - a name as NAME<xx>, for the event lines */
+static void w_nbname(nbstat_writer_t *w, const struct nbstat_node_name *node)
+{
+   uint8_t ch;
+   int i, n;
+
+   for (i = 0, n = name_length(node); i < n; i++) {
+       ch = node->nbf_name[i];
+       w_putc(w, ch >= 0x20 && ch < 0x7f ? (char)ch : '.');
+   }
+   w_putc(w, '<');
+   w_hex(w, node->suffix);
+   w_putc(w, '>');
+}
+
+/* w_json - one responder as a JSON object */
+static void w_json(nbstat_writer_t *w, const nbstat_t *nbstat)
+{
+   const struct nbstat_node_name *node;
+   const char *service;
+   int j;
+
+   w_puts(w, "{\"ip\":\"");
+   w_puts(w, inet_ntoa(nbstat->sin.sin_addr));
+   w_puts(w, "\",\"mac\":\"");
+   w_mac(w, nbstat->hwaddr);
+   w_puts(w, "\",\"names\":[");
+
+   for (j = 0; j < nbstat->count; j++) {
+       node = &nbstat->node[j];
+       w_puts(w, j > 0 ? ",{\"name\":\"" : "{\"name\":\"");
+       w_jname(w, node);
+       w_puts(w, "\",\"suffix\":");
+       w_dec(w, node->suffix);
+       w_puts(w, node->g ? ",\"group\":true,\"flags\":" : ",\"group\":false,\"flags\":");
+       w_dec(w, name_flags(node));
+       service = netbios_service_name(node->g, node->suffix);
+       if (service != NULL) {
+           w_puts(w, ",\"service\":\"");
+           w_puts(w, service);
+           w_putc(w, '"');
+       }
+       w_putc(w, '}');
+   }
+
+   w_puts(w, "]}\n");
+}
+
+/* w_csv - one row per name: ip,mac,name,suffix,type,flags,service */
+static void w_csv(nbstat_writer_t *w, const nbstat_t *nbstat)
+{
+   const struct nbstat_node_name *node;
+   const char *service;
+   int j;
+
+   if (w->count == 0)
+       w_puts(w, "ip,mac,name,suffix,type,flags,service\n");
+
+   for (j = 0; j < nbstat->count; j++) {
+       node = &nbstat->node[j];
+       w_puts(w, inet_ntoa(nbstat->sin.sin_addr));
+       w_putc(w, ',');
+       w_mac(w, nbstat->hwaddr);
+
+       w_putc(w, ',');
+       w_cname(w, node);
+       w_putc(w, ',');
+       w_hex(w, node->suffix);
+       w_puts(w, node->g ? ",GROUP," : ",UNIQUE,");
+       w_dec(w, name_flags(node));
+       w_putc(w, ',');
+       service = netbios_service_name(node->g, node->suffix);
+       if (service != NULL)
+           w_puts(w, service);
+       w_putc(w, '\n');
+   }
+}
+
+/* w_nmblookup - as printed by Samba's nmblookup -A */
+static void w_nmblookup(nbstat_writer_t *w, const nbstat_t *nbstat)
+{
+   static const char ont[] = "BPMH";
+   const struct nbstat_node_name *node;
+   uint8_t ch;
+   int i, j;
+
+   w_puts(w, "Looking up status of ");
+   w_puts(w, inet_ntoa(nbstat->sin.sin_addr));
+   w_putc(w, '\n');
+
+   for (j = 0; j < nbstat->count; j++) {
+       node = &nbstat->node[j];
+       w_putc(w, '\t');
+       for (i = 0; i < sizeof(node->nbf_name); i++) {
+           ch = node->nbf_name[i];
+           w_putc(w, ch >= 0x20 && ch < 0x7f ? (char)ch : '.');
+       }
+       w_puts(w, " <");
+       w_putc(w, "0123456789abcdef"[node->suffix >> 4]);
+       w_putc(w, "0123456789abcdef"[node->suffix & 0x0f]);
+       w_puts(w, node->g ? "> - <GROUP> " : "> -         ");
+       w_putc(w, ont[node->ont]);
+       w_putc(w, ' ');
+       if (node->drg)
+           w_puts(w, "<DEREGISTERING> ");
+       if (node->cnf)
+           w_puts(w, "<CONFLICT> ");
+       if (node->act)
+           w_puts(w, "<ACTIVE> ");
+       if (node->prm)
+           w_puts(w, "<PERMANENT> ");
+       w_putc(w, '\n');
+   }
+
+   w_puts(w, "\n\tMAC Address = ");
+   w_mac(w, nbstat->hwaddr);
+   w_puts(w, "\n\n");
+}
+
+/* w_binary - append one record and its names to the pending block. */
+static void w_binary(nbstat_writer_t *w, const nbstat_t *nbstat)
+{
+   const struct nbstat_node_name *node;
+   uint8_t *rec, *name;
+   int j;
+
+   rec = (uint8_t *)w->buf + w->len;
+   memset(rec, 0x00, NBSTAT_ARCH_REC);
+   enc32be(rec, ntohl(nbstat->sin.sin_addr.s_addr));
+   memcpy(rec + 4, nbstat->hwaddr, 6);
+   enc8be(rec + 10, (uint8_t)nbstat->count);
+   enc64be(rec + 12, w->stamp != 0 ? w->stamp : nbstat_walltime());
+   enc32be(rec + 20, w->nname);
+   w->len += NBSTAT_ARCH_REC;
+   w->nrec++;
+
+   for (j = 0; j < nbstat->count; j++) {
+       node = &nbstat->node[j];
+       name = (uint8_t *)w->names + w->nlen;
+       memset(name, 0x00, NBSTAT_ARCH_NAME);
+       memcpy(name, node->nbf_name, sizeof(node->nbf_name));
+       enc8be(name + 15, node->suffix);
+       enc16be(name + 16, (uint16_t)name_flags(node));
+       w->nlen += NBSTAT_ARCH_NAME;
+       w->nname++;
+   }
+}
+
+/* nbstat_writer_put - format one responder. */
+int nbstat_writer_put(nbstat_writer_t *w, const nbstat_t *nbstat)
+{
+   if (w == NULL || w->buf == NULL || nbstat == NULL)
+       return NBSTAT_EINVAL;
+
+   if (w->size - w->len < NBSTAT_RECORD_MAX || w->size - w->nlen < NBSTAT_RECORD_MAX ||
+       w->nrec >= NBSTAT_ARCH_RECMAX)
+       nbstat_writer_flush(w);
+
+   switch (w->format) {
+       case NBSTAT_FMT_NDJSON:    w_json(w, nbstat); break;
+       case NBSTAT_FMT_CSV:       w_csv(w, nbstat); break;
+       case NBSTAT_FMT_NMBLOOKUP: w_nmblookup(w, nbstat); break;
+       case NBSTAT_FMT_BINARY:    w_binary(w, nbstat); break;
+       default:
+           /* The table goes through stdio; keep it in order with the rest. */
+           nbstat_writer_flush(w);
+           printf("\n    Node IpAddress: [%s]\n", inet_ntoa(nbstat->sin.sin_addr));
+           nbstat_dump_nbtstat(nbstat);
+           break;
+   }
+   w->count++;
+
+   if (nbstat_clock() - w->flushed >= NBSTAT_FLUSH_MS)
+       return nbstat_writer_flush(w);
+
+   return w->error ? NBSTAT_EDEBUG : NBSTAT_EOK;
+}
+
+/* nbstat_writer_event - one change seen by the monitor or a diff: `event' about the
+ * host, or about one of its names if node is not NULL. The binary format
+ * has no events; the monitor writes the new table instead. */
+int nbstat_writer_event(nbstat_writer_t *w, const char *event, const nbstat_t *nbstat,
+                        const struct nbstat_node_name *node)
+{
+   char stamp[32];
+   uint64_t now;
+   time_t t;
+
+   if (w == NULL || w->buf == NULL || nbstat == NULL || w->format == NBSTAT_FMT_BINARY)
+       return NBSTAT_EINVAL;
+
+   if (w->size - w->len < NBSTAT_RECORD_MAX)
+       nbstat_writer_flush(w);
+
+   now = w->stamp != 0 ? w->stamp : nbstat_walltime();
+   switch (w->format) {
+       case NBSTAT_FMT_NDJSON:
+           w_puts(w, "{\"time\":");
+           w_dec(w, (unsigned)(now / 1000));
+           w_puts(w, ",\"ip\":\"");
+           w_puts(w, inet_ntoa(nbstat->sin.sin_addr));
+           w_puts(w, "\",\"event\":\"");
+           w_puts(w, event);
+           w_puts(w, "\",\"mac\":\"");
+           w_mac(w, nbstat->hwaddr);
+           w_putc(w, '"');
+           if (node != NULL) {
+               w_puts(w, ",\"name\":\"");
+               w_jname(w, node);
+               w_puts(w, "\",\"suffix\":");
+               w_dec(w, node->suffix);
+               w_puts(w, node->g ? ",\"group\":true,\"flags\":" : ",\"group\":false,\"flags\":");
+               w_dec(w, name_flags(node));
+           }
+           w_puts(w, "}\n");
+           break;
+       case NBSTAT_FMT_CSV:
+           if (w->count == 0)
+               w_puts(w, "time,ip,event,mac,name,suffix,type,flags\n");
+           w_dec(w, (unsigned)(now / 1000));
+           w_putc(w, ',');
+           w_puts(w, inet_ntoa(nbstat->sin.sin_addr));
+           w_putc(w, ',');
+           w_puts(w, event);
+           w_putc(w, ',');
+           w_mac(w, nbstat->hwaddr);
+           if (node != NULL) {
+               w_putc(w, ',');
+               w_cname(w, node);
+               w_putc(w, ',');
+               w_hex(w, node->suffix);
+               w_puts(w, node->g ? ",GROUP," : ",UNIQUE,");
+               w_dec(w, name_flags(node));
+           } else {
+               w_puts(w, ",,,,");
+           }
+           w_putc(w, '\n');
+           break;
+       default:
+           /* time ip event mac [name<xx> type flags] */
+           t = (time_t)(now / 1000);
+           strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S ", localtime(&t));
+           w_puts(w, stamp);
+           w_puts(w, inet_ntoa(nbstat->sin.sin_addr));
+           w_putc(w, ' ');
+           w_puts(w, event);
+           w_putc(w, ' ');
+           w_mac(w, nbstat->hwaddr);
+           if (node != NULL) {
+               w_putc(w, ' ');
+               w_nbname(w, node);
+               w_puts(w, node->g ? " GROUP" : " UNIQUE");
+               if (node->cnf)
+                   w_puts(w, " CONFLICT");
+               if (node->drg)
+                   w_puts(w, " DEREGISTERING");
+           }
+           w_putc(w, '\n');
+           break;
+   }
+   w->count++;
+
+   if (nbstat_clock() - w->flushed >= NBSTAT_FLUSH_MS)
+       return nbstat_writer_flush(w);
+
+   return w->error ? NBSTAT_EDEBUG : NBSTAT_EOK;
+}
+
+/* nbstat_writer_name - the outcome of one name query, with every owner
+ * address of a positive answer. The table format prints as nmblookup does. */
+int nbstat_writer_name(nbstat_writer_t *w, int result, const uint8_t *name, const struct sockaddr_in *from,
+                       const struct nbstat_nb *nb, int count)
+{
+   static const char ont[] = "BPMH";
+   struct nbstat_node_name node;
+   struct in_addr in;
+   int i;
+
+   if (w == NULL || w->buf == NULL || name == NULL || w->format == NBSTAT_FMT_BINARY)
+       return NBSTAT_EINVAL;
+
+   if (w->size - w->len < NBSTAT_RECORD_MAX)
+       nbstat_writer_flush(w);
+
+   memset(&node, 0x00, sizeof(node));
+   memcpy(node.nbf_name, name, sizeof(node.nbf_name));
+   node.suffix = name[15];
+
+   switch (w->format) {
+       case NBSTAT_FMT_NDJSON:
+           w_puts(w, "{\"name\":\"");
+           w_jname(w, &node);
+           w_puts(w, "\",\"suffix\":");
+           w_dec(w, node.suffix);
+           w_puts(w, ",\"from\":\"");
+           w_puts(w, inet_ntoa(from->sin_addr));
+           if (result != NBSTAT_EOK) {
+               w_puts(w, "\",\"error\":\"");
+               w_puts(w, nbstat_error(result));
+               w_puts(w, "\"}\n");
+               break;
+           }
+           w_puts(w, "\",\"addrs\":[");
+           for (i = 0; i < count; i++) {
+               in.s_addr = htonl(nb[i].addr);
+               w_puts(w, i > 0 ? ",{\"ip\":\"" : "{\"ip\":\"");
+               w_puts(w, inet_ntoa(in));
+               w_puts(w, nb[i].flags & 0x8000 ? "\",\"group\":true,\"ont\":\"" : "\",\"group\":false,\"ont\":\"");
+               w_putc(w, ont[(nb[i].flags >> 13) & 0x3]);
+               w_puts(w, "\"}");
+           }
+           w_puts(w, "]}\n");
+           break;
+       case NBSTAT_FMT_CSV:
+           if (w->count == 0)
+               w_puts(w, "name,suffix,ip,type,ont,from,result\n");
+           for (i = 0; i < (result == NBSTAT_EOK ? count : 1); i++) {
+               w_cname(w, &node);
+               w_putc(w, ',');
+               w_hex(w, node.suffix);
+               w_putc(w, ',');
+               if (result == NBSTAT_EOK) {
+                   in.s_addr = htonl(nb[i].addr);
+                   w_puts(w, inet_ntoa(in));
+                   w_puts(w, nb[i].flags & 0x8000 ? ",GROUP," : ",UNIQUE,");
+                   w_putc(w, ont[(nb[i].flags >> 13) & 0x3]);
+               } else {
+                   w_puts(w, ",,");
+               }
+               w_putc(w, ',');
+               w_puts(w, inet_ntoa(from->sin_addr));
+               w_putc(w, ',');
+               w_puts(w, result == NBSTAT_EOK ? "ok" : nbstat_error(result));
+               w_putc(w, '\n');
+           }
+           break;
+       default:
+           if (result != NBSTAT_EOK) {
+               w_puts(w, "name_query failed to find name ");
+               w_nbname(w, &node);
+               w_putc(w, '\n');
+               break;
+           }
+           for (i = 0; i < count; i++) {
+               in.s_addr = htonl(nb[i].addr);
+               w_puts(w, inet_ntoa(in));
+               w_putc(w, ' ');
+               w_nbname(w, &node);
+               w_putc(w, '\n');
+           }
+           break;
+   }
+   w->count++;
+
+   if (nbstat_clock() - w->flushed >= NBSTAT_FLUSH_MS)
+       return nbstat_writer_flush(w);
+
+   return w->error ? NBSTAT_EDEBUG : NBSTAT_EOK;
+}
+
+/* nbstat_dump_nmblookup - print one node status the way nmblookup -A does. */
+void nbstat_dump_nmblookup(const nbstat_t *nbstat)
+{
+   nbstat_writer_t w;
+
+   if (nbstat_writer_init(&w, stdout, NBSTAT_FMT_NMBLOOKUP, NBSTAT_RECORD_MAX) != NBSTAT_EOK)
+       return;
+
+   nbstat_writer_put(&w, nbstat);
+   nbstat_writer_close(&w);
+}
+
+/*
+ * Archive reader. The file is mapped and walked in place; a block that is
+ * cut short, e.g. by a writer that is still running, ends the walk.
+ */
+
+/* nbstat_archive_close */
+void nbstat_archive_close(nbstat_archive_t *a)
+{
+   if (a == NULL || a->data == NULL)
+       return;
+
+#ifdef _WIN32
+   UnmapViewOfFile(a->data);
+   CloseHandle(a->map);
+   CloseHandle(a->file);
+#else
+   munmap((void *)a->data, a->length);
+#endif
+   a->data = NULL;
+}
+
+/* nbstat_archive_open - map an archive read-only and check its header. */
+int nbstat_archive_open(nbstat_archive_t *a, const char *path)
+{
+#ifndef _WIN32
+   struct stat st;
+   void *p;
+   int fd;
+#else
+   LARGE_INTEGER size;
+#endif
+
+   if (a == NULL || path == NULL)
+       return NBSTAT_EINVAL;
+   memset(a, 0x00, sizeof(*a));
+
+#ifdef _WIN32
+   a->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (a->file == INVALID_HANDLE_VALUE)
+       return NBSTAT_EINVAL;
+   if (!GetFileSizeEx(a->file, &size) || size.QuadPart < NBSTAT_ARCH_HDR) {
+       CloseHandle(a->file);
+       return NBSTAT_EPROTO;
+   }
+   a->map = CreateFileMappingA(a->file, NULL, PAGE_READONLY, 0, 0, NULL);
+   if (a->map != NULL)
+       a->data = (const uint8_t *)MapViewOfFile(a->map, FILE_MAP_READ, 0, 0, 0);
+   if (a->data == NULL) {
+       if (a->map != NULL)
+           CloseHandle(a->map);
+       CloseHandle(a->file);
+       return NBSTAT_ENOMEM;
+   }
+   a->length = (size_t)size.QuadPart;
+#else
+   fd = open(path, O_RDONLY);
+   if (fd < 0)
+       return NBSTAT_EINVAL;
+   if (fstat(fd, &st) < 0 || st.st_size < NBSTAT_ARCH_HDR) {
+       close(fd);
+       return NBSTAT_EPROTO;
+   }
+   p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (p == MAP_FAILED)
+       return NBSTAT_ENOMEM;
+   a->data = (const uint8_t *)p;
+   a->length = (size_t)st.st_size;
+#endif
+
+   if (memcmp(a->data, arch_magic, sizeof(arch_magic)) != 0 ||
+       dec16be(a->data + 4) != NBSTAT_ARCH_VERSION ||
+       dec16be(a->data + 6) != NBSTAT_ARCH_HDR ||
+       dec16be(a->data + 8) != NBSTAT_ARCH_REC ||
+       dec16be(a->data + 10) != NBSTAT_ARCH_NAME) {
+       nbstat_archive_close(a);
+       return NBSTAT_EPROTO;
+   }
+   a->created = dec64be(a->data + 16);
+
+   return NBSTAT_EOK;
+}
+
+/* nbstat_archive_first - position before the first record. */
+void nbstat_archive_first(nbstat_arch_iter_t *it)
+{
+   memset(it, 0x00, sizeof(*it));
+}
+
+/* arch_block - find the block after the one at `block' (0 for the first),
+ * with nrec records and nname names; 0 if there is no complete one. */
+static int arch_block(const nbstat_archive_t *a, size_t block, uint32_t nrec, uint32_t nname,
+                         size_t *off)
+{
+   const uint8_t *blk;
+   uint64_t size;
+
+   *off = block == 0 ? NBSTAT_ARCH_HDR
+                     : block + NBSTAT_ARCH_BLOCK + (size_t)nrec * NBSTAT_ARCH_REC + (size_t)nname * NBSTAT_ARCH_NAME;
+   if (*off > a->length || a->length - *off < NBSTAT_ARCH_BLOCK)
+       return 0;
+
+   blk = a->data + *off;
+   if (memcmp(blk, block_magic, sizeof(block_magic)) != 0)
+       return 0;
+   size = NBSTAT_ARCH_BLOCK + (uint64_t)dec32be(blk + 4) * NBSTAT_ARCH_REC +
+          (uint64_t)dec32be(blk + 8) * NBSTAT_ARCH_NAME;
+   if (size > a->length - *off)
+       return 0;
+
+   return 1;
+}
+
+/* nbstat_archive_next - step to the next record; 0 at the end of the archive,
+ * or at the first block that is damaged or only partly written. */
+int nbstat_archive_next(const nbstat_archive_t *a, nbstat_arch_iter_t *it)
+{
+   const uint8_t *blk;
+   size_t off;
+
+   while (it->i >= it->nrec) {
+       if (arch_block(a, it->block, it->nrec, it->nname, &off) == 0)
+           return 0;
+
+       blk = a->data + off;
+       it->block = off;
+       it->nrec = dec32be(blk + 4);
+       it->nname = dec32be(blk + 8);
+       it->i = 0;
+       it->names = blk + NBSTAT_ARCH_BLOCK + (size_t)it->nrec * NBSTAT_ARCH_REC;
+   }
+
+   it->rec = a->data + it->block + NBSTAT_ARCH_BLOCK + (size_t)it->i * NBSTAT_ARCH_REC;
+   it->i++;
+
+   /* A record must not point outside its block. */
+   if ((uint64_t)dec32be(it->rec + 20) + dec8be(it->rec + 10) > it->nname)
+       return 0;
+
+   return 1;
+}
+
+/* Record accessors */
+uint32_t nbstat_arec_addr(const nbstat_arch_iter_t *it)
+{
+   return dec32be(it->rec);
+}
+
+const uint8_t *nbstat_arec_hwaddr(const nbstat_arch_iter_t *it)
+{
+   return it->rec + 4;
+}
+
+int nbstat_arec_count(const nbstat_arch_iter_t *it)
+{
+   return dec8be(it->rec + 10);
+}
+
+uint64_t nbstat_arec_time(const nbstat_arch_iter_t *it)
+{
+   return dec64be(it->rec + 12);
+}
+
+/* nbstat_arec_name - name i of the record, as in nbstat_view_name(). */
+const uint8_t *nbstat_arec_name(const nbstat_arch_iter_t *it, int i, uint8_t *suffix, uint16_t *flags)
+{
+   const uint8_t *p = it->names + ((size_t)dec32be(it->rec + 20) + i) * NBSTAT_ARCH_NAME;
+
+   if (suffix != NULL)
+       *suffix = dec8be(p + 15);
+   if (flags != NULL)
+       *flags = dec16be(p + 16);
+
+   return p;
+}
+
+/* nbstat_arec_decode - expand the current record into an nbstat_t. */
+void nbstat_arec_decode(const nbstat_arch_iter_t *it, nbstat_t *nbstat)
+{
+   uint8_t entry[NBSTAT_NAME_SIZE];
+   int i;
+
+   memset(&nbstat->sin, 0x00, sizeof(nbstat->sin));
+   nbstat->sin.sin_family = AF_INET;
+   nbstat->sin.sin_addr.s_addr = htonl(nbstat_arec_addr(it));
+   memcpy(nbstat->hwaddr, nbstat_arec_hwaddr(it), sizeof(nbstat->hwaddr));
+   nbstat->ttl = 0;
+
+   nbstat->count = nbstat_arec_count(it);
+   if (nbstat->count > NBSTAT_MAX_NAMES)
+       nbstat->count = NBSTAT_MAX_NAMES;
+
+   /* Archive names keep the wire layout in their first 18 bytes. */
+   for (i = 0; i < nbstat->count; i++) {
+       memcpy(entry, nbstat_arec_name(it, i, NULL, NULL), sizeof(entry));
+       node_name_decode(&nbstat->node[i], entry);
+   }
+}
+
+/*
+ * Capture reader. Classic pcap (either byte order, us or ns stamps) and
+ * pcapng (section, interface and packet blocks) are streamed through one
+ * record buffer, so memory stays constant whatever the size of the capture,
+ * and a capture can come from a pipe. Node status responses are picked out
+ * of IPv4 UDP over Ethernet (with VLAN tags), Linux cooked, loopback and raw
+ * IP links; fragments and anything else are skipped.
+ */
+#define NBSTAT_PCAP_IOBUF (1 << 20)
+
+#define PCAP_MAGIC     0xa1b2c3d4U
+#define PCAP_MAGIC_NS  0xa1b23c4dU
+#define PCAPNG_SHB     0x0a0d0d0aU
+#define PCAPNG_BOM     0x1a2b3c4dU
+#define PCAPNG_IDB     1
+#define PCAPNG_OPB     2 /* Obsolete packet block */
+#define PCAPNG_SPB     3
+#define PCAPNG_EPB     6
+
+#define LINKTYPE_NULL       0
+#define LINKTYPE_ETHERNET   1
+#define LINKTYPE_RAW        101
+#define LINKTYPE_LOOP       108
+#define LINKTYPE_LINUX_SLL  113
+#define LINKTYPE_IPV4       228
+#define LINKTYPE_LINUX_SLL2 276
+
+/* pcap16, pcap32 - a field in the byte order of the capture. */
+static uint16_t pcap16(const nbstat_pcap_t *p, const uint8_t *ptr)
+{
+   return p->be ? dec16be(ptr) : (uint16_t)(ptr[0] | ptr[1] << 8);
+}
+
+static uint32_t pcap32(const nbstat_pcap_t *p, const uint8_t *ptr)
+{
+   return p->be ? dec32be(ptr) : ((uint32_t)ptr[3] << 24 | (uint32_t)ptr[2] << 16 | ptr[1] << 8 | ptr[0]);
+}
+
+/* pcap_read - read exactly n bytes; 0 at a clean or truncated end. */
+static int pcap_read(nbstat_pcap_t *p, void *buf, size_t n)
+{
+   return fread(buf, 1, n, p->fp) == n;
+}
+
+/* pcap_skip - skip n bytes, without seeking, so that pipes work. */
+static int pcap_skip(nbstat_pcap_t *p, uint64_t n)
+{
+   size_t chunk;
+
+   while (n > 0) {
+       chunk = n < NBSTAT_PCAP_SNAP ? (size_t)n : NBSTAT_PCAP_SNAP;
+       if (!pcap_read(p, p->buf, chunk))
+           return 0;
+       n -= chunk;
+   }
+
+   return 1;
+}
+
+/* nbstat_pcap_close */
+void nbstat_pcap_close(nbstat_pcap_t *p)
+{
+   if (p->fp != NULL && p->fp != stdin)
+       fclose(p->fp);
+   free(p->buf);
+   memset(p, 0x00, sizeof(*p));
+}
+
+/* nbstat_pcap_open - open a capture, "-" for stdin, and read its header. */
+int nbstat_pcap_open(nbstat_pcap_t *p, const char *path)
+{
+   uint8_t hdr[24];
+   uint32_t magic;
+
+   memset(p, 0x00, sizeof(*p));
+   p->fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+   if (p->fp == NULL)
+       return NBSTAT_EINVAL;
+#ifdef _WIN32
+   if (p->fp == stdin)
+       _setmode(_fileno(stdin), _O_BINARY);
+#endif
+   setvbuf(p->fp, NULL, _IOFBF, NBSTAT_PCAP_IOBUF);
+
+   p->buf = malloc(NBSTAT_PCAP_SNAP + 32);
+   if (p->buf == NULL) {
+       nbstat_pcap_close(p);
+       return NBSTAT_ENOMEM;
+   }
+
+   if (!pcap_read(p, hdr, 4)) {
+       nbstat_pcap_close(p);
+       return NBSTAT_EPROTO;
+   }
+
+   /* pcapng: the section header is read as the first block. */
+   magic = dec32be(hdr);
+   if (magic == PCAPNG_SHB) {
+       p->ng = 1;
+       p->have = 4;
+       memcpy(p->buf, hdr, 4);
+       return NBSTAT_EOK;
+   }
+
+   p->be = 1;
+   if (magic != PCAP_MAGIC && magic != PCAP_MAGIC_NS) {
+       p->be = 0;
+       magic = pcap32(p, hdr);
+   }
+   if ((magic != PCAP_MAGIC && magic != PCAP_MAGIC_NS) || !pcap_read(p, hdr + 4, sizeof(hdr) - 4)) {
+       nbstat_pcap_close(p);
+       return NBSTAT_EPROTO;
+   }
+   p->nsec = magic == PCAP_MAGIC_NS;
+   p->linktype = pcap32(p, hdr + 20) & 0xffff;
+
+   return NBSTAT_EOK;
+}
+
+/* pcap_idb - take note of a pcapng interface: its link type and time stamp
+ * resolution, 10^-n or 2^-n seconds (option if_tsresol), us by default. */
+static void pcap_idb(nbstat_pcap_t *p, const uint8_t *body, size_t length)
+{
+   const uint8_t *opt = body + 8;
+   const uint8_t *end = body + length;
+   uint64_t units = 1000000;
+   uint16_t code, n;
+   int i;
+
+   if (p->nif >= NBSTAT_PCAP_IFMAX || length < 8)
+       return;
+
+   while (opt + 4 <= end) {
+       code = pcap16(p, opt);
+       n = pcap16(p, opt + 2);
+       if (code == 0 || opt + 4 + n > end)
+           break;
+       if (code == 9 && n == 1) {
+           if (opt[4] & 0x80)
+               units = (opt[4] & 0x7f) < 64 ? (uint64_t)1 << (opt[4] & 0x7f) : 0;
+           else
+               for (units = 1, i = 0; i < opt[4] && i < 19; i++)
+                   units *= 10;
+       }
+       opt += 4 + ((n + 3) & ~3);
+   }
+
+   p->iflink[p->nif] = pcap16(p, body);
+   p->ifunits[p->nif] = units != 0 ? units : 1000000;
+   p->nif++;
+}
+
+/* pcap_ngtime - pcapng stamp of interface i in ms. */
+static uint64_t pcap_ngtime(const nbstat_pcap_t *p, int i, uint32_t hi, uint32_t lo)
+{
+   uint64_t ts = (uint64_t)hi << 32 | lo;
+   uint64_t units = p->ifunits[i];
+
+   return ts / units * 1000 + ts % units * 1000 / units;
+}
+
+/* pcap_block - the next pcapng block into p->buf; returns its total length,
+ * 0 at the end, or -1 after skipping a block too large for the buffer. */
+static int64_t pcap_block(nbstat_pcap_t *p)
+{
+   uint32_t length;
+   int have = p->have;
+
+   /* The block type is palindromic for section headers, so the byte order
+    * of a new section becomes known from the magic that follows it. */
+   p->have = 0;
+   if (!pcap_read(p, p->buf + have, 8 - have))
+       return 0;
+   if (dec32be(p->buf) == PCAPNG_SHB) {
+       if (!pcap_read(p, p->buf + 8, 4))
+           return 0;
+       p->be = dec32be(p->buf + 8) == PCAPNG_BOM;
+       if (pcap32(p, p->buf + 8) != PCAPNG_BOM)
+           return 0;
+       p->nif = 0;
+       length = pcap32(p, p->buf + 4);
+       if (length < 28 || (length & 3))
+           return 0;
+       return pcap_skip(p, length - 12) ? -1 : 0;
+   }
+
+   length = pcap32(p, p->buf + 4);
+   if (length < 12 || (length & 3))
+       return 0;
+   if (length > NBSTAT_PCAP_SNAP + 32) {
+       p->skipped++;
+       return pcap_skip(p, length - 8) ? -1 : 0;
+   }
+
+   return pcap_read(p, p->buf + 8, length - 8) ? (int64_t)length : 0;
+}
+
+/* nbstat_pcap_next - read the next packet; returns 0 at the end of the
+ * capture, including at a truncated last record. */
+int nbstat_pcap_next(nbstat_pcap_t *p, nbstat_packet_t *pkt)
+{
+   const uint8_t *body;
+   uint32_t caplen, type, i;
+   int64_t length;
+
+   while (!p->ng) {
+       if (!pcap_read(p, p->buf, 16))
+           return 0;
+       caplen = pcap32(p, p->buf + 8);
+       if (caplen > NBSTAT_PCAP_SNAP) {
+           p->skipped++;
+           if (!pcap_skip(p, caplen))
+               return 0;
+           continue;
+       }
+       pkt->time = (uint64_t)pcap32(p, p->buf) * 1000 + pcap32(p, p->buf + 4) / (p->nsec ? 1000000 : 1000);
+       if (!pcap_read(p, p->buf, caplen))
+           return 0;
+       pkt->data = p->buf;
+       pkt->length = caplen;
+       pkt->linktype = p->linktype;
+       return 1;
+   }
+
+   for (;;) {
+       length = pcap_block(p);
+       if (length == 0)
+           return 0;
+       if (length < 0)
+           continue;
+
+       type = pcap32(p, p->buf);
+       body = p->buf + 8;
+       length -= 12;
+       if (type == PCAPNG_IDB) {
+           pcap_idb(p, body, (size_t)length);
+           continue;
+       }
+
+       if (type == PCAPNG_EPB || type == PCAPNG_OPB) {
+           if (length < 20)
+               continue;
+           i = type == PCAPNG_EPB ? pcap32(p, body) : pcap16(p, body);
+           caplen = pcap32(p, body + 12);
+           if (i >= (uint32_t)p->nif || caplen > length - 20) {
+               p->skipped++;
+               continue;
+           }
+           pkt->time = pcap_ngtime(p, (int)i, pcap32(p, body + 4), pcap32(p, body + 8));
+           pkt->data = body + 20;
+       } else if (type == PCAPNG_SPB) {
+           if (length < 4 || p->nif == 0)
+               continue;
+           i = 0;
+           caplen = pcap32(p, body);
+           if (caplen > length - 4)
+               caplen = (uint32_t)length - 4;
+           pkt->time = 0;
+           pkt->data = body + 4;
+       } else {
+           continue;
+       }
+
+       pkt->length = caplen;
+       pkt->linktype = p->iflink[i];
+       return 1;
+   }
+}
+
+/* nbstat_pcap_view - validate a packet as a node status response sent from
+ * UDP `port', in place; NBSTAT_EPROTO for anything else. */
+int nbstat_pcap_view(const nbstat_packet_t *pkt, uint16_t port, nbstat_view_t *view, struct sockaddr_in *from)
+{
+   const uint8_t *data = pkt->data;
+   const uint8_t *udp;
+   size_t length = pkt->length;
+   size_t off, ihl, total;
+   uint16_t type = 0x0800;
+   buffer_t buffer;
+
+   switch (pkt->linktype) {
+   case LINKTYPE_ETHERNET:
+       if (length < 14)
+           return NBSTAT_EPROTO;
+       type = dec16be(data + 12);
+       for (off = 14; (type == 0x8100 || type == 0x88a8) && length >= off + 4; off += 4)
+           type = dec16be(data + off + 2);
+       break;
+   case LINKTYPE_NULL: /* Address family in the byte order of the host */
+   case LINKTYPE_LOOP:
+       if (length < 4 || (dec32be(data) != AF_INET && data[0] != AF_INET))
+           return NBSTAT_EPROTO;
+       off = 4;
+       break;
+   case LINKTYPE_LINUX_SLL:
+       if (length < 16)
+           return NBSTAT_EPROTO;
+       type = dec16be(data + 14);
+       off = 16;
+       break;
+   case LINKTYPE_LINUX_SLL2:
+       if (length < 20)
+           return NBSTAT_EPROTO;
+       type = dec16be(data);
+       off = 20;
+       break;
+   case LINKTYPE_RAW:
+   case LINKTYPE_IPV4:
+       off = 0;
+       break;
+   default:
+       return NBSTAT_EPROTO;
+   }
+   if (type != 0x0800 || length < off + 20)
+       return NBSTAT_EPROTO;
+
+   /* IPv4, UDP, not a fragment; the capture may hold trailing padding. */
+   data += off;
+   length -= off;
+   ihl = (size_t)(data[0] & 0x0f) * 4;
+   total = dec16be(data + 2);
+   if ((data[0] >> 4) != 4 || ihl < 20 || data[9] != IPPROTO_UDP || (dec16be(data + 6) & 0x3fff) != 0 ||
+       total < ihl + 8 || total > length)
+       return NBSTAT_EPROTO;
+
+   udp = data + ihl;
+   if (dec16be(udp) != port || dec16be(udp + 4) < 8 || dec16be(udp + 4) > total - ihl)
+       return NBSTAT_EPROTO;
+
+   buffer.data = (void *)(udp + 8);
+   buffer.size = buffer.length = dec16be(udp + 4) - 8;
+   if (nbstat_view_init(view, &buffer) != NBSTAT_EOK)
+       return NBSTAT_EPROTO;
+
+   memset(from, 0x00, sizeof(*from));
+   from->sin_family = AF_INET;
+   memcpy(&from->sin_addr.s_addr, data + 12, 4);
+   from->sin_port = htons(port);
+
+   return NBSTAT_EOK;
+}
+
+/*
+ * Response cache. Node status answers are kept by address with an expiry
+ * time, so that repeated runs only query the hosts whose entry is missing
+ * or stale. The file is an archive whose record time is the expiry.
+ */
+
+#define NBSTAT_CACHE_TTL 300 /* Seconds, when the response carries no TTL */
+
+struct nbstat_centry {
+   uint32_t addr;    /* Host order, 0 = empty slot */
+   int served;       /* Fresh and left out of the sweep */
+   uint64_t expires; /* ms since 1970 */
+   nbstat_t nbstat;
+};
+
+struct nbstat_cache {
+   struct nbstat_centry *slot; /* Open addressing by address */
+   size_t n;
+   size_t size;                /* Power of two */
+   struct nbstat_centry *added; /* Put since the last commit */
+   size_t nadded;
+   size_t maxadded;
+   uint32_t ttl;
+   uint64_t now;
+};
+
+/* nbstat_cache_create - `ttl' applies to responses with a TTL of 0, which
+ * is what most nodes send. */
+int nbstat_cache_create(nbstat_cache_t **cache, uint32_t ttl)
+{
+   nbstat_cache_t *c;
+
+   if (cache == NULL)
+       return NBSTAT_EINVAL;
+
+   c = calloc(1, sizeof(*c));
+   if (c == NULL)
+       return NBSTAT_ENOMEM;
+
+   c->ttl = ttl != 0 ? ttl : NBSTAT_CACHE_TTL;
+   c->now = nbstat_walltime();
+   *cache = c;
+
+   return NBSTAT_EOK;
+}
+
+/* nbstat_cache_destroy */
+void nbstat_cache_destroy(nbstat_cache_t *cache)
+{
+   if (cache == NULL)
+       return;
+
+   free(cache->slot);
+   free(cache->added);
+   free(cache);
+}
+
+/* cache_slot - slot of addr, or the empty slot where it would go */
+static struct nbstat_centry *cache_slot(struct nbstat_centry *slot, size_t size, uint32_t addr)
+{
+   size_t i;
+
+   for (i = addr * 2654435761U & (size - 1); slot[i].addr != 0; i = (i + 1) & (size - 1)) {
+       if (slot[i].addr == addr)
+           break;
+   }
+
+   return &slot[i];
+}
+
+/* cache_insert - store an entry unless a newer one for the address is there. */
+static int cache_insert(nbstat_cache_t *c, const struct nbstat_centry *e)
+{
+   struct nbstat_centry *slot, *p;
+   size_t size, i;
+
+   if (2 * (c->n + 1) > c->size) {
+       size = c->size != 0 ? 2 * c->size : 256;
+       slot = calloc(size, sizeof(*slot));
+       if (slot == NULL)
+           return NBSTAT_ENOMEM;
+       for (i = 0; i < c->size; i++) {
+           if (c->slot[i].addr != 0)
+               *cache_slot(slot, size, c->slot[i].addr) = c->slot[i];
+       }
+       free(c->slot);
+       c->slot = slot;
+       c->size = size;
+   }
+
+   p = cache_slot(c->slot, c->size, e->addr);
+   if (p->addr == 0)
+       c->n++;
+   else if (p->expires > e->expires)
+       return NBSTAT_EOK;
+   *p = *e;
+
+   return NBSTAT_EOK;
+}
+
+/* nbstat_cache_load - add the live entries of a cache file; a missing file
+ * is an empty cache. */
+int nbstat_cache_load(nbstat_cache_t *cache, const char *path)
+{
+   struct nbstat_centry e;
+   nbstat_archive_t archive;
+   nbstat_arch_iter_t it;
+   FILE *fp;
+   int result;
+
+   /* Tell a missing file from one that is not an archive. */
+   fp = fopen(path, "rb");
+   if (fp == NULL)
+       return NBSTAT_EOK;
+   fclose(fp);
+
+   result = nbstat_archive_open(&archive, path);
+   if (result != NBSTAT_EOK)
+       return result;
+
+   memset(&e, 0x00, sizeof(e));
+   nbstat_archive_first(&it);
+   while (result == NBSTAT_EOK && nbstat_archive_next(&archive, &it)) {
+       e.addr = nbstat_arec_addr(&it);
+       e.expires = nbstat_arec_time(&it);
+       if (e.addr == 0 || e.expires <= cache->now)
+           continue;
+       nbstat_arec_decode(&it, &e.nbstat);
+       result = cache_insert(cache, &e);
+   }
+
+   nbstat_archive_close(&archive);
+
+   return result;
+}
+
+/* nbstat_cache_get - the cached answer of addr (host order) if it is still
+ * fresh, or NULL. The entry is marked as served. */
+const nbstat_t *nbstat_cache_get(nbstat_cache_t *cache, uint32_t addr)
+{
+   struct nbstat_centry *e;
+
+   if (cache->n == 0 || addr == 0)
+       return NULL;
+
+   e = cache_slot(cache->slot, cache->size, addr);
+   if (e->addr == 0 || e->expires <= cache->now)
+       return NULL;
+   e->served = 1;
+
+   return &e->nbstat;
+}
+
+/* nbstat_cache_skip - nbstat_skip_fn that leaves out the hosts with a fresh
+ * entry. The table does not change during a sweep, and a sweep asks about
+ * each address once, from the one thread that would send to it, so the
+ * sweep threads may share it. */
+int nbstat_cache_skip(void *arg, uint32_t addr)
+{
+   return nbstat_cache_get((nbstat_cache_t *)arg, addr) != NULL;
+}
+
+/* nbstat_cache_served - report the entries that nbstat_cache_get() handed out. */
+void nbstat_cache_served(const nbstat_cache_t *cache, nbstat_broadcast_fn fn, void *user)
+{
+   size_t i;
+
+   for (i = 0; i < cache->size; i++) {
+       if (cache->slot[i].addr != 0 && cache->slot[i].served)
+           fn(user, &cache->slot[i].nbstat);
+   }
+}
+
+/* nbstat_cache_put - remember a fresh answer. It is kept aside until
+ * nbstat_cache_commit(), so that lookups stay safe during a sweep. */
+int nbstat_cache_put(nbstat_cache_t *cache, const nbstat_t *nbstat)
+{
+   struct nbstat_centry *e;
+   size_t max;
+
+   if (cache->nadded == cache->maxadded) {
+       max = cache->maxadded != 0 ? 2 * cache->maxadded : 64;
+       e = realloc(cache->added, max * sizeof(*e));
+       if (e == NULL)
+           return NBSTAT_ENOMEM;
+       cache->added = e;
+       cache->maxadded = max;
+   }
+
+   e = &cache->added[cache->nadded++];
+   e->addr = ntohl(nbstat->sin.sin_addr.s_addr);
+   e->served = 0;
+   e->expires = nbstat_walltime() + 1000 * (uint64_t)(nbstat->ttl != 0 ? nbstat->ttl : cache->ttl);
+   e->nbstat = *nbstat;
+
+   return NBSTAT_EOK;
+}
+
+/* nbstat_cache_commit - move the new answers into the table. */
+int nbstat_cache_commit(nbstat_cache_t *cache)
+{
+   size_t i;
+
+   for (i = 0; i < cache->nadded; i++) {
+       if (cache->added[i].addr != 0 && cache_insert(cache, &cache->added[i]) != NBSTAT_EOK)
+           return NBSTAT_ENOMEM;
+   }
+   cache->nadded = 0;
+
+   return NBSTAT_EOK;
+}
+
+/* nbstat_cache_save - commit and write the live entries to path. The file
+ * is replaced in one step, so a concurrent reader sees old or new. */
+int nbstat_cache_save(nbstat_cache_t *cache, const char *path)
+{
+   nbstat_writer_t w;
+   char *tmp;
+   FILE *fp;
+   size_t i;
+   int result;
+
+   result = nbstat_cache_commit(cache);
+   if (result != NBSTAT_EOK)
+       return result;
+
+   tmp = malloc(strlen(path) + 5);
+   if (tmp == NULL)
+       return NBSTAT_ENOMEM;
+   strcpy(tmp, path);
+   strcat(tmp, ".tmp");
+
+   fp = fopen(tmp, "wb");
+   if (fp == NULL) {
+       free(tmp);
+       return NBSTAT_EINVAL;
+   }
+
+   result = nbstat_writer_init(&w, fp, NBSTAT_FMT_BINARY, 0);
+   if (result == NBSTAT_EOK) {
+       for (i = 0; i < cache->size; i++) {
+           if (cache->slot[i].addr == 0 || cache->slot[i].expires <= cache->now)
+               continue;
+           w.stamp = cache->slot[i].expires;
+           nbstat_writer_put(&w, &cache->slot[i].nbstat);
+       }
+       result = nbstat_writer_close(&w);
+   }
+   if (fclose(fp) != 0 && result == NBSTAT_EOK)
+       result = NBSTAT_EDEBUG;
+
+#ifdef _WIN32
+   if (result == NBSTAT_EOK && !MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING))
+       result = NBSTAT_EINVAL;
+#else
+   if (result == NBSTAT_EOK && rename(tmp, path) != 0)
+       result = NBSTAT_EINVAL;
+#endif
+   if (result != NBSTAT_EOK)
+       remove(tmp);
+   free(tmp);
+
+   return result;
+}
+
+/*
+ * Result index. Answers are collapsed into one node per MAC address, so a
+ * multi-homed host appears once with all of its addresses, and two hash
+ * tables find the nodes by MAC and by (name, suffix) in O(1). Nodes, lists
+ * and keys all live in one arena and refer to each other by offset, so
+ * growing it is a single realloc; the tables hold arena offsets too.
+ * Pointers returned by lookups are valid until the next nbstat_index_add().
+ */
+
+struct nbstat_inode {
+   nbstat_t nbstat;   /* First answer seen for the MAC */
+   uint32_t addrs;    /* List of nbstat_ilink, by address */
+   uint32_t last;
+   uint32_t naddr;
+};
+
+struct nbstat_ikey {
+   uint8_t nbf_name[15];
+   uint8_t suffix;
+   uint32_t nodes;    /* List of nbstat_ilink, by node */
+   uint32_t last;
+};
+
+/* List element: an address, or the offset of a node */
+struct nbstat_ilink {
+   uint32_t value;
+   uint32_t next;
+};
+
+struct nbstat_index {
+   uint8_t *arena;
+   size_t used;       /* Offset 0 stays unused and means none */
+   size_t size;
+   uint32_t *mac;     /* Node offsets, open addressing by MAC */
+   size_t nmac;
+   size_t macsize;
+   uint32_t *name;    /* Key offsets, open addressing by name and suffix */
+   size_t nname;
+   size_t namesize;
+};
+
+#define INDEX_AT(x, off, type) ((type *)((x)->arena + (off)))
+
+/* nbstat_index_create */
+int nbstat_index_create(nbstat_index_t **index)
+{
+   nbstat_index_t *x;
+
+   if (index == NULL)
+       return NBSTAT_EINVAL;
+
+   x = calloc(1, sizeof(*x));
+   if (x == NULL)
+       return NBSTAT_ENOMEM;
+   x->used = 8;
+   *index = x;
+
+   return NBSTAT_EOK;
+}
+
+/* nbstat_index_destroy */
+void nbstat_index_destroy(nbstat_index_t *index)
+{
+   if (index == NULL)
+       return;
+
+   free(index->arena);
+   free(index->mac);
+   free(index->name);
+   free(index);
+}
+
+/* index_alloc - zeroed room in the arena, 8-byte aligned; 0 if out of memory. */
+static uint32_t index_alloc(nbstat_index_t *x, size_t size)
+{
+   uint8_t *arena;
+   size_t max;
+   uint32_t off;
+
+   size = (size + 7) & ~(size_t)7;
+   if (x->used + size > x->size) {
+       for (max = x->size != 0 ? x->size : 65536; x->used + size > max; max *= 2)
+           ;
+       if (max > 0xffffffffU)
+           return 0;
+       arena = realloc(x->arena, max);
+       if (arena == NULL)
+           return 0;
+       x->arena = arena;
+       x->size = max;
+   }
+
+   off = (uint32_t)x->used;
+   memset(x->arena + off, 0x00, size);
+   x->used += size;
+
+   return off;
+}
+
+/* index_append - add value at the end of the list head/last. The list
+ * fields are passed as offsets, since the arena may move. */
+static int index_append(nbstat_index_t *x, uint32_t head, uint32_t last, uint32_t value)
+{
+   uint32_t off = index_alloc(x, sizeof(struct nbstat_ilink));
+   uint32_t *tail;
+
+   if (off == 0)
+       return NBSTAT_ENOMEM;
+   INDEX_AT(x, off, struct nbstat_ilink)->value = value;
+
+   tail = INDEX_AT(x, last, uint32_t);
+   if (*tail == 0)
+       *INDEX_AT(x, head, uint32_t) = off;
+   else
+       INDEX_AT(x, *tail, struct nbstat_ilink)->next = off;
+   *tail = off;
+
+   return NBSTAT_EOK;
+}
+
+/* mac_hash, name_hash - FNV-1a */
+static uint32_t mac_hash(const uint8_t *hwaddr)
+{
+   uint32_t h = 2166136261U;
+   int i;
+
+   for (i = 0; i < 6; i++)
+       h = (h ^ hwaddr[i]) * 16777619U;
+
+   return h;
+}
+
+static uint32_t name_hash(const uint8_t *nbf_name, uint8_t suffix)
+{
+   uint32_t h = 2166136261U;
+   int i;
+
+   for (i = 0; i < 15; i++)
+       h = (h ^ nbf_name[i]) * 16777619U;
+
+   return (h ^ suffix) * 16777619U;
+}
+
+/* index_mac_slot - slot of hwaddr in the MAC table, or the empty one where it goes */
+static uint32_t *index_mac_slot(const nbstat_index_t *x, uint32_t *table, size_t size, const uint8_t *hwaddr)
+{
+   size_t i;
+
+   for (i = mac_hash(hwaddr) & (size - 1); table[i] != 0; i = (i + 1) & (size - 1)) {
+       if (memcmp(INDEX_AT(x, table[i], struct nbstat_inode)->nbstat.hwaddr, hwaddr, 6) == 0)
+           break;
+   }
+
+   return &table[i];
+}
+
+/* index_name_slot - the same for a name and suffix */
+static uint32_t *index_name_slot(const nbstat_index_t *x, uint32_t *table, size_t size,
+                                 const uint8_t *nbf_name, uint8_t suffix)
+{
+   const struct nbstat_ikey *key;
+   size_t i;
+
+   for (i = name_hash(nbf_name, suffix) & (size - 1); table[i] != 0; i = (i + 1) & (size - 1)) {
+       key = INDEX_AT(x, table[i], struct nbstat_ikey);
+       if (key->suffix == suffix && memcmp(key->nbf_name, nbf_name, 15) == 0)
+           break;
+   }
+
+   return &table[i];
+}
+
+/* index_grow - keep a table at most half full. */
+static int index_grow(nbstat_index_t *x, int names)
+{
+   uint32_t **table = names ? &x->name : &x->mac;
+   size_t *size = names ? &x->namesize : &x->macsize;
+   size_t n = names ? x->nname : x->nmac;
+   const struct nbstat_ikey *key;
+   uint32_t *grown;
+   size_t max, i;
+
+   if (2 * (n + 1) <= *size)
+       return NBSTAT_EOK;
+
+   max = *size != 0 ? 2 * *size : 1024;
+   grown = calloc(max, sizeof(uint32_t));
+   if (grown == NULL)
+       return NBSTAT_ENOMEM;
+
+   for (i = 0; i < *size; i++) {
+       if ((*table)[i] == 0)
+           continue;
+       if (names) {
+           key = INDEX_AT(x, (*table)[i], struct nbstat_ikey);
+           *index_name_slot(x, grown, max, key->nbf_name, key->suffix) = (*table)[i];
+       } else {
+           *index_mac_slot(x, grown, max, INDEX_AT(x, (*table)[i], struct nbstat_inode)->nbstat.hwaddr) = (*table)[i];
+       }
+   }
+
+   free(*table);
+   *table = grown;
+   *size = max;
+
+   return NBSTAT_EOK;
+}
+
+/* nbstat_index_add - index one answer. An answer with the MAC of a known
+ * node only adds its address to that node, and the node keeps the names of
+ * the first answer; all-zero MACs, as sent by some stacks, are never merged. */
+int nbstat_index_add(nbstat_index_t *index, const nbstat_t *nbstat)
+{
+   static const uint8_t zero[6] = { 0 };
+   const struct nbstat_ilink *link;
+   struct nbstat_ikey *key;
+   uint32_t *slot = NULL;
+   uint32_t node, off, addr;
+   int merge = memcmp(nbstat->hwaddr, zero, 6) != 0;
+   int i;
+
+   if (index_grow(index, 0) != NBSTAT_EOK)
+       return NBSTAT_ENOMEM;
+
+   node = 0;
+   if (merge) {
+       slot = index_mac_slot(index, index->mac, index->macsize, nbstat->hwaddr);
+       node = *slot;
+   }
+
+   if (node == 0) {
+       node = index_alloc(index, sizeof(struct nbstat_inode));
+       if (node == 0)
+           return NBSTAT_ENOMEM;
+       INDEX_AT(index, node, struct nbstat_inode)->nbstat = *nbstat;
+       if (merge) {
+           *slot = node;
+           index->nmac++;
+       }
+
+       for (i = 0; i < nbstat->count; i++) {
+           if (index_grow(index, 1) != NBSTAT_EOK)
+               return NBSTAT_ENOMEM;
+           slot = index_name_slot(index, index->name, index->namesize,
+                                  nbstat->node[i].nbf_name, nbstat->node[i].suffix);
+           if (*slot == 0) {
+               off = index_alloc(index, sizeof(struct nbstat_ikey));
+               if (off == 0)
+                   return NBSTAT_ENOMEM;
+               key = INDEX_AT(index, off, struct nbstat_ikey);
+               memcpy(key->nbf_name, nbstat->node[i].nbf_name, 15);
+               key->suffix = nbstat->node[i].suffix;
+               *slot = off;
+               index->nname++;
+           } else {
+               off = *slot;
+           }
+           if (index_append(index, off + offsetof(struct nbstat_ikey, nodes),
+                            off + offsetof(struct nbstat_ikey, last), node) != NBSTAT_EOK)
+               return NBSTAT_ENOMEM;
+       }
+   }
+
+   /* The same host again, e.g. from an archive of several scans */
+   addr = ntohl(nbstat->sin.sin_addr.s_addr);
+   for (off = INDEX_AT(index, node, struct nbstat_inode)->addrs; off != 0; off = link->next) {
+       link = INDEX_AT(index, off, struct nbstat_ilink);
+       if (link->value == addr)
+           return NBSTAT_EOK;
+   }
+   INDEX_AT(index, node, struct nbstat_inode)->naddr++;
+
+   return index_append(index, node + offsetof(struct nbstat_inode, addrs),
+                       node + offsetof(struct nbstat_inode, last), addr);
+}
+
+/* nbstat_index_mac - the node with this MAC, or NULL. Its addresses, in host
+ * order, go to addr; *naddr is the capacity on entry and the count on return. */
+const nbstat_t *nbstat_index_mac(const nbstat_index_t *index, const uint8_t *hwaddr,
+                                 uint32_t *addr, size_t *naddr)
+{
+   const struct nbstat_inode *node;
+   const struct nbstat_ilink *link;
+   uint32_t off;
+   size_t n = 0;
+
+   if (index->macsize == 0 || (off = *index_mac_slot(index, index->mac, index->macsize, hwaddr)) == 0) {
+       *naddr = 0;
+       return NULL;
+   }
+
+   node = INDEX_AT(index, off, struct nbstat_inode);
+   for (off = node->addrs; off != 0 && n < *naddr; off = link->next, n++) {
+       link = INDEX_AT(index, off, struct nbstat_ilink);
+       addr[n] = link->value;
+   }
+   *naddr = n;
+
+   return &node->nbstat;
+}
+
+/* nbstat_index_name - the nodes that hold a name with this suffix, one per
+ * call: *cursor starts at 0 and NULL ends the list. nbf_name is padded with
+ * spaces to 15 bytes. */
+const nbstat_t *nbstat_index_name(const nbstat_index_t *index, const uint8_t *nbf_name, uint8_t suffix,
+                                  uint32_t *cursor)
+{
+   const struct nbstat_ilink *link;
+   uint32_t off = *cursor;
+
+   if (off == 0) {
+       if (index->namesize == 0)
+           return NULL;
+       off = *index_name_slot(index, index->name, index->namesize, nbf_name, suffix);
+       if (off == 0)
+           return NULL;
+       off = INDEX_AT(index, off, struct nbstat_ikey)->nodes;
+   } else if (off == 0xffffffffU) {
+       return NULL;
+   }
+
+   link = INDEX_AT(index, off, struct nbstat_ilink);
+   *cursor = link->next != 0 ? link->next : 0xffffffffU;
+
+   return &INDEX_AT(index, link->value, struct nbstat_inode)->nbstat;
+}
+
+/*
+ * Monitor. One context stays open while every host of an inventory is
+ * probed again one interval after its last answer or timeout. The interval
+ * is jittered by NBSTAT_JITTER percent either way, so that the rescans
+ * spread out instead of coming back in bursts, and only the differences to
+ * the previous answer are reported.
+ */
+
+#define NBSTAT_JITTER 10 /* Percent of the interval */
+
+struct nbstat_mhost {
+   uint32_t addr;
+   int state;        /* 0 not seen yet, 1 answering, -1 silent */
+   uint64_t due;     /* nbstat_clock() time of the next probe */
+   nbstat_t *last;   /* Latest answer, NULL until there is one */
+};
+
+typedef struct nbstat_monitor {
+   struct nbstat_mhost *host; /* Sorted by address */
+   size_t nhost;
+   size_t *heap;              /* Waiting hosts, earliest due first */
+   size_t nheap;
+   uint32_t interval;         /* ms */
+   uint32_t seed;
+   nbstat_writer_t *w;
+   volatile int *stop;
+} nbstat_monitor_t;
+
+/* mon_push - queue host i by its due time. */
+static void mon_push(nbstat_monitor_t *m, size_t i)
+{
+   size_t k = m->nheap++, p;
+
+   while (k > 0 && m->host[m->heap[p = (k - 1) / 2]].due > m->host[i].due) {
+       m->heap[k] = m->heap[p];
+       k = p;
+   }
+   m->heap[k] = i;
+}
+
+/* mon_pop - take the host that is due first. */
+static size_t mon_pop(nbstat_monitor_t *m)
+{
+   size_t top = m->heap[0], last = m->heap[--m->nheap];
+   size_t k = 0, c;
+
+   while ((c = 2 * k + 1) < m->nheap) {
+       if (c + 1 < m->nheap && m->host[m->heap[c + 1]].due < m->host[m->heap[c]].due)
+           c++;
+       if (m->host[m->heap[c]].due >= m->host[last].due)
+           break;
+       m->heap[k] = m->heap[c];
+       k = c;
+   }
+   m->heap[k] = last;
+
+   return top;
+}
+
+/* mon_next - nbstat_target_fn handing out the hosts as they fall due. */
+static int mon_next(void *arg, uint32_t *addr)
+{
+   nbstat_monitor_t *m = (nbstat_monitor_t *)arg;
+   uint64_t now = nbstat_clock();
+
+   /* Events trickle in; do not let them sit in the buffer. */
+   if (m->w->len > 0 && now - m->w->flushed >= NBSTAT_FLUSH_MS)
+       nbstat_writer_flush(m->w);
+
+   if (*m->stop)
+       return 0;
+   if (m->nheap == 0 || m->host[m->heap[0]].due > now)
+       return NBSTAT_TARGET_IDLE;
+
+   *addr = m->host[mon_pop(m)].addr;
+
+   return 1;
+}
+
+/* mon_find - host of addr, by binary search */
+static struct nbstat_mhost *mon_find(nbstat_monitor_t *m, uint32_t addr)
+{
+   size_t a = 0, b = m->nhost, c;
+
+   while (a < b) {
+       c = (a + b) / 2;
+       if (m->host[c].addr < addr)
+           a = c + 1;
+       else
+           b = c;
+   }
+
+   return a < m->nhost && m->host[a].addr == addr ? &m->host[a] : NULL;
+}
+
+/* name_index - entry of nbstat with the same name, suffix and type, or -1 */
+static int name_index(const nbstat_t *nbstat, const struct nbstat_node_name *node)
+{
+   int i;
+
+   for (i = 0; i < nbstat->count; i++) {
+       if (nbstat->node[i].suffix == node->suffix && nbstat->node[i].g == node->g &&
+           memcmp(nbstat->node[i].nbf_name, node->nbf_name, sizeof(node->nbf_name)) == 0)
+           return i;
+   }
+
+   return -1;
+}
+
+/* table_diff - report how cur differs from old, which is NULL for the first
+ * answer; `back' is set for a host that was silent. Returns the number of
+ * events, or just nonzero for the binary format. */
+static int table_diff(nbstat_writer_t *w, const nbstat_t *old, const nbstat_t *cur, int back)
+{
+   const struct nbstat_node_name *o, *n;
+   int binary = w->format == NBSTAT_FMT_BINARY;
+   int events = 0;
+   int i, j;
+
+   if (old == NULL || back) {
+       if (binary)
+           return 1;
+       nbstat_writer_event(w, "up", cur, NULL);
+       events++;
+   }
+   if (old != NULL && memcmp(old->hwaddr, cur->hwaddr, sizeof(cur->hwaddr)) != 0) {
+       if (binary)
+           return 1;
+       nbstat_writer_event(w, "mac", cur, NULL);
+       events++;
+   }
+
+   for (i = 0; i < cur->count; i++) {
+       n = &cur->node[i];
+       j = old != NULL ? name_index(old, n) : -1;
+       o = j >= 0 ? &old->node[j] : NULL;
+       if (o != NULL && o->cnf == n->cnf && o->drg == n->drg && o->act == n->act &&
+           o->prm == n->prm && o->ont == n->ont)
+           continue;
+       if (binary)
+           return 1;
+       if (o == NULL)
+           nbstat_writer_event(w, "name+", cur, n);
+       else if (o->cnf != n->cnf)
+           nbstat_writer_event(w, n->cnf ? "conflict" : "resolved", cur, n);
+       else if (o->drg != n->drg)
+           nbstat_writer_event(w, n->drg ? "deregistering" : "registered", cur, n);
+       else
+           nbstat_writer_event(w, "flags", cur, n);
+       events++;
+   }
+
+   for (j = 0; old != NULL && j < old->count; j++) {
+       if (name_index(cur, &old->node[j]) >= 0)
+           continue;
+       if (binary)
+           return 1;
+       nbstat_writer_event(w, "name-", cur, &old->node[j]);
+       events++;
+   }
+
+   return events;
+}
+
+/* mon_report - nbstat_sweep_fn: compare with the last answer and reschedule. */
+static void mon_report(void *user, int result, const struct sockaddr_in *sin, const nbstat_view_t *view)
+{
+   nbstat_monitor_t *m = (nbstat_monitor_t *)user;
+   struct nbstat_mhost *h = mon_find(m, ntohl(sin->sin_addr.s_addr));
+   uint32_t spread = m->interval / 100 * NBSTAT_JITTER;
+   nbstat_t cur;
+
+   if (h == NULL)
+       return;
+
+   if (result == NBSTAT_EOK) {
+       cur.sin = *sin;
+       nbstat_view_decode(view, &cur);
+       if (h->last == NULL)
+           h->last = malloc(sizeof(nbstat_t));
+       if (h->last != NULL) {
+           if (table_diff(m->w, h->state != 0 ? h->last : NULL, &cur, h->state < 0) > 0 &&
+               m->w->format == NBSTAT_FMT_BINARY)
+               nbstat_writer_put(m->w, &cur);
+           *h->last = cur;
+           h->state = 1;
+       }
+   } else if (result == NBSTAT_ETIMEOUT && h->state == 1) {
+       /* Gone silent. When it answers again, it is compared with the table
+        * from before; the archive gets a record without names. */
+       if (m->w->format == NBSTAT_FMT_BINARY) {
+           memset(&cur, 0x00, sizeof(cur));
+           cur.sin = *sin;
+           nbstat_writer_put(m->w, &cur);
+       } else {
+           nbstat_writer_event(m->w, "down", h->last, NULL);
+       }
+       h->state = -1;
+   }
+
+   h->due = nbstat_clock() + m->interval - spread;
+   if (spread > 0)
+       h->due += xorshift32(&m->seed) % (2 * spread + 1);
+   mon_push(m, h - m->host);
+}
+
+/* mhost_cmp - qsort by address */
+static int mhost_cmp(const void *a, const void *b)
+{
+   uint32_t x = ((const struct nbstat_mhost *)a)->addr;
+   uint32_t y = ((const struct nbstat_mhost *)b)->addr;
+
+   return x < y ? -1 : x > y;
+}
+
+/* nbstat_monitor - probe the targets every `interval' seconds until *stop
+ * is set, writing the changes to w. */
+int nbstat_monitor(nbstat_ctx_t *ctx, nbstat_targets_t *targets, uint16_t port, int timeout,
+                   int window, int interval, nbstat_writer_t *w, volatile int *stop)
+{
+   nbstat_monitor_t m;
+   struct nbstat_mhost *host;
+   size_t max = 0, i, j;
+   uint32_t addr;
+   uint64_t now;
+   int result;
+
+   if (ctx == NULL || targets == NULL || w == NULL || stop == NULL || interval <= 0)
+       return NBSTAT_EINVAL;
+
+   result = targets_freeze(targets);
+   if (result != NBSTAT_EOK)
+       return result;
+
+   /* The inventory is expanded once; hosts are kept sorted for the lookup
+    * of replies, and listed twice only once. */
+   memset(&m, 0x00, sizeof(m));
+   while (nbstat_targets_next(targets, &addr)) {
+       if (m.nhost == max) {
+           max = max != 0 ? 2 * max : 1024;
+           host = realloc(m.host, max * sizeof(*host));
+           if (host == NULL) {
+               free(m.host);
+               return NBSTAT_ENOMEM;
+           }
+           m.host = host;
+       }
+       memset(&m.host[m.nhost], 0x00, sizeof(*m.host));
+       m.host[m.nhost++].addr = addr;
+   }
+   if (m.nhost == 0) {
+       free(m.host);
+       return NBSTAT_EOK;
+   }
+
+   qsort(m.host, m.nhost, sizeof(*m.host), mhost_cmp);
+   for (i = j = 1; i < m.nhost; i++) {
+       if (m.host[i].addr != m.host[j - 1].addr)
+           m.host[j++] = m.host[i];
+   }
+   m.nhost = j;
+
+   m.heap = malloc(m.nhost * sizeof(size_t));
+   if (m.heap == NULL) {
+       free(m.host);
+       return NBSTAT_ENOMEM;
+   }
+
+   m.interval = interval > 4000000 ? 4000000000U : (uint32_t)interval * 1000;
+   m.seed = ((uint32_t)nbstat_clock() ^ (uint32_t)GetCurrentProcessId() << 16) | 1;
+   m.w = w;
+   m.stop = stop;
+
+   /* The first round goes out at once, spread by the pacing. */
+   now = nbstat_clock();
+   for (i = 0; i < m.nhost; i++) {
+       m.host[i].due = now;
+       m.heap[m.nheap++] = i;
+   }
+
+   result = sweep_run(ctx, mon_next, &m, port, timeout, window, mon_report, &m);
+
+   for (i = 0; i < m.nhost; i++)
+       free(m.host[i].last);
+   free(m.host);
+   free(m.heap);
+
+   return result;
+}
+
+/*
+ * Snapshot diff. The blocks of an archive are runs sorted by address, so
+ * the records of a whole archive come out in address order from a k-way
+ * merge over its blocks, and two archives are compared with a merge join in
+ * one pass. Memory grows with the number of blocks, not of records, and the
+ * files are read through their mappings. An address listed more than once
+ * counts with its latest record; a record without names, as the monitor
+ * writes for a host gone silent, counts as no answer. Events are those of
+ * the monitor, time stamped with the newer record.
+ */
+
+/* One block of a merge */
+struct nbstat_run {
+   const uint8_t *rec;
+   const uint8_t *names;
+   uint32_t nrec;
+   uint32_t nname;
+   uint32_t i;
+   uint64_t *order;  /* Address << 32 | record, for a block written unsorted */
+};
+
+typedef struct nbstat_merge {
+   struct nbstat_run *run;
+   size_t nrun;
+   size_t *heap;     /* Runs with records left, lowest address first */
+   size_t nheap;
+} nbstat_merge_t;
+
+/* run_rec - the current record of a run */
+static const uint8_t *run_rec(const struct nbstat_run *r)
+{
+   return r->rec + (size_t)(r->order != NULL ? (uint32_t)r->order[r->i] : r->i) * NBSTAT_ARCH_REC;
+}
+
+/* u64_cmp - qsort ascending */
+static int u64_cmp(const void *a, const void *b)
+{
+   uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+   return x < y ? -1 : x > y;
+}
+
+/* run_init - take a block, up to its first damaged record, and order the
+ * records of one that older writers left unsorted. */
+static int run_init(struct nbstat_run *r, const uint8_t *blk)
+{
+   const uint8_t *rec;
+   int sorted = 1;
+   uint32_t i;
+
+   memset(r, 0x00, sizeof(*r));
+   r->nrec = dec32be(blk + 4);
+   r->nname = dec32be(blk + 8);
+   r->rec = blk + NBSTAT_ARCH_BLOCK;
+   r->names = r->rec + (size_t)r->nrec * NBSTAT_ARCH_REC;
+
+   for (i = 0; i < r->nrec; i++) {
+       rec = r->rec + (size_t)i * NBSTAT_ARCH_REC;
+       if ((uint64_t)dec32be(rec + 20) + dec8be(rec + 10) > r->nname)
+           break;
+       if (i > 0 && arec_cmp(rec - NBSTAT_ARCH_REC, rec) > 0)
+           sorted = 0;
+   }
+   r->nrec = i;
+   if (sorted)
+       return NBSTAT_EOK;
+
+   r->order = malloc((size_t)r->nrec * sizeof(uint64_t));
+   if (r->order == NULL)
+       return NBSTAT_ENOMEM;
+   for (i = 0; i < r->nrec; i++)
+       r->order[i] = (uint64_t)dec32be(r->rec + (size_t)i * NBSTAT_ARCH_REC) << 32 | i;
+   qsort(r->order, r->nrec, sizeof(uint64_t), u64_cmp);
+
+   return NBSTAT_EOK;
+}
+
+/* merge_less - heap order of runs a and b: address, then block order. */
+static int merge_less(const nbstat_merge_t *m, size_t a, size_t b)
+{
+   uint32_t x = dec32be(run_rec(&m->run[a])), y = dec32be(run_rec(&m->run[b]));
+
+   return x < y || (x == y && a < b);
+}
+
+/* merge_sift - restore the heap below position k. */
+static void merge_sift(nbstat_merge_t *m, size_t k)
+{
+   size_t c, top = m->heap[k];
+
+   while ((c = 2 * k + 1) < m->nheap) {
+       if (c + 1 < m->nheap && merge_less(m, m->heap[c + 1], m->heap[c]))
+           c++;
+       if (!merge_less(m, m->heap[c], top))
+           break;
+       m->heap[k] = m->heap[c];
+       k = c;
+   }
+   m->heap[k] = top;
+}
+
+/* merge_close */
+static void merge_close(nbstat_merge_t *m)
+{
+   size_t i;
+
+   for (i = 0; i < m->nrun; i++)
+       free(m->run[i].order);
+   free(m->run);
+   free(m->heap);
+}
+
+/* merge_open - one run per complete block of the archive. */
+static int merge_open(nbstat_merge_t *m, const nbstat_archive_t *a)
+{
+   struct nbstat_run *grown;
+   size_t max = 0, off, k;
+   size_t block = 0;
+   uint32_t nrec = 0, nname = 0;
+
+   memset(m, 0x00, sizeof(*m));
+   while (arch_block(a, block, nrec, nname, &off)) {
+       block = off;
+       nrec = dec32be(a->data + off + 4);
+       nname = dec32be(a->data + off + 8);
+       if (m->nrun == max) {
+           max = max != 0 ? 2 * max : 64;
+           grown = realloc(m->run, max * sizeof(*grown));
+           if (grown == NULL) {
+               merge_close(m);
+               return NBSTAT_ENOMEM;
+           }
+           m->run = grown;
+       }
+       if (run_init(&m->run[m->nrun++], a->data + off) != NBSTAT_EOK) {
+           merge_close(m);
+           return NBSTAT_ENOMEM;
+       }
+   }
+
+   m->heap = malloc((m->nrun != 0 ? m->nrun : 1) * sizeof(size_t));
+   if (m->heap == NULL) {
+       merge_close(m);
+       return NBSTAT_ENOMEM;
+   }
+   for (k = 0; k < m->nrun; k++) {
+       if (m->run[k].nrec > 0)
+           m->heap[m->nheap++] = k;
+   }
+   for (k = m->nheap / 2; k-- > 0; )
+       merge_sift(m, k);
+
+   return NBSTAT_EOK;
+}
+
+/* merge_next - the latest record of the next address, as an iterator that
+ * the record accessors take; 0 at the end. */
+static int merge_next(nbstat_merge_t *m, nbstat_arch_iter_t *it)
+{
+   struct nbstat_run *r;
+   const uint8_t *rec;
+   uint32_t addr = 0;
+   int have = 0;
+
+   while (m->nheap > 0) {
+       r = &m->run[m->heap[0]];
+       rec = run_rec(r);
+       if (have && dec32be(rec) != addr)
+           break;
+       if (!have || dec64be(rec + 12) >= dec64be(it->rec + 12)) {
+           it->rec = rec;
+           it->names = r->names;
+           it->nrec = r->nrec;
+           it->nname = r->nname;
+       }
+       addr = dec32be(rec);
+       have = 1;
+
+       if (++r->i == r->nrec)
+           m->heap[0] = m->heap[--m->nheap];
+       if (m->nheap > 0)
+           merge_sift(m, 0);
+   }
+
+   return have;
+}
+
+/* arec_same - the records hold the same MAC and names, in the same order,
+ * as an unchanged host does; nothing to decode then. */
+static int arec_same(const nbstat_arch_iter_t *x, const nbstat_arch_iter_t *y)
+{
+   int n = nbstat_arec_count(x);
+
+   return n == nbstat_arec_count(y) && memcmp(nbstat_arec_hwaddr(x), nbstat_arec_hwaddr(y), 6) == 0 &&
+          memcmp(nbstat_arec_name(x, 0, NULL, NULL), nbstat_arec_name(y, 0, NULL, NULL),
+                 (size_t)n * NBSTAT_ARCH_NAME) == 0;
+}
+
+/* diff_host - report one address; old or cur is NULL where that snapshot has
+ * no answer. */
+static void diff_host(nbstat_writer_t *w, const nbstat_t *old, const nbstat_t *cur)
+{
+   nbstat_t gone;
+
+   if (cur != NULL) {
+       if (table_diff(w, old, cur, 0) > 0 && w->format == NBSTAT_FMT_BINARY)
+           nbstat_writer_put(w, cur);
+   } else if (w->format == NBSTAT_FMT_BINARY) {
+       memset(&gone, 0x00, sizeof(gone));
+       gone.sin = old->sin;
+       nbstat_writer_put(w, &gone);
+   } else {
+       nbstat_writer_event(w, "down", old, NULL);
+   }
+}
+
+/* nbstat_archive_diff - write how the snapshot in cur differs from old:
+ * the events of the monitor, or the changed tables for the binary format. */
+int nbstat_archive_diff(const nbstat_archive_t *old, const nbstat_archive_t *cur, nbstat_writer_t *w)
+{
+   nbstat_merge_t a, b;
+   nbstat_arch_iter_t x, y;
+   nbstat_t o, n;
+   uint64_t stamp;
+   int hx, hy;
+   int ox, ny;
+   int result;
+
+   if (old == NULL || cur == NULL || w == NULL || w->buf == NULL)
+       return NBSTAT_EINVAL;
+
+   result = merge_open(&a, old);
+   if (result != NBSTAT_EOK)
+       return result;
+   result = merge_open(&b, cur);
+   if (result != NBSTAT_EOK) {
+       merge_close(&a);
+       return result;
+   }
+
+   stamp = w->stamp;
+   hx = merge_next(&a, &x);
+   hy = merge_next(&b, &y);
+   while (hx || hy) {
+       /* Either side may be missing the address, or have it without names. */
+       if (hx && hy && nbstat_arec_addr(&x) == nbstat_arec_addr(&y)) {
+           if (arec_same(&x, &y)) {
+               hx = merge_next(&a, &x);
+               hy = merge_next(&b, &y);
+               continue;
+           }
+           ox = ny = 1;
+       }
+       else if (hy && (!hx || nbstat_arec_addr(&y) < nbstat_arec_addr(&x)))
+           ox = 0, ny = 1;
+       else
+           ox = 1, ny = 0;
+
+       w->stamp = ny ? nbstat_arec_time(&y) : cur->created;
+       if (ox) {
+           nbstat_arec_decode(&x, &o);
+           hx = merge_next(&a, &x);
+       }
+       if (ny) {
+           nbstat_arec_decode(&y, &n);
+           hy = merge_next(&b, &y);
+       }
+       if (ox && o.count == 0)
+           ox = 0;
+       if (ny && n.count == 0)
+           ny = 0;
+       if (ox || ny)
+           diff_host(w, ox ? &o : NULL, ny ? &n : NULL);
+   }
+   w->stamp = stamp;
+
+   merge_close(&a);
+   merge_close(&b);
+
+   return w->error ? NBSTAT_EDEBUG : NBSTAT_EOK;
+}
+
+/*
+ * Command line tool. Left out of the library build (-DNBSTAT_LIBRARY).
+ */
+#ifndef NBSTAT_LIBRARY
+
+static int strtoi(char *str)
+{
+   return atoi(str);
+}
+
+/* Where answers go: the writer, or the index when there are --find queries,
+ * and the cache if there is one. */
+struct nbstat_out {
+   nbstat_writer_t *w;
+   nbstat_index_t *index;
+   nbstat_cache_t *cache;
+   const struct nbstat_stage *stage; /* --then stages of a pipeline */
+   int result;
+};
+
+/* out_put - print or index one answer. */
+static void out_put(struct nbstat_out *out, const nbstat_t *nbstat)
+{
+   if (out->index == NULL)
+       nbstat_writer_put(out->w, nbstat);
+   else if (nbstat_index_add(out->index, nbstat) != NBSTAT_EOK)
+       out->result = NBSTAT_ENOMEM;
+}
+
+/* sweep_print - print the name table of every host that answered. */
+static void sweep_print(void *user, int result, const struct sockaddr_in *sin, const nbstat_view_t *view)
+{
+   struct nbstat_out *out = (struct nbstat_out *)user;
+   nbstat_t nbstat;
+
+   if (result != NBSTAT_EOK)
+       return;
+
+   nbstat.sin = *sin;
+   nbstat_view_decode(view, &nbstat);
+   out_put(out, &nbstat);
+   if (out->cache != NULL)
+       nbstat_cache_put(out->cache, &nbstat);
+}
+
+/* pipe_print - a pipeline answer: the sweep's as in a sweep; a host asked
+ * again gets one "recheck" event per name the stage looks for, or one for the
+ * host if they are gone, "down" if it did not answer. */
+static void pipe_print(void *user, int stage, int result, const struct sockaddr_in *sin, const nbstat_view_t *view)
+{
+   struct nbstat_out *out = (struct nbstat_out *)user;
+   const struct nbstat_stage *st;
+   nbstat_t nbstat;
+   int events = 0;
+   int i;
+
+   if (stage == 0) {
+       sweep_print(user, result, sin, view);
+       return;
+   }
+
+   st = &out->stage[stage - 1];
+   memset(&nbstat, 0x00, sizeof(nbstat));
+   nbstat.sin = *sin;
+   if (result == NBSTAT_EOK)
+       nbstat_view_decode(view, &nbstat);
+   if (out->w->format == NBSTAT_FMT_BINARY) {
+       nbstat_writer_put(out->w, &nbstat);
+       return;
+   }
+   if (result != NBSTAT_EOK) {
+       nbstat_writer_event(out->w, "down", &nbstat, NULL);
+       return;
+   }
+   for (i = 0; i < nbstat.count; i++) {
+       if ((st->suffix >= 0 && nbstat.node[i].suffix != st->suffix) ||
+           (st->flags != 0 && (name_flags(&nbstat.node[i]) & st->flags) == 0))
+           continue;
+       nbstat_writer_event(out->w, "recheck", &nbstat, &nbstat.node[i]);
+       events++;
+   }
+   if (events == 0)
+       nbstat_writer_event(out->w, "recheck", &nbstat, NULL);
+}
+
+/* pipe_name - a pipeline name query */
+static void pipe_name(void *user, int result, const uint8_t *name, const struct sockaddr_in *from,
+                      const struct nbstat_nb *nb, int count)
+{
+   nbstat_writer_name(((struct nbstat_out *)user)->w, result, name, from, nb, count);
+}
+
+/* bcast_print - print the name table of one broadcast responder. */
+static void bcast_print(void *user, const nbstat_t *nbstat)
+{
+   out_put((struct nbstat_out *)user, nbstat);
+}
+
+/* parse_format - output format by name, -1 if unknown. */
+static int parse_format(const char *name)
+{
+   if (strcmp(name, "table") == 0)
+       return NBSTAT_FMT_TABLE;
+   if (strcmp(name, "json") == 0 || strcmp(name, "ndjson") == 0)
+       return NBSTAT_FMT_NDJSON;
+   if (strcmp(name, "csv") == 0)
+       return NBSTAT_FMT_CSV;
+   if (strcmp(name, "nmblookup") == 0)
+       return NBSTAT_FMT_NMBLOOKUP;
+   if (strcmp(name, "binary") == 0)
+       return NBSTAT_FMT_BINARY;
+
+   return -1;
+}
+
+#define NBSTAT_FIND_MAX 32
+#define NBSTAT_STAGES_MAX 8 /* --then */
+#define NBSTAT_STATS_EVERY 10 /* Seconds between --stats reports of a sweep */
+
+/* --find query */
+struct nbstat_find {
+   int mac;
+   uint8_t hwaddr[6];
+   uint8_t nbf_name[15];
+   uint8_t suffix;
+};
+
+/* parse_find - a MAC address as 00-11-22-33-44-55 or with colons, or a name
+ * as NAME<1b> or NAME#1b; the suffix defaults to <00>. */
+static int parse_find(const char *spec, struct nbstat_find *f)
+{
+   unsigned v[6];
+   const char *p;
+   char end;
+   size_t n;
+   int i;
+
+   memset(f, 0x00, sizeof(*f));
+   if (sscanf(spec, "%2x-%2x-%2x-%2x-%2x-%2x%c", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &end) == 6 ||
+       sscanf(spec, "%2x:%2x:%2x:%2x:%2x:%2x%c", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &end) == 6) {
+       f->mac = 1;
+       for (i = 0; i < 6; i++)
+           f->hwaddr[i] = (uint8_t)v[i];
+       return NBSTAT_EOK;
+   }
+
+   p = strpbrk(spec, "<#");
+   n = p != NULL ? (size_t)(p - spec) : strlen(spec);
+   if (n == 0 || n > sizeof(f->nbf_name))
+       return NBSTAT_EINVAL;
+   if (p != NULL) {
+       i = sscanf(p + 1, "%2x%c", &v[0], &end);
+       if (*p == '<' ? i != 2 || end != '>' : i != 1)
+           return NBSTAT_EINVAL;
+       f->suffix = (uint8_t)v[0];
+   }
+
+   /* Names go on the wire in upper case. */
+   memset(f->nbf_name, ' ', sizeof(f->nbf_name));
+   for (i = 0; i < (int)n; i++)
+       f->nbf_name[i] = (uint8_t)(spec[i] >= 'a' && spec[i] <= 'z' ? spec[i] - 'a' + 'A' : spec[i]);
+
+   return NBSTAT_EOK;
+}
+
+/* parse_stage - a --then stage: "name:xx" asks for every name with the hex
+ * suffix xx, "status:cnf", "status:drg" or "status:prm" asks every host with
+ * a name so flagged again. */
+static int parse_stage(const char *spec, struct nbstat_stage *stage)
+{
+   unsigned long suffix;
+   char *end;
+
+   memset(stage, 0x00, sizeof(*stage));
+   stage->suffix = -1;
+   if (strncmp(spec, "name:", 5) == 0) {
+       suffix = strtoul(spec + 5, &end, 16);
+       if (end == spec + 5 || *end != '\0' || suffix > 0xff)
+           return NBSTAT_EINVAL;
+       stage->type = NBSTAT_STAGE_NAMES;
+       stage->suffix = (int)suffix;
+       return NBSTAT_EOK;
+   }
+   if (strncmp(spec, "status:", 7) != 0)
+       return NBSTAT_EINVAL;
+
+   stage->type = NBSTAT_STAGE_STATUS;
+   if (strcmp(spec + 7, "cnf") == 0)
+       stage->flags = 0x0800;
+   else if (strcmp(spec + 7, "drg") == 0)
+       stage->flags = 0x1000;
+   else if (strcmp(spec + 7, "prm") == 0)
+       stage->flags = 0x0200;
+   else
+       return NBSTAT_EINVAL;
+
+   return NBSTAT_EOK;
+}
+
+/* parse_bind - a --bind source: an address, with the /prefix of the subnet
+ * behind it, or an interface name. Without a prefix it comes from the
+ * netmask of the interface holding the address, where the system tells. */
+static int parse_bind(const char *spec, uint32_t *addr, int *prefix)
+{
+#ifndef _WIN32
+   struct ifaddrs *list, *ifa;
+   uint32_t mask;
+#endif
+   const char *sep;
+   char *end;
+   int isaddr;
+
+   sep = strchr(spec, '/');
+   isaddr = nbstat_parse_ipv4(spec, sep != NULL ? (size_t)(sep - spec) : strlen(spec), addr) == NBSTAT_EOK;
+   if (sep != NULL) {
+       *prefix = (int)strtol(sep + 1, &end, 10);
+       return isaddr && end != sep + 1 && *end == '\0' && *prefix >= 0 && *prefix <= 32 ? NBSTAT_EOK : NBSTAT_EINVAL;
+   }
+   *prefix = 0;
+
+#ifndef _WIN32
+   if (getifaddrs(&list) != 0)
+       return isaddr ? NBSTAT_EOK : NBSTAT_EINVAL;
+   for (ifa = list; ifa != NULL; ifa = ifa->ifa_next) {
+       if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_INET || ifa->ifa_netmask == NULL)
+           continue;
+       if (isaddr ? ntohl(((struct sockaddr_in *)ifa->ifa_addr)->sin_addr.s_addr) != *addr
+                  : strcmp(ifa->ifa_name, spec) != 0)
+           continue;
+       *addr = ntohl(((struct sockaddr_in *)ifa->ifa_addr)->sin_addr.s_addr);
+       for (mask = ntohl(((struct sockaddr_in *)ifa->ifa_netmask)->sin_addr.s_addr); mask & 0x80000000U; mask <<= 1)
+           (*prefix)++;
+       isaddr = 1;
+       break;
+   }
+   freeifaddrs(list);
+#endif
+
+   return isaddr ? NBSTAT_EOK : NBSTAT_EINVAL;
+}
+
+/* find_print - answer the queries from the index: every address that has
+ * the MAC, or every node that holds the name. */
+static void find_print(struct nbstat_out *out, const struct nbstat_find *find, int nfind)
+{
+   uint32_t addr[256];
+   uint32_t cursor;
+   const nbstat_t *node;
+   nbstat_t nbstat;
+   size_t n, i;
+   int j;
+
+   for (j = 0; j < nfind; j++) {
+       if (find[j].mac) {
+           n = sizeof(addr) / sizeof(addr[0]);
+           node = nbstat_index_mac(out->index, find[j].hwaddr, addr, &n);
+           for (i = 0; node != NULL && i < n; i++) {
+               nbstat = *node;
+               nbstat.sin.sin_addr.s_addr = htonl(addr[i]);
+               nbstat_writer_put(out->w, &nbstat);
+           }
+       } else {
+           cursor = 0;
+           while ((node = nbstat_index_name(out->index, find[j].nbf_name, find[j].suffix, &cursor)) != NULL)
+               nbstat_writer_put(out->w, node);
+       }
+   }
+}
+
+/* name_print - print the outcome of one name query. */
+static void name_print(void *user, int result, const uint8_t *name, const struct sockaddr_in *from,
+                       const struct nbstat_nb *nb, int count)
+{
+   nbstat_writer_name((nbstat_writer_t *)user, result, name, from, nb, count);
+}
+
+/* name_push - append one NAME<xx> to the list of names to resolve. */
+static int name_push(uint8_t **names, size_t *n, size_t *max, const char *spec)
+{
+   struct nbstat_find f;
+   uint8_t *grown;
+
+   if (parse_find(spec, &f) != NBSTAT_EOK || f.mac)
+       return NBSTAT_EINVAL;
+
+   if (*n == *max) {
+       *max = *max != 0 ? 2 * *max : 64;
+       grown = realloc(*names, *max * 16);
+       if (grown == NULL)
+           return NBSTAT_ENOMEM;
+       *names = grown;
+   }
+   memcpy(*names + 16 * *n, f.nbf_name, 15);
+   (*names)[16 * *n + 15] = f.suffix;
+   (*n)++;
+
+   return NBSTAT_EOK;
+}
+
+/* name_file - append the names of a file, one per line. */
+static int name_file(uint8_t **names, size_t *n, size_t *max, FILE *fp)
+{
+   char line[256];
+   char *p, *q;
+
+   while (fgets(line, sizeof(line), fp) != NULL) {
+       for (p = line; *p == ' ' || *p == '\t'; p++)
+           ;
+       for (q = p; *q != '\0' && *q != '#' && *q != ' ' && *q != '\t' && *q != '\r' && *q != '\n'; q++)
+           ;
+       *q = '\0';
+       if (q != p && name_push(names, n, max, p) != NBSTAT_EOK)
+           return NBSTAT_EINVAL;
+   }
+
+   return NBSTAT_EOK;
+}
+
+/* exclude_file - add every line of an exclusion file. */
+static int exclude_file(nbstat_targets_t *targets, const char *path)
+{
+   char line[256];
+   char *p, *q;
+   FILE *fp;
+
+   fp = fopen(path, "r");
+   if (fp == NULL)
+       return NBSTAT_EINVAL;
+
+   while (fgets(line, sizeof(line), fp) != NULL) {
+       for (p = line; *p == ' ' || *p == '\t'; p++)
+           ;
+       for (q = p; *q != '\0' && *q != '#' && *q != ' ' && *q != '\t' && *q != '\r' && *q != '\n'; q++)
+           ;
+       *q = '\0';
+       if (q != p && nbstat_targets_exclude(targets, p) != NBSTAT_EOK) {
+           fclose(fp);
+           return NBSTAT_EINVAL;
+       }
+   }
+
+   fclose(fp);
+
+   return NBSTAT_EOK;
+}
+
+/* spec_ranges - parse the range arguments of --read and --pcap. */
+static int spec_ranges(char **spec, int nspec, struct nbstat_range **range)
+{
+   int i;
+
+   *range = NULL;
+   if (nspec == 0)
+       return NBSTAT_EOK;
+
+   *range = malloc(nspec * sizeof(**range));
+   if (*range == NULL)
+       return NBSTAT_ENOMEM;
+   for (i = 0; i < nspec; i++) {
+       if (nbstat_parse_range(spec[i], &(*range)[i]) != NBSTAT_EOK) {
+           free(*range);
+           return NBSTAT_EINVAL;
+       }
+   }
+
+   return NBSTAT_EOK;
+}
+
+/* spec_match - whether an address (host order) is in one of the ranges, or
+ * there are none. */
+static int spec_match(const struct nbstat_range *range, int nrange, uint32_t addr)
+{
+   int i;
+
+   for (i = 0; i < nrange && (addr < range[i].first || addr > range[i].last); i++)
+       ;
+
+   return nrange == 0 || i < nrange;
+}
+
+/* read_archive - print the responders of an archive that fall into one of
+ * the `nspec' ranges, or all of them. */
+static int read_archive(const char *path, struct nbstat_out *out, char **spec, int nspec)
+{
+   struct nbstat_range *range;
+   nbstat_archive_t archive;
+   nbstat_arch_iter_t it;
+   nbstat_t nbstat;
+   int result;
+
+   result = spec_ranges(spec, nspec, &range);
+   if (result != NBSTAT_EOK)
+       return result;
+
+   result = nbstat_archive_open(&archive, path);
+   if (result != NBSTAT_EOK) {
+       free(range);
+       return result;
+   }
+
+   nbstat_archive_first(&it);
+   while (nbstat_archive_next(&archive, &it)) {
+       if (!spec_match(range, nspec, nbstat_arec_addr(&it)))
+           continue;
+
+       nbstat_arec_decode(&it, &nbstat);
+       out_put(out, &nbstat);
+   }
+
+   nbstat_archive_close(&archive);
+   free(range);
+
+   return out->w->error ? NBSTAT_EDEBUG : out->result;
+}
+
+/* read_pcap - print the node status responses sent from `port' in a
+ * capture, by the responders that fall into one of the ranges, or all. Binary
+ * records keep the capture time. */
+static int read_pcap(const char *path, uint16_t port, struct nbstat_out *out, char **spec, int nspec)
+{
+   struct nbstat_range *range;
+   struct sockaddr_in from;
+   nbstat_packet_t pkt;
+   nbstat_pcap_t pcap;
+   nbstat_view_t view;
+   nbstat_t nbstat;
+   int result;
+
+   result = spec_ranges(spec, nspec, &range);
+   if (result != NBSTAT_EOK)
+       return result;
+
+   result = nbstat_pcap_open(&pcap, path);
+   if (result != NBSTAT_EOK) {
+       free(range);
+       return result;
+   }
+
+   while (nbstat_pcap_next(&pcap, &pkt) && !out->w->error) {
+       if (nbstat_pcap_view(&pkt, port, &view, &from) != NBSTAT_EOK ||
+           !spec_match(range, nspec, ntohl(from.sin_addr.s_addr)))
+           continue;
+
+       nbstat.sin = from;
+       nbstat_view_decode(&view, &nbstat);
+       out->w->stamp = pkt.time;
+       out_put(out, &nbstat);
+   }
+   out->w->stamp = 0;
+
+   nbstat_pcap_close(&pcap);
+   free(range);
+
+   return out->w->error ? NBSTAT_EDEBUG : out->result;
+}
+
+/* read_diff - print how the archive at `path' differs from the one at `base'. */
+static int read_diff(const char *base, const char *path, nbstat_writer_t *w)
+{
+   nbstat_archive_t old, cur;
+   int result;
+
+   result = nbstat_archive_open(&old, base);
+   if (result != NBSTAT_EOK)
+       return result;
+   result = nbstat_archive_open(&cur, path);
+   if (result == NBSTAT_EOK) {
+       result = nbstat_archive_diff(&old, &cur, w);
+       nbstat_archive_close(&cur);
+   }
+   nbstat_archive_close(&old);
+
+   return result;
+}
+
+/* Set by SIGINT and SIGTERM; the monitor finishes the probes in flight. */
+static volatile int stopping = 0;
+
+static void on_signal(int sig)
+{
+   stopping = 1;
+   signal(sig, on_signal);
+}
+
+#ifdef NBSTAT_BENCH
+/* Benchmarks, in builds with -DNBSTAT_BENCH:
+ *
+ *   nbtquery --bench [-p port] [-n window] [-j threads] [-t timeout] [-R retries]
+ *                    [--latency ms] [--loss percent] [--hosts n] [--queries n]
+ *   nbtquery --mock [-p port] [--latency ms] [--loss percent] [--hosts n]
+ *
+ * --bench times the request encoder and the response decoders over responses
+ * of 1 to NBSTAT_MAX_NAMES names (and an oversized one, which is rejected),
+ * then sweeps an in-process mock responder and reports queries per second and
+ * the RTT distribution. --mock only runs the responder, until interrupted, for
+ * another nbtquery to query with -p; it answers on 127.0.0.1 and up. */
+#ifdef _WIN32
+typedef WSAPOLLFD bench_pollfd_t;
+#define bench_poll WSAPoll
+#else
+typedef struct pollfd bench_pollfd_t;
+#define bench_poll poll
+#endif
+
+#define NBSTAT_BENCH_PORT     13137
+#define NBSTAT_BENCH_HOSTS    64
+#define NBSTAT_BENCH_QUERIES  200000
+#define NBSTAT_BENCH_MS       200     /* Run time of each microbenchmark */
+#define NBSTAT_MOCK_HOSTS_MAX 1024
+#define NBSTAT_MOCK_QUEUE     65536   /* Delayed replies, power of two */
+#define NBSTAT_MOCK_RCVBUF    (4 << 20)
+
+/* A reply waiting for its send time */
+struct nbstat_mock_reply {
+   uint64_t due;           /* nbstat_clock_us() */
+   struct sockaddr_in to;
+   uint16_t trn_id;
+   int host;
+};
+
+/* Mock responder: host i answers on 127.0.0.1 + i with a response of
+ * 1 + i % NBSTAT_MAX_NAMES names, after the latency, unless it is lost. */
+struct nbstat_mock {
+   socket_t sfd[NBSTAT_MOCK_HOSTS_MAX];
+   uint8_t (*packet)[576];
+   size_t length[NBSTAT_MOCK_HOSTS_MAX];
+   int nhost;
+   int latency;            /* ms */
+   int loss;               /* percent */
+   uint32_t seed;
+   uint64_t answered;
+   uint64_t dropped;
+   struct nbstat_mock_reply *queue;
+   uint32_t head, tail;
+   uint32_t stop;
+   int running;
+#ifdef _WIN32
+   HANDLE thread;
+#else
+   pthread_t thread;
+#endif
+};
+
+/* bench_response - build the node status response a Windows host with a
+ * workgroup, a few services and the browser names would send. */
+static size_t bench_response(uint8_t *buf, uint16_t trn_id, int count, uint32_t host)
+{
+   static const struct {
+       const char *name;
+       uint8_t suffix;
+       uint16_t flags;
+   } table[] = {
+       { "HOST", 0x00, 0x0400 }, { "WORKGROUP", 0x00, 0x8400 }, { "HOST", 0x20, 0x0400 },
+       { "WORKGROUP", 0x1e, 0x8400 }, { "WORKGROUP", 0x1d, 0x0400 },
+       { "\x01\x02__MSBROWSE__\x02", 0x01, 0x8400 }, { "HOST", 0x03, 0x0400 }, { "ADMIN", 0x03, 0x0400 }
+   };
+   char name[32];
+   uint8_t *ptr;
+   int i, n;
+
+   memset(buf, 0x00, 57 + NBSTAT_NAME_SIZE * count + NBSTAT_STAT_SIZE);
+   enc16be(buf, trn_id);
+   enc16be(buf + NBSTAT_OFF_FLAGS, 0x8400);
+   enc16be(buf + 6, 1);
+   memset(name, 0x00, 16);
+   name[0] = '*';
+   netbios_encode_name((char *)buf + 12, name, 0x20);
+   enc16be(buf + NBSTAT_OFF_RR_TYPE, RR_TYPE_NBSTAT);
+   enc16be(buf + NBSTAT_OFF_RR_TYPE + 2, RR_CLASS_IN);
+   enc16be(buf + NBSTAT_OFF_TTL + 4, (uint16_t)(1 + NBSTAT_NAME_SIZE * count + NBSTAT_STAT_SIZE));
+   buf[NBSTAT_OFF_NUM_NAMES] = (uint8_t)count;
+
+   ptr = buf + NBSTAT_OFF_NAMES;
+   for (i = 0; i < count; i++, ptr += NBSTAT_NAME_SIZE) {
+       n = i % (int)(sizeof(table) / sizeof(table[0]));
+       if (i < (int)(sizeof(table) / sizeof(table[0])) && table[n].name[0] != 'H')
+           sprintf(name, "%s", table[n].name);
+       else
+           sprintf(name, "%s%u", table[n].name, (unsigned)(host + i / 8));
+       memset(ptr, ' ', 15);
+       memcpy(ptr, name, strlen(name) < 15 ? strlen(name) : 15);
+       ptr[15] = table[n].suffix;
+       enc16be(ptr + 16, table[n].flags);
+   }
+
+   /* A locally administered MAC from the host number. */
+   ptr[0] = 0x02;
+   ptr[3] = (uint8_t)(host >> 16);
+   ptr[4] = (uint8_t)(host >> 8);
+   ptr[5] = (uint8_t)host;
+
+   return (size_t)(ptr + NBSTAT_STAT_SIZE - buf);
+}
+
+/* mock_request - queue the reply to a datagram that host h received. */
+static void mock_request(struct nbstat_mock *m, int h, const uint8_t *data, size_t length,
+                         const struct sockaddr_in *from, uint64_t now)
+{
+   struct nbstat_mock_reply *r;
+
+   /* Node status requests only. */
+   if (length != NBSTAT_REQUEST_SIZE || (data[NBSTAT_OFF_FLAGS] & 0x80) || dec16be(data + 46) != QTYPE_NBSTAT)
+       return;
+
+   m->seed ^= m->seed << 13;
+   m->seed ^= m->seed >> 17;
+   m->seed ^= m->seed << 5;
+   if (m->seed % 100 < (uint32_t)m->loss || m->head - m->tail >= NBSTAT_MOCK_QUEUE) {
+       m->dropped++;
+       return;
+   }
+
+   r = &m->queue[m->head++ & (NBSTAT_MOCK_QUEUE - 1)];
+   r->due = now + 1000 * (uint64_t)m->latency;
+   r->to = *from;
+   r->trn_id = dec16be(data);
+   r->host = h;
+}
+
+/* mock_send - send the replies that are due; returns the us until the next. */
+static int64_t mock_send(struct nbstat_mock *m, uint64_t now)
+{
+   struct nbstat_mock_reply *r;
+   uint8_t *packet;
+
+   while (m->tail != m->head) {
+       r = &m->queue[m->tail & (NBSTAT_MOCK_QUEUE - 1)];
+       if (r->due > now)
+           return (int64_t)(r->due - now);
+
+       packet = m->packet[r->host];
+       enc16be(packet, r->trn_id);
+       if (sendto(m->sfd[r->host], (const char *)packet, (int)m->length[r->host], 0,
+                  (const struct sockaddr *)&r->to, sizeof(r->to)) == SOCKET_ERROR) {
+           if (WSAGetLastError() == WSAEWOULDBLOCK)
+               return 0;
+           m->dropped++;
+       } else {
+           m->answered++;
+       }
+       m->tail++;
+   }
+
+   return -1;
+}
+
+/* mock_run - responder thread body. */
+static void mock_run(struct nbstat_mock *m)
+{
+   bench_pollfd_t pfd[NBSTAT_MOCK_HOSTS_MAX];
+   struct sockaddr_in from;
+   socklen_t fromlen;
+   uint8_t data[576];
+   int64_t wait;
+   int timeout;
+   int i, n;
+
+   for (i = 0; i < m->nhost; i++) {
+       pfd[i].fd = m->sfd[i];
+       pfd[i].events = POLLIN;
+   }
+
+   while (!atomic_load32(&m->stop)) {
+       wait = mock_send(m, nbstat_clock_us());
+       timeout = wait < 0 || wait >= 50000 ? 50 : (int)((wait + 999) / 1000);
+
+       if (bench_poll(pfd, m->nhost, timeout) <= 0)
+           continue;
+       for (i = 0; i < m->nhost; i++) {
+           if (!(pfd[i].revents & POLLIN))
+               continue;
+           for (;;) {
+               fromlen = sizeof(from);
+               n = recvfrom(m->sfd[i], (char *)data, sizeof(data), 0, (struct sockaddr *)&from, &fromlen);
+               if (n == SOCKET_ERROR)
+                   break;
+               mock_request(m, i, data, (size_t)n, &from, nbstat_clock_us());
+           }
+       }
+   }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI mock_thread(LPVOID arg)
+{
+   mock_run((struct nbstat_mock *)arg);
+   return 0;
+}
+#else
+static void *mock_thread(void *arg)
+{
+   mock_run((struct nbstat_mock *)arg);
+   return NULL;
+}
+#endif
+
+/* mock_close - stop the responder and free it. */
+static void mock_close(struct nbstat_mock *m)
+{
+   int i;
+
+   if (m->running) {
+       atomic_store32(&m->stop, 1);
+#ifdef _WIN32
+       WaitForSingleObject(m->thread, INFINITE);
+       CloseHandle(m->thread);
+#else
+       pthread_join(m->thread, NULL);
+#endif
+   }
+   for (i = 0; i < m->nhost; i++)
+       closesocket(m->sfd[i]);
+   free(m->packet);
+   free(m->queue);
+   WSACleanup();
+}
+
+/* mock_open - bind up to `nhost' loopback addresses and start answering.
+ * Where only 127.0.0.1 is local, there is one host. */
+static int mock_open(struct nbstat_mock *m, uint16_t port, int nhost, int latency, int loss)
+{
+   struct sockaddr_in sin;
+   int size = NBSTAT_MOCK_RCVBUF;
+   int i;
+
+   memset(m, 0x00, sizeof(*m));
+   m->latency = latency;
+   m->loss = loss;
+   m->seed = (uint32_t)nbstat_clock_us() | 1;
+   if (nhost > NBSTAT_MOCK_HOSTS_MAX)
+       nhost = NBSTAT_MOCK_HOSTS_MAX;
+
+   if (winsock_init() != 0)
+       return NBSTAT_EWSAFAIL;
+
+   m->packet = malloc(nhost * sizeof(m->packet[0]));
+   m->queue = malloc(NBSTAT_MOCK_QUEUE * sizeof(m->queue[0]));
+   if (m->packet == NULL || m->queue == NULL) {
+       mock_close(m);
+       return NBSTAT_ENOMEM;
+   }
+
+   for (i = 0; i < nhost; i++) {
+       if (nbstat_ctx_socket(&m->sfd[i], INADDR_ANY) != 0)
+           break;
+       memset(&sin, 0x00, sizeof(sin));
+       sin.sin_family = AF_INET;
+       sin.sin_port = htons(port);
+       sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK + i);
+       if (bind(m->sfd[i], (struct sockaddr *)&sin, sizeof(sin)) == SOCKET_ERROR) {
+           closesocket(m->sfd[i]);
+           break;
+       }
+       setsockopt(m->sfd[i], SOL_SOCKET, SO_RCVBUF, (const char *)&size, sizeof(size));
+       setsockopt(m->sfd[i], SOL_SOCKET, SO_SNDBUF, (const char *)&size, sizeof(size));
+       m->length[i] = bench_response(m->packet[i], 0, 1 + i % NBSTAT_MAX_NAMES, (uint32_t)i + 1);
+       m->nhost++;
+   }
+   if (m->nhost == 0) {
+       mock_close(m);
+       return NBSTAT_ESOCKET;
+   }
+
+#ifdef _WIN32
+   m->thread = CreateThread(NULL, 0, mock_thread, m, 0, NULL);
+   if (m->thread == NULL) {
+#else
+   if (pthread_create(&m->thread, NULL, mock_thread, m) != 0) {
+#endif
+       mock_close(m);
+       return NBSTAT_EDEBUG;
+   }
+   m->running = 1;
+
+   return NBSTAT_EOK;
+}
+
+/* Microbenchmark: returns something derived from the work, so that it stays. */
+typedef int (*bench_fn)(void *arg, uint32_t i);
+
+/* Packet under test */
+struct bench_case {
+   buffer_t buffer;
+   uint8_t data[1024];
+   struct nbstat_query query;
+   struct nbstat_node_name node[NBSTAT_MAX_NAMES];
+   char names[8][16];
+};
+
+static int bench_encode(void *arg, uint32_t i)
+{
+   struct bench_case *c = (struct bench_case *)arg;
+
+   c->query.hdr.name_trn_id = (uint16_t)i;
+   c->buffer.length = 0;
+   nbstat_encode_request(&c->buffer, &c->query);
+
+   return c->data[1];
+}
+
+static int bench_name(void *arg, uint32_t i)
+{
+   struct bench_case *c = (struct bench_case *)arg;
+   char encoded[34];
+
+   netbios_encode_name(encoded, c->names[i & 7], 0x20);
+
+   return encoded[1];
+}
+
+static int bench_decode(void *arg, uint32_t i)
+{
+   struct bench_case *c = (struct bench_case *)arg;
+   struct nbstat_response rep;
+
+   rep.node = c->node;
+   if (nbstat_decode_response(&c->buffer, &rep) != NBSTAT_EOK)
+       return 0;
+
+   return rep.num_names + rep.stat.unit_id[5];
+}
+
+static int bench_view(void *arg, uint32_t i)
+{
+   struct bench_case *c = (struct bench_case *)arg;
+   nbstat_view_t view;
+   nbstat_t nbstat;
+
+   if (nbstat_view_init(&view, &c->buffer) != NBSTAT_EOK)
+       return 0;
+   nbstat_view_decode(&view, &nbstat);
+
+   return nbstat.count + nbstat.hwaddr[5];
+}
+
+/* bench_time - run a microbenchmark for NBSTAT_BENCH_MS and print its speed. */
+static void bench_time(const char *label, bench_fn fn, void *arg)
+{
+   volatile int sink = 0;
+   uint64_t start, elapsed, n = 0;
+   uint32_t i;
+
+   start = nbstat_clock_us();
+   do {
+       for (i = 0; i < 1000; i++)
+           sink += fn(arg, (uint32_t)n + i);
+       n += 1000;
+       elapsed = nbstat_clock_us() - start;
+   } while (elapsed < 1000 * NBSTAT_BENCH_MS);
+
+   printf("%-44s %9.1f ns/op %9.2f Mop/s\n", label, 1000.0 * elapsed / n, (double)n / elapsed);
+}
+
+/* Name kernels, each checked against the scalar ones before it is timed. */
+#define BENCH_NAMES 64
+
+typedef void (*name_encode_fn)(uint8_t *out, const uint8_t *src, size_t count, uint8_t pad);
+typedef size_t (*name_decode_fn)(uint8_t *names, const uint8_t *in, size_t count);
+
+struct bench_kernel {
+   const char *label;
+   name_encode_fn encode;
+   name_decode_fn decode;
+};
+
+struct bench_names {
+   uint8_t names[BENCH_NAMES * 16];
+   uint8_t encoded[BENCH_NAMES * NBSTAT_QNAME_SIZE + 1];
+   uint8_t expect[BENCH_NAMES * NBSTAT_QNAME_SIZE + 1];
+   uint8_t decoded[BENCH_NAMES * 16];
+   const struct bench_kernel *k;
+};
+
+static int bench_name_encode(void *arg, uint32_t i)
+{
+   struct bench_names *b = (struct bench_names *)arg;
+
+   b->k->encode(b->encoded, b->names, BENCH_NAMES, 0x20);
+
+   return b->encoded[i % BENCH_NAMES];
+}
+
+static int bench_name_decode(void *arg, uint32_t i)
+{
+   struct bench_names *b = (struct bench_names *)arg;
+
+   return (int)b->k->decode(b->decoded, b->expect, BENCH_NAMES) + b->decoded[i % BENCH_NAMES];
+}
+
+/* bench_check - kernel k against the scalar one: every count, so that each
+ * tail is taken, and a corrupt letter, length or end label in each name. */
+static int bench_check(struct bench_names *b, const struct bench_kernel *k)
+{
+   static const uint8_t corrupt[] = { '@', 'Q', 'a', 0x00 };
+   uint8_t *bad;
+   size_t n, size, j;
+
+   for (n = 0; n <= BENCH_NAMES; n++) {
+       size = n * NBSTAT_QNAME_SIZE;
+       memset(b->encoded, 0xaa, sizeof(b->encoded));
+       k->encode(b->encoded, b->names, n, 0x20);
+       if (memcmp(b->encoded, b->expect, size) != 0 || b->encoded[size] != 0xaa)
+           return NBSTAT_EDEBUG;
+       /* Decoded names are padded already, and encode the same again. */
+       if (k->decode(b->decoded, b->expect, n) != n)
+           return NBSTAT_EDEBUG;
+       name_encode_scalar(b->encoded, b->decoded, n, 0x20);
+       if (memcmp(b->encoded, b->expect, size) != 0)
+           return NBSTAT_EDEBUG;
+   }
+
+   bad = b->encoded;
+   for (n = 0; n < BENCH_NAMES; n++) {
+       j = n % (NBSTAT_QNAME_SIZE + sizeof(corrupt));
+       memcpy(bad, b->expect, sizeof(b->encoded));
+       if (j < NBSTAT_QNAME_SIZE)
+           bad[n * NBSTAT_QNAME_SIZE + j] = j == 0 ? 0x21 : j == NBSTAT_QNAME_SIZE - 1 ? 'A' : 'Z';
+       else
+           bad[n * NBSTAT_QNAME_SIZE + 1 + n % 32] = corrupt[j - NBSTAT_QNAME_SIZE];
+       if (k->decode(b->decoded, bad, BENCH_NAMES) != n || name_decode_scalar(b->decoded, bad, BENCH_NAMES) != n)
+           return NBSTAT_EDEBUG;
+   }
+
+   return NBSTAT_EOK;
+}
+
+/* bench_kernels - the name kernels this CPU runs, over names of every length
+ * (padded from the first NUL), the wildcard, and bytes of any value. */
+static int bench_kernels(void)
+{
+   static const struct bench_kernel kernels[] = {
+       { "scalar", name_encode_scalar, name_decode_scalar },
+#if defined(NBSTAT_SIMD_X86)
+       { "sse2", name_encode_sse2, name_decode_sse2 },
+       { "avx2", name_encode_avx2, name_decode_avx2 },
+#elif defined(NBSTAT_SIMD_NEON)
+       { "neon", name_encode_neon, name_decode_neon },
+#endif
+   };
+   struct bench_names *b;
+   char label[64];
+   uint8_t *name;
+   size_t i, j;
+
+   b = calloc(1, sizeof(*b));
+   if (b == NULL)
+       return NBSTAT_ENOMEM;
+   for (i = 0; i < BENCH_NAMES; i++) {
+       name = b->names + 16 * i;
+       for (j = 0; j < 15; j++)
+           name[j] = (uint8_t)(j < i % 16 ? (i < 32 ? 'A' + i + j : 0x80 + 7 * i + j) : 0x00);
+       name[15] = (uint8_t)(i * 5);
+   }
+   memcpy(b->names + 16 * 3, "*", 1);
+   memcpy(b->names + 16 * 40, "*SMBSERVER", 10);
+   name_encode_scalar(b->expect, b->names, BENCH_NAMES, 0x20);
+
+   for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+#if defined(NBSTAT_SIMD_X86)
+       if (strcmp(kernels[i].label, "avx2") == 0 && !__builtin_cpu_supports("avx2"))
+           continue;
+#endif
+       if (bench_check(b, &kernels[i]) != NBSTAT_EOK) {
+           fprintf(stderr, "The %s name kernel disagrees with the scalar one.\n", kernels[i].label);
+           free(b);
+           return NBSTAT_EDEBUG;
+       }
+       b->k = &kernels[i];
+       sprintf(label, "nbstat_encode_names x%d (%s)", BENCH_NAMES, kernels[i].label);
+       bench_time(label, bench_name_encode, b);
+       sprintf(label, "nbstat_decode_names x%d (%s)", BENCH_NAMES, kernels[i].label);
+       bench_time(label, bench_name_decode, b);
+   }
+
+   free(b);
+
+   return NBSTAT_EOK;
+}
+
+/* bench_codec - the encoder and decoder microbenchmarks. */
+static int bench_codec(void)
+{
+   static const int counts[] = { 1, 3, 8, 16, NBSTAT_MAX_NAMES, 32 };
+   struct bench_case *c;
+   char label[64];
+   int i;
+
+   c = calloc(1, sizeof(*c));
+   if (c == NULL)
+       return NBSTAT_ENOMEM;
+   c->buffer.data = c->data;
+   c->buffer.size = sizeof(c->data);
+   for (i = 0; i < 8; i++) {
+       memset(c->names[i], ' ', 15);
+       memcpy(c->names[i], "WORKSTATION", 11);
+       c->names[i][11] = (char)('0' + i);
+       c->names[i][15] = (char)(i * 0x10);
+   }
+
+   nbstat_query_init(&c->query, 0);
+   bench_time("nbstat_encode_request", bench_encode, c);
+   bench_time("netbios_encode_name", bench_name, c);
+
+   for (i = 0; i < (int)(sizeof(counts) / sizeof(counts[0])); i++) {
+       c->buffer.length = bench_response(c->data, 0x1234, counts[i], 1);
+       sprintf(label, "nbstat_decode_response %2d name%s%s", counts[i], counts[i] > 1 ? "s" : "",
+               counts[i] > NBSTAT_MAX_NAMES ? " (rejected)" : "");
+       bench_time(label, bench_decode, c);
+       sprintf(label, "nbstat_view_init+decode %2d name%s%s", counts[i], counts[i] > 1 ? "s" : "",
+               counts[i] > NBSTAT_MAX_NAMES ? " (rejected)" : "");
+       bench_time(label, bench_view, c);
+   }
+
+   /* Other traffic on the port: a name query answer, and a short datagram. */
+   c->buffer.length = bench_response(c->data, 0x1234, 3, 1);
+   enc16be(c->data + NBSTAT_OFF_RR_TYPE, RR_TYPE_NB);
+   bench_time("nbstat_decode_response (name query answer)", bench_decode, c);
+   c->buffer.length = 40;
+   bench_time("nbstat_decode_response (40-byte datagram)", bench_decode, c);
+
+   free(c);
+
+   return bench_kernels();
+}
+
+/* End-to-end sweep worker: queries the mock hosts in turn. */
+struct bench_worker {
+   nbstat_ctx_t *ctx;
+   uint16_t port;
+   int timeout;
+   int window;
+   int nhost;
+   uint64_t next;
+   uint64_t count;
+   uint64_t ok;
+   uint64_t failed;
+   int result;
+#ifdef _WIN32
+   HANDLE thread;
+#else
+   pthread_t thread;
+#endif
+};
+
+/* bench_next - target source cycling over the mock hosts. */
+static int bench_next(void *arg, uint32_t *addr)
+{
+   struct bench_worker *w = (struct bench_worker *)arg;
+
+   if (w->next >= w->count)
+       return 0;
+
+   *addr = INADDR_LOOPBACK + (uint32_t)(w->next++ % w->nhost);
+
+   return 1;
+}
+
+static void bench_done(void *user, int result, const struct sockaddr_in *sin, const nbstat_view_t *view)
+{
+   struct bench_worker *w = (struct bench_worker *)user;
+
+   if (result == NBSTAT_EOK)
+       w->ok++;
+   else
+       w->failed++;
+}
+
+static void bench_sweep(struct bench_worker *w)
+{
+   w->result = sweep_run(w->ctx, bench_next, w, w->port, w->timeout, w->window, bench_done, w);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI bench_thread(LPVOID arg)
+{
+   bench_sweep((struct bench_worker *)arg);
+   return 0;
+}
+#else
+static void *bench_thread(void *arg)
+{
+   bench_sweep((struct bench_worker *)arg);
+   return NULL;
+}
+#endif
+
+/* bench_e2e - sweep the mock with `nthreads' contexts of `window' each,
+ * `queries' in all, and print the throughput and the statistics. */
+static int bench_e2e(uint16_t port, int nhost, uint64_t queries, int window, int nthreads,
+                     int timeout, int retries)
+{
+   struct bench_worker *w;
+   struct nbstat_stats sum;
+   uint64_t start, elapsed, ok = 0, failed = 0;
+   int result = NBSTAT_EOK;
+   int started = 0;
+   int i;
+
+   w = calloc(nthreads, sizeof(*w));
+   if (w == NULL)
+       return NBSTAT_ENOMEM;
+
+   for (i = 0; i < nthreads && result == NBSTAT_EOK; i++) {
+       result = nbstat_ctx_create(&w[i].ctx);
+       if (result != NBSTAT_EOK)
+           break;
+       if (retries >= 0)
+           nbstat_ctx_set_retries(w[i].ctx, retries);
+       w[i].port = port;
+       w[i].timeout = timeout;
+       w[i].window = window;
+       w[i].nhost = nhost;
+       w[i].count = queries * (i + 1) / nthreads - queries * i / nthreads;
+   }
+
+   start = nbstat_clock_us();
+   if (result == NBSTAT_EOK && nthreads == 1) {
+       bench_sweep(&w[0]);
+       started = 1;
+   } else if (result == NBSTAT_EOK) {
+       for (started = 0; started < nthreads; started++) {
+#ifdef _WIN32
+           w[started].thread = CreateThread(NULL, 0, bench_thread, &w[started], 0, NULL);
+           if (w[started].thread == NULL)
+#else
+           if (pthread_create(&w[started].thread, NULL, bench_thread, &w[started]) != 0)
+#endif
+               break;
+       }
+       for (i = 0; i < started; i++) {
+#ifdef _WIN32
+           WaitForSingleObject(w[i].thread, INFINITE);
+           CloseHandle(w[i].thread);
+#else
+           pthread_join(w[i].thread, NULL);
+#endif
+       }
+   }
+   elapsed = nbstat_clock_us() - start;
+
+   memset(&sum, 0x00, sizeof(sum));
+   for (i = 0; i < nthreads; i++) {
+       if (w[i].ctx == NULL)
+           continue;
+       if (i < started) {
+           ok += w[i].ok;
+           failed += w[i].failed;
+           nbstat_stats_add(&sum, &w[i].ctx->stats);
+           if (w[i].result != NBSTAT_EOK)
+               result = w[i].result;
+       }
+       nbstat_ctx_destroy(w[i].ctx);
+   }
+   free(w);
+   if (result != NBSTAT_EOK)
+       return result;
+
+   printf("sweep: %llu queries to %d hosts, window %d, %d thread%s: %llu answered, %llu failed in %.3f s, %.0f queries/s\n",
+          (unsigned long long)queries, nhost, window, nthreads, nthreads > 1 ? "s" : "",
+          (unsigned long long)ok, (unsigned long long)failed, elapsed / 1e6,
+          elapsed > 0 ? 1e6 * (ok + failed) / elapsed : 0.0);
+   nbstat_stats_print(stdout, &sum, nbstat_clock());
+
+   return NBSTAT_EOK;
+}
+
+/* bench_main - --bench and --mock. */
+static int bench_main(int argc, char *argv[])
+{
+   struct nbstat_mock mock;
+   char *progname = argv[0];
+   int mockonly = strcmp(argv[1], "--mock") == 0;
+   int port = NBSTAT_BENCH_PORT;
+   int nhost = NBSTAT_BENCH_HOSTS;
+   int window = NBSTAT_WINDOW_DEFAULT;
+   int threads = 1;
+   int timeout = 0;
+   int retries = -1;
+   int latency = 0;
+   int loss = 0;
+   int queries = NBSTAT_BENCH_QUERIES;
+   int *opt;
+   int result;
+
+   for (argc -= 2, argv += 2; argc > 0; argc--, argv++) {
+       opt = NULL;
+       if (strcmp(*argv, "-p") == 0)
+           opt = &port;
+       else if (strcmp(*argv, "-n") == 0)
+           opt = &window;
+       else if (strcmp(*argv, "-j") == 0)
+           opt = &threads;
+       else if (strcmp(*argv, "-t") == 0)
+           opt = &timeout;
+       else if (strcmp(*argv, "-R") == 0)
+           opt = &retries;
+       else if (strcmp(*argv, "--latency") == 0)
+           opt = &latency;
+       else if (strcmp(*argv, "--loss") == 0)
+           opt = &loss;
+       else if (strcmp(*argv, "--hosts") == 0)
+           opt = &nhost;
+       else if (strcmp(*argv, "--queries") == 0)
+           opt = &queries;
+       else {
+           fprintf(stderr, "-%s: -unknown option %s \n", progname, *argv);
+           return EXIT_FAILURE;
+       }
+       if (opt != NULL) {
+           if (--argc < 1) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option %s\n", progname, *argv);
+               return EXIT_FAILURE;
+           }
+           *opt = strtoi(*(++argv));
+       }
+   }
+   if (port <= 0 || port > 65535 || nhost <= 0 || window <= 0 || threads <= 0 ||
+       threads > NBSTAT_THREADS_MAX || latency < 0 || loss < 0 || loss > 100 || queries <= 0) {
+       fprintf(stderr, "-%s: incorrect arguments for %s\n", progname, mockonly ? "--mock" : "--bench");
+       return EXIT_FAILURE;
+   }
+
+   result = mock_open(&mock, (uint16_t)port, nhost, latency, loss);
+   if (result != NBSTAT_EOK) {
+       printf("-%s: error! %s (0x%04X) \n", progname, nbstat_error(result), result);
+       return EXIT_FAILURE;
+   }
+
+   if (mockonly) {
+       printf("mock: %d hosts from 127.0.0.1 port %d, latency %d ms, loss %d%%\n",
+              mock.nhost, port, latency, loss);
+       fflush(stdout);
+       signal(SIGINT, on_signal);
+       signal(SIGTERM, on_signal);
+       while (!stopping)
+           mt_sleep(100);
+   } else {
+       result = bench_codec();
+       if (result == NBSTAT_EOK)
+           result = bench_e2e((uint16_t)port, mock.nhost, (uint64_t)queries, window, threads, timeout, retries);
+   }
+
+   mock_close(&mock);
+   printf("mock: %llu answered, %llu dropped\n",
+           (unsigned long long)mock.answered, (unsigned long long)mock.dropped);
+   if (result != NBSTAT_EOK) {
+       printf("-%s: error! %s (0x%04X) \n", progname, nbstat_error(result), result);
+       return EXIT_FAILURE;
+   }
+
+   return EXIT_SUCCESS;
+}
+#endif /* NBSTAT_BENCH */
+
+/* What the periodic reports of a sweep go to */
+struct nbstat_progress {
+   int stats;                /* --stats: the full statistics on stderr */
+   int line;                 /* --progress: one progress line on stderr */
+   const char *status;       /* --status: rewritten with each report */
+   struct nbstat_stats last; /* The previous report, for the rates */
+   uint64_t last_time;
+};
+
+/* progress_status - replace the status file with a JSON object of `st'. */
+static void progress_status(const char *path, const struct nbstat_stats *st, uint64_t elapsed,
+                            uint64_t pps, uint64_t rps, uint64_t eta)
+{
+   FILE *fp;
+   char *tmp;
+   int ok;
+
+   tmp = malloc(strlen(path) + 5);
+   if (tmp == NULL)
+       return;
+   sprintf(tmp, "%s.tmp", path);
+   fp = fopen(tmp, "wb");
+   if (fp == NULL) {
+       free(tmp);
+       return;
+   }
+
+   fprintf(fp, "{\"elapsed_ms\":%llu,\"total\":%llu,\"targets\":%llu,\"completed\":%llu,"
+           "\"inflight\":%llu,\"sent\":%llu,\"resent\":%llu,\"received\":%llu,\"matched\":%llu,"
+           "\"pps\":%llu,\"replies_per_s\":%llu,\"eta_s\":",
+           (unsigned long long)elapsed, (unsigned long long)st->total,
+           (unsigned long long)st->targets, (unsigned long long)st->completed,
+           (unsigned long long)(st->targets - st->completed), (unsigned long long)st->sent,
+           (unsigned long long)st->resent, (unsigned long long)st->received,
+           (unsigned long long)st->matched, (unsigned long long)pps, (unsigned long long)rps);
+   if (eta != (uint64_t)-1)
+       fprintf(fp, "%llu}\n", (unsigned long long)eta);
+   else
+       fprintf(fp, "null}\n");
+   ok = ferror(fp) == 0;
+   ok = fclose(fp) == 0 && ok;
+#ifdef _WIN32
+   ok = ok && MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING);
+#else
+   ok = ok && rename(tmp, path) == 0;
+#endif
+   if (!ok)
+       remove(tmp);
+   free(tmp);
+}
+
+/* stats_report - periodic report of a sweep: the statistics, a progress line
+ * and the status file, as asked. Rates are since the previous report, the ETA
+ * from the average since the start; without a known total there is none. */
+static void stats_report(void *arg, const struct nbstat_stats *st)
+{
+   struct nbstat_progress *pr = arg;
+   uint64_t now = nbstat_clock();
+   uint64_t elapsed = now > st->start ? now - st->start : 0;
+   uint64_t since, pps = 0, rps = 0, eta = (uint64_t)-1;
+   uint64_t done = st->completed, total = st->total;
+
+   if (pr->stats)
+       nbstat_stats_print(stderr, st, now);
+   if (!pr->line && pr->status == NULL)
+       return;
+
+   if (pr->last_time == 0)
+       pr->last_time = st->start;
+   since = now > pr->last_time ? now - pr->last_time : 0;
+   if (since > 0) {
+       pps = (st->sent - pr->last.sent) * 1000 / since;
+       rps = (st->matched - pr->last.matched) * 1000 / since;
+   }
+   if (total > 0 && done > total)
+       done = total;
+   if (total > 0 && done > 0 && elapsed > 0)
+       eta = (total - done) * elapsed / done / 1000;
+
+   if (pr->line) {
+       fprintf(stderr, "progress: %llu.%us, %llu", (unsigned long long)(elapsed / 1000),
+               (unsigned)(elapsed % 1000 / 100), (unsigned long long)st->completed);
+       if (total > 0)
+           fprintf(stderr, "/%llu targets (%u.%u%%)", (unsigned long long)total,
+                   (unsigned)(done * 100 / total), (unsigned)(done * 1000 / total % 10));
+       else
+           fprintf(stderr, " targets");
+       fprintf(stderr, ", %llu sent, %llu in flight, %llu pps, %llu replies/s",
+               (unsigned long long)st->sent, (unsigned long long)(st->targets - st->completed),
+               (unsigned long long)pps, (unsigned long long)rps);
+       if (eta != (uint64_t)-1)
+           fprintf(stderr, ", eta %llu:%02u:%02u", (unsigned long long)(eta / 3600),
+                   (unsigned)(eta / 60 % 60), (unsigned)(eta % 60));
+       fprintf(stderr, "\n");
+   }
+   if (pr->status != NULL)
+       progress_status(pr->status, st, elapsed, pps, rps, eta);
+
+   pr->last = *st;
+   pr->last_time = now;
+}
+
+static void usage(const char *progname)
+{
+   fprintf(stderr, "\nUsage:   %s [-p port] [-t timeout] [-n window] [-R retries] [-P pps] [-j threads] [-H]\n", progname);
+   fprintf(stderr, "         [-o table|json|csv|nmblookup|binary] [--cache file [--cache-ttl seconds]]\n");
+   fprintf(stderr, "         [--daemon seconds] [--find mac|name<xx>]... [--stats] [--stats-every seconds]\n");
+   fprintf(stderr, "         [--progress seconds] [--status file]\n");
+   fprintf(stderr, "         [--bind address[/prefix]|interface]... [-w server] [--then name:xx|status:cnf|drg|prm]...\n");
+   fprintf(stderr, "         -N {-w server | -b broadcast} [-i file] name[<xx>]...\n");
+   fprintf(stderr, "         [-x exclude]... [-X file] [-z] {-b broadcast | [-r range]... [-i file] [target...]}\n");
+   fprintf(stderr, "Example: %s -p 137 -t 3000 192.168.1.200\n", progname); 
+   fprintf(stderr, "         %s -n 1024 -r 10.0.0.0/16 -x 10.0.5.0/24\n", progname); 
+   fprintf(stderr, "         %s -z 10.0.0.1-10.3.255.254\n", progname); 
+   fprintf(stderr, "         %s -i hosts.txt\n", progname); 
+   fprintf(stderr, "         %s -b 192.168.1.255\n", progname); 
+   fprintf(stderr, "         %s -o binary -r 10.0.0.0/16 >> scans.nbq\n", progname); 
+   fprintf(stderr, "         %s --read scans.nbq [-o format] [range...]\n", progname); 
+   fprintf(stderr, "         %s --diff monday.nbq tuesday.nbq [-o format]\n", progname); 
+   fprintf(stderr, "         %s --pcap sensor.pcapng [-p port] [-o format] [range...]\n", progname); 
+   fprintf(stderr, "         %s --daemon 300 -o json -i inventory.txt\n", progname); 
+   fprintf(stderr, "         %s --find 00-0c-29-12-34-56 --find CORP<1b> -r 10.0.0.0/16\n", progname); 
+   fprintf(stderr, "         %s -w 10.0.0.2 FILESRV PRINTSRV<20> CORP<1b>\n", progname); 
+   fprintf(stderr, "         %s -w 10.0.0.2 --then name:1b --then name:1c --then status:cnf -r 10.0.0.0/16\n", progname); 
+   fprintf(stderr, "         %s --bind eth1 --bind 10.2.0.5/16 -r 10.1.0.0/16 -r 10.2.0.0/16\n", progname); 
+}
+
+int main(int argc, char *argv[])
+{
+   nbstat_ctx_t *ctx = NULL;
+   nbstat_t *nbstat = NULL;
+   nbstat_targets_t *targets = NULL;
+   nbstat_cache_t *cache = NULL;
+   nbstat_writer_t writer;
+   struct nbstat_out out;
+   struct nbstat_find find[NBSTAT_FIND_MAX];
+   int nfind = 0;
+   struct nbstat_stage stage[NBSTAT_STAGES_MAX];
+   int nstage = 0;
+   int stagenames = 0;
+   uint32_t bindaddr[NBSTAT_SOURCES_MAX];
+   int bindprefix[NBSTAT_SOURCES_MAX];
+   int nbind = 0;
+   const nbstat_t *cached;
+   int format = -1;
+   FILE *fp = NULL;
+   int nrange = 0;
+   int port = 0;
+   int timeout = 0;
+   int window = 0;
+   int retries = -1;
+   int rate = 0;
+   int threads = 0;
+   int hashed = 0;
+   int shuffle = 0;
+   int cachettl = 0;
+   int daemon = 0;
+   int stats = 0;
+   struct nbstat_progress progress;
+   int every;
+   char *cachefile = NULL;
+   char *file = NULL;
+   char *bcast = NULL;
+   char *wins = NULL;
+   uint8_t *names = NULL;
+   size_t nnames = 0, maxnames = 0;
+   int namemode = 0;
+   char *archive = NULL;
+   char *capture = NULL;
+   char *diff[2] = { NULL, NULL };
+   char *target = NULL;
+   char *progname;
+   uint32_t addr;
+   int result;
+   int i;
+
+#ifdef NBSTAT_BENCH
+   if (argc >= 2 && (strcmp(argv[1], "--bench") == 0 || strcmp(argv[1], "--mock") == 0))
+       return bench_main(argc, argv);
+#endif
+
+   if (argc < 2) {
+       fprintf(stderr, "-%s: incorrect number of arguments\n", argv[0]);
+       usage(argv[0]);
+       return EXIT_FAILURE; 
+   }
+
+   memset(&progress, 0x00, sizeof(progress));
+   progname = argv[0];
+   argc--;
+   argv++;
+
+   if (nbstat_targets_create(&targets) != NBSTAT_EOK) {
+       printf("-%s: error! %s (0x%04X) \n", progname, nbstat_error(NBSTAT_ENOMEM), NBSTAT_ENOMEM);
+       return EXIT_FAILURE;
+   }
+
+   while (argc > 0 && **argv == '-') {
+       if (strcmp(*argv, "-p") == 0) {
+           if (--argc < 1 || port != 0) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option -p\n", progname);
+               return EXIT_FAILURE;
+           }  
+           port = strtoi(*(++argv));    
+       } else if (strcmp(*argv, "-t") == 0) {
+           if (--argc < 1 || timeout != 0) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option -t\n", progname);
+               return EXIT_FAILURE; 
+           }
+           timeout = strtoi(*(++argv)); 
+       } else if (strcmp(*argv, "-n") == 0) {
+           if (--argc < 1 || window != 0) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option -n\n", progname);
+               return EXIT_FAILURE; 
+           }
+           window = strtoi(*(++argv)); 
+       } else if (strcmp(*argv, "-R") == 0) {
+           if (--argc < 1 || retries >= 0) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option -R\n", progname);
+               return EXIT_FAILURE; 
+           }
+           retries = strtoi(*(++argv)); 
+           if (retries < 0)
+               retries = 0;
+       } else if (strcmp(*argv, "-P") == 0) {
+           if (--argc < 1 || rate != 0) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option -P\n", progname);
+               return EXIT_FAILURE; 
+           }
+           rate = strtoi(*(++argv)); 
+       } else if (strcmp(*argv, "-j") == 0) {
+           if (--argc < 1 || threads != 0) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option -j\n", progname);
+               return EXIT_FAILURE; 
+           }
+           threads = strtoi(*(++argv)); 
+       } else if (strcmp(*argv, "-b") == 0) {
+           if (--argc < 1 || bcast != NULL) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option -b\n", progname);
+               return EXIT_FAILURE; 
+           }
+           bcast = *(++argv); 
+       } else if (strcmp(*argv, "-w") == 0) {
+           if (--argc < 1 || wins != NULL) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option -w\n", progname);
+               return EXIT_FAILURE; 
+           }
+           wins = *(++argv); 
+           namemode = 1;
+       } else if (strcmp(*argv, "-N") == 0) {
+           namemode = 1;
+       } else if (strcmp(*argv, "-H") == 0) {
+           hashed = 1;
+       } else if (strcmp(*argv, "-o") == 0) {
+           if (--argc < 1 || format >= 0) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option -o\n", progname);
+               return EXIT_FAILURE; 
+           }
+           format = parse_format(*(++argv));
+           if (format < 0) {
+               fprintf(stderr, "-%s: unknown output format %s\n", progname, *argv);
+               return EXIT_FAILURE;
+           }
+       } else if (strcmp(*argv, "-z") == 0) {
+           shuffle = 1;
+       } else if (strcmp(*argv, "-r") == 0) {
+           if (--argc < 1) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option -r\n", progname);
+               return EXIT_FAILURE; 
+           }
+           if (nbstat_targets_add(targets, *(++argv)) != NBSTAT_EOK) {
+               fprintf(stderr, "-%s: invalid range %s\n", progname, *argv);
+               return EXIT_FAILURE;
+           }
+           nrange++;
+       } else if (strcmp(*argv, "-x") == 0) {
+           if (--argc < 1) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option -x\n", progname);
+               return EXIT_FAILURE; 
+           }
+           if (nbstat_targets_exclude(targets, *(++argv)) != NBSTAT_EOK) {
+               fprintf(stderr, "-%s: invalid range %s\n", progname, *argv);
+               return EXIT_FAILURE;
+           }
+       } else if (strcmp(*argv, "-X") == 0) {
+           if (--argc < 1) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option -X\n", progname);
+               return EXIT_FAILURE; 
+           }
+           if (exclude_file(targets, *(++argv)) != NBSTAT_EOK) {
+               fprintf(stderr, "-%s: cannot read exclusions from %s\n", progname, *argv);
+               return EXIT_FAILURE;
+           }
+       } else if (strcmp(*argv, "--cache") == 0) {
+           if (--argc < 1 || cachefile != NULL) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option --cache\n", progname);
+               return EXIT_FAILURE; 
+           }
+           cachefile = *(++argv); 
+       } else if (strcmp(*argv, "--cache-ttl") == 0) {
+           if (--argc < 1 || cachettl != 0) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option --cache-ttl\n", progname);
+               return EXIT_FAILURE; 
+           }
+           cachettl = strtoi(*(++argv)); 
+       } else if (strcmp(*argv, "--daemon") == 0) {
+           if (--argc < 1 || daemon != 0) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option --daemon\n", progname);
+               return EXIT_FAILURE; 
+           }
+           daemon = strtoi(*(++argv)); 
+           if (daemon <= 0) {
+               fprintf(stderr, "-%s: invalid interval %s\n", progname, *argv);
+               return EXIT_FAILURE;
+           }
+       } else if (strcmp(*argv, "--stats") == 0) {
+           if (stats == 0)
+               stats = NBSTAT_STATS_EVERY;
+       } else if (strcmp(*argv, "--stats-every") == 0) {
+           if (--argc < 1) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option --stats-every\n", progname);
+               return EXIT_FAILURE; 
+           }
+           stats = strtoi(*(++argv)); 
+           if (stats <= 0) {
+               fprintf(stderr, "-%s: invalid interval %s\n", progname, *argv);
+               return EXIT_FAILURE;
+           }
+       } else if (strcmp(*argv, "--progress") == 0) {
+           if (--argc < 1) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option --progress\n", progname);
+               return EXIT_FAILURE; 
+           }
+           progress.line = strtoi(*(++argv)); 
+           if (progress.line <= 0) {
+               fprintf(stderr, "-%s: invalid interval %s\n", progname, *argv);
+               return EXIT_FAILURE;
+           }
+       } else if (strcmp(*argv, "--status") == 0) {
+           if (--argc < 1) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option --status\n", progname);
+               return EXIT_FAILURE; 
+           }
+           progress.status = *(++argv);
+       } else if (strcmp(*argv, "--find") == 0) {
+           if (--argc < 1 || nfind == NBSTAT_FIND_MAX) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option --find\n", progname);
+               return EXIT_FAILURE; 
+           }
+           if (parse_find(*(++argv), &find[nfind++]) != NBSTAT_EOK) {
+               fprintf(stderr, "-%s: invalid MAC address or name %s\n", progname, *argv);
+               return EXIT_FAILURE;
+           }
+       } else if (strcmp(*argv, "--then") == 0) {
+           if (--argc < 1 || nstage == NBSTAT_STAGES_MAX) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option --then\n", progname);
+               return EXIT_FAILURE; 
+           }
+           if (parse_stage(*(++argv), &stage[nstage]) != NBSTAT_EOK) {
+               fprintf(stderr, "-%s: invalid stage %s\n", progname, *argv);
+               return EXIT_FAILURE;
+           }
+           if (stage[nstage++].type == NBSTAT_STAGE_NAMES)
+               stagenames = 1;
+       } else if (strcmp(*argv, "--bind") == 0) {
+           if (--argc < 1 || nbind == NBSTAT_SOURCES_MAX) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option --bind\n", progname);
+               return EXIT_FAILURE; 
+           }
+           if (parse_bind(*(++argv), &bindaddr[nbind], &bindprefix[nbind]) != NBSTAT_EOK) {
+               fprintf(stderr, "-%s: invalid source address or interface %s\n", progname, *argv);
+               return EXIT_FAILURE;
+           }
+           nbind++;
+       } else if (strcmp(*argv, "--pcap") == 0) {
+           if (--argc < 1 || capture != NULL) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option --pcap\n", progname);
+               return EXIT_FAILURE; 
+           }
+           capture = *(++argv); 
+       } else if (strcmp(*argv, "--diff") == 0) {
+           if ((argc -= 2) < 1 || diff[0] != NULL) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option --diff\n", progname);
+               return EXIT_FAILURE; 
+           }
+           diff[0] = *(++argv); 
+           diff[1] = *(++argv); 
+       } else if (strcmp(*argv, "--read") == 0) {
+           if (--argc < 1 || archive != NULL) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option --read\n", progname);
+               return EXIT_FAILURE; 
+           }
+           archive = *(++argv); 
+       } else if (strcmp(*argv, "-i") == 0) {
+           if (--argc < 1 || file != NULL) {
+               fprintf(stderr, "-%s: incorrect number of arguments for option -i\n", progname);
+               return EXIT_FAILURE; 
+           }
+           file = *(++argv); 
+       } else {
+           fprintf(stderr, "-%s: -unknown option %s \n", progname, *argv);
+           return EXIT_FAILURE;
+       }
+
+       argc--; 
+       argv++;  
+   }
+
+   if (format < 0)
+       format = NBSTAT_FMT_TABLE;
+#ifdef _WIN32
+   if (format == NBSTAT_FMT_BINARY)
+       _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+   /* With --find, the answers are only collected, for the queries at the end. */
+   memset(&out, 0x00, sizeof(out));
+   out.w = &writer;
+   if (nfind > 0 && nbstat_index_create(&out.index) != NBSTAT_EOK) {
+       nbstat_targets_destroy(targets);
+       printf("-%s: error! %s (0x%04X) \n", progname, nbstat_error(NBSTAT_ENOMEM), NBSTAT_ENOMEM);
+       return EXIT_FAILURE;
+   }
+
+   /* Reading an archive or a capture back needs no network. */
+   if (archive != NULL || capture != NULL || diff[0] != NULL) {
+       nbstat_targets_destroy(targets);
+       if (nrange > 0 || file != NULL || bcast != NULL ||
+           (archive != NULL) + (capture != NULL) + (diff[0] != NULL) > 1 ||
+           (diff[0] != NULL && (argc > 0 || nfind > 0))) {
+           nbstat_index_destroy(out.index);
+           fprintf(stderr, "-%s: --read and --pcap take ranges as plain arguments, --diff none\n", progname);
+           return EXIT_FAILURE;
+       }
+       result = nbstat_writer_init(&writer, stdout, format, 0);
+       if (result == NBSTAT_EOK) {
+           if (diff[0] != NULL)
+               result = read_diff(diff[0], diff[1], &writer);
+           else if (archive != NULL)
+               result = read_archive(archive, &out, argv, argc);
+           else
+               result = read_pcap(capture, (uint16_t)(port != 0 ? port : 137), &out, argv, argc);
+           if (result == NBSTAT_EOK && out.index != NULL)
+               find_print(&out, find, nfind);
+           nbstat_writer_close(&writer);
+       }
+       nbstat_index_destroy(out.index);
+       if (result != NBSTAT_EOK) {
+           printf("-%s: error! %s (0x%04X) \n", progname, nbstat_error(result), result);
+           return EXIT_FAILURE;
+       }
+
+       return EXIT_SUCCESS;
+   }
+
+   if (port == 0) 
+       port = 137; /* NBSTAT_DEFAULT_PORT; */
+   if (timeout == 0) 
+       timeout = 3000;
+
+   /* A pipeline sweeps, and sends the name queries of its stages to -w. */
+   if (nstage > 0 && (bcast != NULL || daemon > 0 || nfind > 0 || cachefile != NULL || threads > 1 || nbind > 1 ||
+                      (stagenames && (wins == NULL || format == NBSTAT_FMT_CSV || format == NBSTAT_FMT_BINARY)) ||
+                      (nrange == 0 && file == NULL && argc < 1))) {
+       nbstat_targets_destroy(targets);
+       nbstat_index_destroy(out.index);
+       fprintf(stderr, "-%s: incorrect arguments for --then\n", progname);
+       usage(progname);
+       return EXIT_FAILURE;
+   }
+   out.stage = stage;
+
+   /* Name queries: the arguments are names, for a WINS server or broadcast. */
+   if (namemode && nstage == 0) {
+       nbstat_targets_destroy(targets);
+       nbstat_index_destroy(out.index);
+       if ((wins == NULL) == (bcast == NULL) || nrange > 0 || daemon > 0 || nfind > 0 ||
+           cachefile != NULL || format == NBSTAT_FMT_BINARY || (argc < 1 && file == NULL)) {
+           fprintf(stderr, "-%s: incorrect arguments for name queries\n", progname);
+           usage(progname);
+           return EXIT_FAILURE;
+       }
+       for (i = 0; i < argc; i++) {
+           if (name_push(&names, &nnames, &maxnames, argv[i]) != NBSTAT_EOK) {
+               fprintf(stderr, "-%s: invalid name %s\n", progname, argv[i]);
+               free(names);
+               return EXIT_FAILURE;
+           }
+       }
+       if (file != NULL) {
+           fp = strcmp(file, "-") == 0 ? stdin : fopen(file, "r");
+           if (fp == NULL || name_file(&names, &nnames, &maxnames, fp) != NBSTAT_EOK) {
+               fprintf(stderr, "-%s: cannot read names from %s\n", progname, file);
+               if (fp != NULL && fp != stdin)
+                   fclose(fp);
+               free(names);
+               return EXIT_FAILURE;
+           }
+           if (fp != stdin)
+               fclose(fp);
+       }
+
+       result = nbstat_ctx_create(&ctx);
+       for (i = 0; result == NBSTAT_EOK && i < nbind; i++)
+           result = nbstat_ctx_bind(ctx, bindaddr[i], bindprefix[i]);
+       if (result != NBSTAT_EOK) {
+           nbstat_ctx_destroy(ctx);
+       } else {
+           if (retries >= 0)
+               nbstat_ctx_set_retries(ctx, retries);
+           if (rate > 0)
+               nbstat_ctx_set_rate(ctx, (uint32_t)rate);
+           result = nbstat_writer_init(&writer, stdout, format, 0);
+           if (result == NBSTAT_EOK) {
+               result = nbstat_names(ctx, wins != NULL ? wins : bcast, bcast != NULL, names, nnames,
+                                     port, timeout, window, name_print, &writer);
+               nbstat_writer_close(&writer);
+           }
+           if (stats)
+               nbstat_stats_print(stderr, &ctx->stats, nbstat_clock());
+           nbstat_ctx_destroy(ctx);
+       }
+       free(names);
+       if (result != NBSTAT_EOK) {
+           printf("-%s: error! %s (0x%04X) \n", progname, nbstat_error(result), result);
+           return EXIT_FAILURE;
+       }
+
+       return EXIT_SUCCESS;
+   }
+
+   if ((nrange == 0 && file == NULL && bcast == NULL && argc < 1) ||
+       (bcast != NULL && (nrange > 0 || file != NULL || argc > 0)) ||
+       (daemon > 0 && (bcast != NULL || cachefile != NULL || nfind > 0))) {
+       fprintf(stderr, "-%s: incorrect number of arguments\n", progname);
+       usage(progname);
+       return EXIT_FAILURE; 
+   }
+   
+
+   if (cachefile != NULL) {
+       result = nbstat_cache_create(&cache, (uint32_t)cachettl);
+       if (result == NBSTAT_EOK)
+           result = nbstat_cache_load(cache, cachefile);
+       if (result != NBSTAT_EOK) {
+           nbstat_cache_destroy(cache);
+           nbstat_index_destroy(out.index);
+           nbstat_targets_destroy(targets);
+           fprintf(stderr, "-%s: cannot read cache %s\n", progname, cachefile);
+           return EXIT_FAILURE;
+       }
+   }
+
+   result = nbstat_ctx_create(&ctx);
+   for (i = 0; result == NBSTAT_EOK && i < nbind; i++)
+       result = nbstat_ctx_bind(ctx, bindaddr[i], bindprefix[i]);
+   if (result != NBSTAT_EOK) {
+       nbstat_ctx_destroy(ctx);
+       nbstat_targets_destroy(targets);
+       nbstat_cache_destroy(cache);
+       nbstat_index_destroy(out.index);
+       printf("-%s: error! %s (0x%04X) \n", progname, nbstat_error(result), result);
+       return EXIT_FAILURE;
+   }
+   if (retries >= 0)
+       nbstat_ctx_set_retries(ctx, retries);
+   if (rate > 0)
+       nbstat_ctx_set_rate(ctx, (uint32_t)rate);
+   if (hashed)
+       nbstat_ctx_hash_ids(ctx, ((uint32_t)nbstat_clock() * 2654435761U ^ (uint32_t)GetCurrentProcessId()) | 1);
+
+   result = nbstat_writer_init(&writer, stdout, format, 0);
+   if (result != NBSTAT_EOK) {
+       nbstat_ctx_destroy(ctx);
+       nbstat_targets_destroy(targets);
+       nbstat_cache_destroy(cache);
+       nbstat_index_destroy(out.index);
+       printf("-%s: error! %s (0x%04X) \n", progname, nbstat_error(result), result);
+       return EXIT_FAILURE;
+   }
+
+   if (bcast != NULL) {
+       result = nbstat_broadcast(ctx, bcast, port, timeout, bcast_print, &out);
+       if (result == NBSTAT_EOK && out.index != NULL)
+           find_print(&out, find, nfind);
+       nbstat_writer_close(&writer);
+       if (stats)
+           nbstat_stats_print(stderr, &ctx->stats, nbstat_clock());
+       nbstat_ctx_destroy(ctx);
+       nbstat_targets_destroy(targets);
+       nbstat_cache_destroy(cache);
+       nbstat_index_destroy(out.index);
+       if (result != NBSTAT_EOK) {
+           printf("-%s: error! %s (0x%04X) \n", progname, nbstat_error(result), result);
+           return EXIT_FAILURE;
+       }
+
+       return EXIT_SUCCESS;
+   }
+
+   out.cache = cache;
+
+   /* A lone address is a plain query, with the traditional output. */
+   if (daemon == 0 && nfind == 0 && nstage == 0 && nrange == 0 && file == NULL && argc == 1 &&
+       strpbrk(*argv, "/-") == NULL) {
+       target = *argv;
+
+       cached = NULL;
+       if (cache != NULL && nbstat_parse_ipv4(target, strlen(target), &addr) == NBSTAT_EOK)
+           cached = nbstat_cache_get(cache, addr);
+       if (cached != NULL) {
+           nbstat_ctx_destroy(ctx);
+           nbstat_targets_destroy(targets);
+           if (format == NBSTAT_FMT_TABLE)
+               nbstat_dump_nbtstat(cached);
+           else
+               nbstat_writer_put(&writer, cached);
+           nbstat_writer_close(&writer);
+           nbstat_cache_destroy(cache);
+           nbstat_index_destroy(out.index);
+
+           return EXIT_SUCCESS;
+       }
+
+       result = nbstat_query_ctx(ctx, &nbstat, target, port, timeout);
+       if (stats)
+           nbstat_stats_print(stderr, &ctx->stats, nbstat_clock());
+       nbstat_ctx_destroy(ctx);
+       nbstat_targets_destroy(targets);
+       if (result != NBSTAT_EOK /*&& result != NBSTAT_ETIMEOUT*/ ) {
+           nbstat_writer_close(&writer);
+           nbstat_cache_destroy(cache);
+           nbstat_index_destroy(out.index);
+           printf("-%s: error! %s (0x%04X) \n", progname, nbstat_error(result), result);
+           return EXIT_FAILURE;
+       }
+
+       if (format == NBSTAT_FMT_TABLE)
+           nbstat_dump_nbtstat(nbstat);
+       else
+           nbstat_writer_put(&writer, nbstat);
+       nbstat_writer_close(&writer);
+
+       if (cache != NULL) {
+           nbstat_cache_put(cache, nbstat);
+           if (nbstat_cache_save(cache, cachefile) != NBSTAT_EOK)
+               fprintf(stderr, "-%s: cannot write cache %s\n", progname, cachefile);
+           nbstat_cache_destroy(cache);
+           nbstat_index_destroy(out.index);
+       }
+   
+       /* We are done, destroy the nbstat object! */
+       nbstat_free(nbstat);
+
+       return EXIT_SUCCESS;
+   }
+
+   /* Sweep mode: ranges, targets and a target file, lazily expanded. */
+   for (i = 0; i < argc; i++) {
+       if (nbstat_targets_add(targets, argv[i]) != NBSTAT_EOK) {
+           fprintf(stderr, "-%s: invalid target %s\n", progname, argv[i]);
+           nbstat_writer_close(&writer);
+           nbstat_ctx_destroy(ctx);
+           nbstat_targets_destroy(targets);
+           nbstat_cache_destroy(cache);
+           nbstat_index_destroy(out.index);
+           return EXIT_FAILURE;
+       }
+   }
+   if (file != NULL) {
+       fp = strcmp(file, "-") == 0 ? stdin : fopen(file, "r");
+       if (fp == NULL) {
+           fprintf(stderr, "-%s: cannot open %s\n", progname, file);
+           nbstat_writer_close(&writer);
+           nbstat_ctx_destroy(ctx);
+           nbstat_targets_destroy(targets);
+           nbstat_cache_destroy(cache);
+           nbstat_index_destroy(out.index);
+           return EXIT_FAILURE;
+       }
+       nbstat_targets_file(targets, fp);
+   }
+   if (shuffle)
+       nbstat_targets_shuffle(targets, (uint32_t)nbstat_clock() ^ (uint32_t)GetCurrentProcessId() << 16);
+
+   /* Hosts with a fresh cache entry stay off the wire and are printed after. */
+   if (cache != NULL)
+       nbstat_targets_skip(targets, nbstat_cache_skip, cache);
+
+   /* One interval serves all the reports: --progress, else --stats. */
+   every = progress.line ? progress.line : stats ? stats : NBSTAT_STATS_EVERY;
+   progress.stats = stats;
+   if (stats || progress.line || progress.status != NULL)
+       nbstat_ctx_set_report(ctx, 1000 * every, stats_report, &progress);
+   if (daemon > 0) {
+       signal(SIGINT, on_signal);
+       signal(SIGTERM, on_signal);
+       result = nbstat_monitor(ctx, targets, port, timeout, window, daemon, &writer, &stopping);
+   } else if (nstage > 0) {
+       result = nbstat_pipeline(ctx, targets, stage, nstage, wins, 0, port, timeout, window,
+                                pipe_print, pipe_name, &out);
+   } else {
+       result = nbstat_sweep_mt(ctx, targets, port, timeout, window, threads, sweep_print, &out);
+   }
+   if (cache != NULL) {
+       nbstat_cache_served(cache, bcast_print, &out);
+       if (result == NBSTAT_EOK && nbstat_cache_save(cache, cachefile) != NBSTAT_EOK)
+           fprintf(stderr, "-%s: cannot write cache %s\n", progname, cachefile);
+   }
+   if (result == NBSTAT_EOK)
+       result = out.result;
+   if (result == NBSTAT_EOK && out.index != NULL)
+       find_print(&out, find, nfind);
+   nbstat_writer_close(&writer);
+   if (stats)
+       nbstat_stats_print(stderr, &ctx->stats, nbstat_clock());
+   /* And the totals, for a status file read after the sweep. */
+   progress.stats = 0;
+   if (progress.line || progress.status != NULL)
+       stats_report(&progress, &ctx->stats);
+   nbstat_ctx_destroy(ctx);
+   if (nbstat_targets_bad(targets) > 0)
+       fprintf(stderr, "-%s: skipped %lu invalid lines in %s\n", progname, nbstat_targets_bad(targets), file);
+   nbstat_targets_destroy(targets);
+   nbstat_cache_destroy(cache);
+   nbstat_index_destroy(out.index);
+   if (fp != NULL && fp != stdin)
+       fclose(fp);
+   if (result != NBSTAT_EOK) {
+       printf("-%s: error! %s (0x%04X) \n", progname, nbstat_error(result), result);
+       return EXIT_FAILURE;
+   }
+
+   return EXIT_SUCCESS;
+}
+
+#endif /* NBSTAT_LIBRARY */
+
+/* EOF */